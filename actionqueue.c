@@ -0,0 +1,85 @@
+#include "stdafx.h"
+#include "actionqueue.h"
+
+// The queue's slots, with the count of pushed and popped actions. The counts
+// only grow, and the slot of a count is its remainder by the queue size.
+static QueuedAction g_actionQueue[ACTION_QUEUE_SIZE];
+static volatile LONG g_lActionsPushed;
+static volatile LONG g_lActionsPopped;
+static HANDLE g_hActionEvent;
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates the event of the queue
+BOOL ActionQueueInit()
+{
+	g_hActionEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return g_hActionEvent != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Closes the event of the queue
+void ActionQueueUninit()
+{
+	if(g_hActionEvent)
+	{
+		CloseHandle(g_hActionEvent);
+		g_hActionEvent = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds an action to the queue and wakes up the consumer. Returns FALSE, and
+// drops the action, if the queue is full.
+BOOL ActionQueuePush(const QueuedAction* action)
+{
+	LONG pushed = g_lActionsPushed;
+	LONG popped = g_lActionsPopped;
+	MemoryBarrier();
+
+	if(pushed - popped >= ACTION_QUEUE_SIZE)
+		return FALSE;
+
+	g_actionQueue[pushed & (ACTION_QUEUE_SIZE - 1)] = *action;
+
+	// the slot is written before the consumer can see the new count
+	InterlockedExchange(&g_lActionsPushed, pushed + 1);
+
+	SetEvent(g_hActionEvent);
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Takes the oldest action from the queue. Returns FALSE if it's empty.
+BOOL ActionQueuePop(QueuedAction* action)
+{
+	LONG popped = g_lActionsPopped;
+	LONG pushed = g_lActionsPushed;
+	MemoryBarrier();
+
+	if(popped == pushed)
+		return FALSE;
+
+	*action = g_actionQueue[popped & (ACTION_QUEUE_SIZE - 1)];
+
+	// the slot is read before the producer can reuse it
+	InterlockedExchange(&g_lActionsPopped, popped + 1);
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns TRUE if there's no action in the queue
+BOOL ActionQueueIsEmpty()
+{
+	LONG popped = g_lActionsPopped;
+	LONG pushed = g_lActionsPushed;
+	MemoryBarrier();
+
+	return popped == pushed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the event that's signaled when actions are pushed
+HANDLE ActionQueueGetEvent()
+{
+	return g_hActionEvent;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "hookstate.h"
+
+// An action in the queue, with the performance counter time it was queued at
+typedef struct
+{
+	LangAction action;
+	LONGLONG queueTime;
+} QueuedAction;
+
+// number of actions the queue holds, a power of two
+#define ACTION_QUEUE_SIZE 16
+
+// A bounded queue of actions from the keyboard hook thread, which is the only
+// one that pushes, to the thread that runs them, which is the only one that
+// pops. Pushing takes no locks and doesn't allocate, and signals an event
+// the consumer waits for.
+BOOL ActionQueueInit();
+void ActionQueueUninit();
+BOOL ActionQueuePush(const QueuedAction* action);
+BOOL ActionQueuePop(QueuedAction* action);
+BOOL ActionQueueIsEmpty();
+HANDLE ActionQueueGetEvent();
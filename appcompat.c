@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include "appcompat.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Lowercases an ASCII letter
+static LayoutChar LowerAscii(LayoutChar ch)
+{
+	return (ch >= 'A' && ch <= 'Z') ? (LayoutChar)(ch - 'A' + 'a') : ch;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if `text` starts with the ASCII string `prefix`
+static int StartsWith(const LayoutChar* text, const char* prefix)
+{
+	for(; *prefix; text++, prefix++)
+	{
+		if(LowerAscii(*text) != (LayoutChar)*prefix)
+			return 0;
+	}
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compares two names without regard to ASCII case
+static int NamesEqual(const LayoutChar* a, const LayoutChar* b)
+{
+	for(; *a && *b; a++, b++)
+	{
+		if(LowerAscii(*a) != LowerAscii(*b))
+			return 0;
+	}
+	return *a == *b;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FNV-1a hash of a name and what it matches, without regard to ASCII case
+static uint32_t HashName(AppCompatMatch match, const LayoutChar* name)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t)match;
+	for(; *name; name++)
+	{
+		hash ^= LowerAscii(*name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a rule such as "class:OpusApp=cycle"
+int AppCompatParseRule(const LayoutChar* text, AppCompatRule* rule)
+{
+	memset(rule, 0, sizeof(AppCompatRule));
+
+	if(StartsWith(text, "class:"))
+	{
+		rule->match = APPCOMPAT_MATCH_CLASS;
+		text += 6;
+	}
+	else if(StartsWith(text, "process:"))
+	{
+		rule->match = APPCOMPAT_MATCH_PROCESS;
+		text += 8;
+	}
+	else
+	{
+		return 0;
+	}
+
+	// the name is up to the last '='
+	const LayoutChar* equals = NULL;
+	for(const LayoutChar* p = text; *p; p++)
+	{
+		if(*p == '=')
+			equals = p;
+	}
+
+	size_t length = equals ? (size_t)(equals - text) : 0;
+	if(length == 0 || length >= APPCOMPAT_MAX_NAME)
+		return 0;
+
+	memcpy(rule->name, text, sizeof(LayoutChar) * length);
+	rule->name[length] = 0;
+
+	const LayoutChar* strategy = equals + 1;
+	if(StartsWith(strategy, "request") && strategy[7] == 0)
+		rule->strategy = SWITCH_STRATEGY_REQUEST;
+	else if(StartsWith(strategy, "cycle") && strategy[5] == 0)
+		rule->strategy = SWITCH_STRATEGY_CYCLE_KEYS;
+	else
+		return 0;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Finds the slot of a name, or the empty slot where it would go
+static AppCompatSlot* FindSlot(const AppCompatTable* table, AppCompatMatch match, const LayoutChar* name, uint32_t hash)
+{
+	unsigned mask = table->size - 1;
+	for(unsigned i = hash & mask; ; i = (i + 1) & mask)
+	{
+		AppCompatSlot* slot = &table->slots[i];
+		if(!slot->used)
+			return slot;
+		if(slot->hash == hash && slot->match == match && NamesEqual(slot->name, name))
+			return slot;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compiles the rules into an open addressing hash table
+int AppCompatTableInit(AppCompatTable* table, const AppCompatRule* rules, unsigned count)
+{
+	memset(table, 0, sizeof(AppCompatTable));
+
+	table->size = 8;
+	while(table->size < count * 2)
+		table->size *= 2;
+
+	table->slots = (AppCompatSlot*)calloc(table->size, sizeof(AppCompatSlot));
+	if(!table->slots)
+		return 0;
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		uint32_t hash = HashName(rules[i].match, rules[i].name);
+		AppCompatSlot* slot = FindSlot(table, rules[i].match, rules[i].name, hash);
+		if(!slot->used)
+		{
+			slot->used = 1;
+			slot->hash = hash;
+			slot->match = rules[i].match;
+			memcpy(slot->name, rules[i].name, sizeof(slot->name));
+			if(rules[i].match == APPCOMPAT_MATCH_PROCESS)
+				table->processRules++;
+		}
+		slot->strategy = rules[i].strategy;
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees a table
+void AppCompatTableFree(AppCompatTable* table)
+{
+	free(table->slots);
+	memset(table, 0, sizeof(AppCompatTable));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the strategy for a window with `className`, in a process with
+// `imageName`
+SwitchStrategy AppCompatLookup(const AppCompatTable* table, const LayoutChar* className, const LayoutChar* imageName)
+{
+	if(!table->slots)
+		return SWITCH_STRATEGY_REQUEST;
+
+	if(className)
+	{
+		AppCompatSlot* slot = FindSlot(table, APPCOMPAT_MATCH_CLASS, className, HashName(APPCOMPAT_MATCH_CLASS, className));
+		if(slot->used)
+			return slot->strategy;
+	}
+
+	if(imageName)
+	{
+		AppCompatSlot* slot = FindSlot(table, APPCOMPAT_MATCH_PROCESS, imageName, HashName(APPCOMPAT_MATCH_PROCESS, imageName));
+		if(slot->used)
+			return slot->strategy;
+	}
+
+	return SWITCH_STRATEGY_REQUEST;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Empties a cache
+void AppCompatCacheInit(AppCompatCache* cache)
+{
+	memset(cache, 0, sizeof(AppCompatCache));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Finds the strategy decided for `window`. Returns nonzero if there's one.
+int AppCompatCacheGet(const AppCompatCache* cache, uintptr_t window, SwitchStrategy* strategy)
+{
+	for(unsigned i = 0; i < APPCOMPAT_CACHE_SIZE; i++)
+	{
+		if(cache->windows[i] == window && window)
+		{
+			*strategy = cache->strategies[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Keeps the strategy decided for `window`, in place of the one decided
+// before for it or of the oldest one
+void AppCompatCachePut(AppCompatCache* cache, uintptr_t window, SwitchStrategy strategy)
+{
+	for(unsigned i = 0; i < APPCOMPAT_CACHE_SIZE; i++)
+	{
+		if(cache->windows[i] == window && window)
+		{
+			cache->strategies[i] = strategy;
+			return;
+		}
+	}
+
+	cache->windows[cache->next] = window;
+	cache->strategies[cache->next] = strategy;
+	cache->next = (cache->next + 1) % APPCOMPAT_CACHE_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Forgets the strategy decided for `window`, when it's destroyed
+void AppCompatCacheInvalidate(AppCompatCache* cache, uintptr_t window)
+{
+	for(unsigned i = 0; i < APPCOMPAT_CACHE_SIZE; i++)
+	{
+		if(cache->windows[i] == window)
+			cache->windows[i] = 0;
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// Rules that choose how to switch the layout of an application, for the
+// applications that don't handle layout change requests. A rule matches a
+// window class name or a process image name, and the rules are compiled
+// into a hash table so a lookup costs one probe per name. This file and
+// appcompat.c only depend on the C runtime.
+
+#include "layoutcore.h"
+
+// How the layout of a window is switched
+typedef enum
+{
+	SWITCH_STRATEGY_REQUEST,    // post WM_INPUTLANGCHANGEREQUEST to it
+	SWITCH_STRATEGY_CYCLE_KEYS, // simulate Alt+Shift until it has the layout
+} SwitchStrategy;
+
+// What a rule matches
+typedef enum
+{
+	APPCOMPAT_MATCH_CLASS,   // the class name of the root owner window
+	APPCOMPAT_MATCH_PROCESS, // the image file name of its process, such as winword.exe
+} AppCompatMatch;
+
+// maximum length of a name in a rule
+#define APPCOMPAT_MAX_NAME 256
+
+typedef struct
+{
+	AppCompatMatch match;
+	SwitchStrategy strategy;
+	LayoutChar name[APPCOMPAT_MAX_NAME];
+} AppCompatRule;
+
+// Parses a rule written as "class:<name>=<strategy>" or
+// "process:<name>=<strategy>", where the strategy is "request" or "cycle".
+// Returns nonzero on success.
+int AppCompatParseRule(const LayoutChar* text, AppCompatRule* rule);
+
+typedef struct
+{
+	uint32_t hash;
+	AppCompatMatch match;
+	SwitchStrategy strategy;
+	LayoutChar name[APPCOMPAT_MAX_NAME];
+	int used;
+} AppCompatSlot;
+
+typedef struct
+{
+	AppCompatSlot* slots;
+	unsigned size; // a power of two, at least twice the rule count
+	unsigned processRules;
+} AppCompatTable;
+
+// Compiles the rules into a table. When rules match the same name, the last
+// one wins. Names are compared without regard to ASCII case. Returns
+// nonzero on success.
+int AppCompatTableInit(AppCompatTable* table, const AppCompatRule* rules, unsigned count);
+void AppCompatTableFree(AppCompatTable* table);
+
+// Returns the strategy for a window, by its class name first, and then by
+// its process image name, which can be NULL. Windows no rule matches are
+// sent requests.
+SwitchStrategy AppCompatLookup(const AppCompatTable* table, const LayoutChar* className, const LayoutChar* imageName);
+
+// A small cache of the strategies decided for windows, which are identified
+// by any nonzero number (the root owner HWND on Windows)
+#define APPCOMPAT_CACHE_SIZE 32
+
+typedef struct
+{
+	uintptr_t windows[APPCOMPAT_CACHE_SIZE];
+	SwitchStrategy strategies[APPCOMPAT_CACHE_SIZE];
+	unsigned next;
+} AppCompatCache;
+
+void AppCompatCacheInit(AppCompatCache* cache);
+int AppCompatCacheGet(const AppCompatCache* cache, uintptr_t window, SwitchStrategy* strategy);
+void AppCompatCachePut(AppCompatCache* cache, uintptr_t window, SwitchStrategy strategy);
+void AppCompatCacheInvalidate(AppCompatCache* cache, uintptr_t window);
@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "benchmark.h"
+#include "fixlayouts.h"
+#include "corebench.h"
+
+#define BENCHMARK_RESULT_FILE L"recaps-benchmark.csv"
+
+// Text for the installed layouts case, 1 MB
+#define BENCHMARK_TEXT_LENGTH (1024 * 1024 / sizeof(WCHAR))
+#define BENCHMARK_MAX_ALPHABET 512
+
+typedef struct tagBenchmarkSummary
+{
+	FILE* file;
+	char text[2048];
+	size_t length;
+} BenchmarkSummary;
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `text` with random characters that can be converted between the layouts
+static BOOL BuildBenchmarkText(WCHAR* text, size_t length, HKL hklSource, HKL hklTarget)
+{
+	WCHAR alphabet[BENCHMARK_MAX_ALPHABET];
+	UINT alphabetSize = 0;
+
+	for(UINT ch = 0x20; ch < 0xD800 && alphabetSize < BENCHMARK_MAX_ALPHABET; ch++)
+	{
+		if(VkKeyScanEx((WCHAR)ch, hklSource) != -1 &&
+			LayoutConvertCharUncached((WCHAR)ch, hklSource, hklTarget) != 0)
+		{
+			alphabet[alphabetSize++] = (WCHAR)ch;
+		}
+	}
+
+	if(alphabetSize == 0)
+		return FALSE;
+
+	// a fixed seed keeps the text the same between runs
+	DWORD seed = 12345;
+	for(size_t i = 0; i < length; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		text[i] = alphabet[(seed >> 16) % alphabetSize];
+	}
+	text[length] = L'\0';
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a result line to the result file, and to the summary if asked to
+static void ReportResult(void* context, const BenchmarkResult* result)
+{
+	BenchmarkSummary* summary = (BenchmarkSummary*)context;
+
+	if(summary->file)
+		BenchmarkWriteCsv(summary->file, result);
+
+	if(result->summary && summary->length < _countof(summary->text))
+	{
+		int written = BenchmarkFormatSummary(summary->text + summary->length,
+			_countof(summary->text) - summary->length, result);
+		if(written > 0)
+			summary->length = min(summary->length + written, _countof(summary->text) - 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts 1 MB of text between the first two installed layouts, once
+// without the translation tables and twice with them (cold and warm)
+static void RunInstalledLayoutsBenchmark(BenchmarkSummary* summary)
+{
+	HKL hkls[2];
+	if(GetKeyboardLayoutList(2, hkls) < 2)
+		return;
+
+	WCHAR* text = (WCHAR*)malloc(sizeof(WCHAR) * (BENCHMARK_TEXT_LENGTH + 1));
+	WCHAR* buffer = (WCHAR*)malloc(sizeof(WCHAR) * (BENCHMARK_TEXT_LENGTH + 1));
+	if(text && buffer && BuildBenchmarkText(text, BENCHMARK_TEXT_LENGTH, hkls[0], hkls[1]))
+	{
+		LayoutProvider provider;
+		GetWin32LayoutProvider(&provider);
+
+		LayoutId layouts[2] = { (LayoutId)hkls[0], (LayoutId)hkls[1] };
+		LayoutCore core;
+		LayoutCoreInit(&core, &provider);
+		LayoutCoreSync(&core, layouts, 2);
+
+		BenchmarkResult result;
+		ZeroMemory(&result, sizeof(result));
+		result.caseName = "installed";
+		result.sizeName = "1mb";
+		result.length = BENCHMARK_TEXT_LENGTH;
+		result.iterations = 1;
+		result.summary = TRUE;
+
+		double start = BenchmarkNowMs();
+		for(size_t i = 0; i < BENCHMARK_TEXT_LENGTH; i++)
+			buffer[i] = LayoutCoreConvertCharUncached(&provider, text[i], layouts[0], layouts[1]);
+		result.totalMs = BenchmarkNowMs() - start;
+		strcpy_s(result.operation, _countof(result.operation), "convert-uncached");
+		ReportResult(summary, &result);
+
+		core.peakAllocated = core.allocated;
+
+		start = BenchmarkNowMs();
+		LayoutCoreConvertString(&core, text, BENCHMARK_TEXT_LENGTH, buffer, layouts[0], layouts[1]);
+		result.totalMs = BenchmarkNowMs() - start;
+		result.peakAllocated = core.peakAllocated;
+		strcpy_s(result.operation, _countof(result.operation), "convert-cold");
+		ReportResult(summary, &result);
+
+		start = BenchmarkNowMs();
+		LayoutCoreConvertString(&core, text, BENCHMARK_TEXT_LENGTH, buffer, layouts[0], layouts[1]);
+		result.totalMs = BenchmarkNowMs() - start;
+		result.peakAllocated = core.peakAllocated;
+		strcpy_s(result.operation, _countof(result.operation), "convert");
+		ReportResult(summary, &result);
+
+		LayoutCoreFree(&core);
+	}
+
+	free(text);
+	free(buffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs the conversion benchmarks, writes the results to the result file and
+// shows a summary
+int RunBenchmark()
+{
+	BenchmarkSummary summary;
+	summary.length = 0;
+	summary.text[0] = '\0';
+
+	if(_wfopen_s(&summary.file, BENCHMARK_RESULT_FILE, L"w") != 0)
+		summary.file = NULL;
+
+	if(summary.file)
+		BenchmarkWriteCsvHeader(summary.file);
+
+	BOOL succeeded = RunCoreBenchmarks(ReportResult, &summary);
+	RunInstalledLayoutsBenchmark(&summary);
+
+	if(summary.file)
+		fclose(summary.file);
+
+	if(!succeeded)
+	{
+		MessageBox(NULL, L"Failed to prepare the benchmark text.", L"Recaps", MB_OK | MB_ICONINFORMATION);
+		return 1;
+	}
+
+	WCHAR message[2048 + 256];
+	swprintf_s(message, _countof(message), L"%hs\nResults were %s " BENCHMARK_RESULT_FILE L".",
+		summary.text, summary.file ? L"written to" : L"not written to");
+	MessageBox(NULL, message, L"Recaps Benchmark", MB_OK | MB_ICONINFORMATION);
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Measures the layout conversion speed and shows the results.
+// Used with the -benchmark command line switch.
+int RunBenchmark();
@@ -0,0 +1,133 @@
+#include <string.h>
+#include "clipsync.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Sends the copy command and waits for the clipboard sequence number to change
+// from the number right before the command
+int ClipboardWaitForCopy(const ClipboardBackend* backend, uint32_t timeout)
+{
+	uint32_t sequence = backend->GetSequenceNumber(backend->context);
+	uint32_t start = backend->GetTime(backend->context);
+
+	backend->SendCopy(backend->context);
+
+	for(;;)
+	{
+		if(backend->GetSequenceNumber(backend->context) != sequence)
+			return 1;
+
+		uint32_t elapsed = backend->GetTime(backend->context) - start;
+		if(elapsed >= timeout)
+			return 0;
+
+		// the sequence number is the clipboard's own, so a notification of a
+		// change from before the copy command only causes another look
+		if(backend->WaitForChange(backend->context, timeout - elapsed) == CLIPBOARD_WAIT_CANCELED)
+			return CLIPBOARD_WAIT_CANCELED;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulated clipboard
+
+///////////////////////////////////////////////////////////////////////////////
+// Makes the pending change if its time has come
+static void SimClipboardUpdate(SimClipboard* sim)
+{
+	if(sim->changePending && (int32_t)(sim->now - sim->changeTime) >= 0)
+	{
+		sim->changePending = 0;
+		sim->sequence++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.GetSequenceNumber for the simulated clipboard
+static uint32_t SimGetSequenceNumber(void* context)
+{
+	SimClipboard* sim = (SimClipboard*)context;
+	SimClipboardUpdate(sim);
+	return sim->sequence;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.WaitForChange for the simulated clipboard, which moves
+// the clock to the time of the change or of the end of the wait
+static int SimWaitForChange(void* context, uint32_t timeout)
+{
+	SimClipboard* sim = (SimClipboard*)context;
+	sim->waits++;
+
+	if(sim->staleNotifications)
+	{
+		sim->staleNotifications--;
+		SimClipboardUpdate(sim);
+		return 1;
+	}
+
+	if(sim->pollInterval && timeout > sim->pollInterval)
+		timeout = sim->pollInterval;
+
+	if(sim->cancelPending && sim->cancelTime - sim->now <= timeout &&
+		!(sim->changePending && sim->changeTime - sim->now < sim->cancelTime - sim->now))
+	{
+		sim->now = sim->cancelTime;
+		sim->cancelPending = 0;
+		SimClipboardUpdate(sim);
+		return CLIPBOARD_WAIT_CANCELED;
+	}
+
+	if(sim->changePending && sim->changeTime - sim->now <= timeout && !sim->pollInterval)
+	{
+		sim->now = sim->changeTime;
+		SimClipboardUpdate(sim);
+		return 1;
+	}
+
+	sim->now += timeout;
+	SimClipboardUpdate(sim);
+	return sim->pollInterval != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.GetTime for the simulated clipboard
+static uint32_t SimGetTime(void* context)
+{
+	return ((SimClipboard*)context)->now;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.SendCopy for the simulated clipboard
+static void SimSendCopy(void* context)
+{
+	SimClipboard* sim = (SimClipboard*)context;
+	sim->copies++;
+
+	if(sim->copyChanges)
+	{
+		sim->changePending = 1;
+		sim->changeTime = sim->now + sim->copyLatency;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a simulated clipboard, with its clock at 0
+void SimClipboardInit(SimClipboard* sim, uint32_t copyLatency, int copyChanges, uint32_t pollInterval)
+{
+	memset(sim, 0, sizeof(SimClipboard));
+	sim->copyLatency = copyLatency;
+	sim->copyChanges = copyChanges;
+	sim->pollInterval = pollInterval;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `backend` with the backend of a simulated clipboard
+void SimClipboardGetBackend(SimClipboard* sim, ClipboardBackend* backend)
+{
+	memset(backend, 0, sizeof(ClipboardBackend));
+	backend->GetSequenceNumber = SimGetSequenceNumber;
+	backend->WaitForChange = SimWaitForChange;
+	backend->GetTime = SimGetTime;
+	backend->SendCopy = SimSendCopy;
+	backend->context = sim;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// Waiting for the clipboard to change after a copy command, through an
+// interface to the clipboard so that the waiting can run against the real
+// clipboard (clipthread.h) or a simulated one. This file and clipsync.c only
+// depend on the C runtime.
+
+#include <stdint.h>
+
+// returned by waits that are given up before their end
+#define CLIPBOARD_WAIT_CANCELED (-1)
+
+typedef struct
+{
+	// Returns the clipboard sequence number as it is when it's called, which
+	// changes whenever the contents of the clipboard do. It mustn't be a
+	// number recorded at a change notification, which may still be queued
+	// from an earlier change when the copy command is sent.
+	uint32_t (*GetSequenceNumber)(void* context);
+
+	// Waits up to `timeout` milliseconds for a change to the clipboard.
+	// Returns 1 if the clipboard may have changed, 0 on timeout, and
+	// CLIPBOARD_WAIT_CANCELED if the wait should be given up. It may return 1
+	// for a change from before the wait.
+	int (*WaitForChange)(void* context, uint32_t timeout);
+
+	// Returns the current time in milliseconds
+	uint32_t (*GetTime)(void* context);
+
+	// Sends the copy command (Ctrl+C) to the active window
+	void (*SendCopy)(void* context);
+
+	void* context;
+} ClipboardBackend;
+
+// Sends the copy command and waits until the clipboard changes or `timeout`
+// milliseconds pass. Returns 1 if the clipboard changed, 0 if it didn't,
+// which happens if nothing is selected, or CLIPBOARD_WAIT_CANCELED if the
+// backend gave up waiting.
+int ClipboardWaitForCopy(const ClipboardBackend* backend, uint32_t timeout);
+
+// A simulated clipboard with a virtual clock. After the copy command, the
+// clipboard changes `copyLatency` milliseconds later if `copyChanges` is set.
+// Waiting for a change returns as soon as it happens, or after
+// `pollInterval` milliseconds at most if that's not 0, like polling would.
+// If `cancelPending` is set, waits are canceled at `cancelTime`. The first
+// `staleNotifications` waits return at once without a change, like the
+// notifications of earlier changes that are still queued.
+typedef struct
+{
+	uint32_t now;
+	uint32_t sequence;
+	uint32_t copyLatency;
+	int copyChanges;
+	uint32_t pollInterval;
+
+	int changePending;
+	uint32_t changeTime;
+
+	int cancelPending;
+	uint32_t cancelTime;
+
+	unsigned staleNotifications;
+
+	// statistics of the simulation
+	unsigned waits;
+	unsigned copies;
+} SimClipboard;
+
+void SimClipboardInit(SimClipboard* sim, uint32_t copyLatency, int copyChanges, uint32_t pollInterval);
+void SimClipboardGetBackend(SimClipboard* sim, ClipboardBackend* backend);
@@ -0,0 +1,340 @@
+#include "stdafx.h"
+#include "clipthread.h"
+
+// time in milliseconds between looks at the clipboard when there are no
+// change notifications
+#define CLIPBOARD_POLL_INTERVAL 30
+
+#define CLIPBOARD_WINDOW_CLASS L"RecapsClipboardListener"
+
+// message to the clipboard window, to restore the ClipboardData in lParam
+#define CLIPWM_RESTORE (WM_APP + 1)
+
+// time in milliseconds the restored clipboard data is kept for delayed
+// rendering, after which the formats nobody asked for are rendered, and the
+// time between tries when the clipboard can't be opened then
+#define CLIPBOARD_RESTORE_LIFETIME 10000
+#define CLIPBOARD_RENDER_RETRY 200
+
+#define CLIPBOARD_RENDER_TIMER 1
+
+HANDLE g_hClipboardThread;
+DWORD g_dwClipboardThreadId;
+HANDLE g_hClipboardChangeEvent;
+HWND g_hClipboardWnd;
+
+// The data restored to the clipboard with delayed rendering, which only the
+// clipboard thread uses. Formats are rendered from it on request, and what's
+// left is freed when the clipboard is emptied. So that the copy isn't held
+// for as long as nobody copies something else, every format is rendered
+// CLIPBOARD_RESTORE_LIFETIME after the restore and the copy is freed; the
+// clipboard owns the data from then on, like with any other application.
+ClipboardData g_restoredClipboardData;
+
+// nonzero once the clipboard thread gets change notifications
+volatile LONG g_bClipboardListening;
+
+DWORD WINAPI ClipboardThread(LPVOID pParameter);
+LRESULT CALLBACK ClipboardListenerWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+static BOOL OnRestoreClipboardData(HWND hWnd, ClipboardData* formats);
+static void RenderClipboardFormat(UINT format);
+static BOOL RenderAllClipboardFormats(HWND hWnd);
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates a thread with a window that listens for clipboard changes
+BOOL ClipboardThreadInit()
+{
+	BOOL bSuccess = FALSE;
+
+	g_hClipboardChangeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(!g_hClipboardChangeEvent)
+		return FALSE;
+
+	HANDLE hThreadReadyEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(hThreadReadyEvent)
+	{
+		g_hClipboardThread = CreateThread(NULL, 0, ClipboardThread,
+			(void*)hThreadReadyEvent, 0, &g_dwClipboardThreadId);
+		if(g_hClipboardThread)
+		{
+			WaitForSingleObject(hThreadReadyEvent, INFINITE);
+
+			bSuccess = TRUE;
+		}
+
+		CloseHandle(hThreadReadyEvent);
+	}
+
+	return bSuccess;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ends the clipboard thread
+void ClipboardThreadUninit()
+{
+	HANDLE hThread = InterlockedExchangePointer(&g_hClipboardThread, NULL);
+	if(hThread)
+	{
+		PostThreadMessage(g_dwClipboardThreadId, WM_APP, 0, 0);
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+	}
+
+	if(g_hClipboardChangeEvent)
+	{
+		CloseHandle(g_hClipboardChangeEvent);
+		g_hClipboardChangeEvent = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The clipboard thread, which runs a message-only window that's registered
+// as a clipboard format listener
+DWORD WINAPI ClipboardThread(LPVOID pParameter)
+{
+	HANDLE hThreadReadyEvent;
+	HINSTANCE hInstance;
+	WNDCLASSEX wcex;
+	HWND hWnd;
+	MSG msg;
+	BOOL bRet;
+
+	hThreadReadyEvent = (HANDLE)pParameter;
+	hInstance = GetModuleHandle(NULL);
+	PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
+
+	ZeroMemory(&wcex, sizeof(WNDCLASSEX));
+	wcex.cbSize = sizeof(WNDCLASSEX);
+	wcex.lpfnWndProc = ClipboardListenerWindowProc;
+	wcex.hInstance = hInstance;
+	wcex.lpszClassName = CLIPBOARD_WINDOW_CLASS;
+	RegisterClassEx(&wcex);
+
+	hWnd = CreateWindowEx(0, CLIPBOARD_WINDOW_CLASS, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hInstance, NULL);
+	if(hWnd)
+	{
+		if(AddClipboardFormatListener(hWnd))
+			InterlockedExchange(&g_bClipboardListening, TRUE);
+
+		g_hClipboardWnd = hWnd;
+	}
+
+	SetEvent(hThreadReadyEvent);
+
+	while((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
+	{
+		if(bRet == -1)
+		{
+			msg.wParam = 0;
+			break;
+		}
+
+		if(msg.hwnd == NULL && msg.message == WM_APP)
+		{
+			PostQuitMessage(0);
+			continue;
+		}
+
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+
+	if(hWnd)
+	{
+		g_hClipboardWnd = NULL;
+
+		if(InterlockedExchange(&g_bClipboardListening, FALSE))
+			RemoveClipboardFormatListener(hWnd);
+
+		// renders the formats that are still delayed, and frees the rest
+		DestroyWindow(hWnd);
+		FreeClipboardData(&g_restoredClipboardData);
+	}
+
+	UnregisterClass(CLIPBOARD_WINDOW_CLASS, hInstance);
+
+	return (DWORD)msg.wParam;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Signals the waiting thread when the clipboard changes, and renders the
+// restored clipboard data
+LRESULT CALLBACK ClipboardListenerWindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	switch(uMsg)
+	{
+	case WM_CLIPBOARDUPDATE:
+		SetEvent(g_hClipboardChangeEvent);
+		return 0;
+
+	case CLIPWM_RESTORE:
+		return OnRestoreClipboardData(hWnd, (ClipboardData*)lParam);
+
+	case WM_RENDERFORMAT:
+		RenderClipboardFormat((UINT)wParam);
+		return 0;
+
+	case WM_RENDERALLFORMATS:
+		RenderAllClipboardFormats(hWnd);
+		return 0;
+
+	case WM_TIMER:
+		if(wParam == CLIPBOARD_RENDER_TIMER)
+		{
+			if(RenderAllClipboardFormats(hWnd))
+			{
+				KillTimer(hWnd, CLIPBOARD_RENDER_TIMER);
+				FreeClipboardData(&g_restoredClipboardData);
+			}
+			else
+				SetTimer(hWnd, CLIPBOARD_RENDER_TIMER, CLIPBOARD_RENDER_RETRY, NULL);
+		}
+		return 0;
+
+	case WM_DESTROYCLIPBOARD:
+		KillTimer(hWnd, CLIPBOARD_RENDER_TIMER);
+		FreeClipboardData(&g_restoredClipboardData);
+		return 0;
+	}
+
+	return DefWindowProc(hWnd, uMsg, wParam, lParam);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts the formats of `formats` on the clipboard with delayed rendering, and
+// takes over the data
+static BOOL OnRestoreClipboardData(HWND hWnd, ClipboardData* formats)
+{
+	if(!OpenClipboard(hWnd))
+		return FALSE;
+
+	// frees the previously restored data, if the window still owns it
+	EmptyClipboard();
+
+	g_restoredClipboardData = *formats;
+	formats->count = 0;
+	formats->dataArray = NULL;
+
+	for(int i = 0; i < g_restoredClipboardData.count; i++)
+	{
+		SetClipboardData(g_restoredClipboardData.dataArray[i].format, NULL);
+	}
+
+	CloseClipboard();
+
+	if(g_restoredClipboardData.count)
+		SetTimer(hWnd, CLIPBOARD_RENDER_TIMER, CLIPBOARD_RESTORE_LIFETIME, NULL);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts the restored data of `format` on the clipboard, which must be open.
+// The clipboard owns the data afterwards.
+static void RenderClipboardFormat(UINT format)
+{
+	for(int i = 0; i < g_restoredClipboardData.count; i++)
+	{
+		ClipboardFormat* restored = &g_restoredClipboardData.dataArray[i];
+		if(restored->format == format)
+		{
+			PutClipboardFormat(restored);
+			break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts all the restored formats that weren't rendered yet on the clipboard,
+// if the window still owns it. Returns FALSE if the clipboard can't be opened.
+static BOOL RenderAllClipboardFormats(HWND hWnd)
+{
+	if(!OpenClipboard(hWnd))
+		return FALSE;
+
+	if(GetClipboardOwner() == hWnd)
+	{
+		for(int i = 0; i < g_restoredClipboardData.count; i++)
+		{
+			RenderClipboardFormat(g_restoredClipboardData.dataArray[i].format);
+		}
+	}
+
+	CloseClipboard();
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Restores `formats` to the clipboard with delayed rendering. Returns FALSE if
+// the clipboard thread isn't running or can't open the clipboard, in which
+// case `formats` still owns its data.
+BOOL ClipboardThreadRestore(ClipboardData* formats)
+{
+	HWND hWnd = g_hClipboardWnd;
+	if(!hWnd)
+		return FALSE;
+
+	return (BOOL)SendMessage(hWnd, CLIPWM_RESTORE, 0, (LPARAM)formats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.GetSequenceNumber for the Windows clipboard. The change
+// notifications only wake the wait up, since one of the restore of the last
+// conversion may still be queued. The number changes as soon as the copying
+// application empties the clipboard, see ConvertClipboardText.
+static uint32_t Win32GetClipboardSequence(void* context)
+{
+	return GetClipboardSequenceNumber();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.WaitForChange for the Windows clipboard. The context is
+// an event that cancels the wait when it's signaled, or NULL.
+static int Win32WaitForClipboardChange(void* context, uint32_t timeout)
+{
+	HANDLE hCancelEvent = (HANDLE)context;
+	HANDLE handles[2];
+	DWORD count = 0;
+
+	if(hCancelEvent)
+		handles[count++] = hCancelEvent;
+
+	if(g_bClipboardListening)
+		handles[count++] = g_hClipboardChangeEvent;
+	else if(timeout > CLIPBOARD_POLL_INTERVAL)
+		timeout = CLIPBOARD_POLL_INTERVAL;
+
+	DWORD dwWait = count ? WaitForMultipleObjects(count, handles, FALSE, timeout) : (Sleep(timeout), WAIT_TIMEOUT);
+	if(hCancelEvent && dwWait == WAIT_OBJECT_0)
+		return CLIPBOARD_WAIT_CANCELED;
+
+	// when polling, every wait may have seen a change
+	return !g_bClipboardListening || dwWait != WAIT_TIMEOUT;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.GetTime for the Windows clipboard
+static uint32_t Win32GetClipboardTime(void* context)
+{
+	return GetTickCount();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClipboardBackend.SendCopy for the Windows clipboard, which simulates Ctrl-C
+static void Win32SendCopy(void* context)
+{
+	SendKeyCombo('C', TRUE, FALSE, FALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `backend` with the backend of the Windows clipboard, whose waits are
+// canceled when `hCancelEvent` is signaled if it's not NULL
+void GetWin32ClipboardBackend(ClipboardBackend* backend, HANDLE hCancelEvent)
+{
+	ZeroMemory(backend, sizeof(ClipboardBackend));
+	backend->GetSequenceNumber = Win32GetClipboardSequence;
+	backend->WaitForChange = Win32WaitForClipboardChange;
+	backend->GetTime = Win32GetClipboardTime;
+	backend->SendCopy = Win32SendCopy;
+	backend->context = hCancelEvent;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "clipsync.h"
+#include "fixlayouts.h"
+
+// time in milliseconds to wait for the active window to copy the selected
+// text to the clipboard, after which nothing is assumed to be selected
+#define CLIPBOARD_COPY_TIMEOUT 300
+
+// the number of times to try opening the clipboard after a copy, which the
+// copying application may still have open, and the time between the tries
+#define CLIPBOARD_OPEN_TRIES 10
+#define CLIPBOARD_OPEN_RETRY_WAIT 10
+
+// Functions to start and stop the thread that listens for clipboard changes
+BOOL ClipboardThreadInit();
+void ClipboardThreadUninit();
+
+// Restores clipboard data with delayed rendering, see RestoreClipboardData
+BOOL ClipboardThreadRestore(ClipboardData* formats);
+
+// Returns the backend for the Windows clipboard, which waits for the change
+// notifications of the clipboard thread, or polls if it isn't running.
+// Waits are canceled when `hCancelEvent` is signaled, if it's not NULL.
+void GetWin32ClipboardBackend(ClipboardBackend* backend, HANDLE hCancelEvent);
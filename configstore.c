@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <string.h>
+#include "configstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the index of the layout with identifier `id`
+int ConfigFindLayout(const uint32_t* ids, unsigned count, uint32_t id)
+{
+	unsigned i;
+	for(i = 0; i < count; i++)
+	{
+		if(ids[i] == id)
+			break;
+	}
+	return (int)i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a schedule with nothing to save
+void ConfigScheduleInit(ConfigSaveSchedule* schedule)
+{
+	memset(schedule, 0, sizeof(ConfigSaveSchedule));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Changes the settings, and puts off the save if there's something to save
+int ConfigScheduleSet(ConfigSaveSchedule* schedule, const ConfigValues* values, uint32_t now)
+{
+	if(memcmp(&schedule->values, values, sizeof(ConfigValues)) != 0)
+	{
+		schedule->values = *values;
+		schedule->dirty = 1;
+	}
+
+	if(!schedule->dirty)
+		return 0;
+
+	schedule->scheduled = 1;
+	schedule->changeTime = now;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the time until the save is due
+uint32_t ConfigScheduleWait(const ConfigSaveSchedule* schedule, uint32_t now)
+{
+	if(!schedule->scheduled)
+		return CONFIG_NO_SAVE;
+
+	uint32_t elapsed = now - schedule->changeTime;
+	return elapsed >= CONFIG_SAVE_DELAY ? 0 : CONFIG_SAVE_DELAY - elapsed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Takes the values to save, if they changed
+int ConfigScheduleTake(ConfigSaveSchedule* schedule, ConfigValues* values)
+{
+	schedule->scheduled = 0;
+	if(!schedule->dirty)
+		return 0;
+
+	*values = schedule->values;
+	schedule->dirty = 0;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Marks the values as changed again after they couldn't be saved, without
+// scheduling a save, so that a failing disk isn't retried in a loop
+void ConfigScheduleFailed(ConfigSaveSchedule* schedule)
+{
+	schedule->dirty = 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a little endian 32-bit number
+static void PutUint32(uint8_t* p, uint32_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	p[2] = (uint8_t)(value >> 16);
+	p[3] = (uint8_t)(value >> 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads a little endian 32-bit number
+static uint32_t GetUint32(const uint8_t* p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FNV-1a hash of the data, to tell a truncated or damaged file
+static uint32_t ConfigChecksum(const uint8_t* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Serializes the settings that are set
+size_t ConfigSerialize(const ConfigValues* values, uint8_t* buffer, size_t size)
+{
+	uint32_t keys[2] = { CONFIG_KEY_MAIN_LAYOUT, CONFIG_KEY_PAIRED_LAYOUT };
+	uint32_t settings[2] = { values->mainLayout, values->pairedLayout };
+
+	uint32_t count = 0;
+	for(int i = 0; i < 2; i++)
+	{
+		if(settings[i])
+			count++;
+	}
+
+	size_t total = 12 + 8 * (size_t)count + 4;
+	if(total > size)
+		return 0;
+
+	PutUint32(buffer, CONFIG_FILE_MAGIC);
+	PutUint32(buffer + 4, CONFIG_FILE_VERSION);
+	PutUint32(buffer + 8, count);
+
+	uint8_t* p = buffer + 12;
+	for(int i = 0; i < 2; i++)
+	{
+		if(settings[i])
+		{
+			PutUint32(p, keys[i]);
+			PutUint32(p + 4, settings[i]);
+			p += 8;
+		}
+	}
+
+	PutUint32(p, ConfigChecksum(buffer, (size_t)(p - buffer)));
+	return total;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Deserializes settings, leaving those that aren't in the data
+int ConfigDeserialize(const uint8_t* buffer, size_t size, ConfigValues* values)
+{
+	if(size < 16 || GetUint32(buffer) != CONFIG_FILE_MAGIC)
+		return 0;
+
+	uint32_t count = GetUint32(buffer + 8);
+	if(count > (size - 16) / 8)
+		return 0;
+
+	size_t recordsEnd = 12 + 8 * (size_t)count;
+	if(GetUint32(buffer + recordsEnd) != ConfigChecksum(buffer, recordsEnd))
+		return 0;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t* record = buffer + 12 + 8 * (size_t)i;
+		uint32_t value = GetUint32(record + 4);
+
+		switch(GetUint32(record))
+		{
+		case CONFIG_KEY_MAIN_LAYOUT:
+			values->mainLayout = value;
+			break;
+
+		case CONFIG_KEY_PAIRED_LAYOUT:
+			values->pairedLayout = value;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Opens a file in binary mode
+static FILE* OpenConfigFile(const ConfigPathChar* path, int bWrite)
+{
+	FILE* file = NULL;
+#ifdef _WIN32
+	if(_wfopen_s(&file, path, bWrite ? L"wb" : L"rb") != 0)
+		return NULL;
+#else
+	file = fopen(path, bWrite ? "wb" : "rb");
+#endif
+	return file;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigStore.Load for a file
+static int FileConfigLoad(void* context, ConfigValues* values)
+{
+	FileConfigStore* fileStore = (FileConfigStore*)context;
+
+	FILE* file = OpenConfigFile(fileStore->path, 0);
+	if(!file)
+		return 0;
+
+	uint8_t buffer[CONFIG_MAX_FILE_SIZE];
+	size_t size = fread(buffer, 1, sizeof(buffer), file);
+	fclose(file);
+
+	return ConfigDeserialize(buffer, size, values);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigStore.Save for a file
+static int FileConfigSave(void* context, const ConfigValues* values)
+{
+	FileConfigStore* fileStore = (FileConfigStore*)context;
+
+	uint8_t buffer[CONFIG_MAX_FILE_SIZE];
+	size_t size = ConfigSerialize(values, buffer, sizeof(buffer));
+	if(size == 0)
+		return 0;
+
+	FILE* file = OpenConfigFile(fileStore->path, 1);
+	if(!file)
+		return 0;
+
+	int bSaved = fwrite(buffer, 1, size, file) == size;
+	if(fclose(file) != 0)
+		bSaved = 0;
+
+	return bSaved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the path of the file
+int FileConfigStoreInit(FileConfigStore* fileStore, const ConfigPathChar* path)
+{
+	size_t length = 0;
+	while(path[length])
+		length++;
+
+	if(length >= CONFIG_MAX_PATH)
+		return 0;
+
+	memcpy(fileStore->path, path, sizeof(ConfigPathChar) * (length + 1));
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `store` with the file backend
+void FileConfigStoreGetStore(FileConfigStore* fileStore, ConfigStore* store)
+{
+	memset(store, 0, sizeof(ConfigStore));
+	store->Load = FileConfigLoad;
+	store->Save = FileConfigSave;
+	store->context = fileStore;
+}
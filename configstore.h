@@ -0,0 +1,103 @@
+#pragma once
+
+// The settings Recaps changes by itself, and where they're kept. Layouts are
+// stored by a stable identifier (the low 32 bits of the HKL on Windows,
+// which hold the language and layout IDs) rather than by their localized
+// names. The file backend keeps them in a small binary file. This file and
+// configstore.c only depend on the C runtime.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+	uint32_t mainLayout;   // 0 when unset
+	uint32_t pairedLayout; // 0 when unset
+} ConfigValues;
+
+typedef struct
+{
+	// Load into `values`, which keeps what isn't stored. Return nonzero if
+	// the store had settings.
+	int (*Load)(void* context, ConfigValues* values);
+
+	// Returns nonzero if the settings were saved
+	int (*Save)(void* context, const ConfigValues* values);
+
+	void* context;
+} ConfigStore;
+
+// Returns the index of the layout with identifier `id` in `ids`, or `count`
+int ConfigFindLayout(const uint32_t* ids, unsigned count, uint32_t id);
+
+// time in milliseconds without changes after which the settings are saved
+#define CONFIG_SAVE_DELAY 2000
+
+// returned by ConfigScheduleWait when there's nothing to save
+#define CONFIG_NO_SAVE 0xFFFFFFFF
+
+// When the changed settings are saved: once they stop changing for
+// CONFIG_SAVE_DELAY, so that a series of changes, such as switching the
+// language pair a few times, is saved once. The times are in milliseconds,
+// from any clock that wraps around.
+typedef struct
+{
+	ConfigValues values;
+
+	// nonzero if the values differ from the saved ones
+	int dirty;
+
+	// nonzero if a save is due CONFIG_SAVE_DELAY after `changeTime`
+	int scheduled;
+	uint32_t changeTime;
+} ConfigSaveSchedule;
+
+void ConfigScheduleInit(ConfigSaveSchedule* schedule);
+
+// Changes the settings at `now`. Returns nonzero if there's something to
+// save, in which case the save is put off until CONFIG_SAVE_DELAY from now.
+int ConfigScheduleSet(ConfigSaveSchedule* schedule, const ConfigValues* values, uint32_t now);
+
+// Returns the time until the save is due, 0 if it's due, or CONFIG_NO_SAVE
+uint32_t ConfigScheduleWait(const ConfigSaveSchedule* schedule, uint32_t now);
+
+// Takes the values to save into `values`, and returns 0 if they didn't
+// change since the last save. Call ConfigScheduleFailed if saving them fails,
+// and they're saved again with the next change or flush.
+int ConfigScheduleTake(ConfigSaveSchedule* schedule, ConfigValues* values);
+void ConfigScheduleFailed(ConfigSaveSchedule* schedule);
+
+// The file format: a header, records of a key and a value, and a checksum
+// of the rest, all little endian 32-bit numbers. Unknown keys are skipped so
+// older versions can read newer files.
+#define CONFIG_FILE_MAGIC   0x47464352 // "RCFG"
+#define CONFIG_FILE_VERSION 1
+
+#define CONFIG_KEY_MAIN_LAYOUT   1
+#define CONFIG_KEY_PAIRED_LAYOUT 2
+
+// maximum size of a serialized configuration
+#define CONFIG_MAX_FILE_SIZE 4096
+
+// Serialize to and from `buffer`. ConfigSerialize returns the size, or 0
+// if it doesn't fit, and ConfigDeserialize nonzero if the data is valid.
+size_t ConfigSerialize(const ConfigValues* values, uint8_t* buffer, size_t size);
+int ConfigDeserialize(const uint8_t* buffer, size_t size, ConfigValues* values);
+
+#ifdef _WIN32
+typedef wchar_t ConfigPathChar;
+#else
+typedef char ConfigPathChar;
+#endif
+
+// maximum length of the path of a configuration file
+#define CONFIG_MAX_PATH 520
+
+typedef struct
+{
+	ConfigPathChar path[CONFIG_MAX_PATH];
+} FileConfigStore;
+
+// Returns nonzero if `path` fits
+int FileConfigStoreInit(FileConfigStore* fileStore, const ConfigPathChar* path);
+void FileConfigStoreGetStore(FileConfigStore* fileStore, ConfigStore* store);
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "configwriter.h"
+
+static ConfigStore g_configWriterStore;
+static CRITICAL_SECTION g_csConfigValues; // guards the schedule
+static CRITICAL_SECTION g_csConfigSave;   // keeps saves from overlapping
+static ConfigSaveSchedule g_configSchedule;
+static HANDLE g_hConfigChangedEvent;
+static HANDLE g_hConfigQuitEvent;
+static HANDLE g_hConfigWriterThread;
+
+DWORD WINAPI ConfigWriterThread(LPVOID pParameter);
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts the thread that saves the settings
+BOOL ConfigWriterInit(const ConfigStore* store)
+{
+	g_configWriterStore = *store;
+	ConfigScheduleInit(&g_configSchedule);
+	InitializeCriticalSection(&g_csConfigValues);
+	InitializeCriticalSection(&g_csConfigSave);
+
+	g_hConfigChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	g_hConfigQuitEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(g_hConfigChangedEvent && g_hConfigQuitEvent)
+		g_hConfigWriterThread = CreateThread(NULL, 0, ConfigWriterThread, NULL, 0, NULL);
+
+	return g_hConfigWriterThread != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ends the thread that saves the settings, and saves the pending changes
+void ConfigWriterUninit()
+{
+	HANDLE hThread = InterlockedExchangePointer(&g_hConfigWriterThread, NULL);
+	if(hThread)
+	{
+		SetEvent(g_hConfigQuitEvent);
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+	}
+
+	ConfigWriterFlush();
+
+	if(g_hConfigChangedEvent)
+		CloseHandle(g_hConfigChangedEvent);
+	if(g_hConfigQuitEvent)
+		CloseHandle(g_hConfigQuitEvent);
+	g_hConfigChangedEvent = NULL;
+	g_hConfigQuitEvent = NULL;
+
+	DeleteCriticalSection(&g_csConfigSave);
+	DeleteCriticalSection(&g_csConfigValues);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Changes the settings, and lets the thread know. Without the thread they're
+// saved right away.
+void ConfigWriterSet(const ConfigValues* values)
+{
+	EnterCriticalSection(&g_csConfigValues);
+	BOOL bDirty = ConfigScheduleSet(&g_configSchedule, values, GetTickCount());
+	LeaveCriticalSection(&g_csConfigValues);
+
+	if(!bDirty)
+		return;
+
+	if(g_hConfigWriterThread)
+		SetEvent(g_hConfigChangedEvent);
+	else
+		ConfigWriterFlush();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Saves the settings if they changed since they were last saved
+BOOL ConfigWriterFlush()
+{
+	BOOL bSaved = TRUE;
+
+	EnterCriticalSection(&g_csConfigSave);
+
+	EnterCriticalSection(&g_csConfigValues);
+	ConfigValues values;
+	BOOL bDirty = ConfigScheduleTake(&g_configSchedule, &values);
+	LeaveCriticalSection(&g_csConfigValues);
+
+	if(bDirty && !g_configWriterStore.Save(g_configWriterStore.context, &values))
+	{
+		// Try again with the next change or at exit
+		EnterCriticalSection(&g_csConfigValues);
+		ConfigScheduleFailed(&g_configSchedule);
+		LeaveCriticalSection(&g_csConfigValues);
+		bSaved = FALSE;
+	}
+
+	LeaveCriticalSection(&g_csConfigSave);
+
+	return bSaved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The thread that saves the settings when the schedule says so. Every change
+// wakes it up to wait for the new due time.
+DWORD WINAPI ConfigWriterThread(LPVOID pParameter)
+{
+	UNREFERENCED_PARAMETER(pParameter);
+
+	HANDLE events[2] = { g_hConfigQuitEvent, g_hConfigChangedEvent };
+
+	for(;;)
+	{
+		EnterCriticalSection(&g_csConfigValues);
+		DWORD wait = ConfigScheduleWait(&g_configSchedule, GetTickCount());
+		LeaveCriticalSection(&g_csConfigValues);
+
+		DWORD result = WaitForMultipleObjects(2, events, FALSE, wait == CONFIG_NO_SAVE ? INFINITE : wait);
+		if(result == WAIT_OBJECT_0 + 1)
+			continue;
+
+		// ConfigWriterUninit saves the pending changes after a quit
+		if(result != WAIT_TIMEOUT)
+			break;
+
+		ConfigWriterFlush();
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "configstore.h"
+
+// Keeps the settings in memory, and saves them to `store` on a background
+// thread once they stop changing (see ConfigSaveSchedule), so a change never
+// waits for the disk.
+// The store has to stay valid until ConfigWriterUninit, which saves the
+// pending changes.
+BOOL ConfigWriterInit(const ConfigStore* store);
+void ConfigWriterUninit();
+
+// Changes the settings
+void ConfigWriterSet(const ConfigValues* values);
+
+// Saves the pending changes now. Returns FALSE if they couldn't be saved.
+BOOL ConfigWriterFlush();
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include "convhistory.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees the text of a record and clears it
+static void ClearRecord(ConversionRecord* record)
+{
+	free(record->original);
+	memset(record, 0, sizeof(ConversionRecord));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes an empty history
+void ConversionHistoryInit(ConversionHistory* history)
+{
+	memset(history, 0, sizeof(ConversionHistory));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees all the conversions
+void ConversionHistoryFree(ConversionHistory* history)
+{
+	for(unsigned i = 0; i < CONVERSION_HISTORY_SIZE; i++)
+		ClearRecord(&history->records[i]);
+
+	history->next = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds a conversion in place of the oldest one
+int ConversionHistoryAdd(ConversionHistory* history, uint64_t window, uint32_t generation,
+	LayoutId before, LayoutId source, LayoutId target,
+	const LayoutChar* original, size_t originalLength, const LayoutChar* converted, size_t convertedLength)
+{
+	ConversionRecord* record = &history->records[history->next];
+	ClearRecord(record);
+
+	// an older conversion in the window can't be undone once there's a
+	// newer one, so it's dropped
+	for(unsigned i = 0; i < CONVERSION_HISTORY_SIZE; i++)
+	{
+		if(history->records[i].window == window)
+			ClearRecord(&history->records[i]);
+	}
+
+	if(originalLength > CONVERSION_HISTORY_MAX_CHARS || window == 0)
+		return 0;
+
+	record->original = (LayoutChar*)malloc(sizeof(LayoutChar) * (originalLength ? originalLength : 1));
+	if(!record->original)
+		return 0;
+
+	memcpy(record->original, original, sizeof(LayoutChar) * originalLength);
+	record->originalLength = originalLength;
+	record->window = window;
+	record->before = before;
+	record->source = source;
+	record->target = target;
+	ConversionRecordUpdate(record, source, generation, ConversionCaretSteps(converted, convertedLength));
+
+	history->next = (history->next + 1) % CONVERSION_HISTORY_SIZE;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the newest conversion pasted into a window
+ConversionRecord* ConversionHistoryFind(ConversionHistory* history, uint64_t window, uint32_t generation)
+{
+	for(unsigned i = 1; i <= CONVERSION_HISTORY_SIZE; i++)
+	{
+		ConversionRecord* record = &history->records[(history->next + CONVERSION_HISTORY_SIZE - i) % CONVERSION_HISTORY_SIZE];
+		if(record->original && record->window == window)
+			return record->generation == generation ? record : NULL;
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the source layout of the next text. The candidates are the
+// original (0), the layouts other than the source and the target, and the
+// source, and the one after the current one is next.
+LayoutId ConversionRecordNextSource(const ConversionRecord* record, const LayoutId* layouts, unsigned count)
+{
+	if(record->current == record->source)
+		return 0;
+
+	int bFound = record->current == 0;
+	for(unsigned i = 0; i < count; i++)
+	{
+		if(layouts[i] == record->source || layouts[i] == record->target)
+			continue;
+
+		if(bFound)
+			return layouts[i];
+
+		if(layouts[i] == record->current)
+			bFound = 1;
+	}
+
+	// the current layout was the last of the others, or was removed
+	return record->source;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records the text pasted in place of the text in the window
+void ConversionRecordUpdate(ConversionRecord* record, LayoutId current, uint32_t generation, size_t steps)
+{
+	record->current = current;
+	record->generation = generation;
+	record->steps = steps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Counts the caret steps over the text
+size_t ConversionCaretSteps(const LayoutChar* text, size_t length)
+{
+	size_t steps = 0;
+	for(size_t i = 0; i < length; i++)
+	{
+		if(i + 1 < length &&
+			((text[i] == '\r' && text[i + 1] == '\n') ||
+			(text[i] >= 0xD800 && text[i] <= 0xDBFF && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF)))
+			i++;
+
+		steps++;
+	}
+
+	return steps;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+// The last conversions of selected text, so that a conversion can be undone
+// or redone from another source layout without copying the text from the
+// window and detecting its layout again. A conversion is kept with the
+// window it was pasted into and the input generation it was pasted at,
+// which changes when the user types, so it's only found while the pasted
+// text is still right before the caret. This file and convhistory.c only
+// depend on the C runtime.
+
+#include "layoutcore.h"
+
+// number of conversions kept, the oldest being replaced first
+#define CONVERSION_HISTORY_SIZE 8
+
+// the longest original text kept, in characters
+#define CONVERSION_HISTORY_MAX_CHARS 4096
+
+typedef struct
+{
+	uint64_t window;
+	uint32_t generation;
+
+	// the layout of the window before the conversion, and the layouts the
+	// text was converted from and to
+	LayoutId before;
+	LayoutId source;
+	LayoutId target;
+
+	// the source layout of the text in the window now, 0 for the original
+	LayoutId current;
+
+	// the text as it was typed, and the number of caret steps the text in
+	// the window now takes
+	LayoutChar* original;
+	size_t originalLength;
+	size_t steps;
+} ConversionRecord;
+
+// A ring buffer of the conversions, newest at `next - 1`
+typedef struct
+{
+	ConversionRecord records[CONVERSION_HISTORY_SIZE];
+	unsigned next;
+} ConversionHistory;
+
+void ConversionHistoryInit(ConversionHistory* history);
+void ConversionHistoryFree(ConversionHistory* history);
+
+// Adds the conversion of `original` from `source` to `target`, whose result
+// `converted` was pasted into `window`. Returns 0 if the text is too long to
+// keep or there isn't enough memory.
+int ConversionHistoryAdd(ConversionHistory* history, uint64_t window, uint32_t generation,
+	LayoutId before, LayoutId source, LayoutId target,
+	const LayoutChar* original, size_t originalLength, const LayoutChar* converted, size_t convertedLength);
+
+// Returns the newest conversion pasted into `window`, if nothing was typed
+// since, or NULL
+ConversionRecord* ConversionHistoryFind(ConversionHistory* history, uint64_t window, uint32_t generation);
+
+// Returns the source layout of the text to put in place of the text in the
+// window, or 0 for the original text. Going on from the conversion, the
+// original comes first, then the conversions from the other layouts in
+// `layouts` in order, and the conversion from the detected layout last.
+LayoutId ConversionRecordNextSource(const ConversionRecord* record, const LayoutId* layouts, unsigned count);
+
+// Records that the conversion from `current` (or the original if it's 0),
+// which takes `steps` caret steps, was pasted in place of the text in the
+// window at `generation`
+void ConversionRecordUpdate(ConversionRecord* record, LayoutId current, uint32_t generation, size_t steps);
+
+// Returns the number of times the caret moves to go over `text`, in which a
+// CR LF pair and a surrogate pair are a single step
+size_t ConversionCaretSteps(const LayoutChar* text, size_t length);
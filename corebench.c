@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include "corebench.h"
+#include "layouttable.h"
+#include "parallelconvert.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Corpus sizes, in characters: a chat message, a 4 KB paragraph and a 10 MB document
+#define BENCHMARK_CHAT_LENGTH 20
+#define BENCHMARK_PARAGRAPH_LENGTH (4096 / sizeof(LayoutChar))
+#define BENCHMARK_DOCUMENT_LENGTH (10 * 1024 * 1024 / sizeof(LayoutChar))
+
+// Each operation is repeated until about this many characters were processed
+#define BENCHMARK_TARGET_CHARS (16 * 1024 * 1024)
+
+// Cold runs rebuild the tables every iteration, so they get fewer of them
+#define BENCHMARK_MAX_COLD_ITERATIONS 1000
+
+// Hebrew text as typed with the US layout
+static const char g_corpusHebrew[] =
+	"akuo kfuko' vhuo tbh rumv kxpr kfo gk vyhuk agahbu cacug agcr cmpui vt"
+	"r./ hmtbu nueso ccuer ubxgbu kfhuui vdkhk/ nzd vtuuhr vhv bgho uvbu; v"
+	"hv nsvho/ gmrbu khs bjk eyi utfkbu truj, mvrhho n,j, kgmho/ cgrc jzrbu"
+	" vch,v ghhpho tck nrumho ntus/ ";
+
+// Russian text as typed with the US layout
+static const char g_corpusRussian[] =
+	"Ghbdtn dctv? ctujlyz z [jxe hfccrfpfnm dfv j gjtplrt? rjnjhe. vs cjdth"
+	"ibkb yf ghjikjq ytltkt/ Vs dst[fkb hfyj enhjv b gjt[fkb d cnjhjye ujh/"
+	" Gjujlf ,skf ghtrhfcyfz? f dbl ghjcnj gjnhzcf.obq/ Vs jcnfyjdbkbcm e v"
+	"fktymrjq htxrb b gjj,tlfkb gjl lthtdmzvb/ Dtxthjv vs dthyekbcm ljvjq e"
+	"cnfkst? yj jxtym ljdjkmyst/ ";
+
+// Hebrew text as typed with the US layout, mixed with English, numbers and a URL
+static const char g_corpusMixed[] =
+	"akuo kfuko' vhuo tbh rumv kxpr kfo gk Release 2.4.1 (build 20231) vyhu"
+	"k agahbu cacug agcr cmpui vtr./ hmtbu nueso ccuer ubxgbu kfhuui vdkhk/"
+	" see http://example.com/a?b=1 nzd vtuuhr vhv bgho uvbu; vhv nsvho/ gmr"
+	"bu khs bjk eyi utfkbu truj, mvrhho n,j, kgmho/ cgrc jzrbu vch,v ghhpho"
+	" tck nrumho ntus/ call 03-555-1234 ";
+
+typedef struct
+{
+	const char* name;
+	const char* corpus;
+	const char* source;
+	const char* target;
+	// the corpus is typed with `target` and has to be converted to `source` first
+	int reverse;
+} BenchmarkCase;
+
+static const BenchmarkCase g_benchmarkCases[] = {
+	{ "en-he", g_corpusHebrew, "us", "he", 0 },
+	{ "he-en", g_corpusHebrew, "he", "us", 1 },
+	{ "en-ru", g_corpusRussian, "us", "ru", 0 },
+	{ "ru-en", g_corpusRussian, "ru", "us", 1 },
+	{ "mixed", g_corpusMixed, "us", "he", 0 },
+};
+
+// Thread counts the parallel conversion is measured with
+static const unsigned g_benchmarkThreadCounts[] = { 1, 2, 4, 8 };
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the time of the monotonic clock in milliseconds
+double BenchmarkNowMs()
+{
+#ifdef _WIN32
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (double)now.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `text` by repeating the corpus
+static void BuildCorpusText(LayoutChar* text, size_t length, const char* corpus)
+{
+	size_t corpusLength = strlen(corpus);
+	for(size_t i = 0; i < length; i++)
+		text[i] = (LayoutChar)(unsigned char)corpus[i % corpusLength];
+	text[length] = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns how many times an operation runs over a text of the given length
+static unsigned GetIterations(size_t length, int cold)
+{
+	size_t iterations = BENCHMARK_TARGET_CHARS / length;
+	if(iterations < 1)
+		iterations = 1;
+	if(cold && iterations > BENCHMARK_MAX_COLD_ITERATIONS)
+		iterations = BENCHMARK_MAX_COLD_ITERATIONS;
+	return (unsigned)iterations;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text repeatedly, flushing the tables before each run if `cold` is set
+static void BenchmarkConvert(LayoutCore* core, const LayoutChar* text, size_t length, LayoutChar* buffer,
+	LayoutId source, LayoutId target, int cold, BenchmarkResult* result)
+{
+	unsigned iterations = GetIterations(length, cold);
+
+	// warm up, so that the warm runs don't pay for building the tables
+	if(!cold)
+		LayoutCoreConvertString(core, text, length, buffer, source, target);
+
+	core->peakAllocated = core->allocated;
+
+	double start = BenchmarkNowMs();
+	for(unsigned i = 0; i < iterations; i++)
+	{
+		if(cold)
+			LayoutCoreFlush(core);
+		LayoutCoreConvertString(core, text, length, buffer, source, target);
+	}
+	result->totalMs = BenchmarkNowMs() - start;
+	result->iterations = iterations;
+	result->peakAllocated = core->peakAllocated;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Detects the layout of the text repeatedly
+static void BenchmarkDetect(LayoutCore* core, const LayoutChar* text, size_t length, BenchmarkResult* result)
+{
+	unsigned iterations = GetIterations(length, 0);
+	int matches;
+
+	LayoutCoreDetect(core, text, length, &matches);
+
+	core->peakAllocated = core->allocated;
+
+	double start = BenchmarkNowMs();
+	for(unsigned i = 0; i < iterations; i++)
+		LayoutCoreDetect(core, text, length, &matches);
+	result->totalMs = BenchmarkNowMs() - start;
+	result->iterations = iterations;
+	result->peakAllocated = core->peakAllocated;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text repeatedly with ParallelConvertText on `threadCount`
+// threads. Returns 0 if the result differs from `expected`.
+static int BenchmarkParallelConvert(LayoutCore* core, const LayoutChar* text, size_t length, LayoutChar* buffer,
+	const LayoutChar* expected, LayoutId source, LayoutId target, unsigned threadCount, BenchmarkResult* result)
+{
+	unsigned iterations = GetIterations(length, 0);
+
+	LayoutOutput output;
+	memset(&output, 0, sizeof(LayoutOutput));
+	output.buffer = buffer;
+	output.capacity = length + 1;
+
+	ParallelConvertText(core, text, length, &output, source, target, threadCount);
+
+	core->peakAllocated = core->allocated;
+
+	double start = BenchmarkNowMs();
+	for(unsigned i = 0; i < iterations; i++)
+	{
+		output.length = 0;
+		ParallelConvertText(core, text, length, &output, source, target, threadCount);
+	}
+	result->totalMs = BenchmarkNowMs() - start;
+	result->iterations = iterations;
+	result->peakAllocated = core->peakAllocated;
+
+	return output.length == length && memcmp(buffer, expected, sizeof(LayoutChar) * length) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs the conversion and detection benchmarks over the built-in layout tables
+int RunCoreBenchmarks(BenchmarkReport report, void* context)
+{
+	static const struct { const char* name; size_t length; } sizes[] = {
+		{ "chat", BENCHMARK_CHAT_LENGTH },
+		{ "paragraph", BENCHMARK_PARAGRAPH_LENGTH },
+		{ "document", BENCHMARK_DOCUMENT_LENGTH },
+	};
+
+	LayoutTable* tables[3] = {
+		LayoutTableLoadBuiltin("us"),
+		LayoutTableLoadBuiltin("he"),
+		LayoutTableLoadBuiltin("ru"),
+	};
+	LayoutChar* text = (LayoutChar*)malloc(sizeof(LayoutChar) * (BENCHMARK_DOCUMENT_LENGTH + 1));
+	LayoutChar* buffer = (LayoutChar*)malloc(sizeof(LayoutChar) * (BENCHMARK_DOCUMENT_LENGTH + 1));
+	LayoutChar* parallelBuffer = (LayoutChar*)malloc(sizeof(LayoutChar) * (BENCHMARK_DOCUMENT_LENGTH + 1));
+	int succeeded = tables[0] && tables[1] && tables[2] && text && buffer && parallelBuffer;
+
+	if(succeeded)
+	{
+		LayoutProvider provider;
+		LayoutTableGetProvider(&provider);
+
+		LayoutId layouts[3];
+		for(int i = 0; i < 3; i++)
+			layouts[i] = LayoutTableId(tables[i]);
+
+		LayoutCore core;
+		LayoutCoreInit(&core, &provider);
+		LayoutCoreSync(&core, layouts, 3);
+
+		for(size_t i = 0; i < sizeof(g_benchmarkCases) / sizeof(g_benchmarkCases[0]); i++)
+		{
+			const BenchmarkCase* benchmarkCase = &g_benchmarkCases[i];
+			LayoutId source = 0, target = 0;
+
+			for(int j = 0; j < 3; j++)
+			{
+				if(strcmp(tables[j]->name, benchmarkCase->source) == 0)
+					source = layouts[j];
+				if(strcmp(tables[j]->name, benchmarkCase->target) == 0)
+					target = layouts[j];
+			}
+
+			for(size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+			{
+				size_t length = sizes[j].length;
+				BenchmarkResult result;
+				memset(&result, 0, sizeof(result));
+				result.caseName = benchmarkCase->name;
+				result.sizeName = sizes[j].name;
+				result.length = length;
+
+				BuildCorpusText(text, length, benchmarkCase->corpus);
+				if(benchmarkCase->reverse)
+				{
+					// the corpus is typed with the target layout, retype it with the source layout
+					LayoutCoreConvertString(&core, text, length, buffer, target, source);
+					memcpy(text, buffer, sizeof(LayoutChar) * length);
+				}
+
+				BenchmarkConvert(&core, text, length, buffer, source, target, 1, &result);
+				strcpy(result.operation, "convert-cold");
+				result.summary = 0;
+				report(context, &result);
+
+				BenchmarkConvert(&core, text, length, buffer, source, target, 0, &result);
+				strcpy(result.operation, "convert");
+				result.summary = length == BENCHMARK_DOCUMENT_LENGTH;
+				report(context, &result);
+
+				BenchmarkDetect(&core, text, length, &result);
+				strcpy(result.operation, "detect");
+				report(context, &result);
+
+				// the parallel conversion only kicks in for large texts
+				if(length < PARALLEL_CONVERT_THRESHOLD)
+					continue;
+
+				for(size_t k = 0; k < sizeof(g_benchmarkThreadCounts) / sizeof(g_benchmarkThreadCounts[0]); k++)
+				{
+					// the output of the warm run above is in `buffer`
+					int matched = BenchmarkParallelConvert(&core, text, length, parallelBuffer, buffer,
+						source, target, g_benchmarkThreadCounts[k], &result);
+
+					snprintf(result.operation, sizeof(result.operation), "convert-threads-%u%s",
+						g_benchmarkThreadCounts[k], matched ? "" : "-MISMATCH");
+					report(context, &result);
+				}
+			}
+		}
+
+		LayoutCoreFree(&core);
+	}
+
+	ParallelConvertShutdown();
+
+	free(text);
+	free(buffer);
+	free(parallelBuffer);
+	for(int i = 0; i < 3; i++)
+		LayoutTableFree(tables[i]);
+
+	return succeeded;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the header line of the results
+void BenchmarkWriteCsvHeader(FILE* file)
+{
+	fprintf(file, "case,size,operation,characters,iterations,total_ms,chars_per_sec,ns_per_char,peak_alloc_bytes\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the characters per second and nanoseconds per character of a result
+static void GetRates(const BenchmarkResult* result, double* charsPerSec, double* nsPerChar)
+{
+	double characters = (double)result->length * result->iterations;
+	double seconds = result->totalMs / 1000.0;
+	*charsPerSec = seconds > 0 ? characters / seconds : 0;
+	*nsPerChar = characters > 0 ? result->totalMs * 1000000.0 / characters : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a result line
+void BenchmarkWriteCsv(FILE* file, const BenchmarkResult* result)
+{
+	double charsPerSec, nsPerChar;
+	GetRates(result, &charsPerSec, &nsPerChar);
+
+	fprintf(file, "%s,%s,%s,%lu,%u,%.3f,%.0f,%.3f,%lu\n",
+		result->caseName, result->sizeName, result->operation, (unsigned long)result->length,
+		result->iterations, result->totalMs, charsPerSec, nsPerChar, (unsigned long)result->peakAllocated);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Formats a summary line
+int BenchmarkFormatSummary(char* buffer, size_t size, const BenchmarkResult* result)
+{
+	double charsPerSec, nsPerChar;
+	GetRates(result, &charsPerSec, &nsPerChar);
+
+	return snprintf(buffer, size, "%s %s %s:\t%.1f M chars/s, %.2f ns/char\n",
+		result->caseName, result->sizeName, result->operation, charsPerSec / 1000000.0, nsPerChar);
+}
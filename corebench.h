@@ -0,0 +1,44 @@
+#pragma once
+
+// The conversion and detection benchmarks of the layout core over the
+// built-in layout tables and corpora, timed with the monotonic clock of the
+// platform. This file and corebench.c only depend on the C runtime and the
+// clock, so the benchmarks run wherever the core builds. On Windows they
+// run with the -benchmark command line switch (benchmark.c), elsewhere with
+// the driver the Makefile builds.
+
+#include <stdio.h>
+#include "layoutcore.h"
+
+// The results of running an operation over a text
+typedef struct
+{
+	const char* caseName;
+	const char* sizeName;
+	char operation[32];
+	size_t length;
+	unsigned iterations;
+	double totalMs;
+	size_t peakAllocated;
+
+	// nonzero for the results worth showing in a summary
+	int summary;
+} BenchmarkResult;
+
+// Called with each result as soon as it's measured
+typedef void (*BenchmarkReport)(void* context, const BenchmarkResult* result);
+
+// Returns the time of the monotonic clock in milliseconds
+double BenchmarkNowMs();
+
+// Runs the benchmarks. Returns 0 if the tables or the texts couldn't be
+// prepared.
+int RunCoreBenchmarks(BenchmarkReport report, void* context);
+
+// Write the results as comma separated values, one line each
+void BenchmarkWriteCsvHeader(FILE* file);
+void BenchmarkWriteCsv(FILE* file, const BenchmarkResult* result);
+
+// Formats a line of the summary of a result. Returns the number of
+// characters written, like snprintf.
+int BenchmarkFormatSummary(char* buffer, size_t size, const BenchmarkResult* result);
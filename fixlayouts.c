@@ -1,95 +1,520 @@
 #include "stdafx.h"
+#include <aclapi.h>
+#include <sddl.h>
 #include "fixlayouts.h"
 #include "clipboard.h"
+#include "clipthread.h"
+#include "parallelconvert.h"
+#include "keytablecache.h"
+#include "convhistory.h"
+#include "focuscache.h"
 #include "utils.h"
 
 ///////////////////////////////////////////////////////////////////////////////
-// Converts the text in the active window from one keyboard layout to another
-// using the clipboard.
-void ConvertSelectedTextInActiveWindow(HKL hklSource, HKL hklTarget)
+// LayoutOutput.Grow for a moveable global memory block that can be put on
+// the clipboard. The block's handle is the output's context, and the block
+// stays locked while the output is written to.
+static int LayoutOutputGrowGlobal(LayoutOutput* output, size_t capacity)
 {
-	WCHAR* sourceText = NULL;
-	WCHAR* targetText = NULL;
-	const WCHAR dummy[] = L"__RECAPS__";
+	if(capacity < output->capacity * 2)
+		capacity = output->capacity * 2;
 
-	// store previous clipboard data and set clipboard to dummy string
-	ClipboardData prevClipboardData;
-	if(!StoreClipboardData(&prevClipboardData))
-		return;
+	HGLOBAL handle = (HGLOBAL)output->context;
+	HGLOBAL newHandle;
+	if(handle)
+	{
+		GlobalUnlock(handle);
+		newHandle = GlobalReAlloc(handle, sizeof(WCHAR) * capacity, GMEM_MOVEABLE);
+	}
+	else
+		newHandle = GlobalAlloc(GMEM_MOVEABLE, sizeof(WCHAR) * capacity);
 
-	if(!SetClipboardText(dummy))
+	if(!newHandle)
 	{
-		// restore the original clipboard data
-		RestoreClipboardData(&prevClipboardData);
-		return;
+		if(handle)
+			output->buffer = (LayoutChar*)GlobalLock(handle);
+
+		return 0;
+	}
+
+	output->context = newHandle;
+	output->buffer = (LayoutChar*)GlobalLock(newHandle);
+	if(!output->buffer)
+	{
+		output->capacity = 0;
+		return 0;
+	}
+
+	output->capacity = capacity;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The last conversions, which are only used on the action worker thread, and
+// the input generation, which the keyboard and mouse hooks move on when the
+// user types or clicks. The time of the last focus or caret change is
+// compared with the time the last paste was done with, since the paste moves
+// the caret too. The undo is only enabled while all of these are followed.
+
+static ConversionHistory g_conversionHistory;
+static volatile LONG g_inputGeneration;
+static volatile LONG g_lastChangeTime;
+static volatile LONG g_lastPasteTime;
+static volatile LONG g_bUndoTracking;
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text on the clipboard from one keyboard layout to another, and
+// puts the converted text on the clipboard in its place. The converter reads
+// the text right from the clipboard's memory and writes into the memory that
+// becomes the new clipboard text, so the clipboard stays open meanwhile. The
+// conversion is kept for `hWnd` at `generation`, so it can be undone.
+static BOOL ConvertClipboardText(HKL hklSource, HKL hklTarget, HWND hWnd, LONG generation)
+{
+	HKL hklBefore = hklSource;
+
+	// the copy is seen as soon as the clipboard is emptied, before the copying
+	// application sets the text and closes it
+	BOOL bOpened = OpenClipboard(NULL);
+	for(int i = 1; !bOpened && i < CLIPBOARD_OPEN_TRIES; i++)
+	{
+		Sleep(CLIPBOARD_OPEN_RETRY_WAIT);
+		bOpened = OpenClipboard(NULL);
 	}
 
-	// copy the selected text by simulating Ctrl-C
-	SendKeyCombo('C', TRUE, FALSE, FALSE);
+	if(!bOpened)
+		return FALSE;
+
+	BOOL bConverted = FALSE;
+
+	LayoutOutput output;
+	ZeroMemory(&output, sizeof(LayoutOutput));
+	output.Grow = LayoutOutputGrowGlobal;
 
-	// wait until copy operation completes and get the copied data from the clipboard
-	// this loop has the nice side effect of setting copyOK to FALSE if there's no
-	// selected text, since nothing is copied and the clipboard still contains the
-	// contents of `dummy`.
-	BOOL copyOK = FALSE;
-	for(int i = 0; i < 10; i++)
+	HANDLE sourceHandle = GetClipboardData(CF_UNICODETEXT);
+	const WCHAR* sourceText = sourceHandle ? (const WCHAR*)GlobalLock(sourceHandle) : NULL;
+	if(sourceText)
 	{
-		sourceText = GetClipboardText();
-		if(sourceText && wcscmp(sourceText, dummy) != 0)
-		{
-			copyOK = TRUE;
-			break;
-		}
-		else
+		// the text ends at the first NUL, or at the end of its memory block
+		size_t length = wcsnlen(sourceText, GlobalSize(sourceHandle) / sizeof(WCHAR));
+
+		// use the layout whose conversion of the string reads best in the
+		// target language, falling back to the provided layout
+		hklSource = DetectSourceLayoutFromString(sourceText, length, hklSource, hklTarget);
+
+		// convert the text between layouts into a block that fits it, which
+		// grows if the converted text is longer than the source
+		bConverted = LayoutOutputGrowGlobal(&output, length + 1) &&
+			LayoutConvertText(sourceText, length, &output, hklSource, hklTarget);
+
+		if(bConverted)
 		{
-			free(sourceText);
-			Sleep(30);
+			ConversionHistoryAdd(&g_conversionHistory, (uint64_t)(ULONG_PTR)hWnd, (uint32_t)generation,
+				(LayoutId)hklBefore, (LayoutId)hklSource, (LayoutId)hklTarget,
+				sourceText, length, output.buffer, output.length);
 		}
+
+		GlobalUnlock(sourceHandle);
 	}
 
-	if(copyOK)
+	HGLOBAL targetHandle = (HGLOBAL)output.context;
+	if(targetHandle)
 	{
-		// if the string only matches one particular layout, use it
-		// otherwise use the provided layout
-		int matches = 0;
-		HKL hklDetected = DetectLayoutFromString(sourceText, &matches);
-		if(matches == 1)
-			hklSource = hklDetected;
+		GlobalUnlock(targetHandle);
+
+		// replace the source text with the converted text
+		bConverted = bConverted && EmptyClipboard() &&
+			SetClipboardData(CF_UNICODETEXT, targetHandle);
+
+		if(!bConverted)
+			GlobalFree(targetHandle);
+	}
+
+	// the conversion that was kept isn't going to be pasted
+	if(!bConverted)
+		ConversionUndoInvalidate();
+
+	CloseClipboard();
+	return bConverted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulates Ctrl-V to paste the clipboard text into `hWnd`, and lets the
+// application complete pasting. Returns TRUE if the paste is confirmed: the
+// keys were injected, and the focus is still on the window with no input
+// since `generation`.
+static BOOL PasteIntoWindow(HWND hWnd, LONG generation)
+{
+	KeyInjector injector;
+	GetWin32KeyInjector(&injector);
+
+	BOOL bInjected = InjectKeyCombo(&injector, 'V', KEY_STATE_CONTROL);
+	Sleep(REMOTE_APP_WAIT);
+	InterlockedExchange(&g_lastPasteTime, (LONG)GetTickCount());
+
+	return bInjected && FocusCacheGetFocus(NULL, NULL) == hWnd && g_inputGeneration == generation;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The conversion of the selected text runs as a pipeline of stages. Before
+// each stage that can be canceled the cancel event is checked, and if it's
+// signaled the pipeline skips to the restore stage. Once the converted text
+// is pasted, the remaining stages always run so that the clipboard is left
+// the way it was.
+
+typedef struct
+{
+	HKL hklSource;
+	HKL hklTarget;
+	HANDLE hCancelEvent;
+	ClipboardData prevClipboardData;
+	BOOL bCopied;
+
+	// the window the text is converted in, and the input generation when the
+	// conversion started
+	HWND hWnd;
+	LONG generation;
+} ConversionJob;
+
+typedef enum
+{
+	STAGE_NEXT,        // continue with the next stage
+	STAGE_RESTORE,     // skip to the restore stage
+	STAGE_STOP,        // end the pipeline
+} StageResult;
+
+///////////////////////////////////////////////////////////////////////////////
+// Stores the clipboard data, which the copy is going to replace
+static StageResult SnapshotStage(ConversionJob* job)
+{
+	return StoreClipboardData(&job->prevClipboardData) ? STAGE_NEXT : STAGE_STOP;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the selected text by simulating Ctrl-C, and waits up to
+// CLIPBOARD_COPY_TIMEOUT for the clipboard to change. If there's no selected
+// text nothing is copied, and the wait times out.
+static StageResult CopyStage(ConversionJob* job)
+{
+	ClipboardBackend clipboard;
+	GetWin32ClipboardBackend(&clipboard, job->hCancelEvent);
 
-		// convert the text between layouts
-		size_t length = wcslen(sourceText);
-		targetText = (WCHAR*)malloc(sizeof(WCHAR) * (length + 1));
-		size_t converted = LayoutConvertString(sourceText, targetText, length + 1, hklSource, hklTarget);
+	int copied = ClipboardWaitForCopy(&clipboard, CLIPBOARD_COPY_TIMEOUT);
+
+	// a canceled copy might still change the clipboard, so it's restored
+	job->bCopied = copied != 0;
+	return copied == 1 ? STAGE_NEXT : STAGE_RESTORE;
+}
 
-		if(converted)
+///////////////////////////////////////////////////////////////////////////////
+// Converts the copied text on the clipboard
+static StageResult ConvertStage(ConversionJob* job)
+{
+	return ConvertClipboardText(job->hklSource, job->hklTarget, job->hWnd, job->generation) ? STAGE_NEXT : STAGE_RESTORE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pastes the text, replacing the previous text, before the old data is put
+// back on the clipboard. The conversion that was kept can't be undone if the
+// paste isn't confirmed.
+static StageResult PasteStage(ConversionJob* job)
+{
+	if(!PasteIntoWindow(job->hWnd, job->generation))
+		ConversionUndoInvalidate();
+
+	return STAGE_NEXT;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Restores the original clipboard data, unless nothing was copied and it's
+// still there
+static StageResult RestoreStage(ConversionJob* job)
+{
+	if(job->bCopied)
+		RestoreClipboardData(&job->prevClipboardData);
+	else
+		FreeClipboardData(&job->prevClipboardData);
+
+	return STAGE_NEXT;
+}
+
+static const struct
+{
+	StageResult (*Run)(ConversionJob* job);
+	BOOL bCancelable;
+} g_conversionStages[] = {
+	{ SnapshotStage, TRUE },
+	{ CopyStage, TRUE },
+	{ ConvertStage, TRUE },
+	{ PasteStage, FALSE },
+	{ RestoreStage, FALSE },
+};
+
+#define RESTORE_STAGE (_countof(g_conversionStages) - 1)
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text in the active window from one keyboard layout to another
+// using the clipboard. If `hCancelEvent` isn't NULL, the conversion stops
+// early when it's signaled, up to the point the converted text is pasted.
+// Returns FALSE if it was canceled.
+BOOL ConvertSelectedTextInActiveWindow(HKL hklSource, HKL hklTarget, HANDLE hCancelEvent)
+{
+	ConversionJob job;
+	ZeroMemory(&job, sizeof(ConversionJob));
+	job.hklSource = hklSource;
+	job.hklTarget = hklTarget;
+	job.hCancelEvent = hCancelEvent;
+	job.hWnd = FocusCacheGetFocus(NULL, NULL);
+	job.generation = g_inputGeneration;
+
+	BOOL bCanceled = FALSE;
+
+	for(size_t stage = 0; stage < _countof(g_conversionStages); stage++)
+	{
+		if(g_conversionStages[stage].bCancelable && hCancelEvent &&
+			WaitForSingleObject(hCancelEvent, 0) == WAIT_OBJECT_0)
 		{
-			// put the converted string on the clipboard
-			if(SetClipboardText(targetText))
-			{
-				// simulate Ctrl-V to paste the text, replacing the previous text
-				SendKeyCombo('V', TRUE, FALSE, FALSE);
+			bCanceled = TRUE;
 
-				// let the application complete pasting before putting the old data back on the clipboard
-				Sleep(REMOTE_APP_WAIT);
-			}
+			// nothing was stored yet before the first stage
+			if(stage == 0)
+				break;
+
+			stage = RESTORE_STAGE;
 		}
 
-		// free allocated memory
-		free(sourceText);
-		free(targetText);
+		StageResult result = g_conversionStages[stage].Run(&job);
+		if(result == STAGE_STOP)
+			break;
+
+		if(result == STAGE_RESTORE && stage < RESTORE_STAGE)
+			stage = RESTORE_STAGE - 1;
 	}
 
-	// restore the original clipboard data
+	return !bCanceled;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts the original text of the last conversion in the active window back in
+// place of the conversion, or if it's there, the conversion of the original
+// text from the next layout. The text pasted last is selected with
+// Shift+Left, so nothing is copied from the window and the layout isn't
+// detected again. Returns the layout the window should be switched to, or
+// NULL if there's no conversion in the window or the user typed since.
+HKL UndoConversionInActiveWindow()
+{
+	if(!g_bUndoTracking)
+		return NULL;
+
+	// a focus or caret change after the last paste moves on from it
+	if((LONG)((DWORD)g_lastChangeTime - (DWORD)g_lastPasteTime) > 0)
+		ConversionUndoInvalidate();
+
+	LONG generation = g_inputGeneration;
+	HWND hWnd = FocusCacheGetFocus(NULL, NULL);
+	ConversionRecord* record = hWnd ?
+		ConversionHistoryFind(&g_conversionHistory, (uint64_t)(ULONG_PTR)hWnd, (uint32_t)generation) : NULL;
+	if(!record)
+		return NULL;
+
+	HKL hkls[MAX_LAYOUT_LIST];
+	UINT layoutCount = GetKeyboardLayoutList(MAX_LAYOUT_LIST, hkls);
+	LayoutId source = ConversionRecordNextSource(record, (const LayoutId*)hkls, layoutCount);
+
+	// the text to paste, in memory that becomes the clipboard text
+	LayoutOutput output;
+	ZeroMemory(&output, sizeof(LayoutOutput));
+	output.Grow = LayoutOutputGrowGlobal;
+
+	BOOL bReady = LayoutOutputGrowGlobal(&output, record->originalLength + 1);
+	if(bReady && source)
+	{
+		bReady = LayoutConvertText(record->original, record->originalLength, &output, (HKL)source, (HKL)record->target);
+	}
+	else if(bReady)
+	{
+		CopyMemory(output.buffer, record->original, sizeof(WCHAR) * record->originalLength);
+		output.buffer[record->originalLength] = L'\0';
+		output.length = record->originalLength;
+	}
+
+	size_t steps = bReady ? ConversionCaretSteps(output.buffer, output.length) : 0;
+
+	HGLOBAL textHandle = (HGLOBAL)output.context;
+	if(textHandle)
+		GlobalUnlock(textHandle);
+
+	ClipboardData prevClipboardData;
+	if(!bReady || !StoreClipboardData(&prevClipboardData))
+	{
+		if(textHandle)
+			GlobalFree(textHandle);
+		return NULL;
+	}
+
+	BOOL bPut = FALSE;
+	if(OpenClipboard(NULL))
+	{
+		bPut = EmptyClipboard() && SetClipboardData(CF_UNICODETEXT, textHandle);
+		CloseClipboard();
+	}
+
+	if(bPut)
+	{
+		// select the text pasted last, paste the new text in its place, and
+		// let the application complete pasting
+		KeyInjector injector;
+		GetWin32KeyInjector(&injector);
+		if(InjectKeyRepeat(&injector, VK_LEFT, (unsigned)record->steps, KEY_STATE_SHIFT) &&
+			PasteIntoWindow(hWnd, generation))
+			ConversionRecordUpdate(record, source, (uint32_t)generation, steps);
+		else
+			ConversionUndoInvalidate();
+	}
+	else
+		GlobalFree(textHandle);
+
 	RestoreClipboardData(&prevClipboardData);
+
+	if(!bPut)
+		return NULL;
+
+	return source ? (HKL)record->target : (HKL)record->before;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Converts a character from one keyboard layout to another
-WCHAR LayoutConvertChar(WCHAR ch, HKL hklSource, HKL hklTarget)
+// Moves on the input generation, so that the last conversions can't be
+// undone. It's called from the keyboard and mouse hooks, and takes constant
+// time.
+void ConversionUndoInvalidate()
+{
+	InterlockedIncrement(&g_inputGeneration);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records a focus or caret change at `eventTime`, the tick count of the
+// event. Only the hook thread calls it, so keeping the latest time doesn't
+// need a compare and exchange.
+void ConversionUndoChanged(DWORD eventTime)
+{
+	if((LONG)(eventTime - (DWORD)g_lastChangeTime) > 0)
+		InterlockedExchange(&g_lastChangeTime, (LONG)eventTime);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Enables the undo once the input it depends on is followed
+void ConversionUndoSetTracking(BOOL bTracking)
+{
+	if(!bTracking)
+		ConversionUndoInvalidate();
+
+	InterlockedExchange(&g_bUndoTracking, bTracking);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees the last conversions
+void ConversionUndoFree()
+{
+	ConversionHistoryFree(&g_conversionHistory);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Layout provider for the installed Windows keyboard layouts, whose LayoutIds
+// are HKLs. The conversion functions below run the layout core on it, one
+// thread at a time, since the tables may be warming up in the background.
+
+static LayoutCore g_layoutCore;
+static BOOL g_bLayoutCoreInitialized;
+static SRWLOCK g_layoutCoreLock = SRWLOCK_INIT;
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.CharToKey for Windows layouts
+static int Win32CharToKey(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	// get the virtual key code and the shift state using the character and the source keyboard layout
+	SHORT vkAndShift = VkKeyScanEx(ch, (HKL)layout);
+	if(vkAndShift == -1)
+		return 0;
+
+	key->vk = LOBYTE(vkAndShift);
+	key->shift = HIBYTE(vkAndShift);
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills a key state array usable with ToUnicodeEx with the shift state of `key`
+static void GetKeyStateForKey(LayoutKey key, BYTE keyState[256])
+{
+	ZeroMemory(keyState, 256);
+	if(key.shift & LAYOUT_SHIFT) keyState[VK_SHIFT] = 0x80;	// turn on high bit
+	if(key.shift & LAYOUT_CONTROL) keyState[VK_CONTROL] = 0x80;
+	if(key.shift & LAYOUT_ALT) keyState[VK_MENU] = 0x80;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ToUnicodeEx keeps a pressed dead key in the keyboard state of the thread.
+// Pressing space flushes it, so that it doesn't combine with the next key.
+static void ClearDeadKeyState(HKL hkl)
+{
+	BYTE keyState[256] = { 0 };
+	WCHAR buffer[LAYOUT_KEY_CHARS];
+	for(int i = 0; i < 4; i++)
+	{
+		if(ToUnicodeEx(VK_SPACE, 0, keyState, buffer, LAYOUT_KEY_CHARS, 0, hkl) >= 0)
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.KeyToChars for Windows layouts
+static int Win32KeyToChars(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	// convert the shift state returned from VkKeyScanEx to an array that represents the
+	// key state usable with ToUnicodeEx that we'll be calling next
+	BYTE keyState[256];
+	GetKeyStateForKey(key, keyState);
+
+	// convert virtual key and key state to a new character using the target keyboard layout
+	int result = ToUnicodeEx(key.vk, 0, keyState, buffer, size, 0, (HKL)layout);
+	if(result < 0)
+		ClearDeadKeyState((HKL)layout);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.DeadKeyToChars for Windows layouts
+static int Win32DeadKeyToChars(void* context, LayoutId layout, LayoutKey deadKey, LayoutKey key, LayoutChar* buffer, int size)
+{
+	UNREFERENCED_PARAMETER(context);
+
+	BYTE keyState[256];
+
+	// press the dead key, leaving it in the keyboard state, then the key
+	GetKeyStateForKey(deadKey, keyState);
+	if(ToUnicodeEx(deadKey.vk, 0, keyState, buffer, size, 0, (HKL)layout) >= 0)
+		return Win32KeyToChars(context, layout, key, buffer, size);
+
+	GetKeyStateForKey(key, keyState);
+	int result = ToUnicodeEx(key.vk, 0, keyState, buffer, size, 0, (HKL)layout);
+	if(result < 0)
+		ClearDeadKeyState((HKL)layout);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.OverrideChar for Windows layouts
+static LayoutChar Win32OverrideChar(void* context, LayoutId source, LayoutId target, LayoutChar ch)
 {
+	UNREFERENCED_PARAMETER(context);
+
 	// special handling for some ambivalent characters in Hebrew layout
-	if(LOWORD(hklSource) == MAKELANGID(LANG_HEBREW, SUBLANG_HEBREW_ISRAEL) &&
-		LOWORD(hklTarget) == MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US))
+	if(LOWORD(source) == MAKELANGID(LANG_HEBREW, SUBLANG_HEBREW_ISRAEL) &&
+		LOWORD(target) == MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US))
 	{
 		switch(ch)
 		{
@@ -99,8 +524,8 @@ WCHAR LayoutConvertChar(WCHAR ch, HKL hklSource, HKL hklTarget)
 		case L',':  return L'\'';
 		}
 	}
-	else if(LOWORD(hklSource) == MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) &&
-		LOWORD(hklTarget) == MAKELANGID(LANG_HEBREW, SUBLANG_HEBREW_ISRAEL))
+	else if(LOWORD(source) == MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) &&
+		LOWORD(target) == MAKELANGID(LANG_HEBREW, SUBLANG_HEBREW_ISRAEL))
 	{
 		switch(ch)
 		{
@@ -111,129 +536,724 @@ WCHAR LayoutConvertChar(WCHAR ch, HKL hklSource, HKL hklTarget)
 		}
 	}
 
-	// get the virtual key code and the shift state using the character and the source keyboard layout
-	SHORT vkAndShift = VkKeyScanEx(ch, hklSource);
-	if(vkAndShift == -1)
-		return 0; // no such char in source keyboard layout
+	return 0;
+}
 
-	BYTE vk = LOBYTE(vkAndShift);
-	BYTE shift = HIBYTE(vkAndShift);
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.GetLanguage for Windows layouts
+static uint16_t Win32GetLanguage(void* context, LayoutId layout)
+{
+	UNREFERENCED_PARAMETER(context);
 
-	// convert the shift state returned from VkKeyScanEx to an array that represents the
-	// key state usable with ToUnicodeEx that we'll be calling next
-	BYTE keyState[256] = { 0 };
-	if(shift & 1) keyState[VK_SHIFT] = 0x80;	// turn on high bit
-	if(shift & 2) keyState[VK_CONTROL] = 0x80;
-	if(shift & 4) keyState[VK_MENU] = 0x80;
+	// the low word of an HKL is its language identifier
+	return LOWORD(layout);
+}
 
-	// convert virtual key and key state to a new character using the target keyboard layout
-	WCHAR buffer[10] = { 0 };
-	int result = ToUnicodeEx(vk, 0, keyState, buffer, 10, 0, hklTarget);
+///////////////////////////////////////////////////////////////////////////////
+// Fills `provider` with the provider for Windows layouts
+void GetWin32LayoutProvider(LayoutProvider* provider)
+{
+	ZeroMemory(provider, sizeof(LayoutProvider));
+	provider->CharToKey = Win32CharToKey;
+	provider->KeyToChars = Win32KeyToChars;
+	provider->OverrideChar = Win32OverrideChar;
+	provider->DeadKeyToChars = Win32DeadKeyToChars;
+	provider->GetLanguage = Win32GetLanguage;
+}
 
-	// result can be more than 1 if the character in the source layout is represented by 
-	// several characters in the target layout, but we ignore this to simplify the function.
-	if(result == 1)
-		return buffer[0];
+///////////////////////////////////////////////////////////////////////////////
+// Returns the layout core of the installed layouts
+static LayoutCore* GetLayoutCore()
+{
+	if(!g_bLayoutCoreInitialized)
+	{
+		LayoutProvider provider;
+		GetWin32LayoutProvider(&provider);
+		LayoutCoreInit(&g_layoutCore, &provider);
+		g_bLayoutCoreInitialized = TRUE;
+	}
 
-	// conversion failed for some reason
-	return 0;
+	return &g_layoutCore;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Converts a string from one keyboard layout to another
-size_t LayoutConvertString(const WCHAR* str, WCHAR* buffer, size_t size, HKL hklSource, HKL hklTarget)
+// Key tables of the installed layouts, mapped read-only from a file, so that
+// starting up doesn't ask Windows for every key of every layout. The file in
+// the program data folder is shared by all the users of the machine, and
+// their sessions map it from the same pages. Only an administrator writes
+// it, see LayoutCacheInstallShared. If it's missing or for other layouts,
+// the file in the user's local application data folder is used, which is
+// rebuilt when the layouts or the Windows build change.
+
+#define KEYTABLE_MAX_PATH  520
+#define KEYTABLE_FOLDER    L"\\Recaps"
+#define KEYTABLE_FILE_NAME L"\\layouts.cache"
+#define KEYTABLE_TEMP_NAME L"\\layouts.cache.tmp"
+
+// the shared folder can only be changed by the system and administrators
+#define KEYTABLE_SHARED_SDDL L"D:P(A;OICI;GA;;;SY)(A;OICI;GA;;;BA)(A;OICI;GRGX;;;BU)"
+
+static KeyTableCache g_keyTableCache;
+static HANDLE g_hKeyTableMapping;
+static const BYTE* g_keyTableView;
+static BYTE* g_keyTableBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+// Gets the build number and update revision of Windows, which the key
+// tables of its layouts are tied to
+static void GetSystemBuild(uint32_t* build, uint32_t* revision)
+{
+	*build = 0;
+	*revision = 0;
+
+	HKEY hkey;
+	if(RegOpenKeyEx(HKEY_LOCAL_MACHINE, L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion", 0, KEY_QUERY_VALUE, &hkey) != ERROR_SUCCESS)
+		return;
+
+	WCHAR buildNumber[16];
+	DWORD size = sizeof(buildNumber) - sizeof(WCHAR);
+	DWORD type;
+	ZeroMemory(buildNumber, sizeof(buildNumber));
+	if(RegQueryValueEx(hkey, L"CurrentBuildNumber", NULL, &type, (LPBYTE)buildNumber, &size) == ERROR_SUCCESS && type == REG_SZ)
+		*build = wcstoul(buildNumber, NULL, 10);
+
+	DWORD ubr;
+	size = sizeof(ubr);
+	if(RegQueryValueEx(hkey, L"UBR", NULL, &type, (LPBYTE)&ubr, &size) == ERROR_SUCCESS && type == REG_DWORD)
+		*revision = ubr;
+
+	RegCloseKey(hkey);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Gets the key table folder and file under the folder in the environment
+// `variable`. Returns FALSE if there's no such folder.
+static BOOL GetKeyTablePath(const WCHAR* variable, WCHAR* folder, WCHAR* path)
+{
+	DWORD length = GetEnvironmentVariable(variable, folder, KEYTABLE_MAX_PATH);
+	if(length == 0 || length >= KEYTABLE_MAX_PATH ||
+		wcscat_s(folder, KEYTABLE_MAX_PATH, KEYTABLE_FOLDER) != 0 ||
+		wcscpy_s(path, KEYTABLE_MAX_PATH, folder) != 0 ||
+		wcscat_s(path, KEYTABLE_MAX_PATH, KEYTABLE_FILE_NAME) != 0)
+	{
+		folder[0] = L'\0';
+		path[0] = L'\0';
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns TRUE if the file is owned by the system or the administrators, so
+// that no other user could have written it
+static BOOL IsFileOwnedByAdministrators(HANDLE hFile)
+{
+	PSID owner = NULL;
+	PSECURITY_DESCRIPTOR descriptor = NULL;
+	if(GetSecurityInfo(hFile, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &descriptor) != ERROR_SUCCESS)
+		return FALSE;
+
+	BOOL bOwned = owner && (IsWellKnownSid(owner, WinBuiltinAdministratorsSid) || IsWellKnownSid(owner, WinLocalSystemSid));
+	LocalFree(descriptor);
+	return bOwned;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps the key table file read-only. A shared file is only mapped if an
+// administrator wrote it. Returns the view, or NULL.
+static const BYTE* MapKeyTableFile(const WCHAR* path, BOOL bShared, size_t* size)
+{
+	HANDLE hFile = CreateFile(path, GENERIC_READ | (bShared ? READ_CONTROL : 0), FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(hFile == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	const BYTE* view = NULL;
+	LARGE_INTEGER fileSize;
+	if((!bShared || IsFileOwnedByAdministrators(hFile)) && GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0 && (ULONGLONG)fileSize.QuadPart <= (SIZE_T)-1)
+	{
+		g_hKeyTableMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(g_hKeyTableMapping)
+		{
+			view = (const BYTE*)MapViewOfFile(g_hKeyTableMapping, FILE_MAP_READ, 0, 0, 0);
+			if(view)
+				*size = (size_t)fileSize.QuadPart;
+			else
+			{
+				CloseHandle(g_hKeyTableMapping);
+				g_hKeyTableMapping = NULL;
+			}
+		}
+	}
+
+	// the mapping keeps the file open
+	CloseHandle(hFile);
+	return view;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Unmaps the key table file and frees the tables built in memory
+static void UnmapKeyTables()
 {
-	size_t i;
-	for(i = 0; i < wcslen(str) && i < size - 1; i++)
+	if(g_keyTableView)
+		UnmapViewOfFile(g_keyTableView);
+	if(g_hKeyTableMapping)
+		CloseHandle(g_hKeyTableMapping);
+	free(g_keyTableBuffer);
+
+	g_keyTableView = NULL;
+	g_hKeyTableMapping = NULL;
+	g_keyTableBuffer = NULL;
+	ZeroMemory(&g_keyTableCache, sizeof(g_keyTableCache));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the key table file through a temporary file, so that another
+// process never maps half of it
+static BOOL WriteKeyTableFile(const WCHAR* folder, const BYTE* data, size_t size)
+{
+	WCHAR tempPath[KEYTABLE_MAX_PATH];
+	WCHAR path[KEYTABLE_MAX_PATH];
+	if(wcscpy_s(tempPath, KEYTABLE_MAX_PATH, folder) != 0 || wcscat_s(tempPath, KEYTABLE_MAX_PATH, KEYTABLE_TEMP_NAME) != 0 ||
+		wcscpy_s(path, KEYTABLE_MAX_PATH, folder) != 0 || wcscat_s(path, KEYTABLE_MAX_PATH, KEYTABLE_FILE_NAME) != 0)
+		return FALSE;
+
+	HANDLE hFile = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	DWORD written;
+	BOOL bWritten = size <= MAXDWORD && WriteFile(hFile, data, (DWORD)size, &written, NULL) && written == size;
+	CloseHandle(hFile);
+
+	if(!bWritten || !MoveFileEx(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFile(tempPath);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps the key tables of the layouts from their file, rebuilding the file
+// if it's missing, damaged or for other layouts or another Windows build.
+// If the file can't be written, the rebuilt tables are kept in memory.
+// Returns FALSE if there are no key tables.
+static BOOL LoadKeyTables(const HKL* hkls, UINT count)
+{
+	uint32_t build, revision;
+	GetSystemBuild(&build, &revision);
+
+	WCHAR folder[KEYTABLE_MAX_PATH];
+	WCHAR path[KEYTABLE_MAX_PATH];
+	size_t size = 0;
+
+	// the shared file, if it was written for the same layouts
+	if(GetKeyTablePath(L"ProgramData", folder, path))
+	{
+		g_keyTableView = MapKeyTableFile(path, TRUE, &size);
+		if(g_keyTableView && KeyTableCacheOpen(&g_keyTableCache, g_keyTableView, size, (const LayoutId*)hkls, count, build, revision))
+			return TRUE;
+
+		UnmapKeyTables();
+	}
+
+	if(GetKeyTablePath(L"LOCALAPPDATA", folder, path))
+	{
+		g_keyTableView = MapKeyTableFile(path, FALSE, &size);
+		if(g_keyTableView && KeyTableCacheOpen(&g_keyTableCache, g_keyTableView, size, (const LayoutId*)hkls, count, build, revision))
+			return TRUE;
+
+		UnmapKeyTables();
+	}
+
+	LayoutProvider provider;
+	GetWin32LayoutProvider(&provider);
+	g_keyTableBuffer = KeyTableCacheBuild(&provider, (const LayoutId*)hkls, count, build, revision, &size);
+	if(!g_keyTableBuffer)
+		return FALSE;
+
+	if(folder[0])
+	{
+		CreateDirectory(folder, NULL);
+		if(WriteKeyTableFile(folder, g_keyTableBuffer, size))
+		{
+			// use the mapped file, which other processes share, instead of
+			// the copy in memory
+			size_t mappedSize = 0;
+			g_keyTableView = MapKeyTableFile(path, FALSE, &mappedSize);
+			if(g_keyTableView && KeyTableCacheOpen(&g_keyTableCache, g_keyTableView, mappedSize, (const LayoutId*)hkls, count, build, revision))
+			{
+				free(g_keyTableBuffer);
+				g_keyTableBuffer = NULL;
+				return TRUE;
+			}
+
+			if(g_keyTableView)
+				UnmapViewOfFile(g_keyTableView);
+			if(g_hKeyTableMapping)
+				CloseHandle(g_hKeyTableMapping);
+			g_keyTableView = NULL;
+			g_hKeyTableMapping = NULL;
+		}
+	}
+
+	return KeyTableCacheOpen(&g_keyTableCache, g_keyTableBuffer, size, (const LayoutId*)hkls, count, build, revision);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the key tables of the current layouts to the shared file, in a
+// folder only the system and administrators can change. It runs as an
+// administrator, such as from the installer or the image build of virtual
+// desktops, whose users have the same layouts. Returns FALSE on failure.
+BOOL LayoutCacheInstallShared()
+{
+	HKL hkls[MAX_LAYOUT_LIST];
+	UINT count = GetKeyboardLayoutList(MAX_LAYOUT_LIST, hkls);
+
+	WCHAR folder[KEYTABLE_MAX_PATH];
+	WCHAR path[KEYTABLE_MAX_PATH];
+	if(count == 0 || !GetKeyTablePath(L"ProgramData", folder, path))
+		return FALSE;
+
+	SECURITY_ATTRIBUTES attributes;
+	ZeroMemory(&attributes, sizeof(attributes));
+	attributes.nLength = sizeof(attributes);
+	if(!ConvertStringSecurityDescriptorToSecurityDescriptor(KEYTABLE_SHARED_SDDL, SDDL_REVISION_1,
+		&attributes.lpSecurityDescriptor, NULL))
+		return FALSE;
+
+	// a folder that's already there gets the same access, which fails unless
+	// the administrators may change it
+	BOOL bReady = CreateDirectory(folder, &attributes);
+	if(!bReady && GetLastError() == ERROR_ALREADY_EXISTS)
 	{
-		WCHAR ch = LayoutConvertChar(str[i], hklSource, hklTarget);
-		if(ch == 0)
-			return 0;
-		buffer[i] = ch;
+		PACL dacl = NULL;
+		BOOL bPresent, bDefaulted;
+		bReady = GetSecurityDescriptorDacl(attributes.lpSecurityDescriptor, &bPresent, &dacl, &bDefaulted) &&
+			SetNamedSecurityInfo(folder, SE_FILE_OBJECT, DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+				NULL, NULL, dacl, NULL) == ERROR_SUCCESS;
 	}
-	buffer[i] = '\0';
-	return i;
+	LocalFree(attributes.lpSecurityDescriptor);
+
+	uint32_t build, revision;
+	GetSystemBuild(&build, &revision);
+
+	LayoutProvider provider;
+	GetWin32LayoutProvider(&provider);
+
+	size_t size;
+	BYTE* data = bReady ? KeyTableCacheBuild(&provider, (const LayoutId*)hkls, count, build, revision, &size) : NULL;
+	if(!data)
+		return FALSE;
+
+	BOOL bWritten = WriteKeyTableFile(folder, data, size);
+	free(data);
+
+	// the file is only mapped if it's owned by the administrators group,
+	// which isn't the owner of the files of every administrator
+	BYTE sid[SECURITY_MAX_SID_SIZE];
+	DWORD sidSize = sizeof(sid);
+	return bWritten && CreateWellKnownSid(WinBuiltinAdministratorsSid, NULL, sid, &sidSize) &&
+		SetNamedSecurityInfo(path, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, sid, NULL, NULL, NULL) == ERROR_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Drops all the cached conversion tables if the installed layouts differ
+// from the ones the tables were built for.
+void LayoutCacheSync(const HKL* hkls, UINT count)
+{
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	LayoutCoreSync(GetLayoutCore(), (const LayoutId*)hkls, count);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees all the cached conversion tables
+void LayoutCacheFree()
+{
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	LayoutCoreFree(GetLayoutCore());
+
+	// go back to asking Windows before the key tables go away
+	if(g_keyTableCache.data)
+	{
+		GetWin32LayoutProvider(&g_layoutCore.provider);
+		UnmapKeyTables();
+	}
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loads the key tables of the layouts, then builds the conversion tables
+// between every two of them from the key tables, and the detection index.
+// Each pair is built under the lock on its own, so a conversion meanwhile
+// only waits for the pair being built.
+void LayoutCacheWarmUp(const HKL* hkls, UINT count)
+{
+	LayoutCacheSync(hkls, count);
+
+	// the key tables are loaded without the lock, since only the provider
+	// of the core changes to them. Layouts added later aren't in them, and
+	// are asked from Windows.
+	if(!g_keyTableCache.data && LoadKeyTables(hkls, count))
+	{
+		AcquireSRWLockExclusive(&g_layoutCoreLock);
+		LayoutProvider provider;
+		GetWin32LayoutProvider(&provider);
+		KeyTableCacheGetProvider(&g_keyTableCache, &provider, &GetLayoutCore()->provider);
+		ReleaseSRWLockExclusive(&g_layoutCoreLock);
+	}
+
+	for(UINT i = 0; i < count; i++)
+	{
+		for(UINT j = 0; j < count; j++)
+		{
+			if(i == j)
+				continue;
+
+			AcquireSRWLockExclusive(&g_layoutCoreLock);
+			LayoutCoreWarmUp(GetLayoutCore(), (LayoutId)hkls[i], (LayoutId)hkls[j]);
+			ReleaseSRWLockExclusive(&g_layoutCoreLock);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character from one keyboard layout to another
+WCHAR LayoutConvertChar(WCHAR ch, HKL hklSource, HKL hklTarget)
+{
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	WCHAR converted = LayoutCoreConvertChar(GetLayoutCore(), ch, (LayoutId)hklSource, (LayoutId)hklTarget);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+	return converted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character from one keyboard layout to another by querying the
+// layouts directly, without using the cached conversion tables
+WCHAR LayoutConvertCharUncached(WCHAR ch, HKL hklSource, HKL hklTarget)
+{
+	LayoutProvider provider;
+	GetWin32LayoutProvider(&provider);
+	return LayoutCoreConvertCharUncached(&provider, ch, (LayoutId)hklSource, (LayoutId)hklTarget);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a string from one keyboard layout to another.
+// Returns 0 if any of the characters can't be converted.
+size_t LayoutConvertString(const WCHAR* str, WCHAR* buffer, size_t size, HKL hklSource, HKL hklTarget)
+{
+	size_t length = wcslen(str);
+	if(length > size - 1)
+		length = size - 1;
+
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	size_t converted = LayoutCoreConvertString(GetLayoutCore(), str, length, buffer, (LayoutId)hklSource, (LayoutId)hklTarget);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+
+	buffer[converted] = '\0';
+	return converted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts `length` characters of a string from one keyboard layout to
+// another, including characters typed with dead keys and keys that generate
+// several characters. The result is NUL-terminated and appended to `output`.
+// Large strings are converted on several threads.
+BOOL LayoutConvertText(const WCHAR* str, size_t length, LayoutOutput* output, HKL hklSource, HKL hklTarget)
+{
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	BOOL bConverted = ParallelConvertText(GetLayoutCore(), str, length, output, (LayoutId)hklSource, (LayoutId)hklTarget, 0);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+	return bConverted;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Goes through all the installed keyboard layouts and returns a layout that
 // can generate the string. If not matching layout is found, returns NULL.
-// If `multiple` isn't NULL it will be set to the number of matched layouts.
+// If `pmatches` isn't NULL it will be set to the number of matched layouts.
+// Only the first LAYOUT_DETECT_MAX installed layouts are considered.
 HKL DetectLayoutFromString(const WCHAR* str, int* pmatches)
 {
-	HKL result = NULL;
-	HKL* hkls;
-	UINT layoutCount;
-	layoutCount = GetKeyboardLayoutList(0, NULL);
-	hkls = (HKL*)malloc(sizeof(HKL) * layoutCount);
-	GetKeyboardLayoutList(layoutCount, hkls);
+	HKL hkls[MAX_LAYOUT_LIST];
+	UINT layoutCount = GetKeyboardLayoutList(MAX_LAYOUT_LIST, hkls);
+
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	LayoutCoreSync(GetLayoutCore(), (const LayoutId*)hkls, layoutCount);
+	HKL hkl = (HKL)LayoutCoreDetect(GetLayoutCore(), str, wcslen(str), pmatches);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+
+	return hkl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the installed layout the string was most likely typed in, given
+// that it's going to be converted to `hklTarget`. The layouts that can
+// generate the string are ranked by how well their conversion of it reads in
+// the language of the target layout. Returns `hklPreferred` if no layout can
+// generate the string, and on ties.
+HKL DetectSourceLayoutFromString(const WCHAR* str, size_t length, HKL hklPreferred, HKL hklTarget)
+{
+	HKL hkls[MAX_LAYOUT_LIST];
+	UINT layoutCount = GetKeyboardLayoutList(MAX_LAYOUT_LIST, hkls);
+
+	AcquireSRWLockExclusive(&g_layoutCoreLock);
+	LayoutCoreSync(GetLayoutCore(), (const LayoutId*)hkls, layoutCount);
+	HKL hkl = (HKL)LayoutCoreDetectSource(GetLayoutCore(), str, length,
+		(LayoutId)hklTarget, (LayoutId)hklPreferred, NULL);
+	ReleaseSRWLockExclusive(&g_layoutCoreLock);
+
+	return hkl;
+}
+
+// number of bytes of clipboard data kept in memory, and the counters of the
+// stored clipboard data
+static SIZE_T g_clipboardMemoryBudget = CLIPBOARD_MEMORY_BUDGET;
+static ClipboardStoreStats g_clipboardStoreStats;
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the format to store for `format`, or 0 if it's left out because the
+// system synthesizes it from a format that's already stored. Of each group of
+// formats the system converts between, only the first one on the clipboard is
+// stored, which is the one the owner provided. Bitmaps are stored as DIBs,
+// which is only a copy of memory, and the system creates the bitmap again
+// when an application asks for it.
+static UINT GetStoredClipboardFormat(UINT format, UINT* textFormat, UINT* imageFormat, UINT* metafileFormat)
+{
+	UINT* groupFormat;
+
+	switch(format)
+	{
+	case CF_TEXT:
+	case CF_OEMTEXT:
+	case CF_UNICODETEXT:
+		groupFormat = textFormat;
+		break;
+
+	case CF_BITMAP:
+	case CF_DIB:
+	case CF_DIBV5:
+		groupFormat = imageFormat;
+		if(format == CF_BITMAP)
+			format = CF_DIB;
+		break;
+
+	case CF_METAFILEPICT:
+	case CF_ENHMETAFILE:
+		groupFormat = metafileFormat;
+		break;
+
+	default:
+		return format;
+	}
+
+	if(*groupFormat)
+		return 0;
+
+	*groupFormat = format;
+	return format;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns whether the data of `format` is a global memory block, rather than
+// a GDI object or a handle with a structure that points to one
+static BOOL IsGlobalMemoryClipboardFormat(UINT format)
+{
+	switch(format)
+	{
+	case CF_PALETTE:
+	case CF_BITMAP:
+	case CF_DSPBITMAP:
+	case CF_OWNERDISPLAY:
+	case CF_METAFILEPICT:
+	case CF_DSPMETAFILEPICT:
+	case CF_ENHMETAFILE:
+	case CF_DSPENHMETAFILE:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies `size` bytes of the global memory block `dataHandle` to a mapping of
+// a temporary file, which is deleted when it's closed
+static BOOL SpillClipboardFormat(ClipboardFormat* stored, HANDLE dataHandle, SIZE_T size)
+{
+	WCHAR tempPath[MAX_PATH];
+	WCHAR tempFile[MAX_PATH];
+	if(!GetTempPath(MAX_PATH, tempPath) || !GetTempFileName(tempPath, L"rcp", 0, tempFile))
+		return FALSE;
+
+	HANDLE hFile = CreateFile(tempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if(hFile == INVALID_HANDLE_VALUE)
+	{
+		DeleteFile(tempFile);
+		return FALSE;
+	}
+
+	BOOL bSuccess = FALSE;
 
-	int matches = 0;
-	for(size_t layout = 0; layout < layoutCount; layout++)
+	HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE,
+		(DWORD)((ULONGLONG)size >> 32), (DWORD)size, NULL);
+	if(hMapping)
 	{
-		BOOL validLayout = TRUE;
-		for(size_t i = 0; i < wcslen(str); i++)
+		void* view = MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, size);
+		if(view)
 		{
-			UINT vk = VkKeyScanEx(str[i], hkls[layout]);
-			if(vk == -1)
+			void* data = GlobalLock(dataHandle);
+			if(data)
 			{
-				validLayout = FALSE;
-				break;
+				CopyMemory(view, data, size);
+				GlobalUnlock(dataHandle);
+				bSuccess = TRUE;
 			}
+
+			UnmapViewOfFile(view);
 		}
-		if(validLayout)
+
+		if(!bSuccess)
+			CloseHandle(hMapping);
+	}
+
+	if(!bSuccess)
+	{
+		CloseHandle(hFile);
+		return FALSE;
+	}
+
+	stored->spillFile = hFile;
+	stored->spillMapping = hMapping;
+	stored->spillSize = size;
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads the spilled data of `stored` back into a global memory block
+static HANDLE LoadSpilledClipboardFormat(const ClipboardFormat* stored)
+{
+	HANDLE dataHandle = GlobalAlloc(GMEM_MOVEABLE, stored->spillSize);
+	if(!dataHandle)
+		return NULL;
+
+	BOOL bSuccess = FALSE;
+
+	void* view = MapViewOfFile(stored->spillMapping, FILE_MAP_READ, 0, 0, stored->spillSize);
+	if(view)
+	{
+		void* data = GlobalLock(dataHandle);
+		if(data)
 		{
-			matches++;
-			if(!result)
-				result = hkls[layout];
+			CopyMemory(data, view, stored->spillSize);
+			GlobalUnlock(dataHandle);
+			bSuccess = TRUE;
 		}
+
+		UnmapViewOfFile(view);
+	}
+
+	if(!bSuccess)
+	{
+		GlobalFree(dataHandle);
+		return NULL;
 	}
 
-	if(pmatches)
-		*pmatches = matches;
+	return dataHandle;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees the data of one stored format
+static void FreeClipboardFormat(ClipboardFormat* stored)
+{
+	clipboard_free_data(stored->format, stored->dataHandle);
+	stored->dataHandle = NULL;
 
-	return result;
+	if(stored->spillMapping)
+	{
+		CloseHandle(stored->spillMapping);
+		CloseHandle(stored->spillFile);
+		stored->spillMapping = NULL;
+		stored->spillFile = NULL;
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Stores the clipboard data in all its formats in `formats`.
-// You must call FreeAllClipboardData on `formats` when it's no longer needed.
+// Stores the clipboard data in all its formats in `formats`, except for the
+// ones the system can synthesize. Global memory formats that don't fit in
+// the memory budget are spilled to temporary files. You must call
+// RestoreClipboardData or FreeClipboardData on `formats` when it's no longer
+// needed.
 BOOL StoreClipboardData(ClipboardData* formats)
 {
+	formats->count = 0;
+	formats->dataArray = NULL;
+
 	if(!OpenClipboard(NULL))
 		return FALSE;
 
-	formats->count = CountClipboardFormats();
-	if(formats->count == 0)
+	int formatCount = CountClipboardFormats();
+	if(formatCount == 0)
 	{
 		DWORD dwError = GetLastError();
 		CloseClipboard();
 		return dwError == ERROR_SUCCESS;
 	}
 
-	formats->dataArray = (ClipboardFormat*)malloc(sizeof(ClipboardData) * formats->count);
-	ZeroMemory(formats->dataArray, sizeof(ClipboardData) * formats->count);
-	int i = 0;
-
-	UINT format = EnumClipboardFormats(0);
-	while(format)
+	formats->dataArray = (ClipboardFormat*)malloc(sizeof(ClipboardFormat) * formatCount);
+	if(!formats->dataArray)
 	{
-		if(i > formats->count - 1)
-			break;
+		CloseClipboard();
+		return FALSE;
+	}
 
-		HANDLE dataHandle = GetClipboardData(format);
-		if(!dataHandle && GetLastError() != ERROR_SUCCESS)
-			break;
+	UINT textFormat = 0, imageFormat = 0, metafileFormat = 0;
+	SIZE_T bytesInMemory = 0, bytesSpilled = 0, formatsSpilled = 0;
+	BOOL bSuccess = TRUE;
 
-		if(dataHandle)
+	UINT format = EnumClipboardFormats(0);
+	while(format && formats->count < formatCount)
+	{
+		UINT storedFormat = GetStoredClipboardFormat(format, &textFormat, &imageFormat, &metafileFormat);
+		if(storedFormat)
 		{
-			size_t size;
-			formats->dataArray[i].format = format;
-			formats->dataArray[i].dataHandle = clipboard_copy_data(format, dataHandle, &size);
-			if(!formats->dataArray[i].dataHandle)
+			HANDLE dataHandle = GetClipboardData(storedFormat);
+			if(!dataHandle && GetLastError() != ERROR_SUCCESS)
+			{
+				bSuccess = FALSE;
 				break;
+			}
+
+			if(dataHandle)
+			{
+				ClipboardFormat* stored = &formats->dataArray[formats->count];
+				ZeroMemory(stored, sizeof(ClipboardFormat));
+				stored->format = storedFormat;
 
-			i++;
+				SIZE_T size = IsGlobalMemoryClipboardFormat(storedFormat) ? GlobalSize(dataHandle) : 0;
+				if(size && bytesInMemory + size > g_clipboardMemoryBudget &&
+					SpillClipboardFormat(stored, dataHandle, size))
+				{
+					bytesSpilled += size;
+					formatsSpilled++;
+				}
+				else
+				{
+					stored->dataHandle = clipboard_copy_data(storedFormat, dataHandle, &size);
+					if(!stored->dataHandle)
+					{
+						bSuccess = FALSE;
+						break;
+					}
+
+					bytesInMemory += size;
+				}
+
+				formats->count++;
+			}
 		}
 
 		// next format
@@ -242,39 +1262,109 @@ BOOL StoreClipboardData(ClipboardData* formats)
 
 	CloseClipboard();
 
-	if(format) // if failed before completion
+	if(!bSuccess)
 	{
-		for(int j = 0; j < i; j++)
-		{
-			clipboard_free_data(formats->dataArray[j].format, formats->dataArray[j].dataHandle);
-		}
-
-		free(formats->dataArray);
+		FreeClipboardData(formats);
 		return FALSE;
 	}
 
+	InterlockedIncrement64(&g_clipboardStoreStats.snapshots);
+	InterlockedExchangeAdd64(&g_clipboardStoreStats.bytesInMemory, bytesInMemory);
+	InterlockedExchangeAdd64(&g_clipboardStoreStats.bytesSpilled, bytesSpilled);
+	InterlockedExchangeAdd64(&g_clipboardStoreStats.formatsSpilled, formatsSpilled);
+
+#ifdef _DEBUG
+	PrintDebugString("Clipboard stored: %Iu bytes in memory, %Iu bytes spilled", bytesInMemory, bytesSpilled);
+#endif
 	return TRUE;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Restores the data in the clipboard from `formats` that was generated by
-// StoreClipboardData, and frees allocated data.
+// StoreClipboardData. The clipboard thread keeps the data and renders each
+// format only when an application asks for it, otherwise the data is put on
+// the clipboard right away. Either way, `formats` no longer owns the data.
 BOOL RestoreClipboardData(ClipboardData* formats)
 {
+	if(ClipboardThreadRestore(formats))
+		return TRUE;
+
 	if(!OpenClipboard(NULL))
+	{
+		FreeClipboardData(formats);
 		return FALSE;
+	}
 
 	EmptyClipboard();
 	for(int i = 0; i < formats->count; i++)
 	{
-		SetClipboardData(formats->dataArray[i].format, formats->dataArray[i].dataHandle);
+		PutClipboardFormat(&formats->dataArray[i]);
 	}
 
 	CloseClipboard();
-	free(formats->dataArray);
+	FreeClipboardData(formats);
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts the data of a stored format on the clipboard, which must be open, and
+// reads it back first if it was spilled. The clipboard owns the data if this
+// succeeds, and `stored` no longer has it.
+BOOL PutClipboardFormat(ClipboardFormat* stored)
+{
+	HANDLE dataHandle = stored->dataHandle;
+	if(!dataHandle && stored->spillMapping)
+	{
+		dataHandle = LoadSpilledClipboardFormat(stored);
+		if(!dataHandle)
+			return FALSE;
+	}
+
+	if(!dataHandle || !SetClipboardData(stored->format, dataHandle))
+	{
+		if(dataHandle != stored->dataHandle)
+			GlobalFree(dataHandle);
+
+		return FALSE;
+	}
+
+	stored->dataHandle = NULL;
+	FreeClipboardFormat(stored);
 	return TRUE;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Frees the data in `formats` that wasn't put on the clipboard
+void FreeClipboardData(ClipboardData* formats)
+{
+	for(int i = 0; i < formats->count; i++)
+	{
+		FreeClipboardFormat(&formats->dataArray[i]);
+	}
+
+	free(formats->dataArray);
+	formats->dataArray = NULL;
+	formats->count = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the number of bytes of clipboard data that StoreClipboardData keeps
+// in memory, above which it spills formats to temporary files
+void SetClipboardMemoryBudget(SIZE_T budget)
+{
+	g_clipboardMemoryBudget = budget;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the counters of the clipboard data stored so far
+void GetClipboardStoreStats(ClipboardStoreStats* stats)
+{
+	stats->snapshots = InterlockedExchangeAdd64(&g_clipboardStoreStats.snapshots, 0);
+	stats->bytesInMemory = InterlockedExchangeAdd64(&g_clipboardStoreStats.bytesInMemory, 0);
+	stats->bytesSpilled = InterlockedExchangeAdd64(&g_clipboardStoreStats.bytesSpilled, 0);
+	stats->formatsSpilled = InterlockedExchangeAdd64(&g_clipboardStoreStats.formatsSpilled, 0);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Gets unicode text from the clipboard. 
 // You must free the returned string when you don't need it anymore.
@@ -334,69 +1424,82 @@ BOOL SetClipboardText(const WCHAR* text)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Simulates a key combination (such as Ctrl+X) in the active window
-void SendKeyCombo(BYTE vk, BOOL ctrl, BOOL alt, BOOL shift)
+// KeyInjector.GetKeyStates for the keyboard. The keys are read with
+// GetAsyncKeyState, since the key state of the calling thread, which is
+// what GetKeyboardState reads, isn't updated for threads without input such
+// as the action worker.
+static uint32_t Win32GetKeyStates(void* context, uint16_t vk)
 {
-	BYTE vkModifiers[3] = { VK_CONTROL, VK_MENU, VK_SHIFT };
-	BOOL bModRequested[3] = { ctrl != 0, alt != 0, shift != 0 };
-	BOOL bModPressed[3];
-	BOOL bKeyPressed;
+	UNREFERENCED_PARAMETER(context);
 
-	for(int i = 0; i < 3; i++)
-		bModPressed[i] = GetKeyState(vkModifiers[i]) < 0;
+	uint32_t pressed = 0;
+	if(GetAsyncKeyState(VK_CONTROL) & 0x8000)
+		pressed |= KEY_STATE_CONTROL;
+	if(GetAsyncKeyState(VK_MENU) & 0x8000)
+		pressed |= KEY_STATE_MENU;
+	if(GetAsyncKeyState(VK_SHIFT) & 0x8000)
+		pressed |= KEY_STATE_SHIFT;
+	if(GetAsyncKeyState(vk) & 0x8000)
+		pressed |= KEY_STATE_KEY;
 
-	bKeyPressed = GetKeyState(vk) < 0;
+	return pressed;
+}
 
-	for(int i = 0; i < 3; i++)
-	{
-		if(bModRequested[i] != bModPressed[i])
-			keybd_event(vkModifiers[i], 0, bModPressed[i] ? KEYEVENTF_KEYUP : 0, 0);
-	}
+///////////////////////////////////////////////////////////////////////////////
+// KeyInjector.Submit for the keyboard, which injects the inputs with a
+// single SendInput
+static unsigned Win32SubmitKeys(void* context, const KeyInput* inputs, unsigned count)
+{
+	UNREFERENCED_PARAMETER(context);
 
-	if(!bKeyPressed)
-	{
-		keybd_event(vk, 0, 0, 0);
-		keybd_event(vk, 0, KEYEVENTF_KEYUP, 0);
-	}
-	else
-	{
-		keybd_event(vk, 0, KEYEVENTF_KEYUP, 0);
-		keybd_event(vk, 0, 0, 0);
-	}
+	INPUT stackInputs[KEY_COMBO_MAX_INPUTS];
+	INPUT* win32Inputs = count <= KEY_COMBO_MAX_INPUTS ? stackInputs : (INPUT*)malloc(sizeof(INPUT) * count);
+	if(!win32Inputs)
+		return 0;
 
-	for(int i = 2; i >= 0; i--)
+	ZeroMemory(win32Inputs, sizeof(INPUT) * count);
+	for(unsigned i = 0; i < count; i++)
 	{
-		if(bModRequested[i] != bModPressed[i])
-			keybd_event(vkModifiers[i], 0, bModPressed[i] ? 0 : KEYEVENTF_KEYUP, 0);
+		win32Inputs[i].type = INPUT_KEYBOARD;
+		win32Inputs[i].ki.wVk = inputs[i].vk;
+		win32Inputs[i].ki.dwFlags = inputs[i].up ? KEYEVENTF_KEYUP : 0;
 	}
+
+	UINT sent = SendInput(count, win32Inputs, sizeof(INPUT));
+
+	if(win32Inputs != stackInputs)
+		free(win32Inputs);
+
+	return sent;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Simulates Alt+Shift to change languages
-void SendAltShift()
+// Fills `injector` with the functions that simulate key presses in the
+// active window
+void GetWin32KeyInjector(KeyInjector* injector)
 {
-	BYTE vkModifiers[3] = { VK_CONTROL, VK_MENU, VK_SHIFT };
-	BOOL bModRequested[3] = { FALSE, TRUE, TRUE };
-	BOOL bModPressed[3];
-
-	for(int i = 0; i < 3; i++)
-		bModPressed[i] = GetKeyState(vkModifiers[i]) < 0;
+	ZeroMemory(injector, sizeof(KeyInjector));
+	injector->GetKeyStates = Win32GetKeyStates;
+	injector->Submit = Win32SubmitKeys;
+}
 
-	for(int i = 0; i < 3; i++)
-	{
-		if(bModRequested[i] != bModPressed[i])
-			keybd_event(vkModifiers[i], 0, bModPressed[i] ? KEYEVENTF_KEYUP : 0, 0);
-	}
+///////////////////////////////////////////////////////////////////////////////
+// Simulates a key combination (such as Ctrl+X) in the active window
+void SendKeyCombo(BYTE vk, BOOL ctrl, BOOL alt, BOOL shift)
+{
+	KeyInjector injector;
+	GetWin32KeyInjector(&injector);
 
-	if(bModRequested[2] && bModPressed[2])
-	{
-		keybd_event(vkModifiers[2], 0, KEYEVENTF_KEYUP, 0);
-		keybd_event(vkModifiers[2], 0, 0, 0);
-	}
+	uint32_t modifiers = (ctrl ? KEY_STATE_CONTROL : 0) | (alt ? KEY_STATE_MENU : 0) | (shift ? KEY_STATE_SHIFT : 0);
+	InjectKeyCombo(&injector, vk, modifiers);
+}
 
-	for(int i = 2; i >= 0; i--)
-	{
-		if(bModRequested[i] != bModPressed[i])
-			keybd_event(vkModifiers[i], 0, bModPressed[i] ? 0 : KEYEVENTF_KEYUP, 0);
-	}
+///////////////////////////////////////////////////////////////////////////////
+// Simulates Alt+Shift `presses` times to change languages, as a single batch
+// so that no other input can come between them
+void SendAltShift(UINT presses)
+{
+	KeyInjector injector;
+	GetWin32KeyInjector(&injector);
+	InjectAltShift(&injector, presses);
 }
@@ -1,9 +1,17 @@
 #pragma once
 
+#include "layoutcore.h"
+#include "keyinject.h"
+
 typedef struct
 {
 	UINT format;
 	HANDLE dataHandle;
+
+	// data that didn't fit the memory budget, in a temporary file
+	HANDLE spillFile;
+	HANDLE spillMapping;
+	SIZE_T spillSize;
 } ClipboardFormat;
 
 typedef struct
@@ -13,27 +21,76 @@ typedef struct
 } ClipboardData;
 
 
+// Counters of the clipboard data stored before conversions
+typedef struct
+{
+	LONGLONG snapshots;
+	LONGLONG bytesInMemory;
+	LONGLONG bytesSpilled;
+	LONGLONG formatsSpilled;
+} ClipboardStoreStats;
+
+// default number of bytes of clipboard data kept in memory per conversion
+#define CLIPBOARD_MEMORY_BUDGET (4 * 1024 * 1024)
+
+// maximal number of installed layouts the layout functions work with
+#define MAX_LAYOUT_LIST 256
+
 // time in milliseconds to allow the target application
 // to execute commands simulated by keystrokes
 #define REMOTE_APP_WAIT 100
 
 // The main function that converts the current selected text in the active 
-// window from one layout to another.
-void ConvertSelectedTextInActiveWindow(HKL hklSource, HKL hklTarget);
+// window from one layout to another. It stops early when `hCancelEvent` is
+// signaled, if it's not NULL.
+BOOL ConvertSelectedTextInActiveWindow(HKL hklSource, HKL hklTarget, HANDLE hCancelEvent);
+
+// Puts back the original text of the last conversion in the active window,
+// or the conversion from the next layout if it's already back, without
+// copying the text. Returns the layout to switch the window to, or NULL if
+// there's nothing to undo. ConversionUndoInvalidate is called when the user
+// types or clicks, and ConversionUndoChanged when the focus or the caret
+// moves, after which there's nothing to undo. The undo does nothing until
+// ConversionUndoSetTracking enables it.
+HKL UndoConversionInActiveWindow();
+void ConversionUndoInvalidate();
+void ConversionUndoChanged(DWORD eventTime);
+void ConversionUndoSetTracking(BOOL bTracking);
+void ConversionUndoFree();
 
 // Functions to convert UNICODE strings between keyboard layouts
 WCHAR LayoutConvertChar(WCHAR ch, HKL hklSource, HKL hklTarget);
+WCHAR LayoutConvertCharUncached(WCHAR ch, HKL hklSource, HKL hklTarget);
 size_t LayoutConvertString(const WCHAR* str, WCHAR* buffer, size_t size, HKL hklSource, HKL hklTarget);
-HKL DetectLayoutFromString(const WCHAR* str, BOOL* pmatches);
+BOOL LayoutConvertText(const WCHAR* str, size_t length, LayoutOutput* output, HKL hklSource, HKL hklTarget);
+HKL DetectLayoutFromString(const WCHAR* str, int* pmatches);
+HKL DetectSourceLayoutFromString(const WCHAR* str, size_t length, HKL hklPreferred, HKL hklTarget);
+
+// Functions to manage the cache of translation tables used by the conversion functions
+void LayoutCacheSync(const HKL* hkls, UINT count);
+void LayoutCacheFree();
+void LayoutCacheWarmUp(const HKL* hkls, UINT count);
+
+// Writes the key tables of the current layouts for all the users of the
+// machine. It has to run as an administrator.
+BOOL LayoutCacheInstallShared();
+
+// Returns the layout provider for the installed Windows layouts
+void GetWin32LayoutProvider(LayoutProvider* provider);
 
 // Functions to store and restore all of the data in the clipboard
 BOOL StoreClipboardData(ClipboardData* formats);
 BOOL RestoreClipboardData(ClipboardData* formats);
+void FreeClipboardData(ClipboardData* formats);
+BOOL PutClipboardFormat(ClipboardFormat* stored);
+void SetClipboardMemoryBudget(SIZE_T budget);
+void GetClipboardStoreStats(ClipboardStoreStats* stats);
 
 // Convenience functions for the clipboard
 WCHAR* GetClipboardText();
 BOOL SetClipboardText(const WCHAR* text);
 
 // Functions that simulate key presses in the current window
+void GetWin32KeyInjector(KeyInjector* injector);
 void SendKeyCombo(BYTE vk, BOOL ctrl, BOOL alt, BOOL shift);
-void SendAltShift();
+void SendAltShift(UINT presses);
@@ -0,0 +1,179 @@
+#include "stdafx.h"
+#include "focuscache.h"
+#include "stats.h"
+
+typedef struct
+{
+	HWND hWnd;     // the window with the focus, or NULL if it's unknown
+	DWORD threadId; // the thread of the window
+	HKL layout;    // the layout the window was last seen with
+	UINT index;    // the index of `layout` in the layout list
+} FocusEntry;
+
+static CRITICAL_SECTION g_csFocusCache;
+static FocusEntry g_focus;
+static UINT g_focusGeneration; // changes whenever the focus moves
+static const HKL* g_focusLayouts;
+static UINT g_focusLayoutCount;
+static HWINEVENTHOOK g_hForegroundHook;
+static HWINEVENTHOOK g_hFocusHook;
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the index of `hkl` in the layout list, or the layout count
+static UINT FindLayoutIndex(HKL hkl)
+{
+	UINT i;
+	for(i = 0; i < g_focusLayoutCount; i++)
+	{
+		if(g_focusLayouts[i] == hkl)
+			break;
+	}
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Asks the system which window has the focus
+static HWND QueryFocus()
+{
+	GUITHREADINFO remoteThreadInfo;
+	remoteThreadInfo.cbSize = sizeof(GUITHREADINFO);
+	if(!GetGUIThreadInfo(0, &remoteThreadInfo))
+	{
+		return NULL;
+	}
+
+	return remoteThreadInfo.hwndFocus ? remoteThreadInfo.hwndFocus : remoteThreadInfo.hwndActive;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Follows the foreground window and the focus. The layout of the window is
+// left to be read when it's asked for.
+static void CALLBACK FocusEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+	LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+{
+	UNREFERENCED_PARAMETER(hWinEventHook);
+	UNREFERENCED_PARAMETER(event);
+	UNREFERENCED_PARAMETER(idObject);
+	UNREFERENCED_PARAMETER(idChild);
+	UNREFERENCED_PARAMETER(dwEventThread);
+	UNREFERENCED_PARAMETER(dwmsEventTime);
+
+	if(!hWnd)
+		return;
+
+	DWORD threadId = GetWindowThreadProcessId(hWnd, NULL);
+
+	EnterCriticalSection(&g_csFocusCache);
+	if(g_focus.hWnd != hWnd)
+	{
+		g_focus.hWnd = hWnd;
+		g_focus.threadId = threadId;
+		g_focus.layout = NULL;
+		g_focus.index = g_focusLayoutCount;
+		g_focusGeneration++;
+	}
+	LeaveCriticalSection(&g_csFocusCache);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts following the focus
+BOOL FocusCacheInit(const HKL* hkls, UINT count)
+{
+	InitializeCriticalSection(&g_csFocusCache);
+	ZeroMemory(&g_focus, sizeof(g_focus));
+	g_focusLayouts = hkls;
+	g_focusLayoutCount = count;
+	g_focus.index = count;
+
+	g_hForegroundHook = SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND, NULL,
+		FocusEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+	g_hFocusHook = SetWinEventHook(EVENT_OBJECT_FOCUS, EVENT_OBJECT_FOCUS, NULL,
+		FocusEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+
+	return g_hForegroundHook && g_hFocusHook;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stops following the focus
+void FocusCacheUninit()
+{
+	if(g_hFocusHook)
+		UnhookWinEvent(g_hFocusHook);
+	if(g_hForegroundHook)
+		UnhookWinEvent(g_hForegroundHook);
+	g_hFocusHook = NULL;
+	g_hForegroundHook = NULL;
+
+	DeleteCriticalSection(&g_csFocusCache);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the window that has the focus, and its layout. The layout is read
+// from the window's thread every time, which is cheap, and is only looked up
+// in the list when it's not the one the window was last seen with.
+HWND FocusCacheGetFocus(HKL* layout, UINT* index)
+{
+	EnterCriticalSection(&g_csFocusCache);
+	FocusEntry entry = g_focus;
+	UINT generation = g_focusGeneration;
+	LeaveCriticalSection(&g_csFocusCache);
+
+	BOOL bChanged = FALSE;
+
+	// No notification came yet, or the window is gone
+	if(!entry.hWnd || !IsWindow(entry.hWnd))
+	{
+		entry.hWnd = QueryFocus();
+		if(!entry.hWnd)
+			return NULL;
+
+		entry.threadId = GetWindowThreadProcessId(entry.hWnd, NULL);
+		entry.layout = NULL;
+		bChanged = TRUE;
+	}
+
+	HKL currentLayout = GetKeyboardLayout(entry.threadId);
+	if(currentLayout != entry.layout || bChanged)
+	{
+		entry.layout = currentLayout;
+		entry.index = FindLayoutIndex(currentLayout);
+		bChanged = TRUE;
+		StatsIncrement(STAT_COUNTER_FOCUS_CACHE_MISSES);
+	}
+	else
+	{
+		StatsIncrement(STAT_COUNTER_FOCUS_CACHE_HITS);
+	}
+
+	// Keep what was found, unless the focus moved meanwhile
+	if(bChanged)
+	{
+		EnterCriticalSection(&g_csFocusCache);
+		if(g_focusGeneration == generation)
+			g_focus = entry;
+		LeaveCriticalSection(&g_csFocusCache);
+	}
+
+	if(layout)
+		*layout = entry.layout;
+	if(index)
+		*index = entry.index;
+
+	return entry.hWnd;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records the layout `hWnd` was switched to, so that its index is known
+// when the switch is seen
+void FocusCacheSetLayout(HWND hWnd, HKL hkl)
+{
+	UINT index = FindLayoutIndex(hkl);
+
+	EnterCriticalSection(&g_csFocusCache);
+	if(g_focus.hWnd == hWnd)
+	{
+		g_focus.layout = hkl;
+		g_focus.index = index;
+	}
+	LeaveCriticalSection(&g_csFocusCache);
+}
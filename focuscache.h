@@ -0,0 +1,21 @@
+#pragma once
+
+// A cache of the window that has the focus, its thread, and the keyboard
+// layout it was last seen with along with its index in the layout list. It
+// follows the focus with foreground and focus change notifications, so that
+// finding the focused window and its layout doesn't have to ask the system
+// each time.
+
+// Starts following the focus. It has to be called from a thread with a
+// message loop, which the notifications come to. `hkls` has to stay valid
+// until FocusCacheUninit.
+BOOL FocusCacheInit(const HKL* hkls, UINT count);
+void FocusCacheUninit();
+
+// Returns the window that has the focus, or NULL if there's none. If they
+// aren't NULL, `layout` receives its current layout, and `index` the index
+// of the layout in the list, or the layout count if it's not in the list.
+HWND FocusCacheGetFocus(HKL* layout, UINT* index);
+
+// Records that `hWnd` was switched to `hkl`
+void FocusCacheSetLayout(HWND hWnd, HKL hkl);
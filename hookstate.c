@@ -0,0 +1,161 @@
+#include <string.h>
+#include "hookstate.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the HookState.modifiers bit of a modifier key, or 0 for other keys.
+// Keys without a side are counted as the left one.
+static uint32_t ModifierOfKey(uint32_t vk)
+{
+	switch(vk)
+	{
+	case HOOK_VK_SHIFT:
+	case HOOK_VK_LSHIFT:
+		return HOOK_MOD_LSHIFT;
+	case HOOK_VK_RSHIFT:
+		return HOOK_MOD_RSHIFT;
+	case HOOK_VK_CONTROL:
+	case HOOK_VK_LCONTROL:
+		return HOOK_MOD_LCONTROL;
+	case HOOK_VK_RCONTROL:
+		return HOOK_MOD_RCONTROL;
+	case HOOK_VK_MENU:
+	case HOOK_VK_LMENU:
+		return HOOK_MOD_LMENU;
+	case HOOK_VK_RMENU:
+		return HOOK_MOD_RMENU;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tracks the modifier keys, and decides on the action of a CapsLock press
+// from the modifiers that are down. Injected events update the modifiers
+// like the system's key state does, but an injected CapsLock is let through.
+// A CapsLock key down while the key is already down is an autorepeat, which
+// is swallowed like the press was but has no action. The presses of other
+// keys the user types are marked, see HookDecision.typed.
+HookState HookStateProcess(HookState state, const HookEvent* event, HookDecision* decision)
+{
+	memset(decision, 0, sizeof(HookDecision));
+
+	uint32_t modifier = ModifierOfKey(event->vk);
+	if(modifier)
+	{
+		if(event->down)
+			state.modifiers |= modifier;
+		else
+			state.modifiers &= ~modifier;
+
+		return state;
+	}
+
+	if(event->injected)
+		return state;
+
+	if(event->vk != HOOK_VK_CAPITAL)
+	{
+		decision->typed = event->down;
+		return state;
+	}
+
+	if(!event->down)
+	{
+		state.capsDown = 0;
+		return state;
+	}
+
+	decision->autorepeat = state.capsDown;
+	state.capsDown = 1;
+
+	if(state.modifiers & HOOK_MOD_MENU)
+	{
+		// Alt+CapsLock - switch current layout pair
+		decision->action = LANG_ACTION_SWITCH_PAIR;
+		decision->swallow = 1;
+		decision->releaseCapsLock = 1;
+	}
+	else if((state.modifiers & HOOK_MOD_CONTROL) && (state.modifiers & HOOK_MOD_SHIFT))
+	{
+		// Ctrl+Shift+CapsLock - undo the last conversion, or redo it from the
+		// next layout
+		decision->action = LANG_ACTION_UNDO_CONVERSION;
+		decision->swallow = 1;
+	}
+	else if(state.modifiers & HOOK_MOD_CONTROL)
+	{
+		// Ctrl+CapsLock - switch current layout and convert text in current field.
+		// If both ctrl keys are pressed, only the selected text is converted.
+		decision->action = (state.modifiers & HOOK_MOD_CONTROL) == HOOK_MOD_CONTROL ?
+			LANG_ACTION_CONVERT_SELECTED_TEXT : LANG_ACTION_CONVERT_ALL_TEXT;
+		decision->swallow = 1;
+	}
+	else if(state.modifiers & HOOK_MOD_SHIFT)
+	{
+		// Shift+CapsLock - the old CapsLock
+	}
+	else
+	{
+		// CapsLock - only switch current layout
+		decision->action = LANG_ACTION_SWITCH_LAYOUT;
+		decision->swallow = 1;
+	}
+
+	if(decision->autorepeat)
+	{
+		decision->action = LANG_ACTION_NONE;
+		decision->releaseCapsLock = 0;
+	}
+
+	return state;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the modifiers from the system's key state. CapsLock isn't set from it:
+// the hook swallows the CapsLock key downs, so the system never sees the key
+// down, and only a key up the hook sees ends an autorepeat. A missed key up
+// only costs the next press, whose key up clears it again.
+HookState HookStateSync(HookState state, uint32_t modifiers)
+{
+	state.modifiers = modifiers;
+	return state;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Folds the layout switches in `actions` into their net effect. The runs are
+// built like a stack, so that after two toggles cancel out, the pair switches
+// on both sides of them are folded together too.
+size_t CoalesceActions(const LangAction* actions, size_t count, ActionRun* runs)
+{
+	size_t runCount = 0;
+
+	for(size_t i = 0; i < count; i++)
+	{
+		LangAction action = actions[i];
+		ActionRun* last = runCount > 0 ? &runs[runCount - 1] : NULL;
+
+		if(action == LANG_ACTION_NONE)
+			continue;
+
+		if(last && last->action == action)
+		{
+			if(action == LANG_ACTION_SWITCH_LAYOUT)
+			{
+				runCount--;
+				continue;
+			}
+
+			if(action == LANG_ACTION_SWITCH_PAIR)
+			{
+				last->count++;
+				continue;
+			}
+		}
+
+		runs[runCount].action = action;
+		runs[runCount].count = 1;
+		runCount++;
+	}
+
+	return runCount;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// The state machine of the CapsLock keyboard hook. It tracks the modifier
+// keys from the key events the hook sees, and decides what to do with each
+// event, so the hook doesn't have to ask the system for the key states. This
+// file and hookstate.c only depend on the C runtime.
+
+#include <stdint.h>
+
+// The actions the CapsLock key triggers
+typedef enum
+{
+	LANG_ACTION_NONE,
+	LANG_ACTION_SWITCH_LAYOUT,
+	LANG_ACTION_SWITCH_PAIR,
+	LANG_ACTION_CONVERT_ALL_TEXT,
+	LANG_ACTION_CONVERT_SELECTED_TEXT,
+	LANG_ACTION_UNDO_CONVERSION,
+} LangAction;
+
+// The virtual key codes the state machine looks at, which are the same as
+// the VK_ constants of Windows
+#define HOOK_VK_SHIFT    0x10
+#define HOOK_VK_CONTROL  0x11
+#define HOOK_VK_MENU     0x12
+#define HOOK_VK_CAPITAL  0x14
+#define HOOK_VK_LSHIFT   0xA0
+#define HOOK_VK_RSHIFT   0xA1
+#define HOOK_VK_LCONTROL 0xA2
+#define HOOK_VK_RCONTROL 0xA3
+#define HOOK_VK_LMENU    0xA4
+#define HOOK_VK_RMENU    0xA5
+
+// Bits of HookState.modifiers, for the modifier keys that are down
+#define HOOK_MOD_LSHIFT   0x01
+#define HOOK_MOD_RSHIFT   0x02
+#define HOOK_MOD_LCONTROL 0x04
+#define HOOK_MOD_RCONTROL 0x08
+#define HOOK_MOD_LMENU    0x10
+#define HOOK_MOD_RMENU    0x20
+
+#define HOOK_MOD_SHIFT   (HOOK_MOD_LSHIFT | HOOK_MOD_RSHIFT)
+#define HOOK_MOD_CONTROL (HOOK_MOD_LCONTROL | HOOK_MOD_RCONTROL)
+#define HOOK_MOD_MENU    (HOOK_MOD_LMENU | HOOK_MOD_RMENU)
+
+typedef struct
+{
+	uint32_t modifiers;
+
+	// nonzero while the CapsLock key is physically down, so the key downs of
+	// autorepeat can be told apart from presses
+	int capsDown;
+} HookState;
+
+// A key event as the hook sees it
+typedef struct
+{
+	uint32_t vk;
+	int down;
+	int injected;
+} HookEvent;
+
+// What the hook does with an event
+typedef struct
+{
+	// the action to run, or LANG_ACTION_NONE
+	LangAction action;
+
+	// nonzero to keep the event from the system
+	int swallow;
+
+	// nonzero to send a CapsLock key up, see LowLevelKeyboardHookProc
+	int releaseCapsLock;
+
+	// nonzero if the event is an autorepeat of CapsLock, whose action is
+	// dropped
+	int autorepeat;
+
+	// nonzero if the event is a key the user typed, other than CapsLock and
+	// the modifier keys, which moves on from the last conversion
+	int typed;
+} HookDecision;
+
+// A run of queued actions folded into one, see CoalesceActions
+typedef struct
+{
+	LangAction action;
+	unsigned count;
+} ActionRun;
+
+// Returns the state after `event`, and fills `decision` with what to do with
+// the event. It only depends on its arguments.
+HookState HookStateProcess(HookState state, const HookEvent* event, HookDecision* decision);
+
+// Returns `state` with the modifiers set to `modifiers`, as read from the
+// system's key state. CapsLock is left as it is, see HookStateSync.
+HookState HookStateSync(HookState state, uint32_t modifiers);
+
+// Folds the layout switches in `actions` into their net effect, and fills
+// `runs` with what's left to run, in order. Two layout toggles in a row
+// cancel out, and pair switches in a row become one run whose count is the
+// number of steps. Conversions are never folded. Returns the number of runs,
+// which is at most `count`.
+size_t CoalesceActions(const LangAction* actions, size_t count, ActionRun* runs);
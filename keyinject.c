@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+#include "keyinject.h"
+
+// The modifier keys in the order they're pressed in, and released in reverse
+static const uint16_t g_modifierKeys[3] = { KEY_VK_CONTROL, KEY_VK_MENU, KEY_VK_SHIFT };
+static const uint32_t g_modifierStates[3] = { KEY_STATE_CONTROL, KEY_STATE_MENU, KEY_STATE_SHIFT };
+
+///////////////////////////////////////////////////////////////////////////////
+// Appends a key input
+static void AddKeyInput(KeyInput* inputs, unsigned* count, uint16_t vk, int up)
+{
+	inputs[*count].vk = vk;
+	inputs[*count].up = (uint16_t)(up != 0);
+	(*count)++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the inputs of a key combination. The modifiers that differ from
+// the requested ones are pressed or released around the key, and put back
+// afterwards.
+unsigned BuildKeyCombo(KeyInput* inputs, unsigned capacity, uint16_t vk, uint32_t modifiers, uint32_t pressed)
+{
+	unsigned count = 0;
+
+	if(capacity < KEY_COMBO_MAX_INPUTS)
+		return 0;
+
+	for(int i = 0; i < 3; i++)
+	{
+		int bRequested = (modifiers & g_modifierStates[i]) != 0;
+		int bPressed = (pressed & g_modifierStates[i]) != 0;
+		if(bRequested != bPressed)
+			AddKeyInput(inputs, &count, g_modifierKeys[i], bPressed);
+	}
+
+	// A key that's already down is released and pressed again
+	int bKeyPressed = (pressed & KEY_STATE_KEY) != 0;
+	AddKeyInput(inputs, &count, vk, bKeyPressed);
+	AddKeyInput(inputs, &count, vk, !bKeyPressed);
+
+	for(int i = 2; i >= 0; i--)
+	{
+		int bRequested = (modifiers & g_modifierStates[i]) != 0;
+		int bPressed = (pressed & g_modifierStates[i]) != 0;
+		if(bRequested != bPressed)
+			AddKeyInput(inputs, &count, g_modifierKeys[i], !bPressed);
+	}
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the inputs of `presses` Alt+Shift presses. The modifiers that are
+// down are released first so that every press is a clean Alt+Shift.
+unsigned BuildAltShift(KeyInput* inputs, unsigned capacity, unsigned presses, uint32_t pressed)
+{
+	unsigned count = 0;
+
+	if(capacity < KEY_ALT_SHIFT_INPUTS(presses))
+		return 0;
+
+	for(int i = 0; i < 3; i++)
+	{
+		if(pressed & g_modifierStates[i])
+			AddKeyInput(inputs, &count, g_modifierKeys[i], 1);
+	}
+
+	for(unsigned i = 0; i < presses; i++)
+	{
+		AddKeyInput(inputs, &count, KEY_VK_MENU, 0);
+		AddKeyInput(inputs, &count, KEY_VK_SHIFT, 0);
+		AddKeyInput(inputs, &count, KEY_VK_SHIFT, 1);
+		AddKeyInput(inputs, &count, KEY_VK_MENU, 1);
+	}
+
+	for(int i = 2; i >= 0; i--)
+	{
+		if(pressed & g_modifierStates[i])
+			AddKeyInput(inputs, &count, g_modifierKeys[i], 0);
+	}
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the inputs of `presses` presses of a key with the same modifiers,
+// which are set up once around all of them like in BuildKeyCombo
+unsigned BuildKeyRepeat(KeyInput* inputs, unsigned capacity, uint16_t vk, unsigned presses, uint32_t modifiers, uint32_t pressed)
+{
+	unsigned count = 0;
+
+	if(capacity < KEY_REPEAT_INPUTS(presses))
+		return 0;
+
+	for(int i = 0; i < 3; i++)
+	{
+		int bRequested = (modifiers & g_modifierStates[i]) != 0;
+		int bPressed = (pressed & g_modifierStates[i]) != 0;
+		if(bRequested != bPressed)
+			AddKeyInput(inputs, &count, g_modifierKeys[i], bPressed);
+	}
+
+	for(unsigned i = 0; i < presses; i++)
+	{
+		AddKeyInput(inputs, &count, vk, 0);
+		AddKeyInput(inputs, &count, vk, 1);
+	}
+
+	for(int i = 2; i >= 0; i--)
+	{
+		int bRequested = (modifiers & g_modifierStates[i]) != 0;
+		int bPressed = (pressed & g_modifierStates[i]) != 0;
+		if(bRequested != bPressed)
+			AddKeyInput(inputs, &count, g_modifierKeys[i], !bPressed);
+	}
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulates a key combination
+int InjectKeyCombo(const KeyInjector* injector, uint16_t vk, uint32_t modifiers)
+{
+	KeyInput inputs[KEY_COMBO_MAX_INPUTS];
+
+	uint32_t pressed = injector->GetKeyStates(injector->context, vk);
+	unsigned count = BuildKeyCombo(inputs, KEY_COMBO_MAX_INPUTS, vk, modifiers, pressed);
+
+	return injector->Submit(injector->context, inputs, count) == count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulates `presses` presses of Alt+Shift
+int InjectAltShift(const KeyInjector* injector, unsigned presses)
+{
+	if(presses == 0)
+		return 1;
+
+	unsigned capacity = KEY_ALT_SHIFT_INPUTS(presses);
+	KeyInput* inputs = (KeyInput*)malloc(sizeof(KeyInput) * capacity);
+	if(!inputs)
+		return 0;
+
+	uint32_t pressed = injector->GetKeyStates(injector->context, KEY_VK_SHIFT);
+	unsigned count = BuildAltShift(inputs, capacity, presses, pressed & ~KEY_STATE_KEY);
+	int bInjected = injector->Submit(injector->context, inputs, count) == count;
+
+	free(inputs);
+	return bInjected;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulates `presses` presses of a key with the same modifiers
+int InjectKeyRepeat(const KeyInjector* injector, uint16_t vk, unsigned presses, uint32_t modifiers)
+{
+	if(presses == 0)
+		return 1;
+
+	unsigned capacity = KEY_REPEAT_INPUTS(presses);
+	KeyInput* inputs = (KeyInput*)malloc(sizeof(KeyInput) * capacity);
+	if(!inputs)
+		return 0;
+
+	uint32_t pressed = injector->GetKeyStates(injector->context, vk);
+	unsigned count = BuildKeyRepeat(inputs, capacity, vk, presses, modifiers, pressed & ~KEY_STATE_KEY);
+	int bInjected = injector->Submit(injector->context, inputs, count) == count;
+
+	free(inputs);
+	return bInjected;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Recording backend
+
+///////////////////////////////////////////////////////////////////////////////
+// KeyInjector.GetKeyStates for the recording backend
+static uint32_t RecordingGetKeyStates(void* context, uint16_t vk)
+{
+	(void)vk;
+	return ((RecordingInjector*)context)->pressed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KeyInjector.Submit for the recording backend, which appends the inputs to
+// the log as far as they fit
+static unsigned RecordingSubmit(void* context, const KeyInput* inputs, unsigned count)
+{
+	RecordingInjector* recorder = (RecordingInjector*)context;
+
+	unsigned room = recorder->capacity - recorder->count;
+	if(count > room)
+		count = room;
+
+	memcpy(recorder->log + recorder->count, inputs, sizeof(KeyInput) * count);
+	recorder->count += count;
+	recorder->submits++;
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a recording backend that logs into `log`, with no keys down
+void RecordingInjectorInit(RecordingInjector* recorder, KeyInput* log, unsigned capacity)
+{
+	memset(recorder, 0, sizeof(RecordingInjector));
+	recorder->log = log;
+	recorder->capacity = capacity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `injector` with the recording backend
+void RecordingInjectorGetInjector(RecordingInjector* recorder, KeyInjector* injector)
+{
+	memset(injector, 0, sizeof(KeyInjector));
+	injector->GetKeyStates = RecordingGetKeyStates;
+	injector->Submit = RecordingSubmit;
+	injector->context = recorder;
+}
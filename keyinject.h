@@ -0,0 +1,76 @@
+#pragma once
+
+// Simulated key presses. The whole sequence of a key combination, with the
+// modifier keys released, pressed and restored around it, is built as one
+// array and handed to the backend at once, so no other input can come in
+// between. This file and keyinject.c only depend on the C runtime.
+
+#include <stdint.h>
+
+// The virtual key codes of the modifier keys, which are the same as the VK_
+// constants of Windows
+#define KEY_VK_SHIFT   0x10
+#define KEY_VK_CONTROL 0x11
+#define KEY_VK_MENU    0x12
+
+// Bits of the key states a backend reports and of the modifiers requested
+#define KEY_STATE_CONTROL 0x01
+#define KEY_STATE_MENU    0x02
+#define KEY_STATE_SHIFT   0x04
+#define KEY_STATE_KEY     0x08 // the key of the combination itself
+
+// The number of key inputs a combination and `presses` Alt+Shift presses
+// take at most
+#define KEY_COMBO_MAX_INPUTS         8
+#define KEY_ALT_SHIFT_INPUTS(presses) (6 + 4 * (presses))
+#define KEY_REPEAT_INPUTS(presses)    (6 + 2 * (presses))
+
+typedef struct
+{
+	uint16_t vk;
+	uint16_t up;
+} KeyInput;
+
+typedef struct
+{
+	// Returns the KEY_STATE_ bits of the modifier keys that are down, and
+	// KEY_STATE_KEY if `vk` is down
+	uint32_t (*GetKeyStates)(void* context, uint16_t vk);
+
+	// Injects `count` key inputs as one batch, and returns how many of them
+	// were injected
+	unsigned (*Submit)(void* context, const KeyInput* inputs, unsigned count);
+
+	void* context;
+} KeyInjector;
+
+// Build the key inputs into `inputs`, which has room for `capacity` of them,
+// given the key states `pressed`. They return the number of inputs, or 0 if
+// they don't fit.
+unsigned BuildKeyCombo(KeyInput* inputs, unsigned capacity, uint16_t vk, uint32_t modifiers, uint32_t pressed);
+unsigned BuildAltShift(KeyInput* inputs, unsigned capacity, unsigned presses, uint32_t pressed);
+unsigned BuildKeyRepeat(KeyInput* inputs, unsigned capacity, uint16_t vk, unsigned presses, uint32_t modifiers, uint32_t pressed);
+
+// Simulate a key combination, such as Ctrl+C with KEY_STATE_CONTROL,
+// `presses` presses of Alt+Shift, or `presses` presses of a key with the
+// same modifiers, such as Shift+Left. They return nonzero if all of the
+// inputs were injected.
+int InjectKeyCombo(const KeyInjector* injector, uint16_t vk, uint32_t modifiers);
+int InjectAltShift(const KeyInjector* injector, unsigned presses);
+int InjectKeyRepeat(const KeyInjector* injector, uint16_t vk, unsigned presses, uint32_t modifiers);
+
+// A backend that records the inputs instead of injecting them, with the key
+// states set in `pressed`
+typedef struct
+{
+	uint32_t pressed;
+
+	KeyInput* log;
+	unsigned capacity;
+	unsigned count;
+
+	unsigned submits;
+} RecordingInjector;
+
+void RecordingInjectorInit(RecordingInjector* recorder, KeyInput* log, unsigned capacity);
+void RecordingInjectorGetInjector(RecordingInjector* recorder, KeyInjector* injector);
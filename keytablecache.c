@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include "keytablecache.h"
+
+// offsets of the parts of a layout's block
+#define BLOCK_CHARS 0
+#define BLOCK_KINDS (BLOCK_CHARS + 256 * KEYTABLE_LEVELS * 2)
+#define BLOCK_COUNT (BLOCK_KINDS + 256 * KEYTABLE_LEVELS)
+#define BLOCK_KEYS  (BLOCK_COUNT + 4)
+
+// the shift state of each level
+static const uint8_t g_levelShifts[KEYTABLE_LEVELS] = {
+	0, LAYOUT_SHIFT, LAYOUT_CONTROL | LAYOUT_ALT, LAYOUT_SHIFT | LAYOUT_CONTROL | LAYOUT_ALT
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes little endian numbers
+static void PutUint16(uint8_t* p, uint16_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+}
+
+static void PutUint32(uint8_t* p, uint32_t value)
+{
+	PutUint16(p, (uint16_t)value);
+	PutUint16(p + 2, (uint16_t)(value >> 16));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads little endian numbers
+static uint16_t GetUint16(const uint8_t* p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t GetUint32(const uint8_t* p)
+{
+	return (uint32_t)GetUint16(p) | ((uint32_t)GetUint16(p + 2) << 16);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FNV-1a hash of the data
+static uint32_t KeyTableChecksum(const uint8_t* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the level of a shift state, or -1 if it's none of them
+static int LevelOfShift(uint8_t shift)
+{
+	for(int level = 0; level < KEYTABLE_LEVELS; level++)
+	{
+		if(g_levelShifts[level] == shift)
+			return level;
+	}
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills in the characters and kinds of the keys of `layout` in `block`, and
+// marks the characters in `used`. Returns the number of characters marked.
+static unsigned BuildBlockChars(const LayoutProvider* provider, LayoutId layout, uint8_t* block, uint32_t* used)
+{
+	unsigned charCount = 0;
+
+	// the keys of the ASCII characters, including control characters, are
+	// always looked up
+	for(unsigned ch = 1; ch < 128; ch++)
+	{
+		used[ch / 32] |= 1u << (ch % 32);
+		charCount++;
+	}
+
+	for(unsigned vk = 1; vk < 256; vk++)
+	{
+		for(int level = 0; level < KEYTABLE_LEVELS; level++)
+		{
+			LayoutKey key = { (uint8_t)vk, g_levelShifts[level] };
+			LayoutChar chars[LAYOUT_KEY_CHARS];
+			int count = provider->KeyToChars(provider->context, layout, key, chars, LAYOUT_KEY_CHARS);
+
+			uint8_t kind = KEYTABLE_NONE;
+			if(count == 1 || count == -1)
+			{
+				kind = count == 1 ? KEYTABLE_CHAR : KEYTABLE_DEAD;
+				PutUint16(block + BLOCK_CHARS + (vk * KEYTABLE_LEVELS + level) * 2, (uint16_t)chars[0]);
+
+				if(!(used[chars[0] / 32] & (1u << (chars[0] % 32))))
+				{
+					used[chars[0] / 32] |= 1u << (chars[0] % 32);
+					charCount++;
+				}
+			}
+			else if(count > 1)
+			{
+				kind = KEYTABLE_LIVE;
+			}
+
+			block[BLOCK_KINDS + vk * KEYTABLE_LEVELS + level] = kind;
+		}
+	}
+
+	return charCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the file
+uint8_t* KeyTableCacheBuild(const LayoutProvider* provider, const LayoutId* layouts, unsigned count,
+	uint32_t osBuild, uint32_t osRevision, size_t* size)
+{
+	uint32_t* used = (uint32_t*)malloc(sizeof(uint32_t) * 0x10000 / 32);
+	uint8_t** blocks = (uint8_t**)calloc(count ? count : 1, sizeof(uint8_t*));
+	size_t* blockSizes = (size_t*)calloc(count ? count : 1, sizeof(size_t));
+	uint8_t* file = NULL;
+
+	if(!used || !blocks || !blockSizes)
+		goto cleanup;
+
+	size_t total = KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE * (size_t)count;
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		memset(used, 0, sizeof(uint32_t) * 0x10000 / 32);
+
+		// the block is allocated for the most keys it can have, and trimmed
+		// to the characters that have keys
+		uint8_t chars[BLOCK_COUNT];
+		memset(chars, 0, sizeof(chars));
+		unsigned charCount = BuildBlockChars(provider, layouts[i], chars, used);
+
+		blocks[i] = (uint8_t*)malloc(BLOCK_KEYS + 4 * (size_t)charCount);
+		if(!blocks[i])
+			goto cleanup;
+
+		memcpy(blocks[i], chars, BLOCK_COUNT);
+
+		uint32_t keyCount = 0;
+		for(unsigned ch = 1; ch < 0x10000; ch++)
+		{
+			if(!(used[ch / 32] & (1u << (ch % 32))))
+				continue;
+
+			LayoutKey key;
+			if(provider->CharToKey(provider->context, layouts[i], (LayoutChar)ch, &key))
+			{
+				uint8_t* entry = blocks[i] + BLOCK_KEYS + 4 * (size_t)keyCount;
+				PutUint16(entry, (uint16_t)ch);
+				entry[2] = key.vk;
+				entry[3] = key.shift;
+				keyCount++;
+			}
+		}
+
+		PutUint32(blocks[i] + BLOCK_COUNT, keyCount);
+		blockSizes[i] = BLOCK_KEYS + 4 * (size_t)keyCount;
+		total += blockSizes[i];
+	}
+
+	file = (uint8_t*)malloc(total);
+	if(!file)
+		goto cleanup;
+
+	size_t offset = KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE * (size_t)count;
+	for(unsigned i = 0; i < count; i++)
+	{
+		uint8_t* entry = file + KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE * (size_t)i;
+		PutUint32(entry, (uint32_t)(uint64_t)layouts[i]);
+		PutUint32(entry + 4, (uint32_t)((uint64_t)layouts[i] >> 32));
+		PutUint32(entry + 8, (uint32_t)offset);
+		PutUint32(entry + 12, (uint32_t)blockSizes[i]);
+
+		memcpy(file + offset, blocks[i], blockSizes[i]);
+		offset += blockSizes[i];
+	}
+
+	PutUint32(file, KEYTABLE_CACHE_MAGIC);
+	PutUint32(file + 4, KEYTABLE_CACHE_VERSION);
+	PutUint32(file + 8, osBuild);
+	PutUint32(file + 12, osRevision);
+	PutUint32(file + 16, count);
+	PutUint32(file + 20, KeyTableChecksum(file + KEYTABLE_HEADER_SIZE, total - KEYTABLE_HEADER_SIZE));
+
+	*size = total;
+
+cleanup:
+	if(blocks)
+	{
+		for(unsigned i = 0; i < count; i++)
+			free(blocks[i]);
+	}
+	free(blocks);
+	free(blockSizes);
+	free(used);
+	return file;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks the file and sets up the cache to read it
+int KeyTableCacheOpen(KeyTableCache* cache, const uint8_t* data, size_t size, const LayoutId* layouts, unsigned count,
+	uint32_t osBuild, uint32_t osRevision)
+{
+	memset(cache, 0, sizeof(KeyTableCache));
+
+	if(size < KEYTABLE_HEADER_SIZE ||
+		GetUint32(data) != KEYTABLE_CACHE_MAGIC ||
+		GetUint32(data + 4) != KEYTABLE_CACHE_VERSION ||
+		GetUint32(data + 8) != osBuild ||
+		GetUint32(data + 12) != osRevision ||
+		GetUint32(data + 16) != count)
+		return 0;
+
+	if((size - KEYTABLE_HEADER_SIZE) / KEYTABLE_ENTRY_SIZE < count)
+		return 0;
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		const uint8_t* entry = data + KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE * (size_t)i;
+		uint64_t layout = GetUint32(entry) | ((uint64_t)GetUint32(entry + 4) << 32);
+		uint32_t offset = GetUint32(entry + 8);
+		uint32_t blockSize = GetUint32(entry + 12);
+
+		if(layout != (uint64_t)layouts[i] || offset > size || blockSize > size - offset || blockSize < BLOCK_KEYS)
+			return 0;
+
+		if((blockSize - BLOCK_KEYS) / 4 < GetUint32(data + offset + BLOCK_COUNT))
+			return 0;
+	}
+
+	if(GetUint32(data + 20) != KeyTableChecksum(data + KEYTABLE_HEADER_SIZE, size - KEYTABLE_HEADER_SIZE))
+		return 0;
+
+	cache->data = data;
+	cache->size = size;
+	cache->layoutCount = count;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the block of a layout, or NULL if it's not in the cache
+static const uint8_t* FindBlock(const KeyTableCache* cache, LayoutId layout)
+{
+	for(unsigned i = 0; i < cache->layoutCount; i++)
+	{
+		const uint8_t* entry = cache->data + KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE * (size_t)i;
+		if((GetUint32(entry) | ((uint64_t)GetUint32(entry + 4) << 32)) == (uint64_t)layout)
+			return cache->data + GetUint32(entry + 8);
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.CharToKey from the cache, with a binary search of the keys
+static int CachedCharToKey(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key)
+{
+	KeyTableCache* cache = (KeyTableCache*)context;
+	const uint8_t* block = FindBlock(cache, layout);
+	if(!block)
+		return cache->fallback.CharToKey(cache->fallback.context, layout, ch, key);
+
+	uint32_t low = 0, high = GetUint32(block + BLOCK_COUNT);
+	while(low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+		const uint8_t* entry = block + BLOCK_KEYS + 4 * (size_t)middle;
+		uint16_t entryChar = GetUint16(entry);
+
+		if(entryChar == (uint16_t)ch)
+		{
+			key->vk = entry[2];
+			key->shift = entry[3];
+			return 1;
+		}
+
+		if(entryChar < (uint16_t)ch)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.KeyToChars from the cache
+static int CachedKeyToChars(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size)
+{
+	KeyTableCache* cache = (KeyTableCache*)context;
+	const uint8_t* block = FindBlock(cache, layout);
+	int level = LevelOfShift(key.shift);
+
+	uint8_t kind = KEYTABLE_LIVE;
+	if(block && level >= 0)
+		kind = block[BLOCK_KINDS + key.vk * KEYTABLE_LEVELS + level];
+
+	switch(kind)
+	{
+	case KEYTABLE_NONE:
+		return 0;
+
+	case KEYTABLE_CHAR:
+	case KEYTABLE_DEAD:
+		if(size < 1)
+			return 0;
+		buffer[0] = (LayoutChar)GetUint16(block + BLOCK_CHARS + (key.vk * KEYTABLE_LEVELS + level) * 2);
+		return kind == KEYTABLE_CHAR ? 1 : -1;
+
+	default:
+		return cache->fallback.KeyToChars(cache->fallback.context, layout, key, buffer, size);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.OverrideChar of the fallback provider
+static LayoutChar CachedOverrideChar(void* context, LayoutId source, LayoutId target, LayoutChar ch)
+{
+	KeyTableCache* cache = (KeyTableCache*)context;
+	return cache->fallback.OverrideChar(cache->fallback.context, source, target, ch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.DeadKeyToChars of the fallback provider
+static int CachedDeadKeyToChars(void* context, LayoutId layout, LayoutKey deadKey, LayoutKey key, LayoutChar* buffer, int size)
+{
+	KeyTableCache* cache = (KeyTableCache*)context;
+	return cache->fallback.DeadKeyToChars(cache->fallback.context, layout, deadKey, key, buffer, size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.GetLanguage of the fallback provider
+static uint16_t CachedGetLanguage(void* context, LayoutId layout)
+{
+	KeyTableCache* cache = (KeyTableCache*)context;
+	return cache->fallback.GetLanguage(cache->fallback.context, layout);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `provider` with the provider of the cache
+void KeyTableCacheGetProvider(KeyTableCache* cache, const LayoutProvider* fallback, LayoutProvider* provider)
+{
+	cache->fallback = *fallback;
+
+	memset(provider, 0, sizeof(LayoutProvider));
+	provider->CharToKey = CachedCharToKey;
+	provider->KeyToChars = CachedKeyToChars;
+	provider->OverrideChar = fallback->OverrideChar ? CachedOverrideChar : NULL;
+	provider->DeadKeyToChars = fallback->DeadKeyToChars ? CachedDeadKeyToChars : NULL;
+	provider->GetLanguage = fallback->GetLanguage ? CachedGetLanguage : NULL;
+	provider->context = cache;
+}
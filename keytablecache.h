@@ -0,0 +1,65 @@
+#pragma once
+
+// A file of the characters the keys of a set of layouts generate, and the
+// key of each character, so they don't have to be asked from the system at
+// every startup. The file is read in place, so it can be mapped read-only
+// and shared between processes. It's tied to a format version, to the
+// layouts it was built for and to the build of the system, and has a
+// checksum, so a file that doesn't match is rebuilt. This file and
+// keytablecache.c only depend on the C runtime.
+//
+// All numbers are little endian. The file starts with a header:
+//
+//     magic, version, OS build, OS revision, layout count, checksum (uint32 each)
+//
+// followed by an entry for each layout (uint64 layout ID, uint32 offset and
+// uint32 size of its block), and the blocks. A block holds the characters of
+// each key at each level (256 * 4 uint16), the kind of each of them
+// (256 * 4 uint8, KEYTABLE_*), the number of keys of characters (uint32),
+// and the keys sorted by character (uint16 character, uint8 vk, uint8 shift).
+// The checksum covers everything after the header.
+
+#include "layoutcore.h"
+
+#define KEYTABLE_CACHE_MAGIC   0x43544B52 // "RKTC"
+#define KEYTABLE_CACHE_VERSION 1
+
+// size of the header and of a layout entry
+#define KEYTABLE_HEADER_SIZE 24
+#define KEYTABLE_ENTRY_SIZE  16
+
+// The levels of a key: normal, Shift, AltGr (Ctrl+Alt) and Shift+AltGr
+#define KEYTABLE_LEVELS 4
+
+// Kinds of the characters of a key at a level
+#define KEYTABLE_NONE 0 // the key generates nothing
+#define KEYTABLE_CHAR 1 // a single character
+#define KEYTABLE_DEAD 2 // a dead key, with its character
+#define KEYTABLE_LIVE 3 // several characters, which are asked from the provider
+
+typedef struct
+{
+	const uint8_t* data;
+	size_t size;
+	unsigned layoutCount;
+	LayoutProvider fallback;
+} KeyTableCache;
+
+// Builds the file for `layouts` by asking `provider`. Returns a buffer to
+// free with free(), with its size in `size`, or NULL if there isn't enough
+// memory.
+uint8_t* KeyTableCacheBuild(const LayoutProvider* provider, const LayoutId* layouts, unsigned count,
+	uint32_t osBuild, uint32_t osRevision, size_t* size);
+
+// Checks that `data` is a complete file of the current version for
+// `layouts` and the system build, and sets up `cache` to read it. `data`
+// has to stay valid while the cache is used. Returns nonzero on success.
+int KeyTableCacheOpen(KeyTableCache* cache, const uint8_t* data, size_t size, const LayoutId* layouts, unsigned count,
+	uint32_t osBuild, uint32_t osRevision);
+
+// Fills `provider` with a provider that answers from the cache, and asks
+// `fallback` for what the cache doesn't have: layouts that aren't in it,
+// keys that generate several characters, other shift states, dead key
+// combinations, overrides and languages. Characters the cached layouts
+// have no key for fail without asking.
+void KeyTableCacheGetProvider(KeyTableCache* cache, const LayoutProvider* fallback, LayoutProvider* provider);
@@ -0,0 +1,145 @@
+#include "langmodel.h"
+
+// Bigram scores estimated from a few pages of everyday prose (messages,
+// letters, news and technical text) in each language. Runs of non-letters
+// count as one, and unseen bigrams are smoothed by adding half a count.
+
+static const int8_t g_bigramsEnglish[28 * 28] = {
+	-36, -13, -21, -19, -23, -22, -16, -26, -20, -16, -33, -28, -19, -19, -20, -17, -20, -31, -26, -14, -10, -24, -28, -14, -42, -18, -42, -40,
+	-16, -36, -18, -22, -22, -36, -23, -23, -29, -23, -36, -22, -16, -22, -9, -36, -25, -36, -12, -15, -11, -29, -18, -36, -36, -17, -36, -40,
+	-20, -26, -26, -26, -26, -9, -26, -26, -26, -26, -26, -26, -13, -26, -26, -8, -26, -26, -15, -26, -26, -15, -26, -26, -26, -15, -26, -40,
+	-28, -10, -28, -28, -28, -10, -28, -28, -10, -19, -28, -22, -28, -28, -28, -12, -28, -28, -17, -28, -19, -19, -28, -28, -28, -22, -28, -40,
+	-3, -16, -32, -32, -32, -15, -32, -26, -26, -21, -32, -32, -26, -26, -32, -21, -26, -32, -21, -21, -32, -26, -32, -32, -32, -26, -32, -40,
+	-6, -17, -39, -28, -17, -17, -28, -33, -39, -30, -39, -33, -22, -23, -15, -26, -26, -39, -13, -15, -18, -39, -21, -22, -25, -30, -39, -40,
+	-9, -19, -30, -30, -30, -12, -21, -30, -30, -12, -30, -30, -24, -30, -30, -9, -30, -30, -14, -30, -17, -17, -30, -30, -30, -30, -30, -40,
+	-8, -18, -28, -28, -28, -8, -28, -28, -15, -21, -28, -28, -28, -28, -28, -18, -28, -28, -14, -17, -28, -18, -28, -28, -28, -28, -28, -40,
+	-16, -9, -34, -34, -34, -4, -34, -34, -34, -16, -34, -34, -34, -34, -34, -15, -34, -34, -34, -24, -22, -24, -34, -34, -34, -34, -34, -40,
+	-16, -33, -27, -21, -19, -18, -18, -24, -33, -33, -33, -24, -14, -17, -7, -17, -33, -33, -21, -16, -13, -33, -22, -33, -24, -33, -27, -40,
+	-21, -21, -21, -21, -21, -14, -21, -21, -21, -21, -21, -21, -21, -21, -21, -9, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -40,
+	-10, -26, -26, -26, -26, -7, -26, -26, -26, -14, -26, -26, -26, -26, -14, -26, -26, -26, -26, -13, -26, -26, -26, -26, -26, -26, -26, -40,
+	-11, -17, -32, -32, -12, -9, -32, -32, -32, -15, -32, -19, -11, -26, -32, -19, -23, -32, -32, -19, -23, -23, -32, -32, -32, -19, -32, -40,
+	-12, -12, -23, -29, -29, -7, -29, -29, -29, -16, -29, -29, -29, -23, -29, -11, -18, -29, -29, -18, -29, -29, -29, -29, -29, -23, -29, -40,
+	-8, -28, -35, -20, -10, -13, -28, -12, -35, -21, -28, -22, -28, -28, -28, -16, -35, -35, -35, -18, -17, -25, -25, -35, -35, -25, -35, -40,
+	-13, -36, -23, -29, -26, -36, -15, -26, -36, -26, -29, -24, -23, -24, -13, -20, -21, -36, -11, -21, -18, -9, -26, -17, -36, -29, -36, -40,
+	-17, -13, -28, -28, -19, -12, -28, -28, -22, -22, -28, -28, -12, -28, -28, -13, -17, -28, -10, -28, -19, -28, -28, -28, -28, -22, -28, -40,
+	-21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -8, -21, -21, -21, -21, -21, -40,
+	-8, -15, -34, -34, -19, -9, -34, -23, -34, -18, -34, -23, -23, -25, -22, -15, -34, -34, -25, -16, -19, -28, -28, -28, -34, -18, -34, -40,
+	-6, -19, -35, -23, -25, -12, -35, -35, -17, -18, -35, -35, -35, -23, -35, -18, -22, -28, -35, -18, -12, -22, -35, -25, -35, -35, -35, -40,
+	-7, -17, -37, -30, -37, -15, -37, -37, -7, -17, -37, -37, -27, -37, -37, -15, -37, -37, -21, -22, -23, -26, -37, -24, -37, -30, -37, -40,
+	-9, -20, -31, -31, -25, -20, -31, -20, -31, -25, -31, -31, -12, -25, -15, -31, -20, -31, -12, -14, -11, -31, -31, -31, -31, -31, -31, -40,
+	-26, -20, -26, -26, -26, -2, -26, -26, -26, -20, -26, -26, -26, -26, -26, -20, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -40,
+	-12, -10, -31, -31, -25, -9, -31, -31, -12, -13, -31, -31, -31, -31, -16, -13, -31, -31, -25, -25, -31, -31, -31, -31, -31, -31, -31, -40,
+	-15, -21, -21, -12, -21, -15, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -10, -21, -21, -21, -21, -21, -21, -40,
+	-5, -29, -29, -29, -29, -20, -29, -29, -29, -23, -29, -29, -29, -29, -29, -6, -29, -29, -29, -23, -23, -29, -29, -29, -29, -29, -29, -40,
+	-19, -19, -19, -19, -19, -13, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -19, -40,
+	-40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40,
+};
+
+static const int8_t g_bigramsHebrew[29 * 29] = {
+	-33, -13, -15, -25, -27, -11, -16, -23, -21, -33, -19, -40, -18, -13, -40, -16, -40, -23, -28, -17, -40, -25, -40, -27, -26, -23, -13, -22, -40,
+	-11, -32, -21, -26, -32, -18, -12, -32, -14, -23, -16, -32, -26, -17, -19, -32, -32, -13, -32, -32, -26, -23, -32, -26, -32, -23, -21, -11, -40,
+	-15, -17, -18, -25, -20, -14, -14, -25, -25, -25, -14, -31, -31, -15, -31, -31, -25, -31, -31, -15, -31, -25, -31, -20, -20, -15, -22, -14, -40,
+	-24, -24, -13, -24, -13, -24, -24, -24, -24, -24, -10, -24, -24, -15, -18, -24, -24, -24, -24, -24, -24, -24, -24, -24, -24, -15, -13, -24, -40,
+	-10, -29, -18, -29, -29, -18, -12, -29, -29, -29, -12, -29, -20, -29, -20, -18, -29, -29, -29, -17, -29, -23, -29, -29, -20, -14, -14, -29, -40,
+	-5, -19, -21, -22, -19, -21, -20, -35, -25, -35, -14, -35, -21, -28, -28, -24, -28, -25, -25, -17, -35, -24, -35, -24, -20, -17, -21, -21, -40,
+	-11, -19, -19, -36, -17, -29, -24, -29, -20, -29, -21, -24, -19, -13, -21, -23, -18, -19, -23, -23, -29, -29, -29, -26, -20, -19, -24, -9, -40,
+	-23, -23, -23, -23, -23, -10, -14, -23, -23, -23, -17, -23, -23, -23, -23, -10, -23, -23, -23, -23, -23, -23, -23, -23, -23, -14, -23, -23, -40,
+	-12, -29, -23, -29, -13, -20, -11, -29, -29, -29, -13, -29, -23, -23, -23, -18, -29, -14, -29, -29, -29, -29, -29, -23, -23, -14, -16, -20, -40,
+	-11, -23, -23, -23, -23, -23, -17, -23, -23, -23, -12, -23, -23, -17, -23, -23, -17, -17, -23, -17, -23, -23, -23, -23, -23, -14, -23, -23, -40,
+	-12, -23, -21, -35, -20, -24, -13, -35, -23, -35, -15, -29, -19, -19, -9, -29, -20, -19, -24, -26, -35, -21, -29, -29, -26, -18, -20, -19, -40,
+	-4, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -40,
+	-29, -29, -18, -29, -22, -22, -10, -29, -22, -29, -15, -20, -29, -12, -16, -15, -29, -15, -29, -29, -29, -29, -29, -29, -29, -15, -15, -22, -40,
+	-8, -15, -27, -34, -19, -12, -16, -34, -20, -27, -12, -24, -20, -27, -21, -21, -34, -17, -27, -24, -34, -22, -34, -34, -27, -24, -22, -21, -40,
+	-1, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -40,
+	-30, -23, -20, -23, -20, -9, -15, -30, -18, -30, -14, -23, -23, -17, -30, -23, -17, -30, -23, -23, -30, -30, -30, -16, -30, -18, -15, -15, -40,
+	-2, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -40,
+	-30, -20, -30, -30, -20, -13, -6, -30, -17, -30, -10, -30, -23, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -23, -23, -15, -18, -40,
+	-24, -24, -10, -24, -24, -15, -24, -24, -24, -24, -11, -24, -24, -24, -24, -24, -24, -24, -24, -24, -24, -11, -24, -24, -24, -18, -24, -15, -40,
+	-16, -29, -23, -29, -15, -18, -10, -20, -29, -29, -13, -29, -23, -9, -18, -29, -29, -23, -29, -29, -29, -29, -23, -23, -29, -23, -20, -20, -40,
+	-9, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -40,
+	-26, -26, -26, -15, -26, -14, -11, -26, -15, -26, -14, -26, -26, -26, -26, -26, -26, -17, -26, -20, -26, -26, -26, -26, -26, -10, -17, -26, -40,
+	-9, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -20, -40,
+	-25, -14, -25, -25, -16, -14, -10, -25, -19, -19, -14, -25, -25, -16, -25, -19, -25, -25, -25, -19, -25, -25, -25, -25, -25, -16, -25, -25, -40,
+	-18, -27, -14, -27, -16, -18, -12, -27, -20, -16, -14, -27, -27, -27, -27, -27, -20, -27, -27, -27, -27, -16, -27, -20, -27, -13, -16, -27, -40,
+	-9, -16, -22, -20, -25, -17, -11, -32, -20, -19, -11, -17, -20, -32, -32, -32, -32, -25, -22, -22, -25, -32, -32, -25, -22, -32, -32, -25, -40,
+	-17, -17, -16, -32, -26, -15, -15, -26, -32, -32, -11, -32, -26, -10, -26, -16, -26, -18, -23, -23, -32, -21, -32, -32, -26, -17, -23, -18, -40,
+	-4, -20, -26, -26, -33, -16, -15, -33, -19, -33, -18, -33, -23, -33, -33, -20, -23, -33, -33, -33, -33, -26, -33, -23, -17, -17, -23, -26, -40,
+	-40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40,
+};
+
+static const int8_t g_bigramsRussian[34 * 34] = {
+	-34, -29, -19, -15, -23, -18, -29, -26, -20, -16, -40, -16, -25, -16, -13, -16, -13, -21, -13, -19, -20, -29, -26, -31, -20, -31, -40, -40, -40, -40, -29, -40, -23, -40,
+	-8, -36, -22, -20, -29, -18, -24, -19, -19, -36, -24, -18, -15, -15, -18, -36, -22, -20, -16, -17, -29, -29, -24, -29, -24, -22, -36, -36, -36, -36, -36, -23, -23, -40,
+	-22, -22, -29, -29, -29, -29, -12, -29, -29, -19, -29, -22, -17, -29, -15, -10, -29, -22, -22, -29, -13, -29, -29, -29, -29, -29, -17, -29, -12, -29, -29, -22, -22, -40,
+	-12, -11, -31, -31, -31, -31, -13, -31, -31, -16, -31, -22, -20, -31, -22, -10, -31, -17, -15, -25, -31, -31, -25, -31, -25, -31, -31, -31, -17, -31, -31, -31, -25, -40,
+	-20, -16, -27, -27, -27, -13, -27, -27, -27, -20, -27, -27, -14, -27, -27, -7, -27, -14, -27, -27, -20, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -40,
+	-13, -12, -32, -25, -32, -32, -10, -25, -32, -16, -32, -32, -25, -32, -17, -11, -32, -18, -25, -32, -16, -32, -32, -25, -32, -32, -32, -32, -19, -19, -32, -32, -25, -40,
+	-7, -26, -21, -26, -29, -17, -23, -24, -26, -29, -22, -22, -20, -17, -14, -36, -24, -18, -15, -12, -36, -36, -29, -36, -24, -22, -36, -36, -36, -36, -36, -36, -26, -40,
+	-18, -16, -27, -27, -27, -11, -7, -27, -27, -13, -27, -27, -27, -27, -14, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -27, -40,
+	-15, -8, -28, -16, -16, -21, -21, -28, -28, -18, -28, -21, -28, -16, -15, -21, -28, -28, -28, -28, -18, -28, -28, -28, -28, -28, -28, -28, -18, -21, -28, -28, -28, -40,
+	-6, -35, -22, -21, -35, -22, -18, -28, -19, -28, -23, -22, -14, -18, -20, -35, -35, -28, -19, -15, -35, -28, -20, -25, -28, -23, -35, -35, -35, -35, -35, -25, -23, -40,
+	-5, -25, -25, -25, -25, -19, -25, -25, -25, -25, -25, -25, -19, -25, -19, -25, -25, -25, -16, -16, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -40,
+	-12, -8, -31, -25, -31, -31, -25, -25, -25, -18, -31, -31, -31, -31, -25, -7, -31, -20, -25, -22, -18, -31, -31, -25, -31, -31, -31, -31, -31, -31, -31, -31, -31, -40,
+	-16, -12, -32, -32, -26, -32, -11, -32, -32, -10, -32, -32, -32, -32, -19, -14, -32, -32, -26, -32, -17, -32, -32, -32, -32, -32, -32, -32, -23, -13, -32, -18, -21, -40,
+	-7, -15, -32, -32, -32, -32, -13, -32, -32, -13, -32, -32, -32, -23, -20, -11, -32, -32, -32, -32, -26, -32, -32, -32, -32, -32, -32, -32, -13, -26, -32, -32, -20, -40,
+	-25, -8, -34, -34, -34, -25, -11, -34, -34, -11, -34, -28, -34, -34, -21, -12, -34, -34, -28, -34, -21, -28, -34, -25, -34, -34, -34, -34, -16, -18, -34, -25, -23, -40,
+	-11, -37, -16, -15, -17, -17, -20, -18, -24, -31, -22, -21, -15, -15, -17, -26, -28, -16, -18, -17, -37, -31, -26, -37, -24, -26, -26, -37, -37, -37, -37, -37, -28, -40,
+	-30, -14, -30, -30, -30, -30, -14, -30, -30, -19, -30, -30, -19, -30, -30, -6, -30, -9, -30, -30, -24, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -30, -40,
+	-22, -9, -32, -25, -25, -32, -10, -32, -32, -14, -32, -32, -32, -25, -25, -10, -25, -32, -25, -22, -17, -32, -32, -32, -32, -32, -32, -32, -15, -25, -32, -32, -19, -40,
+	-16, -20, -33, -19, -33, -33, -17, -33, -33, -19, -33, -15, -14, -19, -22, -16, -17, -24, -27, -10, -27, -33, -33, -33, -27, -33, -33, -27, -20, -18, -33, -33, -13, -40,
+	-13, -12, -34, -21, -34, -34, -13, -34, -34, -15, -34, -24, -27, -34, -27, -11, -34, -15, -18, -34, -24, -34, -34, -34, -27, -34, -34, -34, -18, -11, -34, -34, -24, -40,
+	-9, -29, -29, -29, -18, -12, -20, -18, -20, -29, -20, -23, -18, -23, -20, -29, -23, -29, -18, -15, -29, -29, -23, -29, -17, -23, -29, -29, -29, -29, -29, -17, -29, -40,
+	-22, -16, -22, -22, -22, -22, -13, -22, -22, -16, -22, -22, -22, -22, -22, -16, -22, -16, -22, -22, -16, -22, -22, -22, -22, -22, -22, -22, -22, -22, -22, -22, -22, -40,
+	-6, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -19, -26, -26, -9, -26, -16, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -26, -40,
+	-23, -17, -23, -17, -23, -23, -10, -23, -23, -12, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -14, -23, -23, -23, -23, -40,
+	-27, -12, -27, -27, -27, -27, -10, -27, -27, -12, -27, -20, -27, -27, -17, -27, -27, -27, -27, -10, -27, -27, -27, -27, -27, -20, -27, -27, -27, -27, -27, -27, -27, -40,
+	-26, -17, -26, -26, -26, -26, -13, -26, -26, -8, -26, -20, -15, -26, -26, -26, -26, -26, -26, -26, -15, -26, -26, -26, -26, -26, -26, -26, -26, -12, -26, -26, -26, -40,
+	-23, -11, -23, -23, -23, -23, -11, -23, -23, -13, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -23, -16, -23, -23, -23, -40,
+	-21, -21, -21, -21, -21, -21, -14, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -40,
+	-5, -29, -29, -23, -29, -29, -18, -29, -29, -29, -17, -23, -16, -15, -23, -29, -29, -23, -20, -23, -29, -29, -16, -29, -29, -18, -29, -29, -29, -29, -29, -29, -29, -40,
+	-5, -29, -29, -29, -29, -29, -29, -29, -20, -29, -29, -14, -29, -18, -23, -29, -29, -29, -14, -23, -29, -29, -29, -29, -29, -15, -29, -29, -29, -29, -29, -23, -23, -40,
+	-21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -10, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -21, -40,
+	-9, -25, -18, -25, -25, -11, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -25, -14, -25, -25, -25, -25, -25, -25, -14, -25, -25, -25, -25, -18, -25, -40,
+	-4, -29, -20, -22, -29, -20, -22, -22, -22, -29, -29, -29, -20, -20, -29, -29, -29, -29, -22, -14, -29, -29, -22, -20, -29, -29, -29, -29, -29, -29, -29, -29, -29, -40,
+	-40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40, -40,
+};
+
+static const LanguageModel g_languageModels[] = {
+	{ 0x09, 0x0061, 0x0041, 26, 0, 0, 0, g_bigramsEnglish },        // LANG_ENGLISH, a-z
+	{ 0x0D, 0x05D0, 0, 27, 0, 0, 0, g_bigramsHebrew },              // LANG_HEBREW, alef-tav with final forms
+	{ 0x19, 0x0430, 0x0410, 32, 0x0451, 0x0401, 0x0435, g_bigramsRussian }, // LANG_RUSSIAN, a-ya, yo as ye
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the model of a language, or NULL if there's none for it
+const LanguageModel* LanguageModelFind(uint16_t lang)
+{
+	for(unsigned i = 0; i < sizeof(g_languageModels) / sizeof(g_languageModels[0]); i++)
+	{
+		if(g_languageModels[i].primaryLang == (lang & 0x3FF))
+			return &g_languageModels[i];
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the class of a character in the model
+unsigned LanguageModelClass(const LanguageModel* model, LayoutChar ch)
+{
+	if(model->foldFrom && (ch == model->foldFrom || ch == model->foldFromUpper))
+		ch = model->foldTo;
+
+	if(ch >= model->lower && ch < model->lower + model->letterCount)
+		return ch - model->lower + 1;
+	if(model->upper && ch >= model->upper && ch < model->upper + model->letterCount)
+		return ch - model->upper + 1;
+
+	// a letter of another alphabet: Latin, or anything from Latin-1 letters up
+	// to the general punctuation block, or the CJK blocks and beyond
+	if((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+		(ch >= 0x00C0 && ch < 0x2000) || ch >= 0x3000)
+		return model->letterCount + 1u;
+
+	return 0;
+}
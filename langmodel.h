@@ -0,0 +1,34 @@
+#pragma once
+
+// Character bigram models of languages, used to tell how plausible a text is
+// in a language.
+//
+// A model sorts characters into classes: 0 for anything that isn't a letter,
+// 1 to N for the letters of the language's alphabet (regardless of case) and
+// N + 1 for letters of other alphabets. Its bigram table holds a score for
+// each pair of consecutive classes, which is 4 * log2 of the probability of
+// the second class following the first one.
+
+#include "layoutcore.h"
+
+typedef struct
+{
+	uint16_t primaryLang;       // the primary language ID of the model's LANGIDs
+	LayoutChar lower;           // the first lowercase letter of the alphabet
+	LayoutChar upper;           // the first uppercase letter of the alphabet, 0 if none
+	uint8_t letterCount;
+	LayoutChar foldFrom;        // a letter outside the range that counts as `foldTo`, 0 if none
+	LayoutChar foldFromUpper;
+	LayoutChar foldTo;
+	const int8_t* bigrams;      // (letterCount + 2) * (letterCount + 2) scores
+} LanguageModel;
+
+// Returns the model of a language (a LANGID), or NULL if there's none for it
+const LanguageModel* LanguageModelFind(uint16_t lang);
+
+// Returns the class of a character in the model
+unsigned LanguageModelClass(const LanguageModel* model, LayoutChar ch);
+
+// Returns the score of `next` following `prev`, where both are classes
+#define LanguageModelScore(model, prev, next) \
+	((model)->bigrams[(prev) * ((model)->letterCount + 2) + (next)])
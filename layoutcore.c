@@ -0,0 +1,834 @@
+#include <stdlib.h>
+#include <string.h>
+#include "layoutcore.h"
+#include "langmodel.h"
+#include "simdconvert.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Translation tables
+//
+// Converting a character costs a CharToKey and a KeyToChars call to the
+// provider, so the results are cached in a table for each (source, target)
+// layout pair. The tables are split into pages of 256 characters which are
+// allocated the first time a character from the page is converted.
+
+// set in a table entry once the conversion result in its low word is known
+#define TABLE_ENTRY_VALID   0x10000
+
+// set in a table entry, with 0 in its low word, if the key of the character
+// generates a dead key or several characters in the target layout
+#define TABLE_ENTRY_COMPLEX 0x20000
+
+#ifndef IS_HIGH_SURROGATE
+#define IS_HIGH_SURROGATE(ch)   ((ch) >= 0xD800 && (ch) <= 0xDBFF)
+#define IS_LOW_SURROGATE(ch)    ((ch) >= 0xDC00 && (ch) <= 0xDFFF)
+#endif
+
+struct LayoutPairTable
+{
+	LayoutId source;
+	LayoutId target;
+	uint32_t* pages[LAYOUT_PAGE_COUNT];
+	unsigned char* simdTables[0x10000 / SIMD_BLOCK_SIZE];
+	struct LayoutPairTable* next;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocates zeroed memory for the core's tables, keeping count of it
+static void* CoreAlloc(LayoutCore* core, size_t size)
+{
+	void* memory = calloc(1, size);
+	if(memory)
+	{
+		core->allocated += size;
+		if(core->allocated > core->peakAllocated)
+			core->peakAllocated = core->allocated;
+	}
+
+	return memory;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees memory allocated with CoreAlloc
+static void CoreFree(LayoutCore* core, void* memory, size_t size)
+{
+	if(memory)
+	{
+		core->allocated -= size;
+		free(memory);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a core that works with the layouts of `provider`
+void LayoutCoreInit(LayoutCore* core, const LayoutProvider* provider)
+{
+	memset(core, 0, sizeof(LayoutCore));
+	core->provider = *provider;
+	core->useSimd = SimdConvertSupported();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees the cached tables and the layouts list
+void LayoutCoreFree(LayoutCore* core)
+{
+	LayoutCoreFlush(core);
+
+	CoreFree(core, core->layouts, sizeof(LayoutId) * (core->layoutCount ? core->layoutCount : 1));
+	core->layouts = NULL;
+	core->layoutCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees all the translation tables and the detection index
+void LayoutCoreFlush(LayoutCore* core)
+{
+	while(core->pairTables)
+	{
+		LayoutPairTable* table = core->pairTables;
+		core->pairTables = table->next;
+
+		for(unsigned i = 0; i < LAYOUT_PAGE_COUNT; i++)
+			CoreFree(core, table->pages[i], sizeof(uint32_t) * LAYOUT_PAGE_SIZE);
+		for(unsigned i = 0; i < sizeof(table->simdTables) / sizeof(table->simdTables[0]); i++)
+			CoreFree(core, table->simdTables[i], SIMD_TABLE_BYTES);
+		CoreFree(core, table, sizeof(LayoutPairTable));
+	}
+
+	for(unsigned i = 0; i < LAYOUT_PAGE_COUNT; i++)
+	{
+		CoreFree(core, core->detectPages[i], sizeof(uint64_t) * LAYOUT_PAGE_SIZE);
+		core->detectPages[i] = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Drops all the cached tables if `layouts` differ from the ones the tables
+// were built for
+void LayoutCoreSync(LayoutCore* core, const LayoutId* layouts, unsigned count)
+{
+	if(core->layouts && count == core->layoutCount &&
+		memcmp(layouts, core->layouts, sizeof(LayoutId) * count) == 0)
+		return;
+
+	LayoutCoreFree(core);
+
+	core->layouts = (LayoutId*)CoreAlloc(core, sizeof(LayoutId) * (count ? count : 1));
+	if(core->layouts)
+	{
+		memcpy(core->layouts, layouts, sizeof(LayoutId) * count);
+		core->layoutCount = count;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the translation table of a layout pair, creating it if needed.
+// Returns NULL if there's not enough memory for a new table.
+static LayoutPairTable* GetPairTable(LayoutCore* core, LayoutId source, LayoutId target)
+{
+	LayoutPairTable** link = &core->pairTables;
+	while(*link)
+	{
+		LayoutPairTable* table = *link;
+		if(table->source == source && table->target == target)
+		{
+			// keep the most recently used pair first
+			*link = table->next;
+			table->next = core->pairTables;
+			core->pairTables = table;
+			return table;
+		}
+
+		link = &table->next;
+	}
+
+	LayoutPairTable* table = (LayoutPairTable*)CoreAlloc(core, sizeof(LayoutPairTable));
+	if(table)
+	{
+		table->source = source;
+		table->target = target;
+		table->next = core->pairTables;
+		core->pairTables = table;
+	}
+
+	return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the table entry of a character: its conversion, or 0 with
+// TABLE_ENTRY_COMPLEX set if its key doesn't generate a single character
+static uint32_t ConvertCharEntry(const LayoutProvider* provider, LayoutChar ch, LayoutId source, LayoutId target)
+{
+	if(provider->OverrideChar)
+	{
+		LayoutChar overridden = provider->OverrideChar(provider->context, source, target, ch);
+		if(overridden)
+			return overridden;
+	}
+
+	LayoutKey key;
+	if(!provider->CharToKey(provider->context, source, ch, &key))
+		return 0; // no such char in source keyboard layout
+
+	LayoutChar buffer[LAYOUT_KEY_CHARS];
+	int result = provider->KeyToChars(provider->context, target, key, buffer, LAYOUT_KEY_CHARS);
+	if(result == 1)
+		return buffer[0];
+
+	// a dead key, or several characters which only LayoutConverter can output
+	if(result != 0)
+		return TABLE_ENTRY_COMPLEX;
+
+	// conversion failed for some reason
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the table entry of a character, filling it in on first use
+static uint32_t PairTableGetEntry(LayoutCore* core, LayoutPairTable* table, LayoutChar ch)
+{
+	uint32_t* page = table->pages[ch >> LAYOUT_PAGE_BITS];
+	if(!page)
+	{
+		page = (uint32_t*)CoreAlloc(core, sizeof(uint32_t) * LAYOUT_PAGE_SIZE);
+		if(!page)
+			return ConvertCharEntry(&core->provider, ch, table->source, table->target);
+
+		table->pages[ch >> LAYOUT_PAGE_BITS] = page;
+	}
+
+	uint32_t entry = page[ch & (LAYOUT_PAGE_SIZE - 1)];
+	if(!(entry & TABLE_ENTRY_VALID))
+	{
+		entry = TABLE_ENTRY_VALID | ConvertCharEntry(&core->provider, ch, table->source, table->target);
+		page[ch & (LAYOUT_PAGE_SIZE - 1)] = entry;
+	}
+
+	return entry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character using the translation table
+static LayoutChar PairTableConvertChar(LayoutCore* core, LayoutPairTable* table, LayoutChar ch)
+{
+	return (LayoutChar)PairTableGetEntry(core, table, ch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the conversion of a character if it's already in the translation
+// table, 0 otherwise
+static LayoutChar PairTableLookupChar(const LayoutPairTable* table, LayoutChar ch)
+{
+	const uint32_t* page = table->pages[ch >> LAYOUT_PAGE_BITS];
+	if(!page)
+		return 0;
+
+	uint32_t entry = page[ch & (LAYOUT_PAGE_SIZE - 1)];
+	return (entry & TABLE_ENTRY_VALID) ? (LayoutChar)entry : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the SIMD translation table for the ASCII block and the block at
+// `base`, building it from the translation table on first use
+static const unsigned char* GetSimdTable(LayoutCore* core, LayoutPairTable* table, LayoutChar base)
+{
+	unsigned char* simdTable = table->simdTables[base / SIMD_BLOCK_SIZE];
+	if(!simdTable)
+	{
+		simdTable = (unsigned char*)CoreAlloc(core, SIMD_TABLE_BYTES);
+		if(!simdTable)
+			return NULL;
+
+		for(unsigned i = 0; i < SIMD_TABLE_SIZE; i++)
+		{
+			LayoutChar ch = (i < SIMD_BLOCK_SIZE) ? (LayoutChar)i : (LayoutChar)(base + i - SIMD_BLOCK_SIZE);
+			LayoutChar converted = PairTableConvertChar(core, table, ch);
+			simdTable[i] = (unsigned char)(converted & 0xFF);
+			simdTable[SIMD_TABLE_SIZE + i] = (unsigned char)(converted >> 8);
+		}
+
+		table->simdTables[base / SIMD_BLOCK_SIZE] = simdTable;
+	}
+
+	return simdTable;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the start of the block of the first character in `str` that is
+// outside of both the ASCII block and the block at `base`, or `base` if
+// there's no such character
+static LayoutChar FindSimdBase(const LayoutChar* str, size_t length, LayoutChar base)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		LayoutChar block = str[i] & ~(SIMD_BLOCK_SIZE - 1);
+		if(block != 0 && block != base)
+			return block;
+	}
+
+	return base;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character from one keyboard layout to another
+LayoutChar LayoutCoreConvertChar(LayoutCore* core, LayoutChar ch, LayoutId source, LayoutId target)
+{
+	LayoutPairTable* table = GetPairTable(core, source, target);
+	if(!table)
+		return LayoutCoreConvertCharUncached(&core->provider, ch, source, target);
+
+	return PairTableConvertChar(core, table, ch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character from one keyboard layout to another by finding the key
+// that generates it in the source layout and pressing it in the target layout
+LayoutChar LayoutCoreConvertCharUncached(const LayoutProvider* provider, LayoutChar ch, LayoutId source, LayoutId target)
+{
+	return (LayoutChar)ConvertCharEntry(provider, ch, source, target);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the characters at the start of `str` up to the first one that
+// can't be converted to a single character. Returns the number converted.
+// If `readOnly` is set the tables aren't changed, and the conversion also
+// stops at characters that aren't in them yet.
+static size_t ConvertRun(LayoutCore* core, LayoutPairTable* table, const LayoutChar* str, size_t length, LayoutChar* buffer,
+	LayoutId source, LayoutId target, int readOnly)
+{
+	int useSimd = table && core->useSimd;
+
+	size_t i = 0;
+	LayoutChar base = SIMD_BLOCK_SIZE;
+	int baseChanged = 0;
+	while(i < length)
+	{
+		// convert runs of ASCII and of a single other block 16 characters at a time
+		if(useSimd && length - i >= 16)
+		{
+			const unsigned char* simdTable = readOnly ? table->simdTables[base / SIMD_BLOCK_SIZE] :
+				GetSimdTable(core, table, base);
+			if(!simdTable && readOnly)
+				return i;
+
+			size_t converted = simdTable ? SimdConvertRun(str + i, buffer + i, length - i, base, simdTable) : 0;
+			if(converted)
+			{
+				i += converted;
+				baseChanged = 0;
+				continue;
+			}
+
+			// the run might have stopped at a character from another block
+			if(!baseChanged)
+			{
+				LayoutChar newBase = FindSimdBase(str + i, 16, base);
+				if(newBase != base)
+				{
+					base = newBase;
+					baseChanged = 1;
+					continue;
+				}
+			}
+		}
+
+		// convert the next characters one by one
+		size_t end = (length - i > 16) ? i + 16 : length;
+		for(; i < end; i++)
+		{
+			LayoutChar ch;
+			if(readOnly)
+				ch = PairTableLookupChar(table, str[i]);
+			else if(table)
+				ch = PairTableConvertChar(core, table, str[i]);
+			else
+				ch = LayoutCoreConvertCharUncached(&core->provider, str[i], source, target);
+
+			if(ch == 0)
+				return i;
+			buffer[i] = ch;
+		}
+
+		baseChanged = 0;
+	}
+
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a string from one keyboard layout to another.
+// Returns 0 if any of the characters can't be converted.
+size_t LayoutCoreConvertString(LayoutCore* core, const LayoutChar* str, size_t length, LayoutChar* buffer, LayoutId source, LayoutId target)
+{
+	LayoutPairTable* table = GetPairTable(core, source, target);
+
+	size_t converted = ConvertRun(core, table, str, length, buffer, source, target, 0);
+	return converted == length ? length : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds the pages of the characters of a string to a page set
+void LayoutPageSetAddString(LayoutPageSet* pages, const LayoutChar* str, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		unsigned page = str[i] >> LAYOUT_PAGE_BITS;
+		pages->bits[page / 32] |= 1u << (page % 32);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills in all the entries and SIMD tables of the pages in the set
+LayoutPairTable* LayoutCorePrepare(LayoutCore* core, LayoutId source, LayoutId target, const LayoutPageSet* pages)
+{
+	LayoutPairTable* table = GetPairTable(core, source, target);
+	if(!table)
+		return NULL;
+
+	for(unsigned page = 0; page < LAYOUT_PAGE_COUNT; page++)
+	{
+		// ConvertRun starts with the SIMD table of the block after ASCII, so
+		// the first page is always needed
+		if(page != 0 && !(pages->bits[page / 32] & (1u << (page % 32))))
+			continue;
+
+		unsigned first = page << LAYOUT_PAGE_BITS;
+		for(unsigned i = 0; i < LAYOUT_PAGE_SIZE; i++)
+			PairTableGetEntry(core, table, (LayoutChar)(first + i));
+
+		if(!table->pages[page])
+			return NULL;
+
+		if(core->useSimd)
+		{
+			for(unsigned block = first; block < first + LAYOUT_PAGE_SIZE; block += SIMD_BLOCK_SIZE)
+			{
+				if(block != 0 && !GetSimdTable(core, table, (LayoutChar)block))
+					return NULL;
+			}
+		}
+	}
+
+	return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts characters with the tables as they are, without changing the core
+size_t LayoutCoreConvertPrepared(LayoutCore* core, LayoutPairTable* table, const LayoutChar* str, size_t length, LayoutChar* buffer)
+{
+	return ConvertRun(core, table, str, length, buffer, table->source, table->target, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a mask of the layouts that can generate `ch`, with bit N set for
+// layout N. The masks are built a page of 256 characters at a time.
+static uint64_t GetCharLayoutMask(LayoutCore* core, LayoutChar ch)
+{
+	unsigned layoutCount = core->layoutCount < LAYOUT_DETECT_MAX ? core->layoutCount : LAYOUT_DETECT_MAX;
+	LayoutKey key;
+
+	uint64_t* page = core->detectPages[ch >> LAYOUT_PAGE_BITS];
+	if(!page)
+	{
+		page = (uint64_t*)CoreAlloc(core, sizeof(uint64_t) * LAYOUT_PAGE_SIZE);
+		if(!page)
+		{
+			uint64_t mask = 0;
+			for(unsigned layout = 0; layout < layoutCount; layout++)
+			{
+				if(core->provider.CharToKey(core->provider.context, core->layouts[layout], ch, &key))
+					mask |= 1ULL << layout;
+			}
+			return mask;
+		}
+
+		LayoutChar first = ch & ~(LAYOUT_PAGE_SIZE - 1);
+		for(unsigned i = 0; i < LAYOUT_PAGE_SIZE; i++)
+		{
+			for(unsigned layout = 0; layout < layoutCount; layout++)
+			{
+				if(core->provider.CharToKey(core->provider.context, core->layouts[layout], (LayoutChar)(first + i), &key))
+					page[i] |= 1ULL << layout;
+			}
+		}
+
+		core->detectPages[ch >> LAYOUT_PAGE_BITS] = page;
+	}
+
+	return page[ch & (LAYOUT_PAGE_SIZE - 1)];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills in the tables of a layout pair and the detection index for the
+// pages of all the characters the keys of `source` generate
+int LayoutCoreWarmUp(LayoutCore* core, LayoutId source, LayoutId target)
+{
+	static const uint8_t shifts[4] = { 0, LAYOUT_SHIFT, LAYOUT_CONTROL | LAYOUT_ALT, LAYOUT_SHIFT | LAYOUT_CONTROL | LAYOUT_ALT };
+
+	LayoutPageSet pages;
+	memset(&pages, 0, sizeof(pages));
+
+	for(unsigned vk = 1; vk < 256; vk++)
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			LayoutKey key = { (uint8_t)vk, shifts[i] };
+			LayoutChar chars[LAYOUT_KEY_CHARS];
+			int count = core->provider.KeyToChars(core->provider.context, source, key, chars, LAYOUT_KEY_CHARS);
+			if(count > 0)
+				LayoutPageSetAddString(&pages, chars, (size_t)count);
+		}
+	}
+
+	if(!LayoutCorePrepare(core, source, target, &pages))
+		return 0;
+
+	for(unsigned page = 0; page < LAYOUT_PAGE_COUNT; page++)
+	{
+		if(pages.bits[page / 32] & (1u << (page % 32)))
+			GetCharLayoutMask(core, (LayoutChar)(page << LAYOUT_PAGE_BITS));
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Goes through the core's layouts and returns the first layout that can
+// generate the string. Only the first LAYOUT_DETECT_MAX layouts are considered.
+LayoutId LayoutCoreDetect(LayoutCore* core, const LayoutChar* str, size_t length, int* pmatches)
+{
+	unsigned layoutCount = core->layoutCount < LAYOUT_DETECT_MAX ? core->layoutCount : LAYOUT_DETECT_MAX;
+
+	// a layout can generate the string if it can generate every character in it
+	uint64_t mask = layoutCount < 64 ? (1ULL << layoutCount) - 1 : ~0ULL;
+	for(size_t i = 0; i < length && mask; i++)
+		mask &= GetCharLayoutMask(core, str[i]);
+
+	LayoutId result = 0;
+	int matches = 0;
+	for(unsigned layout = 0; mask; layout++, mask >>= 1)
+	{
+		if(mask & 1)
+		{
+			matches++;
+			if(!result)
+				result = core->layouts[layout];
+		}
+	}
+
+	if(pmatches)
+		*pmatches = matches;
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Detects the layout a string was typed in by converting it from each of the
+// layouts that can generate it, and scoring the conversions with the language
+// model of the target layout. Everything is done in a single pass over the
+// string, with the state of each layout kept on the stack.
+LayoutId LayoutCoreDetectSource(LayoutCore* core, const LayoutChar* str, size_t length, LayoutId target, LayoutId preferred, int* pmatches)
+{
+	unsigned layoutCount = core->layoutCount < LAYOUT_DETECT_MAX ? core->layoutCount : LAYOUT_DETECT_MAX;
+
+	const LanguageModel* model = NULL;
+	if(core->provider.GetLanguage)
+		model = LanguageModelFind(core->provider.GetLanguage(core->provider.context, target));
+
+	LayoutPairTable* tables[LAYOUT_DETECT_MAX];
+	unsigned prevClass[LAYOUT_DETECT_MAX];
+	long long score[LAYOUT_DETECT_MAX];
+	for(unsigned layout = 0; layout < layoutCount; layout++)
+	{
+		tables[layout] = model ? GetPairTable(core, core->layouts[layout], target) : NULL;
+		prevClass[layout] = 0;
+		score[layout] = 0;
+	}
+
+	uint64_t mask = layoutCount < 64 ? (1ULL << layoutCount) - 1 : ~0ULL;
+	for(size_t i = 0; i < length && mask; i++)
+	{
+		mask &= GetCharLayoutMask(core, str[i]);
+		if(!model)
+			continue;
+
+		for(unsigned layout = 0; layout < layoutCount; layout++)
+		{
+			if(!(mask & (1ULL << layout)))
+				continue;
+
+			LayoutChar converted = tables[layout] ? PairTableConvertChar(core, tables[layout], str[i]) :
+				LayoutCoreConvertCharUncached(&core->provider, str[i], core->layouts[layout], target);
+
+			// runs of non-letters count as one, like in the model
+			unsigned charClass = LanguageModelClass(model, converted);
+			if(charClass == 0 && prevClass[layout] == 0)
+				continue;
+
+			score[layout] += LanguageModelScore(model, prevClass[layout], charClass);
+			prevClass[layout] = charClass;
+		}
+	}
+
+	LayoutId result = 0;
+	long long bestScore = 0;
+	int matches = 0;
+	for(unsigned layout = 0; layout < layoutCount; layout++)
+	{
+		if(!(mask & (1ULL << layout)))
+			continue;
+
+		matches++;
+
+		if(model)
+		{
+			if(prevClass[layout] != 0)
+				score[layout] += LanguageModelScore(model, prevClass[layout], 0);
+
+			if(!result || score[layout] > bestScore ||
+				(score[layout] == bestScore && core->layouts[layout] == preferred))
+			{
+				result = core->layouts[layout];
+				bestScore = score[layout];
+			}
+		}
+		else
+			result = core->layouts[layout];
+	}
+
+	if(pmatches)
+		*pmatches = matches;
+
+	if(!result || (!model && matches != 1))
+		return preferred;
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming conversion
+//
+// LayoutConverter converts most of the text with the translation tables, and
+// presses the keys through the provider for the characters whose keys
+// generate a dead key or several characters in the target layout.
+
+///////////////////////////////////////////////////////////////////////////////
+// Grows a buffer allocated with malloc, at least doubling it
+int LayoutOutputGrowHeap(LayoutOutput* output, size_t capacity)
+{
+	if(capacity < output->capacity * 2)
+		capacity = output->capacity * 2;
+
+	LayoutChar* buffer = (LayoutChar*)realloc(output->buffer, sizeof(LayoutChar) * capacity);
+	if(!buffer)
+		return 0;
+
+	output->buffer = buffer;
+	output->capacity = capacity;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Makes sure `count` more characters fit in the output
+static int ReserveOutput(LayoutOutput* output, size_t count)
+{
+	if(output->capacity - output->length >= count)
+		return 1;
+
+	return output->Grow && output->Grow(output, output->length + count) &&
+		output->capacity - output->length >= count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Appends characters to the output
+static int AppendOutput(LayoutOutput* output, const LayoutChar* chars, size_t count)
+{
+	if(!ReserveOutput(output, count))
+		return 0;
+
+	memcpy(output->buffer + output->length, chars, sizeof(LayoutChar) * count);
+	output->length += count;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Finds the key that generates the characters in `layout` by trying all the
+// keys. Used for surrogate pairs, which can't be looked up with CharToKey.
+static int FindKeyForChars(const LayoutProvider* provider, LayoutId layout, const LayoutChar* chars, int count, LayoutKey* key)
+{
+	static const uint8_t shiftStates[] = {
+		0, LAYOUT_SHIFT, LAYOUT_CONTROL | LAYOUT_ALT, LAYOUT_SHIFT | LAYOUT_CONTROL | LAYOUT_ALT
+	};
+
+	LayoutChar buffer[LAYOUT_KEY_CHARS];
+	for(unsigned vk = 1; vk < 0xFF; vk++)
+	{
+		for(unsigned i = 0; i < sizeof(shiftStates); i++)
+		{
+			key->vk = (uint8_t)vk;
+			key->shift = shiftStates[i];
+			if(provider->KeyToChars(provider->context, layout, *key, buffer, LAYOUT_KEY_CHARS) == count &&
+				memcmp(buffer, chars, sizeof(LayoutChar) * count) == 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Presses a key in the target layout, combining it with a pending dead key
+static int PressKey(LayoutConverter* converter, LayoutKey key, LayoutOutput* output)
+{
+	const LayoutProvider* provider = &converter->core->provider;
+	LayoutChar buffer[LAYOUT_KEY_CHARS];
+	int count;
+
+	if(converter->deadKeyPending)
+	{
+		converter->deadKeyPending = 0;
+		if(provider->DeadKeyToChars)
+		{
+			count = provider->DeadKeyToChars(provider->context, converter->target, converter->deadKey, key, buffer, LAYOUT_KEY_CHARS);
+		}
+		else
+		{
+			if(!AppendOutput(output, &converter->deadChar, 1))
+				return 0;
+			count = provider->KeyToChars(provider->context, converter->target, key, buffer, LAYOUT_KEY_CHARS);
+		}
+	}
+	else
+		count = provider->KeyToChars(provider->context, converter->target, key, buffer, LAYOUT_KEY_CHARS);
+
+	// a dead key generates its character with the next key. If two dead keys
+	// combine into another dead key, the second one is kept as an approximation.
+	if(count < 0)
+	{
+		converter->deadKeyPending = 1;
+		converter->deadKey = key;
+		converter->deadChar = buffer[0];
+		return 1;
+	}
+
+	return count > 0 && AppendOutput(output, buffer, count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a character that ConvertRun couldn't convert
+static int ConvertNextChar(LayoutConverter* converter, LayoutPairTable* table, LayoutChar ch, LayoutOutput* output)
+{
+	const LayoutProvider* provider = &converter->core->provider;
+	LayoutKey key;
+
+	if(converter->highSurrogate)
+	{
+		LayoutChar pair[2] = { converter->highSurrogate, ch };
+		converter->highSurrogate = 0;
+
+		if(!IS_LOW_SURROGATE(ch) || !FindKeyForChars(provider, converter->source, pair, 2, &key))
+			return 0;
+
+		return PressKey(converter, key, output);
+	}
+
+	if(IS_HIGH_SURROGATE(ch))
+	{
+		converter->highSurrogate = ch;
+		return 1;
+	}
+
+	uint32_t entry = table ? PairTableGetEntry(converter->core, table, ch) :
+		ConvertCharEntry(provider, ch, converter->source, converter->target);
+	if(!(entry & TABLE_ENTRY_COMPLEX))
+	{
+		LayoutChar converted = (LayoutChar)entry;
+		if(!converted)
+			return 0;
+
+		// characters that are overridden don't go through the keys, so they
+		// can't combine with a dead key either
+		if(!converter->deadKeyPending || (provider->OverrideChar &&
+			provider->OverrideChar(provider->context, converter->source, converter->target, ch)))
+		{
+			if(converter->deadKeyPending)
+			{
+				converter->deadKeyPending = 0;
+				if(!AppendOutput(output, &converter->deadChar, 1))
+					return 0;
+			}
+
+			return AppendOutput(output, &converted, 1);
+		}
+	}
+
+	if(!provider->CharToKey(provider->context, converter->source, ch, &key))
+		return 0;
+
+	return PressKey(converter, key, output);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts a conversion between two of the core's layouts
+void LayoutConverterInit(LayoutConverter* converter, LayoutCore* core, LayoutId source, LayoutId target)
+{
+	memset(converter, 0, sizeof(LayoutConverter));
+	converter->core = core;
+	converter->source = source;
+	converter->target = target;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a piece of text, appending it to the output
+int LayoutConverterPut(LayoutConverter* converter, const LayoutChar* str, size_t length, LayoutOutput* output)
+{
+	LayoutPairTable* table = GetPairTable(converter->core, converter->source, converter->target);
+
+	size_t i = 0;
+	while(i < length)
+	{
+		// runs of characters that convert to a single character go through the
+		// translation tables, straight into the output
+		if(!converter->deadKeyPending && !converter->highSurrogate)
+		{
+			// if the output can't grow, convert as much as fits in it
+			size_t runLength = length - i;
+			if(!ReserveOutput(output, runLength))
+				runLength = output->capacity - output->length;
+
+			size_t converted = ConvertRun(converter->core, table, str + i, runLength,
+				output->buffer + output->length, converter->source, converter->target, 0);
+			output->length += converted;
+			i += converted;
+			if(i == length)
+				break;
+		}
+
+		if(!ConvertNextChar(converter, table, str[i], output))
+			return 0;
+		i++;
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ends the conversion and NUL-terminates the output
+int LayoutConverterFinish(LayoutConverter* converter, LayoutOutput* output)
+{
+	if(converter->highSurrogate)
+		return 0;
+
+	if(converter->deadKeyPending)
+	{
+		converter->deadKeyPending = 0;
+		if(!AppendOutput(output, &converter->deadChar, 1))
+			return 0;
+	}
+
+	if(!ReserveOutput(output, 1))
+		return 0;
+
+	output->buffer[output->length] = 0;
+	return 1;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+// Platform independent keyboard layout conversion.
+//
+// The conversion and detection logic works on layouts through a
+// LayoutProvider, which maps characters to keys and keys to characters. On
+// Windows the provider queries the installed layouts, and layout tables
+// (layouttable.h) provide the same on any platform. This file and
+// layoutcore.c only depend on the C runtime.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A UTF-16 code unit
+#ifdef _WIN32
+typedef wchar_t LayoutChar;
+#else
+typedef uint16_t LayoutChar;
+#endif
+
+// Identifies a layout to its provider (the HKL on Windows). 0 is never a layout.
+typedef uintptr_t LayoutId;
+
+// Shift state bits of a key, the same as in the high byte returned by VkKeyScanEx
+#define LAYOUT_SHIFT    1
+#define LAYOUT_CONTROL  2
+#define LAYOUT_ALT      4
+
+// A virtual key code and the shift state it's pressed with
+typedef struct
+{
+	uint8_t vk;
+	uint8_t shift;
+} LayoutKey;
+
+typedef struct
+{
+	// Finds the key that generates `ch` in `layout`.
+	// Returns 0 if no key generates it.
+	int (*CharToKey)(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key);
+
+	// Writes the characters `key` generates in `layout` to `buffer`. Returns
+	// their number, 0 if the key generates nothing or -1 for a dead key.
+	int (*KeyToChars)(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size);
+
+	// Optional. Returns the conversion of `ch` between two layouts if it
+	// shouldn't go through the keys, 0 otherwise.
+	LayoutChar (*OverrideChar)(void* context, LayoutId source, LayoutId target, LayoutChar ch);
+
+	// Optional. Writes the characters `key` generates in `layout` after the
+	// dead key `deadKey`, returning the same as KeyToChars. Without it a dead
+	// key followed by another key generates both of their characters.
+	int (*DeadKeyToChars)(void* context, LayoutId layout, LayoutKey deadKey, LayoutKey key, LayoutChar* buffer, int size);
+
+	// Optional. Returns the language of `layout` as a Windows LANGID, or 0 if
+	// it's unknown.
+	uint16_t (*GetLanguage)(void* context, LayoutId layout);
+
+	void* context;
+} LayoutProvider;
+
+// Number of bits of a character that select its page in the lookup tables
+#define LAYOUT_PAGE_BITS    8
+#define LAYOUT_PAGE_SIZE    (1 << LAYOUT_PAGE_BITS)
+#define LAYOUT_PAGE_COUNT   (0x10000 >> LAYOUT_PAGE_BITS)
+
+// Maximal number of layouts LayoutCoreDetect considers
+#define LAYOUT_DETECT_MAX   64
+
+// Maximal number of characters a single key press generates
+#define LAYOUT_KEY_CHARS    16
+
+typedef struct LayoutPairTable LayoutPairTable;
+
+// Conversion state for a set of layouts of a provider. Caches a translation
+// table for each (source, target) pair of layouts converted between, and an
+// index of the layouts that can generate each character for detection. Both
+// are filled in lazily and dropped when the set of layouts changes.
+typedef struct
+{
+	LayoutProvider provider;
+	LayoutId* layouts;
+	unsigned layoutCount;
+	LayoutPairTable* pairTables;
+	uint64_t* detectPages[LAYOUT_PAGE_COUNT];
+	int useSimd;
+
+	// bytes currently allocated for the cached tables, and the most that was
+	// allocated at once
+	size_t allocated;
+	size_t peakAllocated;
+} LayoutCore;
+
+void LayoutCoreInit(LayoutCore* core, const LayoutProvider* provider);
+void LayoutCoreFree(LayoutCore* core);
+
+// Sets the layouts the core works with, dropping the cached tables if they changed
+void LayoutCoreSync(LayoutCore* core, const LayoutId* layouts, unsigned count);
+
+// Drops the cached tables, keeping the layouts
+void LayoutCoreFlush(LayoutCore* core);
+
+// Converts a character between layouts. Returns 0 if it can't be converted.
+LayoutChar LayoutCoreConvertChar(LayoutCore* core, LayoutChar ch, LayoutId source, LayoutId target);
+
+// Converts a character by querying the provider directly, without the cache
+LayoutChar LayoutCoreConvertCharUncached(const LayoutProvider* provider, LayoutChar ch, LayoutId source, LayoutId target);
+
+// Converts `length` characters of `str` into `buffer`. Returns the number of
+// characters converted, or 0 if any of the characters can't be converted.
+size_t LayoutCoreConvertString(LayoutCore* core, const LayoutChar* str, size_t length, LayoutChar* buffer, LayoutId source, LayoutId target);
+
+// Returns the first of the core's layouts that can generate all `length`
+// characters of `str`, or 0 if none can. If `pmatches` isn't NULL it will be
+// set to the number of matched layouts.
+LayoutId LayoutCoreDetect(LayoutCore* core, const LayoutChar* str, size_t length, int* pmatches);
+
+// Returns the most likely layout `str` was typed in, given that it's converted
+// to `target`. Of the core's layouts that can generate the string, the one
+// whose conversion reads best in the target layout's language wins, with ties
+// going to `preferred`. If there's no language model for the target layout,
+// a layout is only returned if it's the only one that can generate the
+// string. Returns `preferred` if no layout is found. If `pmatches` isn't NULL
+// it will be set to the number of layouts that can generate the string.
+LayoutId LayoutCoreDetectSource(LayoutCore* core, const LayoutChar* str, size_t length, LayoutId target, LayoutId preferred, int* pmatches);
+
+// A set of pages of characters, with bit N set for page N
+typedef struct
+{
+	uint32_t bits[LAYOUT_PAGE_COUNT / 32];
+} LayoutPageSet;
+
+// Adds the pages of the characters of a string to a page set
+void LayoutPageSetAddString(LayoutPageSet* pages, const LayoutChar* str, size_t length);
+
+// Fills in the translation tables of a layout pair for all the characters of
+// the pages in `pages`, so that LayoutCoreConvertPrepared can convert them
+// without changing the core. Returns the pair's table, or NULL if there isn't
+// enough memory.
+LayoutPairTable* LayoutCorePrepare(LayoutCore* core, LayoutId source, LayoutId target, const LayoutPageSet* pages);
+
+// Converts the characters at the start of `str` up to the first one that
+// can't be converted to a single character or that isn't in a page prepared
+// with LayoutCorePrepare, returning their number. Doesn't change the core, so
+// it can run on several threads at once as long as nothing else uses the
+// core meanwhile.
+size_t LayoutCoreConvertPrepared(LayoutCore* core, LayoutPairTable* table, const LayoutChar* str, size_t length, LayoutChar* buffer);
+
+// Fills in the translation tables of a layout pair and the detection index
+// for all the characters the keys of `source` generate, so that the first
+// conversion between them doesn't have to. Returns 0 if there isn't enough
+// memory.
+int LayoutCoreWarmUp(LayoutCore* core, LayoutId source, LayoutId target);
+
+// A span of characters the conversion writes to. When it's full, `Grow` is
+// called to make room, and if there's no `Grow` the conversion fails.
+typedef struct LayoutOutput
+{
+	LayoutChar* buffer;
+	size_t length;
+	size_t capacity;
+
+	// Makes room for at least `capacity` characters, updating `buffer` and
+	// `capacity`. Returns 0 on failure.
+	int (*Grow)(struct LayoutOutput* output, size_t capacity);
+	void* context;
+} LayoutOutput;
+
+// LayoutOutput.Grow for a buffer allocated with malloc, which the caller frees
+int LayoutOutputGrowHeap(LayoutOutput* output, size_t capacity);
+
+// Converts text between layouts a piece at a time. Unlike LayoutCoreConvertString
+// it handles dead keys and keys that generate several characters (such as
+// ligatures and surrogate pairs) in the target layout, and surrogate pairs in
+// the source text. The state between the pieces is kept here, so it doesn't
+// allocate memory except for growing the output.
+typedef struct
+{
+	LayoutCore* core;
+	LayoutId source;
+	LayoutId target;
+
+	// the dead key pressed last in the target layout and its own character
+	int deadKeyPending;
+	LayoutKey deadKey;
+	LayoutChar deadChar;
+
+	// the last character of the previous piece if it's the first half of a surrogate pair
+	LayoutChar highSurrogate;
+} LayoutConverter;
+
+void LayoutConverterInit(LayoutConverter* converter, LayoutCore* core, LayoutId source, LayoutId target);
+
+// Converts `length` characters of `str`, appending them to `output`. Returns 0
+// if a character can't be converted or the output can't grow, in which case
+// the output holds the conversion up to that character.
+int LayoutConverterPut(LayoutConverter* converter, const LayoutChar* str, size_t length, LayoutOutput* output);
+
+// Ends the conversion, appending the character of a pending dead key, and
+// terminates the output with a NUL which isn't counted in its length.
+// Returns 0 if the text ended in the middle of a surrogate pair or the output
+// can't grow.
+int LayoutConverterFinish(LayoutConverter* converter, LayoutOutput* output);
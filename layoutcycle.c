@@ -0,0 +1,176 @@
+#include <string.h>
+#include "layoutcycle.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the number of cycle key presses from `current` to `target`
+int LayoutCycleSteps(const LayoutId* cycle, unsigned count, LayoutId current, LayoutId target)
+{
+	int currentIndex = -1, targetIndex = -1;
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		if(cycle[i] == current)
+			currentIndex = (int)i;
+		if(cycle[i] == target)
+			targetIndex = (int)i;
+	}
+
+	if(currentIndex < 0 || targetIndex < 0)
+		return -1;
+
+	return (targetIndex - currentIndex + (int)count) % (int)count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Waits up to `timeout` milliseconds for the layout to change from `layout`,
+// and then until it stays the same for LAYOUT_CYCLE_SETTLE_TIME. Returns the
+// layout at the end.
+static LayoutId WaitForSettledLayout(const LayoutCycleBackend* backend, LayoutId layout, uint32_t timeout)
+{
+	uint32_t start = backend->GetTime(backend->context);
+	LayoutId previous = layout;
+	LayoutId current = backend->WaitForChange(backend->context, layout, timeout);
+
+	// the layout may come back to where it started on the way, so it's only
+	// settled when a wait sees no change
+	while(current != previous)
+	{
+		uint32_t elapsed = backend->GetTime(backend->context) - start;
+		if(elapsed >= timeout)
+			break;
+
+		uint32_t wait = timeout - elapsed;
+		if(wait > LAYOUT_CYCLE_SETTLE_TIME)
+			wait = LAYOUT_CYCLE_SETTLE_TIME;
+
+		previous = current;
+		current = backend->WaitForChange(backend->context, current, wait);
+	}
+
+	return current;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Switches the window to `target` by sending the computed number of presses
+// at once, and then one press at a time if that didn't get there. The batch
+// is only checked once it's applied, since the window may go past the target
+// on the way if its cycle is shorter than the one given.
+int LayoutCycleSwitch(const LayoutCycleBackend* backend, const LayoutId* cycle, unsigned count,
+	LayoutId target, uint32_t timeout)
+{
+	LayoutId current = backend->GetLayout(backend->context);
+	int steps = LayoutCycleSteps(cycle, count, current, target);
+
+	if(steps > 0)
+	{
+		backend->SendCycleKeys(backend->context, (unsigned)steps);
+		current = WaitForSettledLayout(backend, current, timeout);
+	}
+
+	for(unsigned i = 0; i < count && current != target; i++)
+	{
+		backend->SendCycleKeys(backend->context, 1);
+		current = backend->WaitForChange(backend->context, current, timeout);
+	}
+
+	return current == target;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulated window
+
+///////////////////////////////////////////////////////////////////////////////
+// Applies the presses whose time has come
+static void SimLayoutWindowUpdate(SimLayoutWindow* sim)
+{
+	while(sim->pendingPresses && (int32_t)(sim->now - sim->nextPressTime) >= 0)
+	{
+		do
+			sim->current = (sim->current + 1) % sim->count;
+		while(sim->skip && sim->cycle[sim->current] == sim->skip);
+
+		sim->pendingPresses--;
+		sim->nextPressTime += sim->pressLatency;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.GetLayout for the simulated window
+static LayoutId SimGetLayout(void* context)
+{
+	SimLayoutWindow* sim = (SimLayoutWindow*)context;
+	SimLayoutWindowUpdate(sim);
+	return sim->cycle[sim->current];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.SendCycleKeys for the simulated window
+static void SimSendCycleKeys(void* context, unsigned presses)
+{
+	SimLayoutWindow* sim = (SimLayoutWindow*)context;
+	SimLayoutWindowUpdate(sim);
+
+	if(sim->pendingPresses == 0)
+		sim->nextPressTime = sim->now + sim->pressLatency;
+
+	sim->pendingPresses += presses;
+	sim->sends++;
+	sim->presses += presses;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.WaitForChange for the simulated window, which moves the
+// clock to when the window's layout changes or to the end of the wait
+static LayoutId SimWaitForChange(void* context, LayoutId layout, uint32_t timeout)
+{
+	SimLayoutWindow* sim = (SimLayoutWindow*)context;
+	uint32_t end = sim->now + timeout;
+	sim->waits++;
+
+	SimLayoutWindowUpdate(sim);
+	while(sim->cycle[sim->current] == layout && sim->pendingPresses &&
+		(int32_t)(end - sim->nextPressTime) >= 0)
+	{
+		sim->now = sim->nextPressTime;
+		SimLayoutWindowUpdate(sim);
+	}
+
+	if(sim->cycle[sim->current] == layout)
+		sim->now = end;
+
+	return sim->cycle[sim->current];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.GetTime for the simulated window
+static uint32_t SimGetTime(void* context)
+{
+	return ((SimLayoutWindow*)context)->now;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a simulated window on layout `current` of `cycle`, with its
+// clock at 0
+void SimLayoutWindowInit(SimLayoutWindow* sim, const LayoutId* cycle, unsigned count, unsigned current, uint32_t pressLatency)
+{
+	memset(sim, 0, sizeof(SimLayoutWindow));
+	if(count > SIM_LAYOUT_MAX)
+		count = SIM_LAYOUT_MAX;
+
+	memcpy(sim->cycle, cycle, sizeof(LayoutId) * count);
+	sim->count = count;
+	sim->current = current;
+	sim->pressLatency = pressLatency;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `backend` with the backend of a simulated window
+void SimLayoutWindowGetBackend(SimLayoutWindow* sim, LayoutCycleBackend* backend)
+{
+	memset(backend, 0, sizeof(LayoutCycleBackend));
+	backend->GetLayout = SimGetLayout;
+	backend->SendCycleKeys = SimSendCycleKeys;
+	backend->WaitForChange = SimWaitForChange;
+	backend->GetTime = SimGetTime;
+	backend->context = sim;
+}
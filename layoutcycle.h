@@ -0,0 +1,73 @@
+#pragma once
+
+// Switching the layout of a window by simulating the key that cycles through
+// the layouts (Alt+Shift), for applications that don't handle layout change
+// requests. The presses are computed from the cycle order up front, sent at
+// once, and checked once the layout settles, within one bounded wait. This
+// file and layoutcycle.c only depend on the C runtime.
+
+#include "layoutcore.h"
+
+// time in milliseconds the layout has to stay the same after a change to be
+// taken as settled, so that the presses still on their way are applied. A
+// window that takes longer than this between presses looks settled early.
+#define LAYOUT_CYCLE_SETTLE_TIME 50
+
+typedef struct
+{
+	// Returns the current layout of the window
+	LayoutId (*GetLayout)(void* context);
+
+	// Sends `presses` presses of the cycle key to the window at once
+	void (*SendCycleKeys)(void* context, unsigned presses);
+
+	// Waits up to `timeout` milliseconds for the window's layout to be
+	// another one than `layout`, and returns the layout it has at the end
+	LayoutId (*WaitForChange)(void* context, LayoutId layout, uint32_t timeout);
+
+	// Returns the current time in milliseconds
+	uint32_t (*GetTime)(void* context);
+
+	void* context;
+} LayoutCycleBackend;
+
+// Returns the number of cycle key presses that take a window from `current`
+// to `target`, given the order the system cycles through the layouts in, or
+// -1 if either of them isn't in the cycle.
+int LayoutCycleSteps(const LayoutId* cycle, unsigned count, LayoutId current, LayoutId target);
+
+// Switches the window to `target`. The presses are sent at once, and the
+// layout is checked when it has settled or `timeout` milliseconds passed. If
+// the window ends up on another layout, for instance because its cycle isn't
+// the one given, it falls back to one press at a time, at most `count` of
+// them, each waiting for the layout to change. Returns nonzero if the window
+// has the target layout.
+int LayoutCycleSwitch(const LayoutCycleBackend* backend, const LayoutId* cycle, unsigned count,
+	LayoutId target, uint32_t timeout);
+
+// A simulated window with a virtual clock. Each press of the cycle key moves
+// it to the next layout of `cycle`, `pressLatency` milliseconds after the
+// previous one is applied. If `skip` isn't 0, it's a layout the window's
+// cycle goes past, unlike the one the switching is given.
+#define SIM_LAYOUT_MAX 16
+
+typedef struct
+{
+	LayoutId cycle[SIM_LAYOUT_MAX];
+	unsigned count;
+	unsigned current;
+	LayoutId skip;
+	uint32_t pressLatency;
+
+	uint32_t now;
+	unsigned pendingPresses;
+	uint32_t nextPressTime;
+
+	// statistics of the simulation
+	unsigned sends;
+	unsigned presses;
+	unsigned waits;
+} SimLayoutWindow;
+
+void SimLayoutWindowInit(SimLayoutWindow* sim, const LayoutId* cycle, unsigned count, unsigned current, uint32_t pressLatency);
+void SimLayoutWindowGetBackend(SimLayoutWindow* sim, LayoutCycleBackend* backend);
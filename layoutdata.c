@@ -0,0 +1,160 @@
+#include "layouttable.h"
+
+// Layout tables compiled into the program. They describe the normal and Shift
+// levels of the Windows US, Hebrew (Standard) and Russian layouts.
+
+const char g_layoutTableUS[] =
+	"name us\n"
+	"lang 0409\n"
+	"key 20 U+0020 U+0020\n"
+	"key 30 0 )\n"
+	"key 31 1 !\n"
+	"key 32 2 @\n"
+	"key 33 3 #\n"
+	"key 34 4 $\n"
+	"key 35 5 %\n"
+	"key 36 6 ^\n"
+	"key 37 7 &\n"
+	"key 38 8 *\n"
+	"key 39 9 (\n"
+	"key 41 a A\n"
+	"key 42 b B\n"
+	"key 43 c C\n"
+	"key 44 d D\n"
+	"key 45 e E\n"
+	"key 46 f F\n"
+	"key 47 g G\n"
+	"key 48 h H\n"
+	"key 49 i I\n"
+	"key 4A j J\n"
+	"key 4B k K\n"
+	"key 4C l L\n"
+	"key 4D m M\n"
+	"key 4E n N\n"
+	"key 4F o O\n"
+	"key 50 p P\n"
+	"key 51 q Q\n"
+	"key 52 r R\n"
+	"key 53 s S\n"
+	"key 54 t T\n"
+	"key 55 u U\n"
+	"key 56 v V\n"
+	"key 57 w W\n"
+	"key 58 x X\n"
+	"key 59 y Y\n"
+	"key 5A z Z\n"
+	"key BA ; :\n"
+	"key BB = +\n"
+	"key BC , <\n"
+	"key BD U+002D _\n"
+	"key BE . >\n"
+	"key BF / ?\n"
+	"key C0 ` ~\n"
+	"key DB [ {\n"
+	"key DC \\ |\n"
+	"key DD ] }\n"
+	"key DE ' \"\n";
+
+const char g_layoutTableHebrew[] =
+	"name he\n"
+	"lang 040D\n"
+	"key 20 U+0020 U+0020\n"
+	"key 30 0 (\n"
+	"key 31 1 !\n"
+	"key 32 2 @\n"
+	"key 33 3 #\n"
+	"key 34 4 $\n"
+	"key 35 5 %\n"
+	"key 36 6 ^\n"
+	"key 37 7 &\n"
+	"key 38 8 *\n"
+	"key 39 9 )\n"
+	"key 41 U+05E9 A\n"
+	"key 42 U+05E0 B\n"
+	"key 43 U+05D1 C\n"
+	"key 44 U+05D2 D\n"
+	"key 45 U+05E7 E\n"
+	"key 46 U+05DB F\n"
+	"key 47 U+05E2 G\n"
+	"key 48 U+05D9 H\n"
+	"key 49 U+05DF I\n"
+	"key 4A U+05D7 J\n"
+	"key 4B U+05DC K\n"
+	"key 4C U+05DA L\n"
+	"key 4D U+05E6 M\n"
+	"key 4E U+05DE N\n"
+	"key 4F U+05DD O\n"
+	"key 50 U+05E4 P\n"
+	"key 51 / Q\n"
+	"key 52 U+05E8 R\n"
+	"key 53 U+05D3 S\n"
+	"key 54 U+05D0 T\n"
+	"key 55 U+05D5 U\n"
+	"key 56 U+05D4 V\n"
+	"key 57 ' W\n"
+	"key 58 U+05E1 X\n"
+	"key 59 U+05D8 Y\n"
+	"key 5A U+05D6 Z\n"
+	"key BA U+05E3 :\n"
+	"key BB = +\n"
+	"key BC U+05EA >\n"
+	"key BD U+002D _\n"
+	"key BE U+05E5 <\n"
+	"key BF . ?\n"
+	"key C0 ; ~\n"
+	"key DB ] }\n"
+	"key DC \\ |\n"
+	"key DD [ {\n"
+	"key DE , \"\n";
+
+const char g_layoutTableRussian[] =
+	"name ru\n"
+	"lang 0419\n"
+	"key 20 U+0020 U+0020\n"
+	"key 30 0 )\n"
+	"key 31 1 !\n"
+	"key 32 2 \"\n"
+	"key 33 3 U+2116\n"
+	"key 34 4 ;\n"
+	"key 35 5 %\n"
+	"key 36 6 :\n"
+	"key 37 7 ?\n"
+	"key 38 8 *\n"
+	"key 39 9 (\n"
+	"key 41 U+0444 U+0424\n"
+	"key 42 U+0438 U+0418\n"
+	"key 43 U+0441 U+0421\n"
+	"key 44 U+0432 U+0412\n"
+	"key 45 U+0443 U+0423\n"
+	"key 46 U+0430 U+0410\n"
+	"key 47 U+043F U+041F\n"
+	"key 48 U+0440 U+0420\n"
+	"key 49 U+0448 U+0428\n"
+	"key 4A U+043E U+041E\n"
+	"key 4B U+043B U+041B\n"
+	"key 4C U+0434 U+0414\n"
+	"key 4D U+044C U+042C\n"
+	"key 4E U+0442 U+0422\n"
+	"key 4F U+0449 U+0429\n"
+	"key 50 U+0437 U+0417\n"
+	"key 51 U+0439 U+0419\n"
+	"key 52 U+043A U+041A\n"
+	"key 53 U+044B U+042B\n"
+	"key 54 U+0435 U+0415\n"
+	"key 55 U+0433 U+0413\n"
+	"key 56 U+043C U+041C\n"
+	"key 57 U+0446 U+0426\n"
+	"key 58 U+0447 U+0427\n"
+	"key 59 U+043D U+041D\n"
+	"key 5A U+044F U+042F\n"
+	"key BA U+0436 U+0416\n"
+	"key BB = +\n"
+	"key BC U+0431 U+0411\n"
+	"key BD U+002D _\n"
+	"key BE U+044E U+042E\n"
+	"key BF . ,\n"
+	"key C0 U+0451 U+0401\n"
+	"key DB U+0445 U+0425\n"
+	"key DC \\ /\n"
+	"key DD U+044A U+042A\n"
+	"key DE U+044D U+042D\n";
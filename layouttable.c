@@ -0,0 +1,320 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layouttable.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a character token. Returns 0 if the token isn't a character.
+static int ParseCharToken(const char* token, size_t length, LayoutChar* ch, int* dead)
+{
+	*dead = 0;
+	if(length > 1 && token[length - 1] == '!')
+	{
+		*dead = 1;
+		length--;
+	}
+
+	if(length == 1)
+	{
+		*ch = (token[0] == '-') ? 0 : (LayoutChar)(unsigned char)token[0];
+		return 1;
+	}
+
+	if(length > 2 && token[0] == 'U' && token[1] == '+')
+	{
+		char* end;
+		unsigned long value = strtoul(token + 2, &end, 16);
+		if(end != token + length || value == 0 || value > 0xFFFF)
+			return 0;
+
+		*ch = (LayoutChar)value;
+		return 1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Orders reverse index entries by character, and entries of the same
+// character by the order in which they were added
+static int CompareTableKeys(const void* first, const void* second)
+{
+	const LayoutTableKey* a = (const LayoutTableKey*)first;
+	const LayoutTableKey* b = (const LayoutTableKey*)second;
+	if(a->ch != b->ch)
+		return a->ch < b->ch ? -1 : 1;
+
+	// added by level, then by virtual key
+	int levelA = (a->key.shift & LAYOUT_SHIFT) | ((a->key.shift & LAYOUT_ALT) ? 2 : 0);
+	int levelB = (b->key.shift & LAYOUT_SHIFT) | ((b->key.shift & LAYOUT_ALT) ? 2 : 0);
+	if(levelA != levelB)
+		return levelA - levelB;
+	return a->key.vk - b->key.vk;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the index from characters to keys. A character generated by several
+// keys maps to the key at the lowest level, then to the lowest virtual key.
+static int BuildTableKeys(LayoutTable* table)
+{
+	unsigned count = 0;
+	for(unsigned vk = 0; vk < 256; vk++)
+	{
+		for(unsigned level = 0; level < LAYOUT_TABLE_LEVELS; level++)
+		{
+			if(table->chars[vk][level])
+				count++;
+		}
+	}
+
+	table->keys = (LayoutTableKey*)malloc(sizeof(LayoutTableKey) * (count ? count : 1));
+	if(!table->keys)
+		return 0;
+
+	for(unsigned vk = 0; vk < 256; vk++)
+	{
+		for(unsigned level = 0; level < LAYOUT_TABLE_LEVELS; level++)
+		{
+			if(table->chars[vk][level])
+			{
+				LayoutTableKey* entry = &table->keys[table->keyCount++];
+				entry->ch = table->chars[vk][level];
+				entry->key.vk = (uint8_t)vk;
+				entry->key.shift = (uint8_t)(((level & 1) ? LAYOUT_SHIFT : 0) |
+					((level & 2) ? LAYOUT_CONTROL | LAYOUT_ALT : 0));
+			}
+		}
+	}
+
+	qsort(table->keys, table->keyCount, sizeof(LayoutTableKey), CompareTableKeys);
+
+	// keep only the first key of every character
+	unsigned unique = 0;
+	for(unsigned i = 0; i < table->keyCount; i++)
+	{
+		if(unique == 0 || table->keys[unique - 1].ch != table->keys[i].ch)
+			table->keys[unique++] = table->keys[i];
+	}
+	table->keyCount = unique;
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a layout table from its text representation
+LayoutTable* LayoutTableParse(const char* text)
+{
+	LayoutTable* table = (LayoutTable*)calloc(1, sizeof(LayoutTable));
+	if(!table)
+		return NULL;
+
+	const char* line = text;
+	while(*line)
+	{
+		const char* lineEnd = line + strcspn(line, "\r\n");
+
+		// split the line to tokens
+		const char* tokens[2 + LAYOUT_TABLE_LEVELS];
+		size_t lengths[2 + LAYOUT_TABLE_LEVELS];
+		int tokenCount = 0;
+		const char* p = line;
+		while(p < lineEnd && tokenCount < 2 + LAYOUT_TABLE_LEVELS)
+		{
+			while(p < lineEnd && isspace((unsigned char)*p))
+				p++;
+			if(p == lineEnd)
+				break;
+
+			tokens[tokenCount] = p;
+			while(p < lineEnd && !isspace((unsigned char)*p))
+				p++;
+			lengths[tokenCount] = p - tokens[tokenCount];
+			tokenCount++;
+		}
+
+		if(tokenCount == 0 || tokens[0][0] == '#')
+		{
+			// empty line or comment
+		}
+		else if(lengths[0] == 4 && strncmp(tokens[0], "name", 4) == 0 && tokenCount == 2)
+		{
+			size_t length = lengths[1] < sizeof(table->name) - 1 ? lengths[1] : sizeof(table->name) - 1;
+			memcpy(table->name, tokens[1], length);
+			table->name[length] = '\0';
+		}
+		else if(lengths[0] == 4 && strncmp(tokens[0], "lang", 4) == 0 && tokenCount == 2)
+		{
+			table->lang = (uint16_t)strtoul(tokens[1], NULL, 16);
+		}
+		else if(lengths[0] == 3 && strncmp(tokens[0], "key", 3) == 0 && tokenCount >= 3)
+		{
+			char* end;
+			unsigned long vk = strtoul(tokens[1], &end, 16);
+			if(end != tokens[1] + lengths[1] || vk > 0xFF)
+				break;
+
+			int level;
+			for(level = 0; level < tokenCount - 2; level++)
+			{
+				int dead;
+				if(!ParseCharToken(tokens[2 + level], lengths[2 + level], &table->chars[vk][level], &dead))
+					break;
+				if(dead)
+					table->dead[vk] |= 1 << level;
+			}
+
+			if(level < tokenCount - 2)
+				break;
+		}
+		else
+		{
+			break;
+		}
+
+		line = lineEnd;
+		while(*line == '\r' || *line == '\n')
+			line++;
+	}
+
+	// stopped before the end of the text because of a malformed line
+	if(*line || !BuildTableKeys(table))
+	{
+		LayoutTableFree(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loads a layout table from a text file
+LayoutTable* LayoutTableLoad(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if(!file)
+		return NULL;
+
+	LayoutTable* table = NULL;
+	if(fseek(file, 0, SEEK_END) == 0)
+	{
+		long size = ftell(file);
+		char* text = (size >= 0) ? (char*)malloc(size + 1) : NULL;
+		if(text)
+		{
+			rewind(file);
+			if(fread(text, 1, size, file) == (size_t)size)
+			{
+				text[size] = '\0';
+				table = LayoutTableParse(text);
+			}
+			free(text);
+		}
+	}
+
+	fclose(file);
+	return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses one of the compiled-in layout tables
+LayoutTable* LayoutTableLoadBuiltin(const char* name)
+{
+	if(strcmp(name, "us") == 0)
+		return LayoutTableParse(g_layoutTableUS);
+	if(strcmp(name, "he") == 0)
+		return LayoutTableParse(g_layoutTableHebrew);
+	if(strcmp(name, "ru") == 0)
+		return LayoutTableParse(g_layoutTableRussian);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees a layout table
+void LayoutTableFree(LayoutTable* table)
+{
+	if(table)
+	{
+		free(table->keys);
+		free(table);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.CharToKey for layout tables
+static int TableCharToKey(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key)
+{
+	const LayoutTable* table = (const LayoutTable*)layout;
+	(void)context;
+
+	unsigned low = 0, high = table->keyCount;
+	while(low < high)
+	{
+		unsigned middle = (low + high) / 2;
+		if(table->keys[middle].ch < ch)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if(low == table->keyCount || table->keys[low].ch != ch)
+		return 0;
+
+	*key = table->keys[low].key;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.KeyToChars for layout tables
+static int TableKeyToChars(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size)
+{
+	const LayoutTable* table = (const LayoutTable*)layout;
+	(void)context;
+
+	// the table only has the Shift and AltGr (Ctrl+Alt) levels
+	int level;
+	switch(key.shift & (LAYOUT_CONTROL | LAYOUT_ALT))
+	{
+	case 0:
+		level = 0;
+		break;
+	case LAYOUT_CONTROL | LAYOUT_ALT:
+		level = 2;
+		break;
+	default:
+		return 0;
+	}
+
+	if(key.shift & LAYOUT_SHIFT)
+		level++;
+
+	LayoutChar ch = table->chars[key.vk][level];
+	if(!ch || size < 1)
+		return 0;
+
+	buffer[0] = ch;
+	return (table->dead[key.vk] & (1 << level)) ? -1 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.GetLanguage for layout tables
+static uint16_t TableGetLanguage(void* context, LayoutId layout)
+{
+	(void)context;
+	return ((const LayoutTable*)layout)->lang;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a provider for layout tables
+void LayoutTableGetProvider(LayoutProvider* provider)
+{
+	memset(provider, 0, sizeof(LayoutProvider));
+	provider->CharToKey = TableCharToKey;
+	provider->KeyToChars = TableKeyToChars;
+	provider->GetLanguage = TableGetLanguage;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Keyboard layouts described by tables of the characters their keys generate.
+//
+// A layout table is loaded from text with one line per key:
+//
+//     name <name>
+//     lang <LANGID in hex>
+//     key <virtual key in hex> <normal> <Shift> [<AltGr> <Shift+AltGr>]
+//
+// A character is written as itself if it's a single ASCII character, or as
+// U+XXXX otherwise. "-" stands for no character and a "!" suffix marks a dead
+// key. Lines starting with "#" are comments. The virtual key codes are the
+// Windows ones, so tables can be generated for any platform's layouts (for
+// example from XKB symbol files) and used wherever the conversion runs.
+
+#include "layoutcore.h"
+
+// Number of shift levels in a layout table: normal, Shift, AltGr and Shift+AltGr
+#define LAYOUT_TABLE_LEVELS 4
+
+typedef struct
+{
+	LayoutChar ch;
+	LayoutKey key;
+} LayoutTableKey;
+
+typedef struct
+{
+	char name[32];
+	uint16_t lang;
+	LayoutChar chars[256][LAYOUT_TABLE_LEVELS];
+	uint8_t dead[256];          // bit N set if the key is a dead key at level N
+	LayoutTableKey* keys;       // the key of every character, sorted by character
+	unsigned keyCount;
+} LayoutTable;
+
+// Parses a layout table from text. Returns NULL if the text is malformed.
+LayoutTable* LayoutTableParse(const char* text);
+
+// Loads a layout table from a file. Returns NULL on failure.
+LayoutTable* LayoutTableLoad(const char* path);
+
+// Returns one of the tables that are compiled into the program ("us", "he"
+// or "ru"), or NULL if there's no table with that name.
+LayoutTable* LayoutTableLoadBuiltin(const char* name);
+
+void LayoutTableFree(LayoutTable* table);
+
+// Fills `provider` with a provider whose layouts are layout tables,
+// identified by LayoutTableId
+void LayoutTableGetProvider(LayoutProvider* provider);
+
+#define LayoutTableId(table) ((LayoutId)(const LayoutTable*)(table))
+
+// Text of the compiled-in tables, in layoutdata.c
+extern const char g_layoutTableUS[];
+extern const char g_layoutTableHebrew[];
+extern const char g_layoutTableRussian[];
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <string.h>
+#include "parallelconvert.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// The text is split into a few chunks per thread, so that threads that finish
+// early can take over chunks from the others
+#define CHUNKS_PER_THREAD 4
+#define MAX_CHUNKS (PARALLEL_MAX_THREADS * CHUNKS_PER_THREAD)
+
+// The translation tables are filled in on the calling thread before the
+// chunks are converted, for the pages of the characters at the start of the
+// text. Chunks that stop at characters of other pages continue in another
+// pass once their pages are filled in as well.
+#define PREPARE_SAMPLE_LENGTH 4096
+
+// Maximal number of passes over the chunks before giving up on them
+#define MAX_PASSES 16
+
+#define IS_HIGH_HALF(ch) ((ch) >= 0xD800 && (ch) <= 0xDBFF)
+#define IS_LOW_HALF(ch)  ((ch) >= 0xDC00 && (ch) <= 0xDFFF)
+
+///////////////////////////////////////////////////////////////////////////////
+// The threads, counting semaphores and atomic counter the workers use, on
+// Windows and on POSIX systems
+
+#ifdef _WIN32
+
+typedef HANDLE ParallelThread;
+typedef HANDLE ParallelSemaphore;
+typedef volatile LONG ParallelCounter;
+
+#define ParallelIncrement(counter) InterlockedIncrement(counter)
+
+static int SemaphoreInit(ParallelSemaphore* semaphore)
+{
+	*semaphore = CreateSemaphore(NULL, 0, PARALLEL_MAX_THREADS, NULL);
+	return *semaphore != NULL;
+}
+
+static void SemaphoreDestroy(ParallelSemaphore* semaphore)
+{
+	CloseHandle(*semaphore);
+}
+
+static void SemaphoreRelease(ParallelSemaphore* semaphore, unsigned count)
+{
+	ReleaseSemaphore(*semaphore, count, NULL);
+}
+
+static void SemaphoreWait(ParallelSemaphore* semaphore)
+{
+	WaitForSingleObject(*semaphore, INFINITE);
+}
+
+static DWORD WINAPI ParallelWorkerThread(LPVOID pParameter);
+
+static int ThreadStart(ParallelThread* thread)
+{
+	*thread = CreateThread(NULL, 0, ParallelWorkerThread, NULL, 0, NULL);
+	return *thread != NULL;
+}
+
+static void ThreadJoin(ParallelThread* thread)
+{
+	WaitForSingleObject(*thread, INFINITE);
+	CloseHandle(*thread);
+}
+
+static unsigned ProcessorCount()
+{
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	return systemInfo.dwNumberOfProcessors;
+}
+
+#else
+
+typedef pthread_t ParallelThread;
+typedef volatile long ParallelCounter;
+
+// POSIX semaphores aren't on every system, so it's a mutex and a condition
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned count;
+} ParallelSemaphore;
+
+#define ParallelIncrement(counter) __atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST)
+
+static int SemaphoreInit(ParallelSemaphore* semaphore)
+{
+	semaphore->count = 0;
+	if(pthread_mutex_init(&semaphore->mutex, NULL) != 0)
+		return 0;
+
+	if(pthread_cond_init(&semaphore->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&semaphore->mutex);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void SemaphoreDestroy(ParallelSemaphore* semaphore)
+{
+	pthread_cond_destroy(&semaphore->cond);
+	pthread_mutex_destroy(&semaphore->mutex);
+}
+
+static void SemaphoreRelease(ParallelSemaphore* semaphore, unsigned count)
+{
+	pthread_mutex_lock(&semaphore->mutex);
+	semaphore->count += count;
+	pthread_cond_broadcast(&semaphore->cond);
+	pthread_mutex_unlock(&semaphore->mutex);
+}
+
+static void SemaphoreWait(ParallelSemaphore* semaphore)
+{
+	pthread_mutex_lock(&semaphore->mutex);
+	while(semaphore->count == 0)
+		pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+	semaphore->count--;
+	pthread_mutex_unlock(&semaphore->mutex);
+}
+
+static void* ParallelWorkerThread(void* parameter);
+
+static int ThreadStart(ParallelThread* thread)
+{
+	return pthread_create(thread, NULL, ParallelWorkerThread, NULL) == 0;
+}
+
+static void ThreadJoin(ParallelThread* thread)
+{
+	pthread_join(*thread, NULL);
+}
+
+static unsigned ProcessorCount()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (unsigned)count : 1;
+}
+
+#endif
+
+// A text converted in parallel
+typedef struct
+{
+	LayoutCore* core;
+	LayoutPairTable* table;
+	const LayoutChar* str;
+	LayoutChar* buffer;
+	size_t chunkStart[MAX_CHUNKS + 1];
+	size_t chunkPosition[MAX_CHUNKS];   // where the conversion of each chunk stopped
+	long chunkCount;
+
+	ParallelCounter nextChunk;
+	ParallelSemaphore workersDone;      // released by each worker that finished the pass
+} ParallelJob;
+
+static ParallelThread g_workers[PARALLEL_MAX_THREADS - 1];
+static unsigned g_workerCount;
+static ParallelSemaphore g_workSemaphore;
+static int g_bWorkSemaphoreCreated;
+static ParallelJob* volatile g_pJob;
+static volatile int g_bShutdown;
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs a pass on chunks of the job until there are no chunks left
+static void RunChunks(ParallelJob* job)
+{
+	for(;;)
+	{
+		long chunk = ParallelIncrement(&job->nextChunk) - 1;
+		if(chunk >= job->chunkCount)
+			break;
+
+		size_t position = job->chunkPosition[chunk];
+		size_t length = job->chunkStart[chunk + 1] - position;
+		if(length > 0)
+		{
+			job->chunkPosition[chunk] += LayoutCoreConvertPrepared(job->core, job->table,
+				job->str + position, length, job->buffer + position);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs passes whenever the semaphore is released for the worker, until
+// shutdown
+static void RunWorker()
+{
+	for(;;)
+	{
+		SemaphoreWait(&g_workSemaphore);
+		if(g_bShutdown)
+			break;
+
+		ParallelJob* job = g_pJob;
+		RunChunks(job);
+		SemaphoreRelease(&job->workersDone, 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Worker thread
+#ifdef _WIN32
+static DWORD WINAPI ParallelWorkerThread(LPVOID pParameter)
+{
+	UNREFERENCED_PARAMETER(pParameter);
+	RunWorker();
+	return 0;
+}
+#else
+static void* ParallelWorkerThread(void* parameter)
+{
+	(void)parameter;
+	RunWorker();
+	return NULL;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Makes sure there are `count` worker threads, if possible.
+// Returns the number of worker threads.
+static unsigned StartWorkers(unsigned count)
+{
+	if(!g_bWorkSemaphoreCreated)
+	{
+		if(!SemaphoreInit(&g_workSemaphore))
+			return 0;
+		g_bWorkSemaphoreCreated = 1;
+	}
+
+	while(g_workerCount < count)
+	{
+		if(!ThreadStart(&g_workers[g_workerCount]))
+			break;
+
+		g_workerCount++;
+	}
+
+	return g_workerCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs a pass of the job on the calling thread and `workerCount` workers, and
+// waits until all of them are done
+static void RunPass(ParallelJob* job, unsigned workerCount)
+{
+	job->nextChunk = 0;
+	g_pJob = job;
+
+	SemaphoreRelease(&g_workSemaphore, workerCount);
+	RunChunks(job);
+
+	for(unsigned i = 0; i < workerCount; i++)
+		SemaphoreWait(&job->workersDone);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text on the calling thread
+static int ConvertOnThisThread(LayoutCore* core, const LayoutChar* str, size_t length, LayoutOutput* output,
+	LayoutId source, LayoutId target)
+{
+	LayoutConverter converter;
+	LayoutConverterInit(&converter, core, source, target);
+
+	return LayoutConverterPut(&converter, str, length, output) &&
+		LayoutConverterFinish(&converter, output);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts a text, splitting large texts between several threads.
+//
+// Only characters that convert to a single character are converted in
+// parallel, so each chunk's output goes to the same offset as its input. If
+// any chunk has other characters (dead keys, keys that generate several
+// characters, surrogate pairs) or characters that can't be converted, the
+// whole text is converted again on the calling thread, which handles them.
+// The chunks are never split inside a surrogate pair, though a pair would
+// send the text to the calling thread anyway.
+int ParallelConvertText(LayoutCore* core, const LayoutChar* str, size_t length, LayoutOutput* output,
+	LayoutId source, LayoutId target, unsigned threadCount)
+{
+	if(threadCount == 0)
+		threadCount = ProcessorCount();
+
+	if(threadCount > PARALLEL_MAX_THREADS)
+		threadCount = PARALLEL_MAX_THREADS;
+
+	if(length < PARALLEL_CONVERT_THRESHOLD || threadCount < 2)
+		return ConvertOnThisThread(core, str, length, output, source, target);
+
+	unsigned workerCount = StartWorkers(threadCount - 1);
+	if(workerCount > threadCount - 1)
+		workerCount = threadCount - 1;
+
+	// the output has to fit the whole text up front, since the chunks are written to it at once
+	size_t start = output->length;
+	if(workerCount == 0 || (output->capacity - start < length + 1 &&
+		!(output->Grow && output->Grow(output, start + length + 1))))
+		return ConvertOnThisThread(core, str, length, output, source, target);
+
+	ParallelJob* job = (ParallelJob*)malloc(sizeof(ParallelJob));
+	if(!job)
+		return ConvertOnThisThread(core, str, length, output, source, target);
+
+	memset(job, 0, sizeof(ParallelJob));
+	if(!SemaphoreInit(&job->workersDone))
+	{
+		free(job);
+		return ConvertOnThisThread(core, str, length, output, source, target);
+	}
+
+	job->core = core;
+	job->str = str;
+	job->buffer = output->buffer + start;
+	job->chunkCount = (long)((workerCount + 1) * CHUNKS_PER_THREAD);
+	for(long i = 0; i < job->chunkCount; i++)
+	{
+		size_t chunkStart = length / job->chunkCount * i;
+		while(chunkStart > 0 && chunkStart < length && IS_LOW_HALF(str[chunkStart]))
+			chunkStart++;
+		job->chunkStart[i] = chunkStart;
+		job->chunkPosition[i] = chunkStart;
+	}
+	job->chunkStart[job->chunkCount] = length;
+
+	LayoutPageSet preparedPages, pages;
+	memset(&preparedPages, 0, sizeof(LayoutPageSet));
+	memset(&pages, 0, sizeof(LayoutPageSet));
+	LayoutPageSetAddString(&pages, str, length < PREPARE_SAMPLE_LENGTH ? length : PREPARE_SAMPLE_LENGTH);
+
+	int bSucceeded = 0;
+	for(int pass = 0; pass < MAX_PASSES; pass++)
+	{
+		job->table = LayoutCorePrepare(core, source, target, &pages);
+		if(!job->table)
+			break;
+
+		for(size_t i = 0; i < sizeof(pages.bits) / sizeof(pages.bits[0]); i++)
+			preparedPages.bits[i] |= pages.bits[i];
+
+		RunPass(job, workerCount);
+
+		// find the pages of the characters the chunks stopped at. If they're
+		// all prepared already, the characters can only be converted on the
+		// calling thread.
+		int bStopped = 0, bNewPages = 0;
+		memset(&pages, 0, sizeof(LayoutPageSet));
+		for(long i = 0; i < job->chunkCount; i++)
+		{
+			size_t position = job->chunkPosition[i];
+			size_t end = job->chunkStart[i + 1];
+			if(position == end)
+				continue;
+
+			// a SIMD table is looked up for a group of 16 characters
+			bStopped = 1;
+			LayoutPageSetAddString(&pages, str + position, end - position < 16 ? end - position : 16);
+		}
+
+		for(size_t i = 0; i < sizeof(pages.bits) / sizeof(pages.bits[0]); i++)
+		{
+			if(pages.bits[i] & ~preparedPages.bits[i])
+				bNewPages = 1;
+		}
+
+		if(!bStopped || !bNewPages)
+		{
+			bSucceeded = !bStopped;
+			break;
+		}
+	}
+
+	SemaphoreDestroy(&job->workersDone);
+	free(job);
+
+	if(!bSucceeded)
+	{
+		output->length = start;
+		return ConvertOnThisThread(core, str, length, output, source, target);
+	}
+
+	output->length = start + length;
+	output->buffer[output->length] = 0;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stops the worker threads and waits for them to exit
+void ParallelConvertShutdown()
+{
+	if(g_workerCount > 0)
+	{
+		g_bShutdown = 1;
+		SemaphoreRelease(&g_workSemaphore, g_workerCount);
+
+		for(unsigned i = 0; i < g_workerCount; i++)
+			ThreadJoin(&g_workers[i]);
+		g_workerCount = 0;
+		g_bShutdown = 0;
+	}
+
+	if(g_bWorkSemaphoreCreated)
+	{
+		SemaphoreDestroy(&g_workSemaphore);
+		g_bWorkSemaphoreCreated = 0;
+	}
+}
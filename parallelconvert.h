@@ -0,0 +1,24 @@
+#pragma once
+
+// Conversion of large texts on several threads. This file and
+// parallelconvert.c only depend on the C runtime and the threads of the
+// platform (Windows threads, or POSIX threads elsewhere).
+
+#include "layoutcore.h"
+
+// Texts shorter than this many characters are converted on the calling thread
+#define PARALLEL_CONVERT_THRESHOLD (256 * 1024)
+
+// Maximal number of threads that convert a text, the calling thread included
+#define PARALLEL_MAX_THREADS 8
+
+// Converts `length` characters of `str` like LayoutConverter does, appending
+// them to `output` and terminating it with a NUL. Texts of at least
+// PARALLEL_CONVERT_THRESHOLD characters are split into chunks which are
+// converted straight into the output by `threadCount` threads (0 for one per
+// processor). The result is the same as converting on a single thread.
+int ParallelConvertText(LayoutCore* core, const LayoutChar* str, size_t length, LayoutOutput* output,
+	LayoutId source, LayoutId target, unsigned threadCount);
+
+// Stops the worker threads
+void ParallelConvertShutdown();
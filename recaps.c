@@ -26,6 +26,16 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "trayicon.h"
 #include "fixlayouts.h"
 #include "utils.h"
+#include "benchmark.h"
+#include "parallelconvert.h"
+#include "clipthread.h"
+#include "hookstate.h"
+#include "actionqueue.h"
+#include "stats.h"
+#include "layoutcycle.h"
+#include "focuscache.h"
+#include "windowcompat.h"
+#include "configwriter.h"
 
 #define HELP_MESSAGE \
 	L"Recaps allows you to quickly switch the current\n"\
@@ -35,6 +45,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 	L"Alt+Capslock changes the chosen pair of keyboard languages.\n"\
 	L"Ctrl+Capslock fixes text you typed in the wrong laguange.\n"\
 	L"* If both Ctrl keys (left and right) are pressed, only the selected text will be fixed.\n"\
+	L"Ctrl+Shift+Capslock undoes the last fix, and each press after it tries the next language.\n"\
 	L"Shift+Capslock is the old Capslock that lets you type in CAPITAL.\n"\
 	L"\n"\
 	L"http://www.gooli.org/blog/recaps\n\n"\
@@ -59,57 +70,94 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define ID_EXIT              2001
 #define ID_MAIN_LANG         2002
 #define ID_LANG              (2002 + MAX_LAYOUTS)
+#define ID_STATISTICS        (ID_LANG + MAX_LAYOUTS)
+#define ID_EXPORT_STATISTICS (ID_STATISTICS + 1)
 
-// Custom messages
-#define APPWM_LANG_ACTION    (WM_APP + 1)
+// Interval in milliseconds at which the keyboard hook thread checks that its
+// modifier key states match the system's, in case it missed key events
+#define HOOK_RESYNC_INTERVAL 1000
 
-typedef enum
-{
-	LANG_ACTION_NONE,
-	LANG_ACTION_SWITCH_LAYOUT,
-	LANG_ACTION_SWITCH_PAIR,
-	LANG_ACTION_CONVERT_ALL_TEXT,
-	LANG_ACTION_CONVERT_SELECTED_TEXT,
-} LangAction;
+// How long in milliseconds to wait for the Alt+Shift presses sent to a window
+// to change its layout, and how often to check it meanwhile
+#define LAYOUT_SWITCH_TIMEOUT       300
+#define LAYOUT_SWITCH_POLL_INTERVAL 10
 
+// The installed keyboard layouts. The names are loaded when they're first
+// needed and interned in a single arena, where `nameOffsets` point, and the
+// arrays are sized to the layout count.
 typedef struct
 {
-	WCHAR names[MAX_LAYOUTS][MAXLEN];
-	HKL   hkls[MAX_LAYOUTS];
-	UINT  count;
-	UINT  main;
-	UINT  paired;
+	WCHAR* nameArena;
+	UINT*  nameOffsets;
+	HKL*   hkls;
+	UINT   count;
+	UINT   main;
+	UINT   paired;
 } KeyboardLayoutInfo;
 
+#define LAYOUT_NAME(info, i) ((info)->nameArena ? (info)->nameArena + (info)->nameOffsets[i] : L"")
+
+// The identifier a layout is stored in the configuration file by
+#define LAYOUT_CONFIG_ID(hkl) ((uint32_t)(UINT_PTR)(hkl))
+
+// The configuration file, in the application data folder
+#define CONFIG_FOLDER    L"\\Recaps"
+#define CONFIG_FILE_NAME L"\\recaps.cfg"
+
 KeyboardLayoutInfo g_keyboardInfo;
+CRITICAL_SECTION g_csKeyboardInfo; // guards the main and paired layouts, which both the main and worker threads change
 BOOL g_bShowTrayIcon;
 BOOL g_bModalShown;
 HHOOK g_hKeyboardHook;
+HHOOK g_hMouseHook;
+HWINEVENTHOOK g_hUndoFocusHook;
+HWINEVENTHOOK g_hUndoCaretHook;
 UINT g_uTaskbarRestart;
 HWND g_hMainWnd;
 HANDLE g_hKeyboardHookThread;
 DWORD g_dwKeyboardThreadId;
+DWORD g_dwKeyboardHookError;
+HookState g_hookState;
+HANDLE g_hActionWorkerThread;
+HANDLE g_hActionWorkerQuitEvent;
+HANDLE g_hWarmUpThread;
+FileConfigStore g_configFile;
+ConfigStore g_configStore;
 
 LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 int OnTrayIcon(HWND hWnd, WPARAM wParam, LPARAM lParam);
 int OnCommand(HWND hWnd, WORD wID, HWND hCtl);
 BOOL ShowPopupMenu(HWND hWnd);
+void OnLangAction(LangAction action, UINT count);
 
 void GetKeyboardLayouts(KeyboardLayoutInfo* info);
+BOOL LoadLayoutNames(KeyboardLayoutInfo* info);
+void FreeKeyboardLayouts(KeyboardLayoutInfo* info);
+void InitConfigStore();
 void LoadConfiguration(KeyboardLayoutInfo* info);
 void SaveConfiguration(const KeyboardLayoutInfo* info);
 
 HWND RemoteGetFocus();
 HKL GetWindowLayout(HWND hWnd);
 HKL GetCurrentLayout();
+void GetWin32LayoutCycleBackend(LayoutCycleBackend* backend, HWND hWnd);
 HKL SwitchLayout(HWND hWnd, HKL hkl);
 HKL SwitchToPairedLayout();
-HKL SwitchPair();
+HKL SwitchPair(UINT steps);
 void SwitchAndConvert(BOOL bOnlySelected);
+void UndoConversion();
 BOOL KeyboardHookInit();
 void KeyboardHookUninit();
 DWORD WINAPI KeyboardHookThread(LPVOID pParameter);
 LRESULT CALLBACK LowLevelKeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam);
+LRESULT CALLBACK LowLevelMouseHookProc(int nCode, WPARAM wParam, LPARAM lParam);
+void CALLBACK UndoEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+	LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime);
+void SyncHookModifiers();
+BOOL ActionWorkerInit();
+void ActionWorkerUninit();
+DWORD WINAPI ActionWorkerThread(LPVOID pParameter);
+DWORD WINAPI WarmUpThread(LPVOID pParameter);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Program's entry point
@@ -120,6 +168,14 @@ int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmd
 	UNREFERENCED_PARAMETER(lpCmdLine);
 	UNREFERENCED_PARAMETER(nCmdShow);
 
+	// Measure the conversion speed instead of running normally
+	if(DoesCmdLineSwitchExists(L"-benchmark"))
+		return RunBenchmark();
+
+	// Write the key tables of the layouts for all users, as an administrator
+	if(DoesCmdLineSwitchExists(L"-install_layout_cache"))
+		return LayoutCacheInstallShared() ? 0 : 1;
+
 	// Prevent from two copies of Recaps from running at the same time
 	HANDLE mutex = CreateMutex(NULL, FALSE, MUTEX);
 	DWORD result = WaitForSingleObject(mutex, 0);
@@ -131,9 +187,32 @@ int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmd
 	}
 
 	// Initialize
+	StatsInit();
+	InitializeCriticalSection(&g_csKeyboardInfo);
+
+	// Set hook to capture CapsLock first, so presses are queued while the
+	// rest starts up. The queue carries them from the hook to the worker.
+	ActionQueueInit();
+	if(!KeyboardHookInit())
+	{
+		ShowError(L"Failed to install the keyboard hook.");
+		ActionQueueUninit();
+		DeleteCriticalSection(&g_csKeyboardInfo);
+		CloseHandle(mutex);
+		return 1;
+	}
+	StatsMarkStartup(STAT_STARTUP_HOOK_READY);
+
 	GetKeyboardLayouts(&g_keyboardInfo);
+	InitConfigStore();
 	LoadConfiguration(&g_keyboardInfo);
+	ConfigWriterInit(&g_configStore);
 	g_bShowTrayIcon = !DoesCmdLineSwitchExists(L"-no_icon");
+	StatsMarkMemory();
+
+#ifdef _DEBUG
+	PrintMemoryUsage("After initialization");
+#endif
 
 	// Create a fake window to listen to events
 	WNDCLASSEX wclx = { 0 };
@@ -153,8 +232,23 @@ int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmd
 	}
 
 	// Clean up
+	if(DoesCmdLineSwitchExists(L"-export_stats"))
+		StatsExport(NULL, 0);
+
 	UnregisterClass(WINDOWCLASS_NAME, hInstance);
 	SaveConfiguration(&g_keyboardInfo);
+	ConfigWriterUninit();
+	if(g_hWarmUpThread)
+	{
+		WaitForSingleObject(g_hWarmUpThread, INFINITE);
+		CloseHandle(g_hWarmUpThread);
+	}
+	FreeKeyboardLayouts(&g_keyboardInfo);
+	ParallelConvertShutdown();
+	LayoutCacheFree();
+	ConversionUndoFree();
+	ActionQueueUninit();
+	DeleteCriticalSection(&g_csKeyboardInfo);
 	CloseHandle(mutex);
 
 	return 0;
@@ -167,14 +261,28 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 	switch(uMsg)
 	{
 	case WM_CREATE:
+		// Decide how to switch the layout of each app
+		WindowCompatInit();
+
+		// Follow the focused window and its layout
+		FocusCacheInit(g_keyboardInfo.hkls, g_keyboardInfo.count);
+
+		// Listen for clipboard changes, to know when the selected text is copied
+		ClipboardThreadInit();
+
+		// Start the worker that runs the actions of the hook
+		ActionWorkerInit();
+
 		g_uTaskbarRestart = RegisterWindowMessage(L"TaskbarCreated");
 		if(g_bShowTrayIcon)
 		{
 			AddTrayIcon(hWnd, 0, APPWM_TRAYICON, IDI_MAINFRAME, TITLE);
 		}
 
-		// Set hook to capture CapsLock
-		KeyboardHookInit();
+		// Build the conversion tables in the background
+		g_hWarmUpThread = CreateThread(NULL, 0, WarmUpThread, NULL, 0, NULL);
+		if(g_hWarmUpThread)
+			SetThreadPriority(g_hWarmUpThread, THREAD_PRIORITY_BELOW_NORMAL);
 		return 0;
 
 	case APPWM_TRAYICON:
@@ -193,30 +301,13 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 			RemoveTrayIcon(hWnd, 0);
 		}
 		KeyboardHookUninit();
+		ActionWorkerUninit();
+		FocusCacheUninit();
+		WindowCompatUninit();
+		ClipboardThreadUninit();
 		PostQuitMessage(0);
 		return 0;
 
-	case APPWM_LANG_ACTION:
-		switch(wParam)
-		{
-		case LANG_ACTION_SWITCH_LAYOUT:
-			SwitchToPairedLayout();
-			break;
-
-		case LANG_ACTION_SWITCH_PAIR:
-			SwitchPair();
-			break;
-
-		case LANG_ACTION_CONVERT_ALL_TEXT:
-			SwitchAndConvert(FALSE);
-			break;
-
-		case LANG_ACTION_CONVERT_SELECTED_TEXT:
-			SwitchAndConvert(TRUE);
-			break;
-		}
-		return 0;
-
 	default:
 		if(uMsg == g_uTaskbarRestart)
 		{
@@ -231,6 +322,38 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Runs an action from the keyboard hook, on the action worker thread.
+// `count` is the number of pair switches folded into one.
+void OnLangAction(LangAction action, UINT count)
+{
+	switch(action)
+	{
+	case LANG_ACTION_SWITCH_LAYOUT:
+		SwitchToPairedLayout();
+		break;
+
+	case LANG_ACTION_SWITCH_PAIR:
+		SwitchPair(count);
+		break;
+
+	case LANG_ACTION_CONVERT_ALL_TEXT:
+		SwitchAndConvert(FALSE);
+		break;
+
+	case LANG_ACTION_CONVERT_SELECTED_TEXT:
+		SwitchAndConvert(TRUE);
+		break;
+
+	case LANG_ACTION_UNDO_CONVERSION:
+		UndoConversion();
+		break;
+
+	default:
+		break;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Create and display a popup menu when the user right-clicks on the icon
 int OnTrayIcon(HWND hWnd, WPARAM wParam, LPARAM lParam)
@@ -265,19 +388,38 @@ int OnCommand(HWND hWnd, WORD wID, HWND hCtl)
 	{
 		MessageBox(NULL, HELP_MESSAGE, HELP_TITLE, MB_OK | MB_ICONINFORMATION);
 	}
+	else if(wID == ID_STATISTICS)
+	{
+		WCHAR report[2048];
+		StatsFormatReport(report, _countof(report));
+		MessageBox(NULL, report, L"Recaps Statistics", MB_OK | MB_ICONINFORMATION);
+	}
+	else if(wID == ID_EXPORT_STATISTICS)
+	{
+		WCHAR path[MAX_PATH];
+		if(StatsExport(path, _countof(path)))
+			ShellExecute(NULL, L"open", path, NULL, NULL, SW_SHOWNORMAL);
+		else
+			ShowError(L"Failed to export the statistics.");
+	}
 	else if(wID >= ID_MAIN_LANG && wID < ID_MAIN_LANG + MAX_LAYOUTS)
 	{
 		UINT newMainLayout = wID - ID_MAIN_LANG;
+
+		EnterCriticalSection(&g_csKeyboardInfo);
 		if(newMainLayout == g_keyboardInfo.paired)
 			g_keyboardInfo.paired = g_keyboardInfo.main;
 
 		g_keyboardInfo.main = newMainLayout;
 		SaveConfiguration(&g_keyboardInfo);
+		LeaveCriticalSection(&g_csKeyboardInfo);
 	}
 	else if(wID >= ID_LANG && wID < ID_LANG + MAX_LAYOUTS)
 	{
+		EnterCriticalSection(&g_csKeyboardInfo);
 		g_keyboardInfo.paired = wID - ID_LANG;
 		SaveConfiguration(&g_keyboardInfo);
+		LeaveCriticalSection(&g_csKeyboardInfo);
 	}
 
 	return 0;
@@ -287,13 +429,16 @@ int OnCommand(HWND hWnd, WORD wID, HWND hCtl)
 // Create and display a popup menu when the user right-clicks on the icon
 BOOL ShowPopupMenu(HWND hWnd)
 {
+	EnterCriticalSection(&g_csKeyboardInfo);
+	LoadLayoutNames(&g_keyboardInfo);
+
 	// Create a submenu for the main locale
 	HMENU hMainLocalePop = CreatePopupMenu();
 
 	// Add items for the languages
 	for(UINT layout = 0; layout < g_keyboardInfo.count; layout++)
 	{
-		AppendMenu(hMainLocalePop, MF_STRING, ID_MAIN_LANG + layout, g_keyboardInfo.names[layout]);
+		AppendMenu(hMainLocalePop, MF_STRING, ID_MAIN_LANG + layout, LAYOUT_NAME(&g_keyboardInfo, layout));
 	}
 
 	// Check the main language
@@ -315,7 +460,7 @@ BOOL ShowPopupMenu(HWND hWnd)
 
 		WCHAR szBuffer[MAXLEN * 2 + 16];
 		swprintf_s(szBuffer, sizeof(szBuffer) / sizeof(WCHAR), L"%s <=> %s",
-			g_keyboardInfo.names[g_keyboardInfo.main], g_keyboardInfo.names[layout]);
+			LAYOUT_NAME(&g_keyboardInfo, g_keyboardInfo.main), LAYOUT_NAME(&g_keyboardInfo, layout));
 
 		AppendMenu(hPop, MF_STRING, ID_LANG + layout, szBuffer);
 	}
@@ -324,9 +469,14 @@ BOOL ShowPopupMenu(HWND hWnd)
 	CheckMenuRadioItem(hPop, ID_LANG, ID_LANG + g_keyboardInfo.count - 1, 
 		ID_LANG + g_keyboardInfo.paired, MF_BYCOMMAND);
 
+	AppendMenu(hPop, MF_SEPARATOR, 0, NULL);
+	AppendMenu(hPop, MF_STRING, ID_STATISTICS, L"Statistics...");
+	AppendMenu(hPop, MF_STRING, ID_EXPORT_STATISTICS, L"Export statistics");
 	AppendMenu(hPop, MF_SEPARATOR, 0, NULL);
 	AppendMenu(hPop, MF_STRING, ID_EXIT, L"Exit");
 
+	LeaveCriticalSection(&g_csKeyboardInfo);
+
 	// Show the menu
 
 	// See http://support.microsoft.com/kb/135788 for the reasons 
@@ -352,18 +502,26 @@ BOOL ShowPopupMenu(HWND hWnd)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Fills ``info`` with the currently installed keyboard layouts
-// Based on http://blogs.msdn.com/michkap/archive/2004/12/05/275231.aspx.
+// Fills ``info`` with the currently installed keyboard layouts. Their names
+// are only loaded when they're needed, by LoadLayoutNames.
 void GetKeyboardLayouts(KeyboardLayoutInfo* info)
 {
 	BOOL mainWasChosen = FALSE;
-	memset(info, 0, sizeof(KeyboardLayoutInfo));
-	info->count = GetKeyboardLayoutList(MAX_LAYOUTS, info->hkls);
+	FreeKeyboardLayouts(info);
+
+	UINT count = GetKeyboardLayoutList(0, NULL);
+	if(count > MAX_LAYOUTS)
+		count = MAX_LAYOUTS;
+
+	info->hkls = (HKL*)malloc(sizeof(HKL) * max(count, 1));
+	if(!info->hkls)
+		return;
+
+	info->count = GetKeyboardLayoutList(count, info->hkls);
+
 	for(UINT i = 0; i < info->count; i++)
 	{
 		LANGID language = LOWORD(info->hkls[i]);
-		LCID locale = MAKELCID(language, SORT_DEFAULT);
-		GetLocaleInfo(locale, LOCALE_SLANGUAGE, info->names[i], MAXLEN);
 
 		// Prefer English as the default main language
 		if(!mainWasChosen && language == MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US))
@@ -377,94 +535,234 @@ void GetKeyboardLayouts(KeyboardLayoutInfo* info)
 
 	if(!mainWasChosen && info->count >= 2)
 		info->paired = 1;
+
+	// Drop cached translation tables of layouts that were removed
+	LayoutCacheSync(info->hkls, info->count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loads the names of the layouts in ``info`` if they aren't loaded yet. The
+// caller has to hold g_csKeyboardInfo once other threads are running.
+// Based on http://blogs.msdn.com/michkap/archive/2004/12/05/275231.aspx.
+BOOL LoadLayoutNames(KeyboardLayoutInfo* info)
+{
+	if(info->nameArena || info->count == 0)
+		return info->nameArena != NULL;
+
+	info->nameOffsets = (UINT*)malloc(sizeof(UINT) * info->count);
+	if(!info->nameOffsets)
+		return FALSE;
+
+	WCHAR* arena = NULL;
+	UINT arenaSize = 0;
+	UINT arenaCapacity = 0;
+	for(UINT i = 0; i < info->count; i++)
+	{
+		LANGID language = LOWORD(info->hkls[i]);
+		LCID locale = MAKELCID(language, SORT_DEFAULT);
+
+		WCHAR name[MAXLEN];
+		if(!GetLocaleInfo(locale, LOCALE_SLANGUAGE, name, MAXLEN))
+			name[0] = L'\0';
+
+		// Layouts of the same language share their name
+		UINT j;
+		for(j = 0; j < i; j++)
+		{
+			if(wcscmp(name, arena + info->nameOffsets[j]) == 0)
+				break;
+		}
+
+		if(j < i)
+		{
+			info->nameOffsets[i] = info->nameOffsets[j];
+		}
+		else
+		{
+			UINT length = (UINT)wcslen(name) + 1;
+			if(arenaSize + length > arenaCapacity)
+			{
+				UINT newCapacity = max(arenaCapacity * 2, arenaSize + length);
+				WCHAR* newArena = (WCHAR*)realloc(arena, sizeof(WCHAR) * newCapacity);
+				if(!newArena)
+				{
+					free(arena);
+					free(info->nameOffsets);
+					info->nameOffsets = NULL;
+					return FALSE;
+				}
+
+				arena = newArena;
+				arenaCapacity = newCapacity;
+			}
+
+			memcpy(arena + arenaSize, name, sizeof(WCHAR) * length);
+			info->nameOffsets[i] = arenaSize;
+			arenaSize += length;
+		}
+	}
+
+	// Give back the unused end of the arena
+	if(arenaSize < arenaCapacity)
+	{
+		WCHAR* newArena = (WCHAR*)realloc(arena, sizeof(WCHAR) * arenaSize);
+		if(newArena)
+			arena = newArena;
+	}
+
+	info->nameArena = arena;
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frees the memory of ``info`` and empties it
+void FreeKeyboardLayouts(KeyboardLayoutInfo* info)
+{
+	free(info->nameArena);
+	free(info->nameOffsets);
+	free(info->hkls);
+	memset(info, 0, sizeof(KeyboardLayoutInfo));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets up the configuration file in the application data folder, creating
+// the folder if needed
+void InitConfigStore()
+{
+	WCHAR path[CONFIG_MAX_PATH];
+	DWORD length = GetEnvironmentVariable(L"APPDATA", path, CONFIG_MAX_PATH);
+	if(length > 0 && length < CONFIG_MAX_PATH &&
+		wcscat_s(path, CONFIG_MAX_PATH, CONFIG_FOLDER) == 0)
+	{
+		CreateDirectory(path, NULL);
+		if(wcscat_s(path, CONFIG_MAX_PATH, CONFIG_FILE_NAME) != 0)
+			path[0] = L'\0';
+	}
+	else
+	{
+		path[0] = L'\0';
+	}
+
+	FileConfigStoreInit(&g_configFile, path);
+	FileConfigStoreGetStore(&g_configFile, &g_configStore);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Load currently active keyboard layouts from the registry
+// Load currently active keyboard layouts and other settings
 void LoadConfiguration(KeyboardLayoutInfo* info)
 {
 	HKEY hkey;
 	LONG result;
 
-	result = RegOpenKeyEx(HKEY_CURRENT_USER, L"Software\\Recaps", 0, KEY_QUERY_VALUE, &hkey);
+	// Load main and paired language from the configuration file, by their
+	// layouts' identifiers
+	ConfigValues values;
+	ZeroMemory(&values, sizeof(values));
+	BOOL bLoaded = g_configStore.Load(g_configStore.context, &values);
+	if(bLoaded)
+	{
+		uint32_t ids[MAX_LAYOUTS];
+		for(UINT i = 0; i < info->count; i++)
+			ids[i] = LAYOUT_CONFIG_ID(info->hkls[i]);
+
+		UINT index = ConfigFindLayout(ids, info->count, values.mainLayout);
+		if(index < info->count)
+			info->main = index;
 
-	// Load main and paired language
+		index = ConfigFindLayout(ids, info->count, values.pairedLayout);
+		if(index < info->count)
+			info->paired = index;
+	}
+
+	result = RegOpenKeyEx(HKEY_CURRENT_USER, L"Software\\Recaps", 0, KEY_QUERY_VALUE, &hkey);
 	if(result == ERROR_SUCCESS)
 	{
 		WCHAR localeName[MAXLEN];
 		DWORD length;
 
-		length = sizeof(localeName);
-		result = RegGetValue(hkey, NULL, L"main", RRF_RT_REG_SZ, NULL, localeName, &length);
-		if(result == ERROR_SUCCESS)
+		// Without the file, load main and paired language as older versions
+		// saved them, by the languages' names
+		if(!bLoaded && LoadLayoutNames(info))
 		{
-			for(UINT i = 0; i < info->count; i++)
+			length = sizeof(localeName);
+			result = RegGetValue(hkey, NULL, L"main", RRF_RT_REG_SZ, NULL, localeName, &length);
+			if(result == ERROR_SUCCESS)
 			{
-				if(wcscmp(localeName, info->names[i]) == 0)
+				for(UINT i = 0; i < info->count; i++)
 				{
-					info->main = i;
-					break;
+					if(wcscmp(localeName, LAYOUT_NAME(info, i)) == 0)
+					{
+						info->main = i;
+						break;
+					}
 				}
 			}
-		}
 
-		length = sizeof(localeName);
-		result = RegGetValue(hkey, NULL, L"paired", RRF_RT_REG_SZ, NULL, localeName, &length);
-		if(result == ERROR_SUCCESS)
-		{
-			for(UINT i = 0; i < info->count; i++)
+			length = sizeof(localeName);
+			result = RegGetValue(hkey, NULL, L"paired", RRF_RT_REG_SZ, NULL, localeName, &length);
+			if(result == ERROR_SUCCESS)
 			{
-				if(wcscmp(localeName, info->names[i]) == 0)
+				for(UINT i = 0; i < info->count; i++)
 				{
-					info->paired = i;
-					break;
+					if(wcscmp(localeName, LAYOUT_NAME(info, i)) == 0)
+					{
+						info->paired = i;
+						break;
+					}
 				}
 			}
 		}
 
-		if(info->main == info->paired && info->count >= 2)
-			info->paired = (info->main == 0) ? 1 : 0;
+		// Load the number of kilobytes of clipboard data to keep in memory
+		DWORD budget;
+		length = sizeof(budget);
+		result = RegGetValue(hkey, NULL, L"clipboardMemoryBudgetKB", RRF_RT_REG_DWORD, NULL, &budget, &length);
+		if(result == ERROR_SUCCESS)
+			SetClipboardMemoryBudget((SIZE_T)budget * 1024);
+
+		// Load the app compatibility rules, one per string
+		DWORD size = 0;
+		result = RegGetValue(hkey, NULL, L"appCompatRules", RRF_RT_REG_MULTI_SZ, NULL, NULL, &size);
+		if(result == ERROR_SUCCESS && size > 0)
+		{
+			WCHAR* rules = (WCHAR*)calloc(size + 2 * sizeof(WCHAR), 1);
+			if(rules)
+			{
+				result = RegGetValue(hkey, NULL, L"appCompatRules", RRF_RT_REG_MULTI_SZ, NULL, rules, &size);
+				if(result == ERROR_SUCCESS)
+					WindowCompatLoadRules(rules);
+				free(rules);
+			}
+		}
 
 		RegCloseKey(hkey);
 	}
+
+	if(info->main == info->paired && info->count >= 2)
+		info->paired = (info->main == 0) ? 1 : 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Saves currently active keyboard layouts to the registry
+// Saves currently active keyboard layouts. They're written to the file in
+// the background, after they stop changing.
 void SaveConfiguration(const KeyboardLayoutInfo* info)
 {
-	HKEY hkey;
-	LONG result;
+	if(info->count == 0)
+		return;
 
-	result = RegCreateKeyEx(HKEY_CURRENT_USER, L"Software\\Recaps", 0, NULL, 0, KEY_SET_VALUE, NULL, &hkey, NULL);
+	ConfigValues values;
+	ZeroMemory(&values, sizeof(values));
+	values.mainLayout = LAYOUT_CONFIG_ID(info->hkls[info->main]);
+	values.pairedLayout = LAYOUT_CONFIG_ID(info->hkls[info->paired]);
 
-	// Save main and paired language
-	if(result == ERROR_SUCCESS)
-	{
-		const WCHAR *pLocaleName;
-
-		pLocaleName = info->names[info->main];
-		RegSetValueEx(hkey, L"main", 0, REG_SZ, (const BYTE *)(pLocaleName), (DWORD)((wcslen(pLocaleName) + 1) * sizeof(WCHAR)));
-
-		pLocaleName = info->names[info->paired];
-		RegSetValueEx(hkey, L"paired", 0, REG_SZ, (const BYTE *)(pLocaleName), (DWORD)((wcslen(pLocaleName) + 1) * sizeof(WCHAR)));
-
-		RegCloseKey(hkey);
-	}
+	ConfigWriterSet(&values);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Finds out which window has the focus
 HWND RemoteGetFocus()
 {
-	GUITHREADINFO remoteThreadInfo;
-	remoteThreadInfo.cbSize = sizeof(GUITHREADINFO);
-	if(!GetGUIThreadInfo(0, &remoteThreadInfo))
-	{
-		return NULL;
-	}
-
-	return remoteThreadInfo.hwndFocus ? remoteThreadInfo.hwndFocus : remoteThreadInfo.hwndActive;
+	return FocusCacheGetFocus(NULL, NULL);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -479,58 +777,87 @@ HKL GetWindowLayout(HWND hWnd)
 // Returns the current layout in the active window
 HKL GetCurrentLayout()
 {
-	HWND hWnd = RemoteGetFocus();
-	if(!hWnd)
+	HKL layout;
+	if(!FocusCacheGetFocus(&layout, NULL))
 		return NULL;
 
-	return GetWindowLayout(hWnd);
+	return layout;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Switches the current language
-HKL SwitchLayout(HWND hWnd, HKL hkl)
+// LayoutCycleBackend.GetLayout for a window
+static LayoutId Win32GetCycleLayout(void* context)
+{
+	return (LayoutId)GetWindowLayout((HWND)context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.SendCycleKeys for a window, which has to be the
+// foreground one
+static void Win32SendCycleKeys(void* context, unsigned presses)
 {
-	BOOL bBuggy = FALSE;
+	UNREFERENCED_PARAMETER(context);
+	SendAltShift(presses);
+}
 
-	HWND hRootOwnerWnd = GetAncestor(hWnd, GA_ROOTOWNER);
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.WaitForChange for a window
+static LayoutId Win32WaitForCycleChange(void* context, LayoutId layout, uint32_t timeout)
+{
+	DWORD start = GetTickCount();
+	HKL current = GetWindowLayout((HWND)context);
 
-	WCHAR szClassName[256];
-	if(hRootOwnerWnd && GetClassName(hRootOwnerWnd, szClassName, _countof(szClassName)))
+	while((LayoutId)current == layout && GetTickCount() - start < timeout)
 	{
-		// Skype and Word hang when posting WM_INPUTLANGCHANGEREQUEST.
-		if(wcscmp(szClassName, L"tSkMainForm") == 0 ||
-			wcscmp(szClassName, L"TConversationForm") == 0 ||
-			wcscmp(szClassName, L"OpusApp") == 0)
-		{
-			bBuggy = TRUE;
-		}
+		Sleep(LAYOUT_SWITCH_POLL_INTERVAL);
+		current = GetWindowLayout((HWND)context);
 	}
 
-	if(bBuggy)
-	{
-		// A workaround for apps which don't support WM_INPUTLANGCHANGEREQUEST.
-		for(UINT i = 0; i < g_keyboardInfo.count; i++)
-		{
-			HKL currentLayout = GetWindowLayout(hWnd);
-			if(currentLayout == hkl)
-				break;
+	return (LayoutId)current;
+}
 
-			// Change layout by simulating Alt+Shift.
-			SendAltShift();
+///////////////////////////////////////////////////////////////////////////////
+// LayoutCycleBackend.GetTime for a window
+static uint32_t Win32GetCycleTime(void* context)
+{
+	UNREFERENCED_PARAMETER(context);
+	return GetTickCount();
+}
 
-			// Wait for the change to apply.
-			for(UINT j = 0; j < 10; j++)
-			{
-				if(GetWindowLayout(hWnd) != currentLayout)
-					break;
+///////////////////////////////////////////////////////////////////////////////
+// Fills `backend` with the functions that switch the layout of `hWnd` by
+// simulating Alt+Shift
+void GetWin32LayoutCycleBackend(LayoutCycleBackend* backend, HWND hWnd)
+{
+	ZeroMemory(backend, sizeof(LayoutCycleBackend));
+	backend->GetLayout = Win32GetCycleLayout;
+	backend->SendCycleKeys = Win32SendCycleKeys;
+	backend->WaitForChange = Win32WaitForCycleChange;
+	backend->GetTime = Win32GetCycleTime;
+	backend->context = hWnd;
+}
 
-				Sleep(30);
-			}
+///////////////////////////////////////////////////////////////////////////////
+// Switches the current language
+HKL SwitchLayout(HWND hWnd, HKL hkl)
+{
+	if(GetWindowSwitchStrategy(hWnd) == SWITCH_STRATEGY_CYCLE_KEYS)
+	{
+		// A workaround for apps which don't support WM_INPUTLANGCHANGEREQUEST.
+		// Alt+Shift cycles through the layouts in the order of the layout
+		// list, so the presses needed are sent at once.
+		LayoutCycleBackend backend;
+		GetWin32LayoutCycleBackend(&backend, hWnd);
+		if(LayoutCycleSwitch(&backend, (const LayoutId*)g_keyboardInfo.hkls, g_keyboardInfo.count,
+			(LayoutId)hkl, LAYOUT_SWITCH_TIMEOUT))
+		{
+			FocusCacheSetLayout(hWnd, hkl);
 		}
 	}
 	else
 	{
 		PostMessage(hWnd, WM_INPUTLANGCHANGEREQUEST, 0, (LPARAM)hkl);
+		FocusCacheSetLayout(hWnd, hkl);
 	}
 
 	return hkl;
@@ -540,51 +867,57 @@ HKL SwitchLayout(HWND hWnd, HKL hkl)
 // Switches the current language to the other language of the current pair
 HKL SwitchToPairedLayout()
 {
-	HWND hWnd = RemoteGetFocus();
+	// Find the focused window and its current keyboard layout's index
+	UINT currentLanguageIndex;
+	HWND hWnd = FocusCacheGetFocus(NULL, &currentLanguageIndex);
 	if(!hWnd)
 		return NULL;
 
-	HKL currentLayout = GetWindowLayout(hWnd);
-
-	// Find the current keyboard layout's index
-	UINT i;
-	for(i = 0; i < g_keyboardInfo.count; i++)
-	{
-		if(g_keyboardInfo.hkls[i] == currentLayout)
-			break;
-	}
-	UINT currentLanguageIndex = i;
-
 	// Decide the new layout
 	UINT newLanguage;
+	EnterCriticalSection(&g_csKeyboardInfo);
 	if(currentLanguageIndex == g_keyboardInfo.main)
 		newLanguage = g_keyboardInfo.paired;
 	else
 		newLanguage = g_keyboardInfo.main;
+	LeaveCriticalSection(&g_csKeyboardInfo);
 
 	// Activate the new language
 	SwitchLayout(hWnd, g_keyboardInfo.hkls[newLanguage]);
 
 #ifdef _DEBUG
-	PrintDebugString("Language set to %S", g_keyboardInfo.names[newLanguage]);
+	EnterCriticalSection(&g_csKeyboardInfo);
+	LoadLayoutNames(&g_keyboardInfo);
+	PrintDebugString("Language set to %S", LAYOUT_NAME(&g_keyboardInfo, newLanguage));
+	LeaveCriticalSection(&g_csKeyboardInfo);
 #endif
 
 	return g_keyboardInfo.hkls[newLanguage];
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Switches the language pair
-HKL SwitchPair()
+// Switches the language pair `steps` times, and the current language to the
+// final one
+HKL SwitchPair(UINT steps)
 {
 	// Find the current keyboard layout's index
+	EnterCriticalSection(&g_csKeyboardInfo);
 	UINT newPaired = g_keyboardInfo.paired;
-	newPaired = (newPaired + 1) % g_keyboardInfo.count;
-	if(newPaired == g_keyboardInfo.main)
+	if(g_keyboardInfo.count >= 2)
+		steps %= g_keyboardInfo.count - 1;
+
+	for(UINT i = 0; i < steps; i++)
 	{
 		newPaired = (newPaired + 1) % g_keyboardInfo.count;
+		if(newPaired == g_keyboardInfo.main)
+		{
+			newPaired = (newPaired + 1) % g_keyboardInfo.count;
+		}
 	}
 
 	g_keyboardInfo.paired = newPaired;
+	SaveConfiguration(&g_keyboardInfo);
+	LeaveCriticalSection(&g_csKeyboardInfo);
 
 	HWND hWnd = RemoteGetFocus();
 	if(hWnd)
@@ -592,8 +925,6 @@ HKL SwitchPair()
 		SwitchLayout(hWnd, g_keyboardInfo.hkls[newPaired]);
 	}
 
-	SaveConfiguration(&g_keyboardInfo);
-
 	return g_keyboardInfo.hkls[newPaired];
 }
 
@@ -610,12 +941,28 @@ void SwitchAndConvert(BOOL bOnlySelected)
 	HKL targetLayout = SwitchToPairedLayout();
 	if(sourceLayout && targetLayout)
 	{
-		ConvertSelectedTextInActiveWindow(sourceLayout, targetLayout);
+		// an action that's queued meanwhile cancels the conversion
+		ConvertSelectedTextInActiveWindow(sourceLayout, targetLayout, ActionQueueGetEvent());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Undoes the last conversion in the active window, or redoes it from the
+// next layout, and switches the window to the layout of the pasted text
+void UndoConversion()
+{
+	HKL hkl = UndoConversionInActiveWindow();
+	HWND hWnd = RemoteGetFocus();
+	if(hkl && hWnd)
+	{
+		SwitchLayout(hWnd, hkl);
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Creates a thread, and initializes the keyboard hook inside it
+// Creates a thread, and initializes the keyboard hook inside it. Returns
+// FALSE, with the error of SetWindowsHookEx as the last error, if the hook
+// couldn't be installed.
 BOOL KeyboardHookInit()
 {
 	BOOL bSuccess = FALSE;
@@ -630,9 +977,12 @@ BOOL KeyboardHookInit()
 			SetThreadPriority(g_hKeyboardHookThread, THREAD_PRIORITY_TIME_CRITICAL);
 			ResumeThread(g_hKeyboardHookThread);
 
+			// the thread signals once the hook is installed, or once it failed
 			WaitForSingleObject(hThreadReadyEvent, INFINITE);
 
-			bSuccess = TRUE;
+			bSuccess = g_hKeyboardHook != NULL;
+			if(!bSuccess)
+				SetLastError(g_dwKeyboardHookError);
 		}
 
 		CloseHandle(hThreadReadyEvent);
@@ -665,11 +1015,30 @@ DWORD WINAPI KeyboardHookThread(LPVOID pParameter)
 
 	hThreadReadyEvent = (HANDLE)pParameter;
 	PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
-	SetEvent(hThreadReadyEvent);
+
+	SyncHookModifiers();
 
 	g_hKeyboardHook = SetWindowsHookEx(WH_KEYBOARD_LL, LowLevelKeyboardHookProc, GetModuleHandle(NULL), 0);
+	if(!g_hKeyboardHook)
+		g_dwKeyboardHookError = GetLastError();
+
+	// KeyboardHookInit closes the event once it's signaled
+	SetEvent(hThreadReadyEvent);
+
 	if(g_hKeyboardHook)
 	{
+		UINT_PTR uTimer = SetTimer(NULL, 0, HOOK_RESYNC_INTERVAL, NULL);
+
+		// A conversion can only be undone while nothing moved the caret since
+		// it was pasted, so the undo is enabled only if clicks, focus changes
+		// and caret moves can be followed as well
+		g_hMouseHook = SetWindowsHookEx(WH_MOUSE_LL, LowLevelMouseHookProc, GetModuleHandle(NULL), 0);
+		g_hUndoFocusHook = SetWinEventHook(EVENT_OBJECT_FOCUS, EVENT_OBJECT_FOCUS, NULL,
+			UndoEventProc, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+		g_hUndoCaretHook = SetWinEventHook(EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE, NULL,
+			UndoEventProc, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+		ConversionUndoSetTracking(g_hMouseHook && g_hUndoFocusHook && g_hUndoCaretHook);
+
 		while((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
 		{
 			if(bRet == -1)
@@ -684,10 +1053,30 @@ DWORD WINAPI KeyboardHookThread(LPVOID pParameter)
 				continue;
 			}
 
+			if(msg.hwnd == NULL && msg.message == WM_TIMER)
+			{
+				SyncHookModifiers();
+				continue;
+			}
+
 			TranslateMessage(&msg);
 			DispatchMessage(&msg);
 		}
 
+		if(uTimer)
+			KillTimer(NULL, uTimer);
+
+		ConversionUndoSetTracking(FALSE);
+		if(g_hUndoCaretHook)
+			UnhookWinEvent(g_hUndoCaretHook);
+		if(g_hUndoFocusHook)
+			UnhookWinEvent(g_hUndoFocusHook);
+		if(g_hMouseHook)
+			UnhookWindowsHookEx(g_hMouseHook);
+		g_hUndoCaretHook = NULL;
+		g_hUndoFocusHook = NULL;
+		g_hMouseHook = NULL;
+
 		UnhookWindowsHookEx(g_hKeyboardHook);
 	}
 	else
@@ -701,64 +1090,227 @@ DWORD WINAPI KeyboardHookThread(LPVOID pParameter)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// A LowLevelHookProc implementation that captures the CapsLock key
+// Creates the thread that runs the actions of the keyboard hook
+BOOL ActionWorkerInit()
+{
+	g_hActionWorkerQuitEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!g_hActionWorkerQuitEvent)
+		return FALSE;
+
+	g_hActionWorkerThread = CreateThread(NULL, 0, ActionWorkerThread, NULL, 0, NULL);
+	if(!g_hActionWorkerThread)
+	{
+		CloseHandle(g_hActionWorkerQuitEvent);
+		g_hActionWorkerQuitEvent = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ends the action worker thread, after the action it's running
+void ActionWorkerUninit()
+{
+	HANDLE hThread = InterlockedExchangePointer(&g_hActionWorkerThread, NULL);
+	if(hThread)
+	{
+		SetEvent(g_hActionWorkerQuitEvent);
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+	}
+
+	if(g_hActionWorkerQuitEvent)
+	{
+		CloseHandle(g_hActionWorkerQuitEvent);
+		g_hActionWorkerQuitEvent = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The action worker thread, so the main thread never waits for the target
+// application. It takes all the queued actions at once and folds the layout
+// switches among them into their net effect before running them. The
+// queue's event is reset after taking the actions, so that an action queued
+// while they run signals the event and cancels what's left of a conversion.
+// An action queued between taking the last one and the reset signals it
+// again.
+DWORD WINAPI ActionWorkerThread(LPVOID pParameter)
+{
+	UNREFERENCED_PARAMETER(pParameter);
+
+	HANDLE handles[2] = { g_hActionWorkerQuitEvent, ActionQueueGetEvent() };
+
+	while(WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+	{
+		for(;;)
+		{
+			QueuedAction action;
+			LangAction actions[ACTION_QUEUE_SIZE];
+			size_t count = 0;
+
+			LONGLONG start = StatsNow();
+			while(count < ACTION_QUEUE_SIZE && ActionQueuePop(&action))
+			{
+				StatsRecord(STAT_HOOK_TO_DISPATCH, action.queueTime, start);
+				actions[count++] = action.action;
+			}
+
+			if(count == 0)
+				break;
+
+			ResetEvent(handles[1]);
+			if(!ActionQueueIsEmpty())
+				SetEvent(handles[1]);
+
+			ActionRun runs[ACTION_QUEUE_SIZE];
+			size_t runCount = CoalesceActions(actions, count, runs);
+			StatsAdd(STAT_COUNTER_ACTIONS_COALESCED, count - runCount);
+
+			for(size_t i = 0; i < runCount; i++)
+			{
+				if(WaitForSingleObject(g_hActionWorkerQuitEvent, 0) == WAIT_OBJECT_0)
+					return 0;
+
+				start = StatsNow();
+				OnLangAction(runs[i].action, runs[i].count);
+				StatsRecord(STAT_ACTION_HISTOGRAM(runs[i].action), start, StatsNow());
+			}
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A LowLevelHookProc implementation that captures the CapsLock key. It runs
+// the hook state machine, which tracks the modifier keys itself, and queues
+// the action to the worker thread, so it does a constant amount of work.
 LRESULT CALLBACK LowLevelKeyboardHookProc(int nCode, WPARAM wParam, LPARAM lParam)
 {
 	if(nCode != HC_ACTION)
 		return CallNextHookEx(g_hKeyboardHook, nCode, wParam, lParam);
 
+	LONGLONG start = StatsNow();
 	KBDLLHOOKSTRUCT* data = (KBDLLHOOKSTRUCT*)lParam;
-	BOOL caps = data->vkCode == VK_CAPITAL &&
-		(wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN);
 
-	// ignore injected keystrokes
-	if(caps && (data->flags & LLKHF_INJECTED) == 0)
+	HookEvent event;
+	event.vk = data->vkCode;
+	event.down = wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN;
+	event.injected = (data->flags & LLKHF_INJECTED) != 0;
+
+	HookDecision decision;
+	g_hookState = HookStateProcess(g_hookState, &event, &decision);
+
+	if(decision.action != LANG_ACTION_NONE)
 	{
-		if(GetKeyState(VK_MENU) < 0)
-		{
-			// Handle Alt+CapsLock - switch current layout pair
-			PostMessage(g_hMainWnd, APPWM_LANG_ACTION, LANG_ACTION_SWITCH_PAIR, 0);
-
-			// This call of keybd_event is a workaround for the following issue:
-			// Because we disable the WM_KEYDOWN-VK_CAPITAL message, the target
-			// window might get the following sequence:
-			// 1. WM_KEYDOWN-VK_MENU
-			// 2. WM_KEYUP  -VK_MENU
-			// 3. WM_KEYUP  -VK_CAPITAL
-			// Between 1 and 2 there's the deleted message of WM_KEYDOWN-VK_CAPITAL.
-			// Because of this sequence, the target window activates the menu, as
-			// if the ALT button was pressed.
-			// As a workaround, we send an additional WM_KEYUP-VK_CAPITAL message,
-			// so it becomes:
-			// 1. WM_KEYDOWN-VK_MENU
-			// 2. WM_KEYUP  -VK_CAPITAL
-			// 3. WM_KEYUP  -VK_MENU
-			// 4. WM_KEYUP  -VK_CAPITAL
-			keybd_event(VK_CAPITAL, 0, KEYEVENTF_KEYUP, 0);
-			return 1;
-		}
-		else if(GetKeyState(VK_CONTROL) < 0)
-		{
-			// Handle Ctrl+CapsLock - switch current layout and convert text in current field.
-			// If both ctrl keys are pressed, don't select all text with Ctrl+A before converting.
+		QueuedAction action;
+		action.action = decision.action;
+		action.queueTime = start;
+		StatsIncrement(ActionQueuePush(&action) ? STAT_COUNTER_ACTIONS_QUEUED : STAT_COUNTER_ACTIONS_DROPPED);
+	}
+	else if(decision.autorepeat)
+		StatsIncrement(STAT_COUNTER_AUTOREPEATS_DROPPED);
 
-			BOOL bBothControlsAreDown = GetKeyState(VK_LCONTROL) < 0 && GetKeyState(VK_RCONTROL) < 0;
-			WPARAM wAction = bBothControlsAreDown ? LANG_ACTION_CONVERT_SELECTED_TEXT : LANG_ACTION_CONVERT_ALL_TEXT;
-			PostMessage(g_hMainWnd, APPWM_LANG_ACTION, wAction, 0);
+	if(decision.typed)
+		ConversionUndoInvalidate();
 
-			return 1; // prevent windows from handling the keystroke
-		}
-		else if(GetKeyState(VK_SHIFT) < 0)
-		{
-			// Skip Shift+CapsLock
-		}
-		else
-		{
-			// Handle CapsLock - only switch current layout
-			PostMessage(g_hMainWnd, APPWM_LANG_ACTION, LANG_ACTION_SWITCH_LAYOUT, 0);
-			return 1;
-		}
+	if(decision.releaseCapsLock)
+	{
+		// This call of keybd_event is a workaround for the following issue:
+		// Because we disable the WM_KEYDOWN-VK_CAPITAL message, the target
+		// window might get the following sequence:
+		// 1. WM_KEYDOWN-VK_MENU
+		// 2. WM_KEYUP  -VK_MENU
+		// 3. WM_KEYUP  -VK_CAPITAL
+		// Between 1 and 2 there's the deleted message of WM_KEYDOWN-VK_CAPITAL.
+		// Because of this sequence, the target window activates the menu, as
+		// if the ALT button was pressed.
+		// As a workaround, we send an additional WM_KEYUP-VK_CAPITAL message,
+		// so it becomes:
+		// 1. WM_KEYDOWN-VK_MENU
+		// 2. WM_KEYUP  -VK_CAPITAL
+		// 3. WM_KEYUP  -VK_MENU
+		// 4. WM_KEYUP  -VK_CAPITAL
+		keybd_event(VK_CAPITAL, 0, KEYEVENTF_KEYUP, 0);
 	}
 
+	StatsRecord(STAT_HOOK_CALLBACK, start, StatsNow());
+
+	if(decision.swallow)
+		return 1; // prevent windows from handling the keystroke
+
 	return CallNextHookEx(g_hKeyboardHook, nCode, wParam, lParam);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// A LowLevelHookProc implementation for the mouse. A click or a scroll may
+// move the caret or the selection, after which the last conversion can't be
+// undone. Mouse moves are let through without any work.
+LRESULT CALLBACK LowLevelMouseHookProc(int nCode, WPARAM wParam, LPARAM lParam)
+{
+	if(nCode == HC_ACTION && wParam != WM_MOUSEMOVE)
+		ConversionUndoInvalidate();
+
+	return CallNextHookEx(g_hMouseHook, nCode, wParam, lParam);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Follows the focus and the caret of other processes, see
+// ConversionUndoChanged. The location changes of objects other than the caret
+// are ignored.
+void CALLBACK UndoEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+	LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+{
+	UNREFERENCED_PARAMETER(hWinEventHook);
+	UNREFERENCED_PARAMETER(hWnd);
+	UNREFERENCED_PARAMETER(idChild);
+	UNREFERENCED_PARAMETER(dwEventThread);
+
+	if(event == EVENT_OBJECT_LOCATIONCHANGE && idObject != OBJID_CARET)
+		return;
+
+	ConversionUndoChanged(dwmsEventTime);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the modifier keys of the hook state from the system's key state. It runs on the keyboard hook thread between hook calls, so that
+// a key up the hook missed (such as on the secure desktop) doesn't leave a
+// key down.
+void SyncHookModifiers()
+{
+	static const struct
+	{
+		int vk;
+		uint32_t modifier;
+	} modifierKeys[] = {
+		{ VK_LSHIFT, HOOK_MOD_LSHIFT },
+		{ VK_RSHIFT, HOOK_MOD_RSHIFT },
+		{ VK_LCONTROL, HOOK_MOD_LCONTROL },
+		{ VK_RCONTROL, HOOK_MOD_RCONTROL },
+		{ VK_LMENU, HOOK_MOD_LMENU },
+		{ VK_RMENU, HOOK_MOD_RMENU },
+	};
+
+	uint32_t modifiers = 0;
+	for(int i = 0; i < _countof(modifierKeys); i++)
+	{
+		if(GetAsyncKeyState(modifierKeys[i].vk) < 0)
+			modifiers |= modifierKeys[i].modifier;
+	}
+
+	g_hookState = HookStateSync(g_hookState, modifiers);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the conversion and detection tables of the installed layouts, so
+// the first conversion doesn't have to
+DWORD WINAPI WarmUpThread(LPVOID pParameter)
+{
+	UNREFERENCED_PARAMETER(pParameter);
+
+	LayoutCacheWarmUp(g_keyboardInfo.hkls, g_keyboardInfo.count);
+	StatsMarkStartup(STAT_STARTUP_WARM);
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+#include "simdconvert.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+#include <intrin.h>
+#include <smmintrin.h>
+
+#define SIMD_CONVERT_KERNEL
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if the processor supports SSE4.1
+int SimdConvertSupported()
+{
+	static int supported = -1;
+	if(supported == -1)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		supported = (info[2] & (1 << 19)) != 0;
+	}
+
+	return supported;
+}
+
+#elif defined(__i386__) || defined(__x86_64__)
+
+#include <smmintrin.h>
+
+#define SIMD_CONVERT_KERNEL __attribute__((target("sse4.1")))
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if the processor supports SSE4.1
+int SimdConvertSupported()
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+
+#endif
+
+#ifdef SIMD_CONVERT_KERNEL
+
+///////////////////////////////////////////////////////////////////////////////
+// Each group of 16 characters is packed to byte indexes into the table, 0-127
+// for the ASCII block and 128-255 for the other block. The table is looked up
+// as 16 PSHUFB tables of 16 bytes. For table N the indexes are shifted down by
+// 16 * N and then saturated, so that only indexes that belong to the table
+// keep their high bit clear and the rest select zero.
+SIMD_CONVERT_KERNEL
+size_t SimdConvertRun(const LayoutChar* src, LayoutChar* dst, size_t length, LayoutChar base, const unsigned char* table)
+{
+	const __m128i blockMask = _mm_set1_epi16((short)(0x10000 - SIMD_BLOCK_SIZE));
+	const __m128i baseVector = _mm_set1_epi16((short)(base - SIMD_BLOCK_SIZE));
+	const __m128i saturate = _mm_set1_epi8(0x70);
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i;
+	for(i = 0; i + 16 <= length; i += 16)
+	{
+		__m128i first = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i second = _mm_loadu_si128((const __m128i*)(src + i + 8));
+
+		// index the other block from 128
+		__m128i firstOther = _mm_sub_epi16(first, baseVector);
+		__m128i secondOther = _mm_sub_epi16(second, baseVector);
+
+		__m128i firstAscii = _mm_cmpeq_epi16(_mm_and_si128(first, blockMask), zero);
+		__m128i secondAscii = _mm_cmpeq_epi16(_mm_and_si128(second, blockMask), zero);
+		__m128i firstInTable = _mm_or_si128(firstAscii,
+			_mm_cmpeq_epi16(_mm_and_si128(firstOther, blockMask), _mm_set1_epi16(SIMD_BLOCK_SIZE)));
+		__m128i secondInTable = _mm_or_si128(secondAscii,
+			_mm_cmpeq_epi16(_mm_and_si128(secondOther, blockMask), _mm_set1_epi16(SIMD_BLOCK_SIZE)));
+
+		// stop if a character is outside of both blocks
+		if(!_mm_test_all_ones(_mm_and_si128(firstInTable, secondInTable)))
+			break;
+
+		__m128i index = _mm_packus_epi16(
+			_mm_blendv_epi8(firstOther, first, firstAscii),
+			_mm_blendv_epi8(secondOther, second, secondAscii));
+
+		__m128i resultLow = zero;
+		__m128i resultHigh = zero;
+		for(int part = 0; part < SIMD_TABLE_SIZE / 16; part++)
+		{
+			__m128i select = _mm_adds_epu8(_mm_sub_epi8(index, _mm_set1_epi8((char)(part * 16))), saturate);
+			__m128i partLow = _mm_loadu_si128((const __m128i*)(table + part * 16));
+			__m128i partHigh = _mm_loadu_si128((const __m128i*)(table + SIMD_TABLE_SIZE + part * 16));
+
+			resultLow = _mm_or_si128(resultLow, _mm_shuffle_epi8(partLow, select));
+			resultHigh = _mm_or_si128(resultHigh, _mm_shuffle_epi8(partHigh, select));
+		}
+
+		__m128i resultFirst = _mm_unpacklo_epi8(resultLow, resultHigh);
+		__m128i resultSecond = _mm_unpackhi_epi8(resultLow, resultHigh);
+
+		// stop if a character can't be converted, the caller will fail on it
+		__m128i failed = _mm_or_si128(_mm_cmpeq_epi16(resultFirst, zero), _mm_cmpeq_epi16(resultSecond, zero));
+		if(!_mm_testz_si128(failed, failed))
+			break;
+
+		_mm_storeu_si128((__m128i*)(dst + i), resultFirst);
+		_mm_storeu_si128((__m128i*)(dst + i + 8), resultSecond);
+	}
+
+	return i;
+}
+
+#else
+
+int SimdConvertSupported()
+{
+	return 0;
+}
+
+size_t SimdConvertRun(const LayoutChar* src, LayoutChar* dst, size_t length, LayoutChar base, const unsigned char* table)
+{
+	(void)src;
+	(void)dst;
+	(void)length;
+	(void)base;
+	(void)table;
+	return 0;
+}
+
+#endif
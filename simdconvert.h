@@ -0,0 +1,22 @@
+#pragma once
+
+#include "layoutcore.h"
+
+// Number of consecutive characters in a block. A SIMD translation table covers
+// the ASCII block and one more block, so that runs of text in a single script
+// can be converted together with the spaces and punctuation between words.
+#define SIMD_BLOCK_SIZE 128
+
+// A SIMD translation table holds the low bytes of the converted characters of
+// both blocks, followed by their high bytes
+#define SIMD_TABLE_SIZE  (SIMD_BLOCK_SIZE * 2)
+#define SIMD_TABLE_BYTES (SIMD_TABLE_SIZE * 2)
+
+// Returns nonzero if the processor can run SimdConvertRun
+int SimdConvertSupported();
+
+// Converts the characters at the start of `src` that belong to the ASCII block
+// or to the block beginning with `base`, 16 at a time. Stops at the first group
+// of 16 that has other characters or a character that can't be converted, and
+// returns the number of characters converted.
+size_t SimdConvertRun(const LayoutChar* src, LayoutChar* dst, size_t length, LayoutChar base, const unsigned char* table);
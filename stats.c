@@ -0,0 +1,291 @@
+#include "stdafx.h"
+#include <intrin.h>
+#include <psapi.h>
+#include "stats.h"
+#include "fixlayouts.h"
+
+typedef struct
+{
+	volatile LONG buckets[STATS_BUCKETS];
+	volatile LONGLONG totalNs;
+	volatile LONGLONG maxNs;
+} StatsHistogramData;
+
+static const WCHAR* g_statHistogramNames[STAT_HISTOGRAM_COUNT] = {
+	L"hook callback",
+	L"hook to dispatch",
+	L"switch layout",
+	L"switch pair",
+	L"convert all text",
+	L"convert selected text",
+	L"undo conversion",
+};
+
+static const WCHAR* g_statCounterNames[STAT_COUNTER_COUNT] = {
+	L"actions queued",
+	L"actions dropped",
+	L"autorepeats dropped",
+	L"actions coalesced",
+	L"focus cache hits",
+	L"focus cache misses",
+};
+
+static const WCHAR* g_statStartupNames[STAT_STARTUP_COUNT] = {
+	L"hook ready",
+	L"fully warm",
+};
+
+static StatsHistogramData g_statHistograms[STAT_HISTOGRAM_COUNT];
+static volatile LONGLONG g_statCounters[STAT_COUNTER_COUNT];
+
+// the time StatsInit ran at, and the times of the startup points since then
+// in nanoseconds, or 0 until they're reached
+static LONGLONG g_statsStartTime;
+static volatile LONGLONG g_statStartupNs[STAT_STARTUP_COUNT];
+
+// the working set and private bytes once the process was initialized, or 0
+static SIZE_T g_statsInitialWorkingSet;
+static SIZE_T g_statsInitialPrivateBytes;
+
+// nanoseconds per performance counter tick, in 16.16 fixed point
+static ULONGLONG g_statsNsPerTick;
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads the performance counter frequency
+void StatsInit()
+{
+	LARGE_INTEGER frequency;
+	if(QueryPerformanceFrequency(&frequency) && frequency.QuadPart > 0)
+		g_statsNsPerTick = (1000000000ULL << 16) / (ULONGLONG)frequency.QuadPart;
+
+	g_statsStartTime = StatsNow();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the current time in performance counter ticks
+LONGLONG StatsNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the bucket of a time, which is the index of its highest set bit
+static int BucketOfTime(ULONGLONG ns)
+{
+	unsigned long index;
+	if(ns >> 32)
+	{
+		_BitScanReverse(&index, (unsigned long)(ns >> 32));
+		index += 32;
+	}
+	else if(!_BitScanReverse(&index, (unsigned long)ns))
+		index = 0;
+
+	return index < STATS_BUCKETS ? (int)index : STATS_BUCKETS - 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records the time between two StatsNow results in a histogram
+void StatsRecord(StatHistogram histogram, LONGLONG start, LONGLONG end)
+{
+	StatsHistogramData* data = &g_statHistograms[histogram];
+	ULONGLONG ticks = end > start ? (ULONGLONG)(end - start) : 0;
+	ULONGLONG ns = (ticks * g_statsNsPerTick) >> 16;
+
+	InterlockedIncrement(&data->buckets[BucketOfTime(ns)]);
+	InterlockedExchangeAdd64(&data->totalNs, (LONGLONG)ns);
+
+	// the maximum rarely changes, so it's usually only read
+	LONGLONG maxNs = data->maxNs;
+	while((LONGLONG)ns > maxNs)
+	{
+		LONGLONG prevMaxNs = InterlockedCompareExchange64(&data->maxNs, (LONGLONG)ns, maxNs);
+		if(prevMaxNs == maxNs)
+			break;
+
+		maxNs = prevMaxNs;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Increments an event counter
+void StatsIncrement(StatCounter counter)
+{
+	InterlockedIncrement64(&g_statCounters[counter]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds to an event counter
+void StatsAdd(StatCounter counter, LONGLONG value)
+{
+	InterlockedExchangeAdd64(&g_statCounters[counter], value);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records the time a startup point is reached at, the first time it is
+void StatsMarkStartup(StatStartup point)
+{
+	ULONGLONG ticks = (ULONGLONG)(StatsNow() - g_statsStartTime);
+	LONGLONG ns = (LONGLONG)((ticks * g_statsNsPerTick) >> 16);
+	InterlockedCompareExchange64(&g_statStartupNs[point], ns ? ns : 1, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records the memory use of the process after its initialization
+void StatsMarkMemory()
+{
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	counters.cb = sizeof(counters);
+	if(GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+	{
+		g_statsInitialWorkingSet = counters.WorkingSetSize;
+		g_statsInitialPrivateBytes = counters.PrivateUsage;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the upper bound in microseconds of the bucket where the given
+// fraction of the samples is reached
+static double HistogramPercentile(const LONG* buckets, LONGLONG count, double fraction)
+{
+	LONGLONG target = (LONGLONG)(count * fraction + 0.5);
+	LONGLONG seen = 0;
+
+	for(int i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if(seen >= target)
+			return (double)(2ULL << i) / 1000.0;
+	}
+
+	return (double)(2ULL << (STATS_BUCKETS - 1)) / 1000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a summary of the statistics to `buffer`
+void StatsFormatReport(WCHAR* buffer, size_t size)
+{
+	size_t length = 0;
+	int written;
+	buffer[0] = L'\0';
+
+	for(int h = 0; h < STAT_HISTOGRAM_COUNT; h++)
+	{
+		StatsHistogramData* data = &g_statHistograms[h];
+
+		LONG buckets[STATS_BUCKETS];
+		LONGLONG count = 0;
+		for(int i = 0; i < STATS_BUCKETS; i++)
+		{
+			buckets[i] = data->buckets[i];
+			count += buckets[i];
+		}
+
+		if(count == 0)
+			written = swprintf_s(buffer + length, size - length, L"%s: no samples\n", g_statHistogramNames[h]);
+		else
+		{
+			written = swprintf_s(buffer + length, size - length,
+				L"%s: %I64d samples, mean %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us\n",
+				g_statHistogramNames[h], count, data->totalNs / 1000.0 / count,
+				HistogramPercentile(buckets, count, 0.5), HistogramPercentile(buckets, count, 0.99),
+				data->maxNs / 1000.0);
+		}
+
+		if(written < 0)
+			return;
+
+		length += written;
+	}
+
+	for(int c = 0; c < STAT_COUNTER_COUNT; c++)
+	{
+		written = swprintf_s(buffer + length, size - length, L"%s: %I64d\n",
+			g_statCounterNames[c], g_statCounters[c]);
+		if(written < 0)
+			return;
+
+		length += written;
+	}
+
+	for(int p = 0; p < STAT_STARTUP_COUNT; p++)
+	{
+		LONGLONG ns = g_statStartupNs[p];
+		if(ns)
+			written = swprintf_s(buffer + length, size - length, L"startup, %s: %.1f ms\n", g_statStartupNames[p], ns / 1000000.0);
+		else
+			written = swprintf_s(buffer + length, size - length, L"startup, %s: not yet\n", g_statStartupNames[p]);
+		if(written < 0)
+			return;
+
+		length += written;
+	}
+
+	if(g_statsInitialWorkingSet)
+	{
+		written = swprintf_s(buffer + length, size - length,
+			L"memory after startup: working set %Iu KB, private bytes %Iu KB\n",
+			g_statsInitialWorkingSet / 1024, g_statsInitialPrivateBytes / 1024);
+		if(written < 0)
+			return;
+
+		length += written;
+	}
+
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	counters.cb = sizeof(counters);
+	if(GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+	{
+		written = swprintf_s(buffer + length, size - length,
+			L"memory now: working set %Iu KB (peak %Iu KB), private bytes %Iu KB\n",
+			counters.WorkingSetSize / 1024, counters.PeakWorkingSetSize / 1024, counters.PrivateUsage / 1024);
+		if(written < 0)
+			return;
+
+		length += written;
+	}
+
+	ClipboardStoreStats clipboardStats;
+	GetClipboardStoreStats(&clipboardStats);
+	swprintf_s(buffer + length, size - length,
+		L"clipboard: %I64d snapshots, %I64d bytes in memory, %I64d bytes spilled\n",
+		clipboardStats.snapshots, clipboardStats.bytesInMemory, clipboardStats.bytesSpilled);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the summary and all histogram buckets to the export file
+BOOL StatsExport(WCHAR* path, size_t size)
+{
+	WCHAR filePath[MAX_PATH];
+	DWORD length = GetTempPath(MAX_PATH, filePath);
+	if(length == 0 || length >= MAX_PATH ||
+		wcscat_s(filePath, MAX_PATH, STATS_EXPORT_FILE) != 0)
+		return FALSE;
+
+	FILE* file;
+	if(_wfopen_s(&file, filePath, L"w") != 0)
+		return FALSE;
+
+	WCHAR report[2048];
+	StatsFormatReport(report, _countof(report));
+	fwprintf(file, L"%s\nhistogram,bucket_upper_ns,samples\n", report);
+
+	for(int h = 0; h < STAT_HISTOGRAM_COUNT; h++)
+	{
+		for(int i = 0; i < STATS_BUCKETS; i++)
+		{
+			LONG samples = g_statHistograms[h].buckets[i];
+			if(samples)
+				fwprintf(file, L"%s,%I64u,%ld\n", g_statHistogramNames[h], 2ULL << i, samples);
+		}
+	}
+
+	fclose(file);
+
+	if(path)
+		wcscpy_s(path, size, filePath);
+
+	return TRUE;
+}
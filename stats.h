@@ -0,0 +1,69 @@
+#pragma once
+
+#include "hookstate.h"
+
+// Latency histograms, whose buckets are powers of two of nanoseconds
+typedef enum
+{
+	STAT_HOOK_CALLBACK,          // time spent in the keyboard hook callback
+	STAT_HOOK_TO_DISPATCH,       // time from the hook queuing an action to running it
+	STAT_ACTION_SWITCH_LAYOUT,   // time to run each LANG_ACTION_*
+	STAT_ACTION_SWITCH_PAIR,
+	STAT_ACTION_CONVERT_ALL_TEXT,
+	STAT_ACTION_CONVERT_SELECTED_TEXT,
+	STAT_ACTION_UNDO_CONVERSION,
+	STAT_HISTOGRAM_COUNT
+} StatHistogram;
+
+// Event counters
+typedef enum
+{
+	STAT_COUNTER_ACTIONS_QUEUED,
+	STAT_COUNTER_ACTIONS_DROPPED,
+	STAT_COUNTER_AUTOREPEATS_DROPPED,
+	STAT_COUNTER_ACTIONS_COALESCED,
+	STAT_COUNTER_FOCUS_CACHE_HITS,
+	STAT_COUNTER_FOCUS_CACHE_MISSES,
+	STAT_COUNTER_COUNT
+} StatCounter;
+
+// Points of the startup, whose times since StatsInit are recorded once
+typedef enum
+{
+	STAT_STARTUP_HOOK_READY, // the keyboard hook is installed
+	STAT_STARTUP_WARM,       // the conversion tables are built
+	STAT_STARTUP_COUNT
+} StatStartup;
+
+// number of buckets in each histogram, the last one holds all longer times
+#define STATS_BUCKETS 40
+
+// name of the file the statistics are exported to, in the temporary directory
+#define STATS_EXPORT_FILE L"recaps-stats.txt"
+
+// Returns the histogram of the time to run `action`
+#define STAT_ACTION_HISTOGRAM(action) \
+	((StatHistogram)(STAT_ACTION_SWITCH_LAYOUT + (action) - LANG_ACTION_SWITCH_LAYOUT))
+
+void StatsInit();
+
+// Returns the current time in performance counter ticks
+LONGLONG StatsNow();
+
+// Records the time between two StatsNow results in a histogram. It takes no
+// locks, and it's cheap enough to always be enabled.
+void StatsRecord(StatHistogram histogram, LONGLONG start, LONGLONG end);
+void StatsIncrement(StatCounter counter);
+void StatsAdd(StatCounter counter, LONGLONG value);
+void StatsMarkStartup(StatStartup point);
+
+// Records the working set and private bytes of the process once it's
+// initialized, to compare with the current ones in the report
+void StatsMarkMemory();
+
+// Writes a summary of the statistics to `buffer`
+void StatsFormatReport(WCHAR* buffer, size_t size);
+
+// Writes the summary and all histogram buckets to STATS_EXPORT_FILE in the
+// temporary directory, and returns its path in `path` if it's not NULL
+BOOL StatsExport(WCHAR* path, size_t size);
@@ -0,0 +1,46 @@
+// Runs the benchmarks of corebench.c. The results are written as comma
+// separated values to the file given on the command line (or to the
+// standard output), and a summary is printed to the standard error.
+//
+//     build/benchmark [results.csv]
+
+#include <stdio.h>
+#include "../corebench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a result line to the result file, and to the summary if asked to
+static void ReportResult(void* context, const BenchmarkResult* result)
+{
+	char line[256];
+
+	BenchmarkWriteCsv((FILE*)context, result);
+	fflush((FILE*)context);
+
+	if(result->summary && BenchmarkFormatSummary(line, sizeof(line), result) > 0)
+		fputs(line, stderr);
+}
+
+int main(int argc, char** argv)
+{
+	FILE* file = stdout;
+
+	if(argc > 1 && !(file = fopen(argv[1], "w")))
+	{
+		fprintf(stderr, "Cannot write %s\n", argv[1]);
+		return 1;
+	}
+
+	BenchmarkWriteCsvHeader(file);
+	int succeeded = RunCoreBenchmarks(ReportResult, file);
+
+	if(file != stdout)
+		fclose(file);
+
+	if(!succeeded)
+	{
+		fprintf(stderr, "Failed to prepare the benchmark text.\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// A minimal harness for the tests of the platform independent modules, which
+// the Makefile builds and runs on any platform with a C99 compiler. Each test
+// file is a program whose main calls its test functions and returns
+// TestResult.
+
+#include <stdio.h>
+#include <string.h>
+#include "../layoutcore.h"
+
+static int g_testChecks;
+static int g_testFailures;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		g_testChecks++; \
+		if(!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			g_testFailures++; \
+		} \
+	} while(0)
+
+///////////////////////////////////////////////////////////////////////////////
+// Prints the result of the test program, and returns its exit code
+static inline int TestResult(const char* name)
+{
+	if(g_testFailures)
+		fprintf(stderr, "%s: %d of %d checks failed\n", name, g_testFailures, g_testChecks);
+	else
+		printf("%s: %d checks passed\n", name, g_testChecks);
+
+	return g_testFailures != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decodes UTF-8 text into UTF-16 in `buffer`, which has room for `size`
+// characters and the NUL. Returns the number of characters.
+static inline size_t TestText(LayoutChar* buffer, size_t size, const char* utf8)
+{
+	size_t length = 0;
+	const unsigned char* p = (const unsigned char*)utf8;
+
+	while(*p && length < size)
+	{
+		uint32_t code;
+		if(p[0] < 0x80)
+			code = *p++;
+		else if((p[0] & 0xE0) == 0xC0)
+		{
+			code = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+			p += 2;
+		}
+		else if((p[0] & 0xF0) == 0xE0)
+		{
+			code = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+			p += 3;
+		}
+		else
+		{
+			code = ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+			p += 4;
+		}
+
+		if(code >= 0x10000 && length + 1 < size)
+		{
+			code -= 0x10000;
+			buffer[length++] = (LayoutChar)(0xD800 + (code >> 10));
+			buffer[length++] = (LayoutChar)(0xDC00 + (code & 0x3FF));
+		}
+		else if(code < 0x10000)
+			buffer[length++] = (LayoutChar)code;
+		else
+			break;
+	}
+
+	buffer[length] = 0;
+	return length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if the `length` characters of `str` are the UTF-8 text
+static inline int TestTextEquals(const LayoutChar* str, size_t length, const char* utf8)
+{
+	LayoutChar expected[1024];
+	size_t expectedLength = TestText(expected, 1023, utf8);
+	return length == expectedLength && memcmp(str, expected, sizeof(LayoutChar) * length) == 0;
+}
@@ -0,0 +1,192 @@
+#include "test.h"
+#include "../appcompat.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a rule written in UTF-8
+static int ParseRule(const char* text, AppCompatRule* rule)
+{
+	LayoutChar buffer[APPCOMPAT_MAX_NAME + 64];
+	TestText(buffer, APPCOMPAT_MAX_NAME + 63, text);
+	return AppCompatParseRule(buffer, rule);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Looks up a window by names written in UTF-8, either of which can be NULL
+static SwitchStrategy Lookup(const AppCompatTable* table, const char* className, const char* imageName)
+{
+	LayoutChar classBuffer[APPCOMPAT_MAX_NAME], imageBuffer[APPCOMPAT_MAX_NAME];
+	if(className)
+		TestText(classBuffer, APPCOMPAT_MAX_NAME - 1, className);
+	if(imageName)
+		TestText(imageBuffer, APPCOMPAT_MAX_NAME - 1, imageName);
+
+	return AppCompatLookup(table, className ? classBuffer : NULL, imageName ? imageBuffer : NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rules are a prefix, a name and a strategy
+static void TestParse()
+{
+	AppCompatRule rule;
+
+	CHECK(ParseRule("class:OpusApp=cycle", &rule));
+	CHECK(rule.match == APPCOMPAT_MATCH_CLASS && rule.strategy == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(TestTextEquals(rule.name, 7, "OpusApp") && rule.name[7] == 0);
+
+	CHECK(ParseRule("PROCESS:WinWord.exe=Request", &rule));
+	CHECK(rule.match == APPCOMPAT_MATCH_PROCESS && rule.strategy == SWITCH_STRATEGY_REQUEST);
+	CHECK(TestTextEquals(rule.name, 11, "WinWord.exe"));
+
+	// the name is up to the last '='
+	CHECK(ParseRule("class:a=b=cycle", &rule));
+	CHECK(TestTextEquals(rule.name, 3, "a=b"));
+
+	// a bad prefix
+	CHECK(!ParseRule("window:OpusApp=cycle", &rule));
+	CHECK(!ParseRule("classOpusApp=cycle", &rule));
+	CHECK(!ParseRule("", &rule));
+
+	// no '=' or no name
+	CHECK(!ParseRule("class:OpusApp", &rule));
+	CHECK(!ParseRule("class:=cycle", &rule));
+	CHECK(!ParseRule("process:", &rule));
+
+	// an unknown strategy
+	CHECK(!ParseRule("class:OpusApp=toggle", &rule));
+	CHECK(!ParseRule("class:OpusApp=cycles", &rule));
+	CHECK(!ParseRule("class:OpusApp=", &rule));
+
+	// a name that's too long
+	char text[APPCOMPAT_MAX_NAME + 32] = "class:";
+	memset(text + 6, 'x', APPCOMPAT_MAX_NAME);
+	strcpy(text + 6 + APPCOMPAT_MAX_NAME, "=cycle");
+	CHECK(!ParseRule(text, &rule));
+	strcpy(text + 6 + APPCOMPAT_MAX_NAME - 1, "=cycle");
+	CHECK(ParseRule(text, &rule));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Lookups by class and then by process, without regard to case, with the
+// last of the rules for a name winning
+static void TestLookup()
+{
+	static const char* texts[] = {
+		"class:OpusApp=cycle",
+		"process:winword.exe=cycle",
+		"process:Notepad.exe=cycle",
+		"class:Notepad=request",
+		"process:NOTEPAD.EXE=request",
+		"class:ConsoleWindowClass=cycle",
+	};
+	AppCompatRule rules[6];
+	for(unsigned i = 0; i < 6; i++)
+		CHECK(ParseRule(texts[i], &rules[i]));
+
+	AppCompatTable table;
+	CHECK(AppCompatTableInit(&table, rules, 6));
+	CHECK(table.size >= 12 && (table.size & (table.size - 1)) == 0);
+	CHECK(table.processRules == 2);
+
+	CHECK(Lookup(&table, "OpusApp", NULL) == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(Lookup(&table, "opusapp", NULL) == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(Lookup(&table, "OPUSAPP", "explorer.exe") == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(Lookup(&table, "OpusApp2", NULL) == SWITCH_STRATEGY_REQUEST);
+	CHECK(Lookup(&table, "Opus", NULL) == SWITCH_STRATEGY_REQUEST);
+
+	CHECK(Lookup(&table, "_WwG", "WINWORD.exe") == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(Lookup(&table, NULL, "winword.EXE") == SWITCH_STRATEGY_CYCLE_KEYS);
+
+	// the last rule for notepad.exe wins
+	CHECK(Lookup(&table, NULL, "notepad.exe") == SWITCH_STRATEGY_REQUEST);
+
+	// a class name and a process name don't match each other's rules
+	CHECK(Lookup(&table, "winword.exe", NULL) == SWITCH_STRATEGY_REQUEST);
+	CHECK(Lookup(&table, "Edit", "OpusApp") == SWITCH_STRATEGY_REQUEST);
+
+	// the class rule comes first
+	CHECK(Lookup(&table, "Notepad", "winword.exe") == SWITCH_STRATEGY_REQUEST);
+	CHECK(Lookup(&table, "ConsoleWindowClass", "notepad.exe") == SWITCH_STRATEGY_CYCLE_KEYS);
+
+	// non-ASCII letters are compared as they are
+	CHECK(Lookup(&table, "OpusApp\xC3\x89", NULL) == SWITCH_STRATEGY_REQUEST);
+
+	AppCompatTableFree(&table);
+	CHECK(table.slots == NULL);
+	CHECK(Lookup(&table, "OpusApp", "winword.exe") == SWITCH_STRATEGY_REQUEST);
+
+	// more rules than the initial size, all found
+	static AppCompatRule many[100];
+	for(unsigned i = 0; i < 100; i++)
+	{
+		char text[64];
+		snprintf(text, sizeof(text), "process:app%u.exe=%s", i, i % 3 ? "request" : "cycle");
+		CHECK(ParseRule(text, &many[i]));
+	}
+	CHECK(AppCompatTableInit(&table, many, 100));
+	CHECK(table.size >= 200);
+	int mismatches = 0;
+	for(unsigned i = 0; i < 100; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "APP%u.EXE", i);
+		if(Lookup(&table, NULL, name) != (i % 3 ? SWITCH_STRATEGY_REQUEST : SWITCH_STRATEGY_CYCLE_KEYS))
+			mismatches++;
+	}
+	CHECK(mismatches == 0);
+	AppCompatTableFree(&table);
+
+	// no rules at all
+	CHECK(AppCompatTableInit(&table, NULL, 0));
+	CHECK(Lookup(&table, "OpusApp", "winword.exe") == SWITCH_STRATEGY_REQUEST);
+	AppCompatTableFree(&table);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The cache keeps the last strategies decided, until a window is destroyed
+static void TestCache()
+{
+	AppCompatCache cache;
+	SwitchStrategy strategy;
+	AppCompatCacheInit(&cache);
+
+	CHECK(!AppCompatCacheGet(&cache, 0x100, &strategy));
+	CHECK(!AppCompatCacheGet(&cache, 0, &strategy));
+
+	AppCompatCachePut(&cache, 0x100, SWITCH_STRATEGY_CYCLE_KEYS);
+	AppCompatCachePut(&cache, 0x200, SWITCH_STRATEGY_REQUEST);
+	CHECK(AppCompatCacheGet(&cache, 0x100, &strategy) && strategy == SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(AppCompatCacheGet(&cache, 0x200, &strategy) && strategy == SWITCH_STRATEGY_REQUEST);
+	CHECK(!AppCompatCacheGet(&cache, 0x300, &strategy));
+
+	// a window decided again keeps the newer strategy
+	AppCompatCachePut(&cache, 0x100, SWITCH_STRATEGY_REQUEST);
+	CHECK(AppCompatCacheGet(&cache, 0x100, &strategy) && strategy == SWITCH_STRATEGY_REQUEST);
+
+	AppCompatCacheInvalidate(&cache, 0x100);
+	CHECK(!AppCompatCacheGet(&cache, 0x100, &strategy));
+	CHECK(AppCompatCacheGet(&cache, 0x200, &strategy));
+
+	// invalidating a window that isn't cached, or the empty id, changes nothing
+	AppCompatCacheInvalidate(&cache, 0x300);
+	AppCompatCacheInvalidate(&cache, 0);
+	CHECK(AppCompatCacheGet(&cache, 0x200, &strategy) && strategy == SWITCH_STRATEGY_REQUEST);
+
+	// the oldest windows are replaced once the cache is full
+	AppCompatCacheInit(&cache);
+	for(uintptr_t window = 1; window <= APPCOMPAT_CACHE_SIZE + 2; window++)
+		AppCompatCachePut(&cache, window, SWITCH_STRATEGY_CYCLE_KEYS);
+	CHECK(!AppCompatCacheGet(&cache, 1, &strategy));
+	CHECK(!AppCompatCacheGet(&cache, 2, &strategy));
+	int found = 0;
+	for(uintptr_t window = 3; window <= APPCOMPAT_CACHE_SIZE + 2; window++)
+		found += AppCompatCacheGet(&cache, window, &strategy);
+	CHECK(found == APPCOMPAT_CACHE_SIZE);
+}
+
+int main()
+{
+	TestParse();
+	TestLookup();
+	TestCache();
+	return TestResult("appcompat");
+}
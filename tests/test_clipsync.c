@@ -0,0 +1,151 @@
+#include "test.h"
+#include "../clipsync.h"
+
+#define TIMEOUT 1000
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies with a simulated clipboard and returns the result of the wait
+static int Copy(SimClipboard* sim, uint32_t timeout)
+{
+	ClipboardBackend backend;
+	SimClipboardGetBackend(sim, &backend);
+	return ClipboardWaitForCopy(&backend, timeout);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The wait ends as soon as the clipboard changes
+static void TestChange()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 1, 0);
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 30);
+	CHECK(sim.copies == 1);
+	CHECK(sim.waits == 1);
+	CHECK(sim.sequence == 1);
+
+	// a change that's already there when the wait starts
+	SimClipboardInit(&sim, 0, 1, 0);
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 0);
+	CHECK(sim.waits == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Without a selection the clipboard doesn't change, and the wait times out
+static void TestNoSelection()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 0, 0);
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == TIMEOUT);
+	CHECK(sim.sequence == 0);
+
+	// a change that comes too late
+	SimClipboardInit(&sim, TIMEOUT + 500, 1, 0);
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == TIMEOUT);
+
+	// no time to wait at all
+	SimClipboardInit(&sim, 30, 1, 0);
+	CHECK(Copy(&sim, 0) == 0);
+	CHECK(sim.copies == 1);
+	CHECK(sim.waits == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Waits that return without a change, like polling, only cause another look
+static void TestPolling()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 1, 50);
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 50);
+	CHECK(sim.waits == 1);
+
+	SimClipboardInit(&sim, 120, 1, 50);
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 150);
+	CHECK(sim.waits == 3);
+
+	SimClipboardInit(&sim, 30, 0, 300);
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == TIMEOUT);
+	CHECK(sim.waits == 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A canceled wait is given up, unless the clipboard changed before
+static void TestCancel()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 1, 0);
+	sim.cancelPending = 1;
+	sim.cancelTime = 10;
+	CHECK(Copy(&sim, TIMEOUT) == CLIPBOARD_WAIT_CANCELED);
+	CHECK(sim.now == 10);
+
+	SimClipboardInit(&sim, 30, 1, 0);
+	sim.cancelPending = 1;
+	sim.cancelTime = 50;
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 30);
+	CHECK(sim.cancelPending);
+
+	// a cancel after the timeout doesn't matter
+	SimClipboardInit(&sim, 30, 0, 0);
+	sim.cancelPending = 1;
+	sim.cancelTime = TIMEOUT + 10;
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == TIMEOUT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A notification of the restore of the last conversion, still queued when
+// the copy command is sent, doesn't count as the copy
+static void TestStaleNotification()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 0, 0);
+	sim.staleNotifications = 2;
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == TIMEOUT);
+	CHECK(sim.waits == 3);
+	CHECK(sim.staleNotifications == 0);
+
+	// the copy is still seen when it comes
+	SimClipboardInit(&sim, 30, 1, 0);
+	sim.staleNotifications = 1;
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 30);
+	CHECK(sim.waits == 2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The clock and the sequence number may wrap around during the wait
+static void TestWrapAround()
+{
+	SimClipboard sim;
+	SimClipboardInit(&sim, 30, 1, 0);
+	sim.now = 0xFFFFFFF0;
+	sim.sequence = 0xFFFFFFFF;
+	CHECK(Copy(&sim, TIMEOUT) == 1);
+	CHECK(sim.now == 14);
+	CHECK(sim.sequence == 0);
+
+	SimClipboardInit(&sim, 30, 0, 0);
+	sim.now = 0xFFFFFFF0;
+	CHECK(Copy(&sim, TIMEOUT) == 0);
+	CHECK(sim.now == (uint32_t)(0xFFFFFFF0 + TIMEOUT));
+}
+
+int main()
+{
+	TestChange();
+	TestNoSelection();
+	TestPolling();
+	TestCancel();
+	TestStaleNotification();
+	TestWrapAround();
+	return TestResult("clipsync");
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "test.h"
+#include "../configstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if the values are the given ones
+static int ValuesAre(const ConfigValues* values, uint32_t mainLayout, uint32_t pairedLayout)
+{
+	return values->mainLayout == mainLayout && values->pairedLayout == pairedLayout;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The settings come back from their serialization, and damaged data is
+// refused without touching them
+static void TestSerialize()
+{
+	uint8_t buffer[CONFIG_MAX_FILE_SIZE];
+	ConfigValues values = { 0x04090409, 0x040D040D };
+	ConfigValues loaded = { 0, 0 };
+
+	size_t size = ConfigSerialize(&values, buffer, sizeof(buffer));
+	CHECK(size == 12 + 2 * 8 + 4);
+	CHECK(ConfigDeserialize(buffer, size, &loaded));
+	CHECK(ValuesAre(&loaded, 0x04090409, 0x040D040D));
+
+	// the settings that aren't stored are kept
+	ConfigValues mainOnly = { 0x04190419, 0 };
+	size = ConfigSerialize(&mainOnly, buffer, sizeof(buffer));
+	CHECK(size == 12 + 8 + 4);
+	CHECK(ConfigDeserialize(buffer, size, &loaded));
+	CHECK(ValuesAre(&loaded, 0x04190419, 0x040D040D));
+
+	CHECK(ConfigSerialize(&values, buffer, 12 + 2 * 8 + 3) == 0);
+
+	size = ConfigSerialize(&values, buffer, sizeof(buffer));
+	for(size_t i = 0; i < size; i++)
+	{
+		buffer[i] ^= 0x40;
+		CHECK(!ConfigDeserialize(buffer, size, &loaded));
+		buffer[i] ^= 0x40;
+	}
+
+	for(size_t truncated = 0; truncated < size; truncated++)
+		CHECK(!ConfigDeserialize(buffer, truncated, &loaded));
+
+	CHECK(ValuesAre(&loaded, 0x04190419, 0x040D040D));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records with keys of newer versions are skipped
+static void TestUnknownKey()
+{
+	uint8_t buffer[CONFIG_MAX_FILE_SIZE];
+	ConfigValues values = { 0x04090409, 0x040D040D };
+	ConfigValues loaded = { 0, 0 };
+
+	size_t size = ConfigSerialize(&values, buffer, sizeof(buffer));
+
+	// turn the main layout record into an unknown one, and fix the checksum
+	buffer[12] = 99;
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size - 4; i++)
+	{
+		hash ^= buffer[i];
+		hash *= 16777619u;
+	}
+	for(int i = 0; i < 4; i++)
+		buffer[size - 4 + i] = (uint8_t)(hash >> (8 * i));
+
+	CHECK(ConfigDeserialize(buffer, size, &loaded));
+	CHECK(ValuesAre(&loaded, 0, 0x040D040D));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes `size` bytes to a file
+static int WriteTestFile(const char* path, const void* data, size_t size)
+{
+	FILE* file = fopen(path, "wb");
+	if(!file)
+		return 0;
+
+	int bWritten = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && bWritten;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The file backend saves and loads the settings, and ignores a missing or
+// damaged file
+static void TestFileStore()
+{
+	const char* directory = getenv("TMPDIR");
+	char path[CONFIG_MAX_PATH];
+	snprintf(path, sizeof(path), "%s/recaps-test-%ld.cfg", directory ? directory : "/tmp", (long)getpid());
+
+	FileConfigStore fileStore;
+	ConfigStore store;
+	CHECK(FileConfigStoreInit(&fileStore, path));
+	FileConfigStoreGetStore(&fileStore, &store);
+
+	ConfigValues loaded = { 0x1111, 0x2222 };
+	remove(path);
+	CHECK(!store.Load(store.context, &loaded));
+	CHECK(ValuesAre(&loaded, 0x1111, 0x2222));
+
+	ConfigValues values = { 0x04090409, 0x04190419 };
+	CHECK(store.Save(store.context, &values));
+	CHECK(store.Load(store.context, &loaded));
+	CHECK(ValuesAre(&loaded, 0x04090409, 0x04190419));
+
+	// saving again replaces the file
+	ConfigValues swapped = { 0x04190419, 0x04090409 };
+	CHECK(store.Save(store.context, &swapped));
+	CHECK(store.Load(store.context, &loaded));
+	CHECK(ValuesAre(&loaded, 0x04190419, 0x04090409));
+
+	static const char garbage[] = "[Recaps]\r\nMainLanguage=English\r\n";
+	CHECK(WriteTestFile(path, garbage, sizeof(garbage) - 1));
+	CHECK(!store.Load(store.context, &loaded));
+	CHECK(ValuesAre(&loaded, 0x04190419, 0x04090409));
+
+	CHECK(WriteTestFile(path, "", 0));
+	CHECK(!store.Load(store.context, &loaded));
+
+	remove(path);
+
+	// a path that doesn't fit
+	char longPath[CONFIG_MAX_PATH + 1];
+	memset(longPath, 'a', CONFIG_MAX_PATH);
+	longPath[CONFIG_MAX_PATH] = 0;
+	CHECK(!FileConfigStoreInit(&fileStore, longPath));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A series of changes is saved once, CONFIG_SAVE_DELAY after the last one
+static void TestSchedule()
+{
+	ConfigSaveSchedule schedule;
+	ConfigValues values = { 1, 2 };
+	ConfigValues saved;
+
+	ConfigScheduleInit(&schedule);
+	CHECK(ConfigScheduleWait(&schedule, 0) == CONFIG_NO_SAVE);
+	CHECK(!ConfigScheduleTake(&schedule, &saved));
+
+	CHECK(ConfigScheduleSet(&schedule, &values, 100));
+	values.mainLayout = 2;
+	values.pairedLayout = 1;
+	CHECK(ConfigScheduleSet(&schedule, &values, 600));
+	values.mainLayout = 3;
+	CHECK(ConfigScheduleSet(&schedule, &values, 1100));
+
+	CHECK(ConfigScheduleWait(&schedule, 1100) == CONFIG_SAVE_DELAY);
+	CHECK(ConfigScheduleWait(&schedule, 1600) == CONFIG_SAVE_DELAY - 500);
+	CHECK(ConfigScheduleWait(&schedule, 1100 + CONFIG_SAVE_DELAY) == 0);
+	CHECK(ConfigScheduleWait(&schedule, 5000 + CONFIG_SAVE_DELAY) == 0);
+
+	CHECK(ConfigScheduleTake(&schedule, &saved));
+	CHECK(ValuesAre(&saved, 3, 1));
+	CHECK(ConfigScheduleWait(&schedule, 5000) == CONFIG_NO_SAVE);
+	CHECK(!ConfigScheduleTake(&schedule, &saved));
+
+	// setting the saved values again doesn't save
+	CHECK(!ConfigScheduleSet(&schedule, &values, 6000));
+	CHECK(ConfigScheduleWait(&schedule, 6000) == CONFIG_NO_SAVE);
+
+	// a change that's undone before the save is still saved, since the
+	// schedule doesn't keep the saved values
+	values.pairedLayout = 4;
+	CHECK(ConfigScheduleSet(&schedule, &values, 7000));
+	values.pairedLayout = 1;
+	CHECK(ConfigScheduleSet(&schedule, &values, 7100));
+	CHECK(ConfigScheduleWait(&schedule, 7100) == CONFIG_SAVE_DELAY);
+	CHECK(ConfigScheduleTake(&schedule, &saved));
+	CHECK(ValuesAre(&saved, 3, 1));
+
+	// a failed save waits for the next change, or a flush
+	ConfigScheduleFailed(&schedule);
+	CHECK(ConfigScheduleWait(&schedule, 20000) == CONFIG_NO_SAVE);
+	CHECK(ConfigScheduleSet(&schedule, &values, 20000));
+	CHECK(ConfigScheduleWait(&schedule, 20000) == CONFIG_SAVE_DELAY);
+	CHECK(ConfigScheduleTake(&schedule, &saved));
+	ConfigScheduleFailed(&schedule);
+	CHECK(ConfigScheduleTake(&schedule, &saved));
+	CHECK(ValuesAre(&saved, 3, 1));
+
+	// the clock wraps around
+	values.mainLayout = 5;
+	CHECK(ConfigScheduleSet(&schedule, &values, 0xFFFFFF00));
+	CHECK(ConfigScheduleWait(&schedule, 0x100) == CONFIG_SAVE_DELAY - 0x200);
+	CHECK(ConfigScheduleWait(&schedule, CONFIG_SAVE_DELAY) == 0);
+}
+
+int main()
+{
+	TestSerialize();
+	TestUnknownKey();
+	TestFileStore();
+	TestSchedule();
+	return TestResult("configstore");
+}
@@ -0,0 +1,171 @@
+#include "test.h"
+#include "../convhistory.h"
+
+#define WINDOW 0x10020
+#define OTHER_WINDOW 0x30040
+
+#define LAYOUT_US 1
+#define LAYOUT_HE 2
+#define LAYOUT_RU 3
+#define LAYOUT_DE 4
+
+static ConversionHistory g_history;
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds the conversion of `original` to `converted` in `window`
+static int AddConversion(uint64_t window, uint32_t generation, LayoutId source, LayoutId target,
+	const char* original, const char* converted)
+{
+	LayoutChar originalText[64], convertedText[64];
+	size_t originalLength = TestText(originalText, 63, original);
+	size_t convertedLength = TestText(convertedText, 63, converted);
+
+	return ConversionHistoryAdd(&g_history, window, generation, target, source, target,
+		originalText, originalLength, convertedText, convertedLength);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A conversion is kept with its original text, and found until the input
+// generation changes or a newer conversion in the window replaces it
+static void TestFind()
+{
+	ConversionHistoryInit(&g_history);
+
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 1) == NULL);
+
+	CHECK(AddConversion(WINDOW, 1, LAYOUT_US, LAYOUT_HE, "akuo", "שלום"));
+	ConversionRecord* record = ConversionHistoryFind(&g_history, WINDOW, 1);
+	CHECK(record != NULL);
+	if(!record)
+		return;
+
+	CHECK(TestTextEquals(record->original, record->originalLength, "akuo"));
+	CHECK(record->source == LAYOUT_US && record->target == LAYOUT_HE && record->before == LAYOUT_HE);
+	CHECK(record->current == LAYOUT_US);
+	CHECK(record->steps == 4);
+
+	// the user typed or clicked since
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 2) == NULL);
+	CHECK(ConversionHistoryFind(&g_history, OTHER_WINDOW, 1) == NULL);
+
+	// once updated at the new generation, it's found again
+	ConversionRecordUpdate(record, 0, 2, 4);
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 2) == record);
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 1) == NULL);
+
+	// a conversion in another window doesn't replace it
+	CHECK(AddConversion(OTHER_WINDOW, 2, LAYOUT_RU, LAYOUT_US, "ghbdtn", "привет"));
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 2) == record);
+	CHECK(ConversionHistoryFind(&g_history, OTHER_WINDOW, 2) != NULL);
+
+	// a newer conversion in the window does, and the older one is gone even
+	// at its own generation
+	CHECK(AddConversion(WINDOW, 3, LAYOUT_HE, LAYOUT_US, "ab", "שנ"));
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 2) == NULL);
+	record = ConversionHistoryFind(&g_history, WINDOW, 3);
+	CHECK(record && TestTextEquals(record->original, record->originalLength, "ab"));
+
+	// a text that's too long, or a conversion without a window, isn't kept,
+	// and drops the older conversion in the window
+	static LayoutChar longText[CONVERSION_HISTORY_MAX_CHARS + 1];
+	for(size_t i = 0; i < CONVERSION_HISTORY_MAX_CHARS + 1; i++)
+		longText[i] = 'a';
+	CHECK(!ConversionHistoryAdd(&g_history, WINDOW, 3, LAYOUT_US, LAYOUT_US, LAYOUT_HE,
+		longText, CONVERSION_HISTORY_MAX_CHARS + 1, longText, CONVERSION_HISTORY_MAX_CHARS + 1));
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 3) == NULL);
+	CHECK(!AddConversion(0, 3, LAYOUT_US, LAYOUT_HE, "a", "ש"));
+	CHECK(ConversionHistoryFind(&g_history, 0, 3) == NULL);
+
+	ConversionHistoryFree(&g_history);
+	CHECK(ConversionHistoryFind(&g_history, OTHER_WINDOW, 2) == NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The oldest conversion is replaced once the ring is full
+static void TestRing()
+{
+	ConversionHistoryInit(&g_history);
+
+	for(uint64_t i = 0; i < CONVERSION_HISTORY_SIZE + 2; i++)
+		CHECK(AddConversion(WINDOW + i, 1, LAYOUT_US, LAYOUT_HE, "a", "ש"));
+
+	CHECK(ConversionHistoryFind(&g_history, WINDOW, 1) == NULL);
+	CHECK(ConversionHistoryFind(&g_history, WINDOW + 1, 1) == NULL);
+	int found = 0;
+	for(uint64_t i = 2; i < CONVERSION_HISTORY_SIZE + 2; i++)
+		found += ConversionHistoryFind(&g_history, WINDOW + i, 1) != NULL;
+	CHECK(found == CONVERSION_HISTORY_SIZE);
+
+	ConversionHistoryFree(&g_history);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The texts come in order: the original, the other layouts in list order,
+// and the conversion from the detected layout again
+static void TestNextSource()
+{
+	static const LayoutId layouts[4] = { LAYOUT_RU, LAYOUT_HE, LAYOUT_US, LAYOUT_DE };
+	ConversionHistoryInit(&g_history);
+
+	CHECK(AddConversion(WINDOW, 1, LAYOUT_US, LAYOUT_HE, "akuo", "שלום"));
+	ConversionRecord* record = ConversionHistoryFind(&g_history, WINDOW, 1);
+	CHECK(record != NULL);
+	if(!record)
+		return;
+
+	LayoutId expected[] = { 0, LAYOUT_RU, LAYOUT_DE, LAYOUT_US, 0, LAYOUT_RU };
+	int mismatches = 0;
+	for(size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+	{
+		LayoutId source = ConversionRecordNextSource(record, layouts, 4);
+		if(source != expected[i])
+			mismatches++;
+		ConversionRecordUpdate(record, source, 1, 4);
+	}
+	CHECK(mismatches == 0);
+
+	// with only the two layouts of the conversion, it toggles
+	ConversionRecordUpdate(record, LAYOUT_US, 1, 4);
+	CHECK(ConversionRecordNextSource(record, layouts + 1, 2) == 0);
+	ConversionRecordUpdate(record, 0, 1, 4);
+	CHECK(ConversionRecordNextSource(record, layouts + 1, 2) == LAYOUT_US);
+
+	// the current layout was removed from the list
+	ConversionRecordUpdate(record, LAYOUT_DE, 1, 4);
+	CHECK(ConversionRecordNextSource(record, layouts, 3) == LAYOUT_US);
+
+	ConversionHistoryFree(&g_history);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CR LF and surrogate pairs are a single caret step, and lone halves count
+// on their own
+static void TestCaretSteps()
+{
+	static const LayoutChar crlf[] = { 'a', '\r', '\n', 'b', '\n', '\r', 'c' };
+	static const LayoutChar pair[] = { 'a', 0xD83D, 0xDE00, 'b' };
+	static const LayoutChar lone[] = { 0xDE00, 0xD83D, 'a', 0xD83D };
+	static const LayoutChar trailing[] = { 'a', '\r' };
+
+	CHECK(ConversionCaretSteps(crlf, 0) == 0);
+	CHECK(ConversionCaretSteps(crlf, 7) == 6);
+	CHECK(ConversionCaretSteps(crlf, 2) == 2);
+	CHECK(ConversionCaretSteps(pair, 4) == 3);
+	CHECK(ConversionCaretSteps(pair, 2) == 2);
+	CHECK(ConversionCaretSteps(lone, 4) == 4);
+	CHECK(ConversionCaretSteps(trailing, 2) == 2);
+
+	LayoutChar text[16];
+	size_t length = TestText(text, 15, "a😀\r\nש");
+	CHECK(length == 6);
+	CHECK(ConversionCaretSteps(text, length) == 4);
+}
+
+int main()
+{
+	TestFind();
+	TestRing();
+	TestNextSource();
+	TestCaretSteps();
+	return TestResult("convhistory");
+}
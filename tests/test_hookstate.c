@@ -0,0 +1,302 @@
+#include "test.h"
+#include "../hookstate.h"
+
+#define VK_A 0x41
+
+static HookState g_state;
+static HookDecision g_decision;
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs a key event through the state machine, leaving the decision in
+// g_decision
+static void Key(uint32_t vk, int down, int injected)
+{
+	HookEvent event;
+	event.vk = vk;
+	event.down = down;
+	event.injected = injected;
+	g_state = HookStateProcess(g_state, &event, &g_decision);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Presses and releases CapsLock, and returns the decision of the press
+static HookDecision PressCapsLock()
+{
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	HookDecision decision = g_decision;
+
+	Key(HOOK_VK_CAPITAL, 0, 0);
+	CHECK(g_decision.action == LANG_ACTION_NONE);
+	CHECK(!g_decision.swallow);
+
+	return decision;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Each side of a modifier is tracked on its own, and the events are let through
+static void TestModifiers()
+{
+	memset(&g_state, 0, sizeof(g_state));
+
+	Key(HOOK_VK_LSHIFT, 1, 0);
+	CHECK(g_state.modifiers == HOOK_MOD_LSHIFT);
+	CHECK(!g_decision.swallow && !g_decision.typed && g_decision.action == LANG_ACTION_NONE);
+
+	Key(HOOK_VK_RSHIFT, 1, 0);
+	Key(HOOK_VK_RCONTROL, 1, 0);
+	Key(HOOK_VK_LMENU, 1, 0);
+	CHECK(g_state.modifiers == (HOOK_MOD_SHIFT | HOOK_MOD_RCONTROL | HOOK_MOD_LMENU));
+
+	Key(HOOK_VK_LSHIFT, 0, 0);
+	CHECK(g_state.modifiers == (HOOK_MOD_RSHIFT | HOOK_MOD_RCONTROL | HOOK_MOD_LMENU));
+
+	Key(HOOK_VK_RSHIFT, 0, 0);
+	Key(HOOK_VK_RCONTROL, 0, 0);
+	Key(HOOK_VK_LMENU, 0, 0);
+	CHECK(g_state.modifiers == 0);
+
+	// keys without a side count as the left one
+	Key(HOOK_VK_SHIFT, 1, 0);
+	Key(HOOK_VK_CONTROL, 1, 0);
+	Key(HOOK_VK_MENU, 1, 0);
+	CHECK(g_state.modifiers == (HOOK_MOD_LSHIFT | HOOK_MOD_LCONTROL | HOOK_MOD_LMENU));
+	Key(HOOK_VK_LSHIFT, 0, 0);
+	Key(HOOK_VK_LCONTROL, 0, 0);
+	Key(HOOK_VK_LMENU, 0, 0);
+	CHECK(g_state.modifiers == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The action of CapsLock depends on the modifiers that are down
+static void TestCapsLock()
+{
+	HookDecision decision;
+	memset(&g_state, 0, sizeof(g_state));
+
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_SWITCH_LAYOUT);
+	CHECK(decision.swallow && !decision.releaseCapsLock && !decision.autorepeat && !decision.typed);
+
+	Key(HOOK_VK_LMENU, 1, 0);
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_SWITCH_PAIR);
+	CHECK(decision.swallow && decision.releaseCapsLock);
+
+	// Alt wins over Ctrl
+	Key(HOOK_VK_LCONTROL, 1, 0);
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_SWITCH_PAIR);
+	Key(HOOK_VK_LMENU, 0, 0);
+
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_CONVERT_ALL_TEXT);
+	CHECK(decision.swallow && !decision.releaseCapsLock);
+
+	// both Ctrl keys convert the selected text only
+	Key(HOOK_VK_RCONTROL, 1, 0);
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_CONVERT_SELECTED_TEXT);
+	CHECK(decision.swallow);
+
+	Key(HOOK_VK_LCONTROL, 0, 0);
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_CONVERT_ALL_TEXT);
+
+	// Ctrl+Shift undoes the last conversion
+	Key(HOOK_VK_LSHIFT, 1, 0);
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_UNDO_CONVERSION);
+	CHECK(decision.swallow && !decision.releaseCapsLock);
+	Key(HOOK_VK_RCONTROL, 0, 0);
+
+	// Shift lets the old CapsLock through
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_NONE);
+	CHECK(!decision.swallow);
+	Key(HOOK_VK_LSHIFT, 0, 0);
+
+	decision = PressCapsLock();
+	CHECK(decision.action == LANG_ACTION_SWITCH_LAYOUT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Key downs while CapsLock is held are swallowed without an action
+static void TestAutorepeat()
+{
+	memset(&g_state, 0, sizeof(g_state));
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_SWITCH_LAYOUT);
+	CHECK(!g_decision.autorepeat);
+	CHECK(g_state.capsDown);
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.autorepeat);
+	CHECK(g_decision.action == LANG_ACTION_NONE);
+	CHECK(g_decision.swallow);
+
+	Key(HOOK_VK_CAPITAL, 0, 0);
+	CHECK(!g_state.capsDown);
+
+	// the autorepeat of Alt+CapsLock doesn't release CapsLock again
+	Key(HOOK_VK_RMENU, 1, 0);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_SWITCH_PAIR && g_decision.releaseCapsLock);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.autorepeat);
+	CHECK(g_decision.action == LANG_ACTION_NONE && !g_decision.releaseCapsLock);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+	Key(HOOK_VK_RMENU, 0, 0);
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_SWITCH_LAYOUT && !g_decision.autorepeat);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Syncing the modifiers with the system's key state, which never sees the
+// swallowed CapsLock down, keeps a held CapsLock an autorepeat
+static void TestSync()
+{
+	memset(&g_state, 0, sizeof(g_state));
+
+	Key(HOOK_VK_LCONTROL, 1, 0);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_CONVERT_ALL_TEXT);
+
+	// the key up of Ctrl was missed
+	g_state = HookStateSync(g_state, 0);
+	CHECK(g_state.modifiers == 0);
+	CHECK(g_state.capsDown);
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.autorepeat);
+	CHECK(g_decision.action == LANG_ACTION_NONE && g_decision.swallow);
+
+	g_state = HookStateSync(g_state, HOOK_MOD_RSHIFT);
+	CHECK(g_state.modifiers == HOOK_MOD_RSHIFT);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.autorepeat && g_decision.action == LANG_ACTION_NONE);
+
+	Key(HOOK_VK_CAPITAL, 0, 0);
+	CHECK(!g_state.capsDown);
+	g_state = HookStateSync(g_state, 0);
+	CHECK(!g_state.capsDown);
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_SWITCH_LAYOUT && !g_decision.autorepeat);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Injected modifiers count, but injected CapsLock and other keys are let
+// through untouched
+static void TestInjected()
+{
+	memset(&g_state, 0, sizeof(g_state));
+
+	Key(HOOK_VK_CAPITAL, 1, 1);
+	CHECK(g_decision.action == LANG_ACTION_NONE && !g_decision.swallow);
+	CHECK(!g_state.capsDown);
+	Key(HOOK_VK_CAPITAL, 0, 1);
+
+	Key(VK_A, 1, 1);
+	CHECK(!g_decision.typed);
+
+	// Ctrl injected by a conversion, which CapsLock sees as down
+	Key(HOOK_VK_LCONTROL, 1, 1);
+	CHECK(g_state.modifiers == HOOK_MOD_LCONTROL);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.action == LANG_ACTION_CONVERT_ALL_TEXT);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+	Key(HOOK_VK_LCONTROL, 0, 1);
+	CHECK(g_state.modifiers == 0);
+
+	// an injected CapsLock while the key is held doesn't end the hold
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	Key(HOOK_VK_CAPITAL, 0, 1);
+	CHECK(g_state.capsDown);
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(g_decision.autorepeat);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Only the presses of keys other than CapsLock and the modifiers are typed
+static void TestTyped()
+{
+	memset(&g_state, 0, sizeof(g_state));
+
+	Key(VK_A, 1, 0);
+	CHECK(g_decision.typed);
+	CHECK(!g_decision.swallow && g_decision.action == LANG_ACTION_NONE);
+	Key(VK_A, 0, 0);
+	CHECK(!g_decision.typed);
+
+	Key(HOOK_VK_LSHIFT, 1, 0);
+	CHECK(!g_decision.typed);
+	Key(VK_A, 1, 0);
+	CHECK(g_decision.typed);
+	Key(VK_A, 0, 0);
+	Key(HOOK_VK_LSHIFT, 0, 0);
+
+	Key(HOOK_VK_CAPITAL, 1, 0);
+	CHECK(!g_decision.typed);
+	Key(HOOK_VK_CAPITAL, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if coalescing `actions` gives the runs in `expected`
+static int CheckCoalesce(const LangAction* actions, size_t count, const ActionRun* expected, size_t expectedCount)
+{
+	ActionRun runs[16];
+	size_t runCount = CoalesceActions(actions, count, runs);
+	if(runCount != expectedCount)
+		return 0;
+
+	for(size_t i = 0; i < runCount; i++)
+	{
+		if(runs[i].action != expected[i].action || runs[i].count != expected[i].count)
+			return 0;
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Layout switches are folded into their net effect, and conversions never are
+static void TestCoalesce()
+{
+	static const LangAction toggles[] = {
+		LANG_ACTION_SWITCH_LAYOUT, LANG_ACTION_SWITCH_LAYOUT, LANG_ACTION_SWITCH_LAYOUT };
+	static const ActionRun togglesRuns[] = { { LANG_ACTION_SWITCH_LAYOUT, 1 } };
+	CHECK(CheckCoalesce(toggles, 2, NULL, 0));
+	CHECK(CheckCoalesce(toggles, 3, togglesRuns, 1));
+
+	static const LangAction pairs[] = {
+		LANG_ACTION_SWITCH_PAIR, LANG_ACTION_SWITCH_LAYOUT, LANG_ACTION_NONE,
+		LANG_ACTION_SWITCH_LAYOUT, LANG_ACTION_SWITCH_PAIR, LANG_ACTION_SWITCH_PAIR };
+	static const ActionRun pairsRuns[] = { { LANG_ACTION_SWITCH_PAIR, 3 } };
+	CHECK(CheckCoalesce(pairs, 6, pairsRuns, 1));
+
+	static const LangAction conversions[] = {
+		LANG_ACTION_CONVERT_ALL_TEXT, LANG_ACTION_CONVERT_ALL_TEXT, LANG_ACTION_SWITCH_LAYOUT,
+		LANG_ACTION_UNDO_CONVERSION, LANG_ACTION_UNDO_CONVERSION, LANG_ACTION_SWITCH_LAYOUT };
+	static const ActionRun conversionsRuns[] = {
+		{ LANG_ACTION_CONVERT_ALL_TEXT, 1 }, { LANG_ACTION_CONVERT_ALL_TEXT, 1 },
+		{ LANG_ACTION_SWITCH_LAYOUT, 1 }, { LANG_ACTION_UNDO_CONVERSION, 1 },
+		{ LANG_ACTION_UNDO_CONVERSION, 1 }, { LANG_ACTION_SWITCH_LAYOUT, 1 } };
+	CHECK(CheckCoalesce(conversions, 6, conversionsRuns, 6));
+}
+
+int main()
+{
+	TestModifiers();
+	TestCapsLock();
+	TestAutorepeat();
+	TestSync();
+	TestInjected();
+	TestTyped();
+	TestCoalesce();
+	return TestResult("hookstate");
+}
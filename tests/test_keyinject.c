@@ -0,0 +1,162 @@
+#include "test.h"
+#include "../keyinject.h"
+
+#define VK_C    0x43
+#define VK_LEFT 0x25
+
+// key downs and ups in the expected sequences
+#define DOWN(vk) { vk, 0 }
+#define UP(vk)   { vk, 1 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns nonzero if the recorder logged exactly the `count` inputs
+static int Logged(const RecordingInjector* recorder, const KeyInput* expected, unsigned count)
+{
+	if(recorder->count != count)
+		return 0;
+
+	for(unsigned i = 0; i < count; i++)
+	{
+		if(recorder->log[i].vk != expected[i].vk || recorder->log[i].up != expected[i].up)
+			return 0;
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The modifiers of a combination are set up around the key and put back
+static void TestKeyCombo()
+{
+	KeyInput log[64];
+	RecordingInjector recorder;
+	KeyInjector injector;
+
+	static const KeyInput copy[] = { DOWN(KEY_VK_CONTROL), DOWN(VK_C), UP(VK_C), UP(KEY_VK_CONTROL) };
+	RecordingInjectorInit(&recorder, log, 64);
+	RecordingInjectorGetInjector(&recorder, &injector);
+	CHECK(InjectKeyCombo(&injector, VK_C, KEY_STATE_CONTROL));
+	CHECK(Logged(&recorder, copy, 4));
+	CHECK(recorder.submits == 1);
+
+	// Shift is held by the user, and released around Ctrl+C only
+	static const KeyInput copyShift[] = {
+		DOWN(KEY_VK_CONTROL), UP(KEY_VK_SHIFT), DOWN(VK_C), UP(VK_C), DOWN(KEY_VK_SHIFT), UP(KEY_VK_CONTROL) };
+	RecordingInjectorInit(&recorder, log, 64);
+	recorder.pressed = KEY_STATE_SHIFT;
+	CHECK(InjectKeyCombo(&injector, VK_C, KEY_STATE_CONTROL));
+	CHECK(Logged(&recorder, copyShift, 6));
+	CHECK(recorder.submits == 1);
+
+	// Ctrl is already down, and the key too
+	static const KeyInput copyHeld[] = { UP(VK_C), DOWN(VK_C) };
+	RecordingInjectorInit(&recorder, log, 64);
+	recorder.pressed = KEY_STATE_CONTROL | KEY_STATE_KEY;
+	CHECK(InjectKeyCombo(&injector, VK_C, KEY_STATE_CONTROL));
+	CHECK(Logged(&recorder, copyHeld, 2));
+
+	// every modifier flipped
+	static const KeyInput flipped[] = {
+		UP(KEY_VK_CONTROL), DOWN(KEY_VK_MENU), UP(KEY_VK_SHIFT), DOWN(VK_C), UP(VK_C),
+		DOWN(KEY_VK_SHIFT), UP(KEY_VK_MENU), DOWN(KEY_VK_CONTROL) };
+	RecordingInjectorInit(&recorder, log, 64);
+	recorder.pressed = KEY_STATE_CONTROL | KEY_STATE_SHIFT;
+	CHECK(InjectKeyCombo(&injector, VK_C, KEY_STATE_MENU));
+	CHECK(Logged(&recorder, flipped, KEY_COMBO_MAX_INPUTS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Alt+Shift presses are clean, with the held modifiers released around them
+static void TestAltShift()
+{
+	KeyInput log[64];
+	RecordingInjector recorder;
+	KeyInjector injector;
+
+	static const KeyInput twice[] = {
+		UP(KEY_VK_CONTROL),
+		DOWN(KEY_VK_MENU), DOWN(KEY_VK_SHIFT), UP(KEY_VK_SHIFT), UP(KEY_VK_MENU),
+		DOWN(KEY_VK_MENU), DOWN(KEY_VK_SHIFT), UP(KEY_VK_SHIFT), UP(KEY_VK_MENU),
+		DOWN(KEY_VK_CONTROL) };
+	RecordingInjectorInit(&recorder, log, 64);
+	RecordingInjectorGetInjector(&recorder, &injector);
+	recorder.pressed = KEY_STATE_CONTROL;
+	CHECK(InjectAltShift(&injector, 2));
+	CHECK(Logged(&recorder, twice, 10));
+	CHECK(recorder.submits == 1);
+
+	// the state of Shift as the key of the combination doesn't count twice
+	static const KeyInput shiftHeld[] = {
+		UP(KEY_VK_SHIFT),
+		DOWN(KEY_VK_MENU), DOWN(KEY_VK_SHIFT), UP(KEY_VK_SHIFT), UP(KEY_VK_MENU),
+		DOWN(KEY_VK_SHIFT) };
+	RecordingInjectorInit(&recorder, log, 64);
+	recorder.pressed = KEY_STATE_SHIFT | KEY_STATE_KEY;
+	CHECK(InjectAltShift(&injector, 1));
+	CHECK(Logged(&recorder, shiftHeld, 6));
+
+	RecordingInjectorInit(&recorder, log, 64);
+	CHECK(InjectAltShift(&injector, 0));
+	CHECK(recorder.submits == 0);
+
+	KeyInput inputs[64];
+	CHECK(BuildAltShift(inputs, 64, 3, 0) == 12);
+	CHECK(BuildAltShift(inputs, 64, 3, KEY_STATE_CONTROL | KEY_STATE_MENU | KEY_STATE_SHIFT) == KEY_ALT_SHIFT_INPUTS(3));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The presses of a key share one setup of the modifiers
+static void TestKeyRepeat()
+{
+	KeyInput log[64];
+	RecordingInjector recorder;
+	KeyInjector injector;
+
+	static const KeyInput select[] = {
+		DOWN(KEY_VK_SHIFT), DOWN(VK_LEFT), UP(VK_LEFT), DOWN(VK_LEFT), UP(VK_LEFT),
+		DOWN(VK_LEFT), UP(VK_LEFT), UP(KEY_VK_SHIFT) };
+	RecordingInjectorInit(&recorder, log, 64);
+	RecordingInjectorGetInjector(&recorder, &injector);
+	CHECK(InjectKeyRepeat(&injector, VK_LEFT, 3, KEY_STATE_SHIFT));
+	CHECK(Logged(&recorder, select, 8));
+	CHECK(recorder.submits == 1);
+
+	// Ctrl is held by the user, and Left is still pressed from scratch
+	static const KeyInput selectCtrl[] = {
+		UP(KEY_VK_CONTROL), DOWN(KEY_VK_SHIFT), DOWN(VK_LEFT), UP(VK_LEFT), UP(KEY_VK_SHIFT), DOWN(KEY_VK_CONTROL) };
+	RecordingInjectorInit(&recorder, log, 64);
+	recorder.pressed = KEY_STATE_CONTROL | KEY_STATE_KEY;
+	CHECK(InjectKeyRepeat(&injector, VK_LEFT, 1, KEY_STATE_SHIFT));
+	CHECK(Logged(&recorder, selectCtrl, 6));
+
+	RecordingInjectorInit(&recorder, log, 64);
+	CHECK(InjectKeyRepeat(&injector, VK_LEFT, 0, KEY_STATE_SHIFT));
+	CHECK(recorder.submits == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sequences that don't fit are refused, and partial injections reported
+static void TestCapacity()
+{
+	KeyInput inputs[64];
+	CHECK(BuildKeyCombo(inputs, KEY_COMBO_MAX_INPUTS - 1, VK_C, KEY_STATE_CONTROL, 0) == 0);
+	CHECK(BuildAltShift(inputs, KEY_ALT_SHIFT_INPUTS(2) - 1, 2, 0) == 0);
+	CHECK(BuildKeyRepeat(inputs, KEY_REPEAT_INPUTS(2) - 1, VK_LEFT, 2, KEY_STATE_SHIFT, 0) == 0);
+
+	KeyInput log[3];
+	RecordingInjector recorder;
+	KeyInjector injector;
+	RecordingInjectorInit(&recorder, log, 3);
+	RecordingInjectorGetInjector(&recorder, &injector);
+	CHECK(!InjectKeyCombo(&injector, VK_C, KEY_STATE_CONTROL));
+	CHECK(recorder.count == 3);
+}
+
+int main()
+{
+	TestKeyCombo();
+	TestAltShift();
+	TestKeyRepeat();
+	TestCapacity();
+	return TestResult("keyinject");
+}
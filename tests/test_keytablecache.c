@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include "test.h"
+#include "../keytablecache.h"
+#include "../layouttable.h"
+
+#define OS_BUILD    22631
+#define OS_REVISION 3880
+
+static LayoutTable* g_us;
+static LayoutTable* g_he;
+static LayoutTable* g_ru;
+
+// The layout table provider, counting the questions the cache passes on
+static LayoutProvider g_tables;
+static unsigned g_fallbackCalls;
+
+static int FallbackCharToKey(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key)
+{
+	g_fallbackCalls++;
+	return g_tables.CharToKey(context, layout, ch, key);
+}
+
+static int FallbackKeyToChars(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size)
+{
+	g_fallbackCalls++;
+	return g_tables.KeyToChars(context, layout, key, buffer, size);
+}
+
+static uint16_t FallbackGetLanguage(void* context, LayoutId layout)
+{
+	g_fallbackCalls++;
+	return g_tables.GetLanguage(context, layout);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills `provider` with the counting provider
+static void GetFallbackProvider(LayoutProvider* provider)
+{
+	*provider = g_tables;
+	provider->CharToKey = FallbackCharToKey;
+	provider->KeyToChars = FallbackKeyToChars;
+	provider->GetLanguage = FallbackGetLanguage;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Puts back the checksum of a file that was changed on purpose
+static void FixChecksum(uint8_t* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = KEYTABLE_HEADER_SIZE; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	for(int i = 0; i < 4; i++)
+		data[20 + i] = (uint8_t)(hash >> (8 * i));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a little endian number into a file
+static void SetUint32(uint8_t* p, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(value >> (8 * i));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The cache answers like the provider it was built from, and asks the
+// fallback for the layouts it doesn't have
+static void TestRoundTrip()
+{
+	LayoutId layouts[2] = { LayoutTableId(g_us), LayoutTableId(g_he) };
+	size_t size;
+	uint8_t* data = KeyTableCacheBuild(&g_tables, layouts, 2, OS_BUILD, OS_REVISION, &size);
+	CHECK(data != NULL);
+	if(!data)
+		return;
+
+	KeyTableCache cache;
+	CHECK(KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	LayoutProvider fallback, provider;
+	GetFallbackProvider(&fallback);
+	KeyTableCacheGetProvider(&cache, &fallback, &provider);
+	CHECK(provider.GetLanguage != NULL);
+	CHECK(provider.DeadKeyToChars == NULL);
+	CHECK(provider.OverrideChar == NULL);
+
+	g_fallbackCalls = 0;
+	int mismatches = 0;
+	for(int i = 0; i < 2; i++)
+	{
+		for(unsigned ch = 1; ch < 0x10000; ch++)
+		{
+			LayoutKey expected, key;
+			int bExpected = g_tables.CharToKey(g_tables.context, layouts[i], (LayoutChar)ch, &expected);
+			int bFound = provider.CharToKey(provider.context, layouts[i], (LayoutChar)ch, &key);
+			if(bFound != bExpected || (bFound && (key.vk != expected.vk || key.shift != expected.shift)))
+				mismatches++;
+		}
+
+		static const uint8_t shifts[4] = { 0, LAYOUT_SHIFT, LAYOUT_CONTROL | LAYOUT_ALT, LAYOUT_SHIFT | LAYOUT_CONTROL | LAYOUT_ALT };
+		for(unsigned vk = 0; vk < 256; vk++)
+		{
+			for(int level = 0; level < 4; level++)
+			{
+				LayoutKey key = { (uint8_t)vk, shifts[level] };
+				LayoutChar expected[LAYOUT_KEY_CHARS], chars[LAYOUT_KEY_CHARS];
+				int expectedCount = g_tables.KeyToChars(g_tables.context, layouts[i], key, expected, LAYOUT_KEY_CHARS);
+				int count = provider.KeyToChars(provider.context, layouts[i], key, chars, LAYOUT_KEY_CHARS);
+				if(count != expectedCount || (count != 0 && chars[0] != expected[0]))
+					mismatches++;
+			}
+		}
+	}
+	CHECK(mismatches == 0);
+	CHECK(g_fallbackCalls == 0);
+
+	// other shift states and layouts go to the fallback
+	LayoutKey ctrlA = { 0x41, LAYOUT_CONTROL };
+	LayoutChar chars[LAYOUT_KEY_CHARS];
+	provider.KeyToChars(provider.context, layouts[0], ctrlA, chars, LAYOUT_KEY_CHARS);
+	CHECK(g_fallbackCalls == 1);
+
+	LayoutKey key;
+	CHECK(provider.CharToKey(provider.context, LayoutTableId(g_ru), 0x0444, &key));
+	CHECK(key.vk == 0x41 && key.shift == 0);
+	CHECK(g_fallbackCalls == 2);
+
+	CHECK(provider.GetLanguage(provider.context, layouts[1]) == 0x040D);
+
+	// the conversion through the cache
+	LayoutCore core;
+	LayoutCoreInit(&core, &provider);
+	LayoutCoreSync(&core, layouts, 2);
+
+	LayoutChar text[16], buffer[16];
+	size_t length = TestText(text, 15, "akuo");
+	LayoutCoreConvertString(&core, text, length, buffer, layouts[0], layouts[1]);
+	CHECK(TestTextEquals(buffer, length, "שלום"));
+	LayoutCoreFree(&core);
+
+	// the same layouts build the same file
+	size_t sizeAgain;
+	uint8_t* dataAgain = KeyTableCacheBuild(&g_tables, layouts, 2, OS_BUILD, OS_REVISION, &sizeAgain);
+	CHECK(dataAgain && sizeAgain == size && memcmp(data, dataAgain, size) == 0);
+	free(dataAgain);
+
+	free(data);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A file of another version, system build or set of layouts, or a damaged
+// one, is refused
+static void TestRejected()
+{
+	LayoutId layouts[2] = { LayoutTableId(g_us), LayoutTableId(g_he) };
+	LayoutId swapped[2] = { LayoutTableId(g_he), LayoutTableId(g_us) };
+	LayoutId other[2] = { LayoutTableId(g_us), LayoutTableId(g_ru) };
+	KeyTableCache cache;
+	size_t size;
+
+	uint8_t* data = KeyTableCacheBuild(&g_tables, layouts, 2, OS_BUILD, OS_REVISION, &size);
+	CHECK(data != NULL);
+	if(!data)
+		return;
+
+	CHECK(!KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD + 1, OS_REVISION));
+	CHECK(!KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION + 1));
+	CHECK(!KeyTableCacheOpen(&cache, data, size, swapped, 2, OS_BUILD, OS_REVISION));
+	CHECK(!KeyTableCacheOpen(&cache, data, size, other, 2, OS_BUILD, OS_REVISION));
+	CHECK(!KeyTableCacheOpen(&cache, data, size, layouts, 1, OS_BUILD, OS_REVISION));
+	CHECK(cache.data == NULL);
+
+	SetUint32(data + 4, KEYTABLE_CACHE_VERSION + 1);
+	CHECK(!KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION));
+	SetUint32(data + 4, KEYTABLE_CACHE_VERSION);
+
+	data[0] ^= 1;
+	CHECK(!KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION));
+	data[0] ^= 1;
+
+	// a flipped bit anywhere after the header
+	int accepted = 0;
+	for(size_t i = KEYTABLE_HEADER_SIZE; i < size; i += 7)
+	{
+		data[i] ^= 0x10;
+		accepted += KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION);
+		data[i] ^= 0x10;
+	}
+	CHECK(accepted == 0);
+
+	CHECK(KeyTableCacheOpen(&cache, data, size, layouts, 2, OS_BUILD, OS_REVISION));
+	free(data);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Truncated files and entries that point outside of the file are refused,
+// even with a checksum that matches
+static void TestBounds()
+{
+	LayoutId layouts[2] = { LayoutTableId(g_us), LayoutTableId(g_he) };
+	KeyTableCache cache;
+	size_t size;
+
+	uint8_t* data = KeyTableCacheBuild(&g_tables, layouts, 2, OS_BUILD, OS_REVISION, &size);
+	CHECK(data != NULL);
+	if(!data)
+		return;
+
+	int accepted = 0;
+	for(size_t truncated = 0; truncated < size; truncated++)
+		accepted += KeyTableCacheOpen(&cache, data, truncated, layouts, 2, OS_BUILD, OS_REVISION);
+	CHECK(accepted == 0);
+
+	uint8_t* copy = (uint8_t*)malloc(size);
+	if(!copy)
+	{
+		free(data);
+		return;
+	}
+
+	uint8_t* secondEntry = copy + KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE;
+	const uint8_t* built = data + KEYTABLE_HEADER_SIZE + KEYTABLE_ENTRY_SIZE;
+	uint32_t offset = (uint32_t)built[8] | ((uint32_t)built[9] << 8) |
+		((uint32_t)built[10] << 16) | ((uint32_t)built[11] << 24);
+
+	// a block past the end of the file
+	memcpy(copy, data, size);
+	SetUint32(secondEntry + 8, (uint32_t)size + 16);
+	FixChecksum(copy, size);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	// a block that goes past the end, with an offset that wraps around
+	memcpy(copy, data, size);
+	SetUint32(secondEntry + 12, (uint32_t)(size - offset) + 1);
+	FixChecksum(copy, size);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	memcpy(copy, data, size);
+	SetUint32(secondEntry + 12, 0xFFFFFFFF);
+	FixChecksum(copy, size);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	// a block too small for its tables
+	memcpy(copy, data, size);
+	SetUint32(secondEntry + 12, 16);
+	FixChecksum(copy, size);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	// more keys than the block holds
+	memcpy(copy, data, size);
+	SetUint32(copy + offset + 256 * KEYTABLE_LEVELS * 3, 0x10000);
+	FixChecksum(copy, size);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	// more layouts than the file has entries for
+	LayoutId many[200];
+	for(int i = 0; i < 200; i++)
+		many[i] = layouts[i % 2];
+	memcpy(copy, data, size);
+	SetUint32(copy + 16, 200);
+	CHECK(!KeyTableCacheOpen(&cache, copy, size, many, 200, OS_BUILD, OS_REVISION));
+
+	// and the file as built still opens
+	memcpy(copy, data, size);
+	FixChecksum(copy, size);
+	CHECK(KeyTableCacheOpen(&cache, copy, size, layouts, 2, OS_BUILD, OS_REVISION));
+
+	free(copy);
+	free(data);
+}
+
+int main()
+{
+	g_us = LayoutTableLoadBuiltin("us");
+	g_he = LayoutTableLoadBuiltin("he");
+	g_ru = LayoutTableLoadBuiltin("ru");
+	LayoutTableGetProvider(&g_tables);
+
+	TestRoundTrip();
+	TestRejected();
+	TestBounds();
+
+	LayoutTableFree(g_us);
+	LayoutTableFree(g_he);
+	LayoutTableFree(g_ru);
+	return TestResult("keytablecache");
+}
@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include "test.h"
+#include "../layoutcore.h"
+#include "../layouttable.h"
+
+static LayoutTable* g_us;
+static LayoutTable* g_he;
+static LayoutTable* g_ru;
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets up a core over the built-in US, Hebrew and Russian tables
+static void InitCore(LayoutCore* core)
+{
+	LayoutProvider provider;
+	LayoutTableGetProvider(&provider);
+
+	LayoutId layouts[3] = { LayoutTableId(g_us), LayoutTableId(g_he), LayoutTableId(g_ru) };
+	LayoutCoreInit(core, &provider);
+	LayoutCoreSync(core, layouts, 3);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parsing layout tables
+static void TestLayoutTable()
+{
+	CHECK(g_us && g_he && g_ru);
+	CHECK(LayoutTableLoadBuiltin("xx") == NULL);
+	CHECK(LayoutTableParse("name bad\nkey zz a A\n") == NULL);
+
+	LayoutTable* table = LayoutTableParse("name dk\nlang 0406\nkey 41 a A\nkey DE U+00B4! U+00A8!\n");
+	CHECK(table != NULL);
+	if(table)
+	{
+		CHECK(table->lang == 0x0406);
+		CHECK(table->chars[0x41][0] == 'a' && table->chars[0x41][1] == 'A');
+		CHECK(table->chars[0xDE][0] == 0xB4 && (table->dead[0xDE] & 3) == 3);
+		LayoutTableFree(table);
+	}
+
+	LayoutProvider provider;
+	LayoutTableGetProvider(&provider);
+
+	LayoutKey key;
+	CHECK(provider.CharToKey(provider.context, LayoutTableId(g_he), 0x05E9, &key));
+	CHECK(key.vk == 0x41 && key.shift == 0);
+	CHECK(!provider.CharToKey(provider.context, LayoutTableId(g_he), 0x0444, &key));
+	CHECK(provider.GetLanguage(provider.context, LayoutTableId(g_ru)) == 0x0419);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converting characters and strings, with and without the SIMD kernel
+static void TestConvert()
+{
+	LayoutCore core;
+	InitCore(&core);
+	LayoutId us = LayoutTableId(g_us), he = LayoutTableId(g_he), ru = LayoutTableId(g_ru);
+
+	CHECK(LayoutCoreConvertChar(&core, 'a', us, he) == 0x05E9);
+	CHECK(LayoutCoreConvertChar(&core, 'a', us, ru) == 0x0444);
+	CHECK(LayoutCoreConvertChar(&core, 0x05E9, he, us) == 'a');
+	CHECK(LayoutCoreConvertChar(&core, 0x20AC, us, he) == 0);
+	CHECK(LayoutCoreConvertCharUncached(&core.provider, 'a', us, he) == 0x05E9);
+
+	LayoutChar text[64], buffer[64];
+	size_t length = TestText(text, 63, "akuo");
+	CHECK(LayoutCoreConvertString(&core, text, length, buffer, us, he) == length);
+	CHECK(TestTextEquals(buffer, length, "שלום"));
+
+	length = TestText(text, 63, "ghbdtn");
+	CHECK(LayoutCoreConvertString(&core, text, length, buffer, us, ru) == length);
+	CHECK(TestTextEquals(buffer, length, "привет"));
+
+	length = TestText(text, 63, "a\xE2\x82\xAC");
+	CHECK(LayoutCoreConvertString(&core, text, length, buffer, us, he) == 0);
+
+	// a long text goes through the SIMD kernel where it's supported, and has
+	// to come out the same as without it
+	size_t longLength = 10000;
+	LayoutChar* longText = (LayoutChar*)malloc(sizeof(LayoutChar) * longLength);
+	LayoutChar* simdBuffer = (LayoutChar*)malloc(sizeof(LayoutChar) * longLength);
+	LayoutChar* scalarBuffer = (LayoutChar*)malloc(sizeof(LayoutChar) * longLength);
+	CHECK(longText && simdBuffer && scalarBuffer);
+	if(longText && simdBuffer && scalarBuffer)
+	{
+		static const char letters[] = "abcdefghijklmnopqrstuvwxyz ,.;[]'ABC 123";
+		for(size_t i = 0; i < longLength; i++)
+			longText[i] = (LayoutChar)letters[(i * 7 + i / 13) % (sizeof(letters) - 1)];
+
+		CHECK(LayoutCoreConvertString(&core, longText, longLength, simdBuffer, us, ru) == longLength);
+		core.useSimd = 0;
+		LayoutCoreFlush(&core);
+		CHECK(LayoutCoreConvertString(&core, longText, longLength, scalarBuffer, us, ru) == longLength);
+		CHECK(memcmp(simdBuffer, scalarBuffer, sizeof(LayoutChar) * longLength) == 0);
+	}
+	free(longText);
+	free(simdBuffer);
+	free(scalarBuffer);
+
+	LayoutCoreFree(&core);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Detecting the layout a text was typed in
+static void TestDetect()
+{
+	LayoutCore core;
+	InitCore(&core);
+	LayoutId us = LayoutTableId(g_us), he = LayoutTableId(g_he), ru = LayoutTableId(g_ru);
+
+	LayoutChar text[64];
+	int matches;
+
+	size_t length = TestText(text, 63, "שלום");
+	CHECK(LayoutCoreDetect(&core, text, length, &matches) == he && matches == 1);
+
+	length = TestText(text, 63, "привет");
+	CHECK(LayoutCoreDetect(&core, text, length, &matches) == ru && matches == 1);
+
+	length = TestText(text, 63, "\xE2\x82\xAC");
+	CHECK(LayoutCoreDetect(&core, text, length, &matches) == 0 && matches == 0);
+
+	// Latin text typed with the US layout, converted to Russian or Hebrew
+	length = TestText(text, 63, "ghbdtn rfr ltkf");
+	CHECK(LayoutCoreDetectSource(&core, text, length, ru, he, NULL) == us);
+
+	length = TestText(text, 63, "akuo kfuko");
+	CHECK(LayoutCoreDetectSource(&core, text, length, he, ru, NULL) == us);
+
+	LayoutCoreFree(&core);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The streaming converter, with a dead key in the target layout
+static void TestConverter()
+{
+	LayoutTable* dk = LayoutTableParse("name dk\nlang 0406\nkey 41 a A\nkey 45 e E\nkey DE U+00B4! U+00A8!\n");
+	CHECK(dk != NULL);
+	if(!dk)
+		return;
+
+	LayoutProvider provider;
+	LayoutTableGetProvider(&provider);
+
+	LayoutId layouts[2] = { LayoutTableId(g_us), LayoutTableId(dk) };
+	LayoutCore core;
+	LayoutCoreInit(&core, &provider);
+	LayoutCoreSync(&core, layouts, 2);
+
+	LayoutOutput output;
+	memset(&output, 0, sizeof(output));
+	output.Grow = LayoutOutputGrowHeap;
+
+	// without DeadKeyToChars a dead key and the next key generate both characters
+	LayoutConverter converter;
+	LayoutChar text[16];
+	LayoutConverterInit(&converter, &core, layouts[0], layouts[1]);
+	size_t length = TestText(text, 15, "a'");
+	CHECK(LayoutConverterPut(&converter, text, length, &output));
+	length = TestText(text, 15, "e'");
+	CHECK(LayoutConverterPut(&converter, text, length, &output));
+	CHECK(LayoutConverterFinish(&converter, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "a\xC2\xB4" "e\xC2\xB4"));
+	CHECK(output.buffer[output.length] == 0);
+
+	free(output.buffer);
+	LayoutCoreFree(&core);
+	LayoutTableFree(dk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A provider with a dead key that combines with the next key, and keys that
+// generate several characters, which the layout tables can't describe
+
+#define TEST_SOURCE 1
+#define TEST_TARGET 2
+
+typedef struct
+{
+	uint8_t vk;
+	int count; // -1 for a dead key
+	LayoutChar chars[2];
+} TestKey;
+
+static const TestKey g_sourceKeys[] = {
+	{ 0x41, 1, { 'a' } },
+	{ 0x45, 1, { 'e' } },
+	{ 0x4C, 1, { 'l' } },
+	{ 0x51, 2, { 0xD83D, 0xDE00 } }, // U+1F600
+	{ 0xDE, 1, { '\'' } },
+};
+
+static const TestKey g_targetKeys[] = {
+	{ 0x41, 1, { 'a' } },
+	{ 0x45, 1, { 'e' } },
+	{ 0x4C, 2, { 0xD834, 0xDD1E } }, // U+1D11E
+	{ 0x51, 2, { 'c', 'h' } },
+	{ 0xDE, -1, { 0x00B4 } },
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the keys of a test layout and their number
+static const TestKey* GetTestKeys(LayoutId layout, size_t* count)
+{
+	*count = layout == TEST_SOURCE ? sizeof(g_sourceKeys) / sizeof(TestKey) : sizeof(g_targetKeys) / sizeof(TestKey);
+	return layout == TEST_SOURCE ? g_sourceKeys : g_targetKeys;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.CharToKey for the test layouts
+static int TestCharToKey(void* context, LayoutId layout, LayoutChar ch, LayoutKey* key)
+{
+	(void)context;
+	size_t count;
+	const TestKey* keys = GetTestKeys(layout, &count);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(keys[i].count != 2 && keys[i].chars[0] == ch)
+		{
+			key->vk = keys[i].vk;
+			key->shift = 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.KeyToChars for the test layouts
+static int TestKeyToChars(void* context, LayoutId layout, LayoutKey key, LayoutChar* buffer, int size)
+{
+	(void)context;
+	size_t count;
+	const TestKey* keys = GetTestKeys(layout, &count);
+	for(size_t i = 0; i < count && key.shift == 0; i++)
+	{
+		if(keys[i].vk == key.vk)
+		{
+			int length = keys[i].count < 0 ? 1 : keys[i].count;
+			if(length > size)
+				return 0;
+
+			memcpy(buffer, keys[i].chars, sizeof(LayoutChar) * length);
+			return keys[i].count;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LayoutProvider.DeadKeyToChars for the target layout, whose acute accent
+// combines with A and E. With other keys it generates its own character
+// followed by theirs, like Windows does.
+static int TestDeadKeyToChars(void* context, LayoutId layout, LayoutKey deadKey, LayoutKey key, LayoutChar* buffer, int size)
+{
+	if(deadKey.vk != 0xDE || key.shift != 0 || size < 3)
+		return 0;
+
+	if(key.vk == 0x41 || key.vk == 0x45)
+	{
+		buffer[0] = key.vk == 0x41 ? 0x00E1 : 0x00E9;
+		return 1;
+	}
+
+	buffer[0] = 0x00B4;
+	int count = TestKeyToChars(context, layout, key, buffer + 1, size - 1);
+	return count > 0 ? count + 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts pieces of text from the test source layout to the target layout,
+// and returns the result of LayoutConverterFinish. The output is freed by
+// the caller.
+static int ConvertPieces(LayoutCore* core, const LayoutChar* const* pieces, const size_t* lengths, size_t count, LayoutOutput* output)
+{
+	memset(output, 0, sizeof(LayoutOutput));
+	output->Grow = LayoutOutputGrowHeap;
+
+	LayoutConverter converter;
+	LayoutConverterInit(&converter, core, TEST_SOURCE, TEST_TARGET);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!LayoutConverterPut(&converter, pieces[i], lengths[i], output))
+			return 0;
+	}
+
+	return LayoutConverterFinish(&converter, output);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dead keys that combine, keys that generate several characters, and
+// surrogate pairs in the source text, also across pieces
+static void TestConverterKeys()
+{
+	LayoutProvider provider;
+	memset(&provider, 0, sizeof(provider));
+	provider.CharToKey = TestCharToKey;
+	provider.KeyToChars = TestKeyToChars;
+	provider.DeadKeyToChars = TestDeadKeyToChars;
+
+	LayoutId layouts[2] = { TEST_SOURCE, TEST_TARGET };
+	LayoutCore core;
+	LayoutCoreInit(&core, &provider);
+	LayoutCoreSync(&core, layouts, 2);
+
+	LayoutOutput output;
+	LayoutChar text[16];
+	const LayoutChar* pieces[3];
+	size_t lengths[3];
+
+	// the dead key combines with the next key, also in the next piece
+	pieces[0] = text;
+	lengths[0] = TestText(text, 15, "'e'a");
+	CHECK(ConvertPieces(&core, pieces, lengths, 1, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "\xC3\xA9\xC3\xA1"));
+	free(output.buffer);
+
+	static const LayoutChar apostrophe[] = { '\'' }, letterE[] = { 'e' };
+	pieces[0] = apostrophe;
+	pieces[1] = letterE;
+	lengths[0] = lengths[1] = 1;
+	CHECK(ConvertPieces(&core, pieces, lengths, 2, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "\xC3\xA9"));
+	free(output.buffer);
+
+	// a dead key that doesn't combine, or that ends the text, generates its
+	// own character
+	pieces[0] = text;
+	lengths[0] = TestText(text, 15, "'la'");
+	CHECK(ConvertPieces(&core, pieces, lengths, 1, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "\xC2\xB4\xF0\x9D\x84\x9E" "a\xC2\xB4"));
+	CHECK(output.buffer[output.length] == 0);
+	free(output.buffer);
+
+	// a key that generates several characters
+	lengths[0] = TestText(text, 15, "ele");
+	CHECK(ConvertPieces(&core, pieces, lengths, 1, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "e\xF0\x9D\x84\x9E" "e"));
+	free(output.buffer);
+
+	// a surrogate pair in the source, split between two pieces
+	static const LayoutChar high[] = { 'a', 0xD83D }, low[] = { 0xDE00, 'e' };
+	pieces[0] = high;
+	pieces[1] = low;
+	lengths[0] = lengths[1] = 2;
+	CHECK(ConvertPieces(&core, pieces, lengths, 2, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "ache"));
+	free(output.buffer);
+
+	// a dead key before the split pair
+	static const LayoutChar deadHigh[] = { '\'', 0xD83D };
+	pieces[0] = deadHigh;
+	CHECK(ConvertPieces(&core, pieces, lengths, 2, &output));
+	CHECK(TestTextEquals(output.buffer, output.length, "\xC2\xB4" "che"));
+	free(output.buffer);
+
+	// a high surrogate at the end of the text, or one without its low half
+	pieces[0] = high;
+	CHECK(!ConvertPieces(&core, pieces, lengths, 1, &output));
+	CHECK(output.length == 1 && output.buffer[0] == 'a');
+	free(output.buffer);
+
+	static const LayoutChar unpaired[] = { 0xD83D, 'e' };
+	pieces[0] = unpaired;
+	CHECK(!ConvertPieces(&core, pieces, lengths, 1, &output));
+	free(output.buffer);
+
+	// a pair that no key generates
+	static const LayoutChar unknown[] = { 0xD83D, 0xDE01 };
+	pieces[0] = unknown;
+	CHECK(!ConvertPieces(&core, pieces, lengths, 1, &output));
+	free(output.buffer);
+
+	LayoutCoreFree(&core);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Warming up, and dropping the tables when the layouts change
+static void TestWarmUp()
+{
+	LayoutCore core;
+	InitCore(&core);
+
+	// only the layouts list is allocated before any conversion
+	size_t listAllocated = core.allocated;
+	CHECK(LayoutCoreWarmUp(&core, LayoutTableId(g_us), LayoutTableId(g_he)));
+	CHECK(core.allocated > listAllocated);
+
+	LayoutId layouts[2] = { LayoutTableId(g_us), LayoutTableId(g_ru) };
+	LayoutCoreSync(&core, layouts, 2);
+	CHECK(core.pairTables == NULL);
+
+	LayoutCoreFree(&core);
+	CHECK(core.allocated == 0);
+}
+
+int main()
+{
+	g_us = LayoutTableLoadBuiltin("us");
+	g_he = LayoutTableLoadBuiltin("he");
+	g_ru = LayoutTableLoadBuiltin("ru");
+
+	TestLayoutTable();
+	TestConvert();
+	TestDetect();
+	TestConverter();
+	TestConverterKeys();
+	TestWarmUp();
+
+	LayoutTableFree(g_us);
+	LayoutTableFree(g_he);
+	LayoutTableFree(g_ru);
+	return TestResult("layoutcore");
+}
@@ -0,0 +1,117 @@
+#include "test.h"
+#include "../layoutcycle.h"
+
+#define TIMEOUT 300
+
+static const LayoutId g_cycle[4] = { 0x0409, 0x040D, 0x0419, 0x0407 };
+
+///////////////////////////////////////////////////////////////////////////////
+// Switches a simulated window and returns the result
+static int Switch(SimLayoutWindow* sim, LayoutId target)
+{
+	LayoutCycleBackend backend;
+	SimLayoutWindowGetBackend(sim, &backend);
+	return LayoutCycleSwitch(&backend, g_cycle, 4, target, TIMEOUT);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the layout of a simulated window once all its presses are applied
+static LayoutId FinalLayout(SimLayoutWindow* sim)
+{
+	LayoutCycleBackend backend;
+	SimLayoutWindowGetBackend(sim, &backend);
+	sim->now += 10 * TIMEOUT;
+	return backend.GetLayout(backend.context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The presses go forward through the cycle, wrapping around
+static void TestSteps()
+{
+	CHECK(LayoutCycleSteps(g_cycle, 4, g_cycle[0], g_cycle[3]) == 3);
+	CHECK(LayoutCycleSteps(g_cycle, 4, g_cycle[3], g_cycle[0]) == 1);
+	CHECK(LayoutCycleSteps(g_cycle, 4, g_cycle[2], g_cycle[1]) == 3);
+	CHECK(LayoutCycleSteps(g_cycle, 4, g_cycle[1], g_cycle[1]) == 0);
+	CHECK(LayoutCycleSteps(g_cycle, 4, 0x0411, g_cycle[1]) == -1);
+	CHECK(LayoutCycleSteps(g_cycle, 4, g_cycle[1], 0x0411) == -1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The presses are sent at once, and checked once the layout settles
+static void TestBatch()
+{
+	SimLayoutWindow sim;
+	SimLayoutWindowInit(&sim, g_cycle, 4, 0, 5);
+	CHECK(Switch(&sim, g_cycle[3]));
+	CHECK(sim.sends == 1);
+	CHECK(sim.presses == 3);
+	CHECK(sim.now == 15 + LAYOUT_CYCLE_SETTLE_TIME);
+	CHECK(FinalLayout(&sim) == g_cycle[3]);
+
+	// the window applies all the presses at once
+	SimLayoutWindowInit(&sim, g_cycle, 4, 2, 0);
+	CHECK(Switch(&sim, g_cycle[1]));
+	CHECK(sim.sends == 1);
+	CHECK(sim.presses == 3);
+	CHECK(FinalLayout(&sim) == g_cycle[1]);
+
+	// nothing to do
+	SimLayoutWindowInit(&sim, g_cycle, 4, 1, 5);
+	CHECK(Switch(&sim, g_cycle[1]));
+	CHECK(sim.sends == 0);
+	CHECK(sim.now == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A window whose cycle is shorter goes past the target on the way, which
+// the check must not take for success
+static void TestShorterCycle()
+{
+	SimLayoutWindow sim;
+	SimLayoutWindowInit(&sim, g_cycle, 4, 0, 5);
+	sim.skip = g_cycle[2];
+
+	// the batch goes 0409 -> 040D -> 0407 -> 0409, and then one press at a time
+	CHECK(Switch(&sim, g_cycle[3]));
+	CHECK(sim.sends == 3);
+	CHECK(sim.presses == 5);
+
+	// each press of the fallback only waits for the layout to change
+	CHECK(sim.now == 15 + LAYOUT_CYCLE_SETTLE_TIME + 2 * 5);
+	CHECK(FinalLayout(&sim) == g_cycle[3]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A target the window can't get to fails after a bounded number of presses
+// and waits
+static void TestUnreachable()
+{
+	SimLayoutWindow sim;
+	SimLayoutWindowInit(&sim, g_cycle, 4, 0, 5);
+	sim.skip = g_cycle[2];
+	CHECK(!Switch(&sim, g_cycle[2]));
+	CHECK(sim.sends == 1 + 4);
+	CHECK(sim.presses == 2 + 4);
+	CHECK(sim.now == 10 + LAYOUT_CYCLE_SETTLE_TIME + 4 * 5);
+
+	// a window that doesn't react to the presses in time
+	SimLayoutWindowInit(&sim, g_cycle, 4, 0, TIMEOUT * 10);
+	CHECK(!Switch(&sim, g_cycle[1]));
+	CHECK(sim.sends == 1 + 4);
+	CHECK(sim.now == 5 * TIMEOUT);
+
+	// a layout that's not in the cycle
+	SimLayoutWindowInit(&sim, g_cycle, 4, 0, 5);
+	CHECK(!Switch(&sim, 0x0411));
+	CHECK(sim.sends == 4);
+	CHECK(FinalLayout(&sim) == g_cycle[0]);
+}
+
+int main()
+{
+	TestSteps();
+	TestBatch();
+	TestShorterCycle();
+	TestUnreachable();
+	return TestResult("layoutcycle");
+}
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include "test.h"
+#include "../layouttable.h"
+#include "../parallelconvert.h"
+
+#define TEXT_LENGTH (PARALLEL_CONVERT_THRESHOLD * 2 + 123)
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts `str` on a single thread with the streaming converter
+static int ConvertSingle(LayoutCore* core, const LayoutChar* str, size_t length, LayoutOutput* output,
+	LayoutId source, LayoutId target)
+{
+	LayoutConverter converter;
+	LayoutConverterInit(&converter, core, source, target);
+	return LayoutConverterPut(&converter, str, length, output) &&
+		LayoutConverterFinish(&converter, output);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Converts the text with every thread count, checking that the result is
+// the same as on a single thread
+static void CheckThreadCounts(LayoutCore* core, const LayoutChar* text, size_t length, LayoutId source, LayoutId target)
+{
+	static const unsigned threadCounts[] = { 0, 1, 2, 3, 4, 8 };
+
+	LayoutOutput expected;
+	memset(&expected, 0, sizeof(expected));
+	expected.Grow = LayoutOutputGrowHeap;
+	int bExpected = ConvertSingle(core, text, length, &expected, source, target);
+
+	for(size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++)
+	{
+		// the output starts with a prefix, which the conversion appends to
+		LayoutOutput output;
+		memset(&output, 0, sizeof(output));
+		output.Grow = LayoutOutputGrowHeap;
+		CHECK(LayoutOutputGrowHeap(&output, 16));
+		output.buffer[0] = '>';
+		output.length = 1;
+
+		LayoutCoreFlush(core);
+		CHECK(ParallelConvertText(core, text, length, &output, source, target, threadCounts[i]) == bExpected);
+		if(bExpected)
+		{
+			CHECK(output.length == expected.length + 1);
+			CHECK(output.buffer[0] == '>');
+			CHECK(memcmp(output.buffer + 1, expected.buffer, sizeof(LayoutChar) * expected.length) == 0);
+			CHECK(output.buffer[output.length] == 0);
+		}
+
+		free(output.buffer);
+	}
+
+	free(expected.buffer);
+}
+
+int main()
+{
+	LayoutTable* us = LayoutTableLoadBuiltin("us");
+	LayoutTable* ru = LayoutTableLoadBuiltin("ru");
+
+	LayoutProvider provider;
+	LayoutTableGetProvider(&provider);
+
+	LayoutId layouts[2] = { LayoutTableId(us), LayoutTableId(ru) };
+	LayoutCore core;
+	LayoutCoreInit(&core, &provider);
+	LayoutCoreSync(&core, layouts, 2);
+
+	LayoutChar* text = (LayoutChar*)malloc(sizeof(LayoutChar) * (TEXT_LENGTH + 1));
+	CHECK(text != NULL);
+	if(text)
+	{
+		static const char letters[] = "ghbdtn rfr ltkf, [jhjij. ";
+		for(size_t i = 0; i < TEXT_LENGTH; i++)
+			text[i] = (LayoutChar)letters[i % (sizeof(letters) - 1)];
+
+		// converted in chunks
+		CheckThreadCounts(&core, text, TEXT_LENGTH, layouts[0], layouts[1]);
+
+		// Cyrillic late in the text is in pages that weren't prepared up
+		// front, so it takes another pass
+		for(size_t i = TEXT_LENGTH - 1000; i < TEXT_LENGTH; i += 10)
+			text[i] = 0x0444;
+		CheckThreadCounts(&core, text, TEXT_LENGTH, layouts[1], layouts[0]);
+
+		// a character that can't be converted fails like on a single thread
+		text[TEXT_LENGTH / 3] = 0x20AC;
+		CheckThreadCounts(&core, text, TEXT_LENGTH, layouts[0], layouts[1]);
+
+		// a short text is converted on the calling thread
+		CheckThreadCounts(&core, text, 1000, layouts[0], layouts[1]);
+	}
+
+	ParallelConvertShutdown();
+	free(text);
+	LayoutCoreFree(&core);
+	LayoutTableFree(us);
+	LayoutTableFree(ru);
+	return TestResult("parallelconvert");
+}
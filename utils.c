@@ -1,5 +1,10 @@
 #include "stdafx.h"
 
+#ifdef _DEBUG
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
 #define BUFSIZE 2048
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -57,3 +62,18 @@ BOOL DoesCmdLineSwitchExists(const WCHAR* command)
 
 	return FALSE;
 }
+
+#ifdef _DEBUG
+///////////////////////////////////////////////////////////////////////////////
+// Prints the memory usage of the process to the debugger
+void PrintMemoryUsage(const char* label)
+{
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	counters.cb = sizeof(counters);
+	if(GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+	{
+		PrintDebugString("%s: working set %Iu KB, private bytes %Iu KB", label,
+			counters.WorkingSetSize / 1024, counters.PrivateUsage / 1024);
+	}
+}
+#endif
@@ -3,3 +3,7 @@
 void ShowError(const WCHAR* message);
 void PrintDebugString(const char* format, ...);
 BOOL DoesCmdLineSwitchExists(const WCHAR* command);
+
+#ifdef _DEBUG
+void PrintMemoryUsage(const char* label);
+#endif
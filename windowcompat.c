@@ -0,0 +1,166 @@
+#include "stdafx.h"
+#include "windowcompat.h"
+#include "utils.h"
+
+// The apps that don't handle WM_INPUTLANGCHANGEREQUEST: Skype and Word hang
+// when it's posted to them
+static const WCHAR* g_builtinRules[] = {
+	L"class:tSkMainForm=cycle",
+	L"class:TConversationForm=cycle",
+	L"class:OpusApp=cycle",
+};
+
+static AppCompatTable g_appCompatTable;
+static BOOL g_bAppCompatLoaded;
+static AppCompatCache g_appCompatCache;
+static CRITICAL_SECTION g_csAppCompatCache;
+static HWINEVENTHOOK g_hDestroyHook;
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a rule into `rules`, and returns the new rule count
+static UINT AddRule(AppCompatRule* rules, UINT count, const WCHAR* text)
+{
+	if(AppCompatParseRule(text, &rules[count]))
+		return count + 1;
+
+#ifdef _DEBUG
+	PrintDebugString("Skipping app compatibility rule %S", text);
+#endif
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compiles the built-in rules and `rules` into the table
+void WindowCompatLoadRules(const WCHAR* rules)
+{
+	UINT maxCount = _countof(g_builtinRules);
+	for(const WCHAR* rule = rules; rule && *rule; rule += wcslen(rule) + 1)
+		maxCount++;
+
+	AppCompatRule* parsed = (AppCompatRule*)malloc(sizeof(AppCompatRule) * maxCount);
+	if(!parsed)
+		return;
+
+	UINT count = 0;
+	for(UINT i = 0; i < _countof(g_builtinRules); i++)
+		count = AddRule(parsed, count, g_builtinRules[i]);
+	for(const WCHAR* rule = rules; rule && *rule; rule += wcslen(rule) + 1)
+		count = AddRule(parsed, count, rule);
+
+	AppCompatTableFree(&g_appCompatTable);
+	g_bAppCompatLoaded = AppCompatTableInit(&g_appCompatTable, parsed, count);
+	free(parsed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Forgets the strategy of a destroyed window
+static void CALLBACK WindowDestroyedProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hWnd,
+	LONG idObject, LONG idChild, DWORD dwEventThread, DWORD dwmsEventTime)
+{
+	UNREFERENCED_PARAMETER(hWinEventHook);
+	UNREFERENCED_PARAMETER(event);
+	UNREFERENCED_PARAMETER(dwEventThread);
+	UNREFERENCED_PARAMETER(dwmsEventTime);
+
+	if(!hWnd || idObject != OBJID_WINDOW || idChild != CHILDID_SELF)
+		return;
+
+	EnterCriticalSection(&g_csAppCompatCache);
+	AppCompatCacheInvalidate(&g_appCompatCache, (uintptr_t)hWnd);
+	LeaveCriticalSection(&g_csAppCompatCache);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts caching the strategies of windows
+BOOL WindowCompatInit()
+{
+	if(!g_bAppCompatLoaded)
+		WindowCompatLoadRules(NULL);
+
+	InitializeCriticalSection(&g_csAppCompatCache);
+	AppCompatCacheInit(&g_appCompatCache);
+
+	g_hDestroyHook = SetWinEventHook(EVENT_OBJECT_DESTROY, EVENT_OBJECT_DESTROY, NULL,
+		WindowDestroyedProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+
+	return g_hDestroyHook != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stops caching the strategies of windows, and frees the rules
+void WindowCompatUninit()
+{
+	if(g_hDestroyHook)
+		UnhookWinEvent(g_hDestroyHook);
+	g_hDestroyHook = NULL;
+
+	DeleteCriticalSection(&g_csAppCompatCache);
+	AppCompatTableFree(&g_appCompatTable);
+	g_bAppCompatLoaded = FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the image file name of the process of `hWnd`, such as winword.exe,
+// in `imageName`
+static BOOL GetWindowImageName(HWND hWnd, WCHAR* imageName, DWORD size)
+{
+	DWORD processId = 0;
+	GetWindowThreadProcessId(hWnd, &processId);
+
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+	if(!hProcess)
+		return FALSE;
+
+	WCHAR path[MAX_PATH];
+	DWORD length = _countof(path);
+	BOOL bSuccess = QueryFullProcessImageName(hProcess, 0, path, &length);
+	CloseHandle(hProcess);
+
+	if(bSuccess)
+	{
+		const WCHAR* fileName = wcsrchr(path, L'\\');
+		wcscpy_s(imageName, size, fileName ? fileName + 1 : path);
+	}
+
+	return bSuccess;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns how to switch the layout of `hWnd`. The decision is looked up by
+// the root owner window's class and process on the first switch, and kept
+// until the window is destroyed.
+SwitchStrategy GetWindowSwitchStrategy(HWND hWnd)
+{
+	SwitchStrategy strategy = SWITCH_STRATEGY_REQUEST;
+
+	HWND hRootOwnerWnd = GetAncestor(hWnd, GA_ROOTOWNER);
+	if(!hRootOwnerWnd)
+		return strategy;
+
+	EnterCriticalSection(&g_csAppCompatCache);
+	BOOL bCached = AppCompatCacheGet(&g_appCompatCache, (uintptr_t)hRootOwnerWnd, &strategy);
+	LeaveCriticalSection(&g_csAppCompatCache);
+
+	if(bCached)
+		return strategy;
+
+	WCHAR szClassName[256];
+	WCHAR szImageName[MAX_PATH];
+	const WCHAR* className = NULL;
+	const WCHAR* imageName = NULL;
+
+	if(GetClassName(hRootOwnerWnd, szClassName, _countof(szClassName)))
+		className = szClassName;
+
+	// Only look for the process when there are rules for processes
+	if(g_appCompatTable.processRules && GetWindowImageName(hRootOwnerWnd, szImageName, _countof(szImageName)))
+		imageName = szImageName;
+
+	strategy = AppCompatLookup(&g_appCompatTable, className, imageName);
+
+	EnterCriticalSection(&g_csAppCompatCache);
+	AppCompatCachePut(&g_appCompatCache, (uintptr_t)hRootOwnerWnd, strategy);
+	LeaveCriticalSection(&g_csAppCompatCache);
+
+	return strategy;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "appcompat.h"
+
+// Loads the app compatibility rules, the built-in ones followed by those in
+// `rules`, a list of null-terminated strings ended by an empty one (as in a
+// REG_MULTI_SZ value), which can be NULL. Rules that can't be parsed are
+// skipped.
+void WindowCompatLoadRules(const WCHAR* rules);
+
+// Starts caching the strategies decided for windows, and forgetting them when
+// the windows are destroyed. It has to be called from a thread with a
+// message loop.
+BOOL WindowCompatInit();
+void WindowCompatUninit();
+
+// Returns how to switch the layout of `hWnd`, decided by its root owner window
+SwitchStrategy GetWindowSwitchStrategy(HWND hWnd);